@@ -0,0 +1,918 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "eeprom-internal.h"
+#include "eeprom-archive.h"
+
+/*
+ * Index file format (all integers little-endian):
+ *
+ *   header:     magic, version, section count, and the record
+ *               count and fingerprint of the archive indexed
+ *   sections:   a descriptor for each section, followed by the
+ *               section data, 8-byte aligned
+ *
+ * Section kinds:
+ *   dict:    for a string field, its distinct values in sorted
+ *            order, then the start of each value's postings,
+ *            then the postings (the record numbers holding each
+ *            value, in order)
+ *   bitmap:  for a small-valued attribute (layout version,
+ *            module type, part number type), each value present
+ *            followed by a bitmap of the records that have it;
+ *            module types are cvm, cvb, and other (for a vendor
+ *            block signature that is not recognized)
+ *   macs:    the MAC address ranges of all records (ethernet
+ *            MACs expanded by their counts), sorted by first
+ *            address, followed by the largest last address in
+ *            each subtree, making the array an interval tree
+ *            (each subtree's root being the middle entry of
+ *            its range)
+ *
+ * Record numbers are 32 bits, so archives of more than
+ * UINT32_MAX records cannot be indexed.
+ */
+#define INDEX_MAGIC		"TEGEEIDX"
+#define INDEX_VERSION		2
+#define INDEX_MAX_SECTIONS	8
+#define MAC_MASK		0xffffffffffffULL
+#define ALIGN8(n_)		(((n_) + 7) & ~(size_t) 7)
+
+enum {
+	sect_dict,
+	sect_bitmap,
+	sect_macs,
+};
+
+enum {
+	bitmap_layout_version,
+	bitmap_module_type,
+	bitmap_partnumber_type,
+	bitmap_count,
+};
+
+static const char *bitmap_names[bitmap_count] = {
+	[bitmap_layout_version] = "major-version",
+	[bitmap_module_type] = "module-type",
+	[bitmap_partnumber_type] = "partnumber-type",
+};
+
+static const char *dict_fields[] = { "partnumber", "system-serialnumber" };
+#define DICT_FIELD_COUNT (sizeof(dict_fields)/sizeof(dict_fields[0]))
+#define DICT_MAX_WIDTH	22
+
+struct idx_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsections;
+	uint64_t nrecords;
+	uint64_t fingerprint;
+} __attribute__((packed));
+
+struct idx_section {
+	uint8_t kind;
+	uint8_t id;		// layout field index, or bitmap_xxx
+	uint16_t width;		// of dict values
+	uint32_t count;
+	uint64_t offset;
+	uint64_t length;
+} __attribute__((packed));
+
+struct idx_mac {
+	uint64_t first;
+	uint64_t last;
+	uint32_t record;
+	uint8_t field;		// layout field index
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+struct eeprom_archive_index_s {
+	const uint8_t *map;
+	size_t size;
+	uint64_t nrecords;
+	unsigned int nsections;
+	const struct idx_section *sections;
+};
+
+struct dict_item {
+	uint8_t value[DICT_MAX_WIDTH];
+	uint32_t record;
+};
+
+/*
+ * Section being built: its descriptor, and its contents
+ */
+struct build_section {
+	struct idx_section desc;
+	uint8_t *data;
+	size_t length;
+};
+
+/*
+ * dict_value
+ *
+ * Extracts a string field's value as it is indexed: with
+ * the customer part number marker dropped, trailing
+ * padding trimmed, and zero-filled to the field width.
+ * Returns the trimmed length.
+ */
+static size_t
+dict_value (uint8_t *out, const uint8_t *val, size_t width, int is_partnumber)
+{
+	size_t len;
+
+	if (is_partnumber && width > 0 && val[0] == 0xcc) {
+		val += 1;
+		width -= 1;
+	}
+	len = width;
+	while (len > 0 && (val[len-1] == 0 || val[len-1] == 0xff || val[len-1] == ' '))
+		len -= 1;
+	memset(out, 0, DICT_MAX_WIDTH);
+	memcpy(out, val, len);
+	return len;
+
+} /* dict_value */
+
+/*
+ * dict_item_compare
+ */
+static int
+dict_item_compare (const void *va, const void *vb)
+{
+	const struct dict_item *a = va, *b = vb;
+	int c = memcmp(a->value, b->value, DICT_MAX_WIDTH);
+
+	if (c != 0)
+		return c;
+	return (a->record < b->record ? -1 : a->record > b->record);
+
+} /* dict_item_compare */
+
+/*
+ * build_dict
+ */
+static int
+build_dict (eeprom_archive_t a, int field, struct build_section *s)
+{
+	const eeprom_layout_field_t *f = &eeprom_layout_fields[field];
+	int column = eeprom_archive_column(a, f->name);
+	int vcolumn = eeprom_archive_column(a, "major-version");
+	uint64_t nrecords = eeprom_archive_count(a), r;
+	struct dict_item *items;
+	const uint8_t *val, *ver;
+	uint32_t nitems = 0, ndistinct = 0, i;
+	uint32_t *starts, *postings;
+	size_t valbytes;
+	uint8_t *values;
+
+	if (column < 0 || vcolumn < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	items = malloc((nrecords > 0 ? nrecords : 1) * sizeof(*items));
+	if (items == NULL)
+		return -1;
+	for (r = 0; r < nrecords; r++) {
+		val = eeprom_archive_field(a, r, column, NULL);
+		ver = eeprom_archive_field(a, r, vcolumn, NULL);
+		if (val == NULL || ver == NULL) {
+			free(items);
+			return -1;
+		}
+		if (strcmp(f->name, "system-serialnumber") == 0 && *ver < LAYOUT_VERSION_V2)
+			continue;
+		if (dict_value(items[nitems].value, val, f->size, strcmp(f->name, "partnumber") == 0) == 0)
+			continue;
+		items[nitems++].record = (uint32_t) r;
+	}
+	qsort(items, nitems, sizeof(*items), dict_item_compare);
+	for (i = 0; i < nitems; i++)
+		if (i == 0 || memcmp(items[i].value, items[i-1].value, DICT_MAX_WIDTH) != 0)
+			ndistinct += 1;
+
+	valbytes = ALIGN8((size_t) ndistinct * f->size);
+	s->length = valbytes + ALIGN8(((size_t) ndistinct + 1) * sizeof(uint32_t)) +
+		ALIGN8((size_t) nitems * sizeof(uint32_t));
+	s->data = calloc(1, s->length ? s->length : 1);
+	if (s->data == NULL) {
+		free(items);
+		return -1;
+	}
+	values = s->data;
+	starts = (uint32_t *)(s->data + valbytes);
+	postings = (uint32_t *)(s->data + valbytes + ALIGN8(((size_t) ndistinct + 1) * sizeof(uint32_t)));
+	ndistinct = 0;
+	for (i = 0; i < nitems; i++) {
+		if (i == 0 || memcmp(items[i].value, items[i-1].value, DICT_MAX_WIDTH) != 0) {
+			memcpy(values + (size_t) ndistinct * f->size, items[i].value, f->size);
+			starts[ndistinct++] = htole32(i);
+		}
+		postings[i] = htole32(items[i].record);
+	}
+	starts[ndistinct] = htole32(nitems);
+	free(items);
+	s->desc.kind = sect_dict;
+	s->desc.id = (uint8_t) field;
+	s->desc.width = f->size;
+	s->desc.count = ndistinct;
+	return 0;
+
+} /* build_dict */
+
+/*
+ * sig_module_type
+ *
+ * Module type from the vendor block signature: "NVCB" on
+ * a module, "FFFF" (no vendor block) on a carrier board.
+ * Any other signature is not one we recognize.
+ */
+static int
+sig_module_type (const uint8_t *sig)
+{
+	if (memcmp(sig, "NVCB", 4) == 0)
+		return module_type_cvm;
+	if (memcmp(sig, "FFFF", 4) == 0)
+		return module_type_cvb;
+	return module_type_other;
+
+} /* sig_module_type */
+
+/*
+ * bitmap_attribute
+ *
+ * Value of one of the bitmap-indexed attributes for a record.
+ */
+static int
+bitmap_attribute (eeprom_archive_t a, unsigned int which, const int *columns, uint64_t r)
+{
+	const uint8_t *val = eeprom_archive_field(a, r, columns[which], NULL);
+
+	if (val == NULL)
+		return -1;
+	switch (which) {
+	case bitmap_layout_version:
+		return val[0];
+	case bitmap_module_type:
+		return sig_module_type(val);
+	case bitmap_partnumber_type:
+		return (val[0] == 0xcc ? partnum_type_customer : partnum_type_nvidia);
+	default:
+		break;
+	}
+	return -1;
+
+} /* bitmap_attribute */
+
+/*
+ * build_bitmap
+ */
+static int
+build_bitmap (eeprom_archive_t a, unsigned int which, struct build_section *s)
+{
+	static const char *columnnames[bitmap_count] = {
+		[bitmap_layout_version] = "major-version",
+		[bitmap_module_type] = "cfgblk-sig",
+		[bitmap_partnumber_type] = "partnumber",
+	};
+	uint64_t nrecords = eeprom_archive_count(a), r, *maps[256], *entry;
+	size_t nwords = (nrecords + 63) / 64;
+	int columns[bitmap_count];
+	unsigned int v, count = 0;
+	int value, ret = -1;
+
+	memset(maps, 0, sizeof(maps));
+	columns[which] = eeprom_archive_column(a, columnnames[which]);
+	if (columns[which] < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (r = 0; r < nrecords; r++) {
+		value = bitmap_attribute(a, which, columns, r);
+		if (value < 0)
+			goto depart;
+		if (maps[value] == NULL) {
+			maps[value] = calloc(nwords ? nwords : 1, sizeof(uint64_t));
+			if (maps[value] == NULL)
+				goto depart;
+			count += 1;
+		}
+		maps[value][r / 64] |= 1ULL << (r % 64);
+	}
+	s->length = (size_t) count * (nwords + 1) * sizeof(uint64_t);
+	s->data = malloc(s->length ? s->length : 1);
+	if (s->data == NULL)
+		goto depart;
+	entry = (uint64_t *) s->data;
+	for (v = 0; v < 256; v++) {
+		if (maps[v] == NULL)
+			continue;
+		entry[0] = htole64(v);
+		for (r = 0; r < nwords; r++)
+			entry[r+1] = htole64(maps[v][r]);
+		entry += nwords + 1;
+	}
+	s->desc.kind = sect_bitmap;
+	s->desc.id = which;
+	s->desc.count = count;
+	ret = 0;
+
+  depart:
+	for (v = 0; v < 256; v++)
+		free(maps[v]);
+	return ret;
+
+} /* build_bitmap */
+
+/*
+ * mac_compare
+ */
+static int
+mac_compare (const void *va, const void *vb)
+{
+	const struct idx_mac *a = va, *b = vb;
+
+	if (a->first != b->first)
+		return (a->first < b->first ? -1 : 1);
+	return (a->record < b->record ? -1 : a->record > b->record);
+
+} /* mac_compare */
+
+/*
+ * fill_maxlast
+ *
+ * Computes the largest last address in each subtree of
+ * the implicit tree over entries lo through hi-1.
+ */
+static uint64_t
+fill_maxlast (const struct idx_mac *macs, uint64_t *maxlast, size_t lo, size_t hi)
+{
+	size_t mid;
+	uint64_t m, sub;
+
+	if (lo >= hi)
+		return 0;
+	mid = lo + (hi - lo) / 2;
+	m = macs[mid].last;
+	sub = fill_maxlast(macs, maxlast, lo, mid);
+	if (sub > m)
+		m = sub;
+	sub = fill_maxlast(macs, maxlast, mid + 1, hi);
+	if (sub > m)
+		m = sub;
+	maxlast[mid] = m;
+	return m;
+
+} /* fill_maxlast */
+
+/*
+ * build_macs
+ *
+ * Collects every record's MAC address ranges.  Addresses
+ * that are unset (all zeros or all ones) are skipped, as
+ * in audits.
+ */
+static int
+build_macs (eeprom_archive_t a, struct build_section *s)
+{
+	uint64_t nrecords = eeprom_archive_count(a), r, mac, *maxlast;
+	int columns[EEPROM_IMAGE_SIZE], counts[EEPROM_IMAGE_SIZE], vcolumn;
+	struct idx_mac *macs = NULL, *newp;
+	size_t nmacs = 0, alloc = 0, i;
+	const uint8_t *val, *cnt, *ver;
+	unsigned int f, count;
+
+	vcolumn = eeprom_archive_column(a, "major-version");
+	if (vcolumn < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (f = 0; f < eeprom_layout_field_count; f++) {
+		columns[f] = counts[f] = -1;
+		if (eeprom_layout_fields[f].kind != layout_field_macaddr)
+			continue;
+		columns[f] = eeprom_archive_column(a, eeprom_layout_fields[f].name);
+		if (strcmp(eeprom_layout_fields[f].name, "factory-default-ether-mac") == 0)
+			counts[f] = eeprom_archive_column(a, "factory-default-ether-mac-count");
+		else if (strcmp(eeprom_layout_fields[f].name, "vendor-ether-mac") == 0)
+			counts[f] = eeprom_archive_column(a, "vendor-ether-mac-count");
+	}
+	for (r = 0; r < nrecords; r++) {
+		ver = eeprom_archive_field(a, r, vcolumn, NULL);
+		if (ver == NULL)
+			goto failed;
+		for (f = 0; f < eeprom_layout_field_count; f++) {
+			if (columns[f] < 0)
+				continue;
+			val = eeprom_archive_field(a, r, columns[f], NULL);
+			if (val == NULL)
+				goto failed;
+			// stored little-endian
+			for (mac = 0, i = 0; i < 6; i++)
+				mac = (mac << 8) | val[5-i];
+			if (mac == 0 || mac == MAC_MASK)
+				continue;
+			count = 1;
+			if (counts[f] >= 0 && *ver >= LAYOUT_VERSION_V2) {
+				cnt = eeprom_archive_field(a, r, counts[f], NULL);
+				if (cnt == NULL)
+					goto failed;
+				if (*cnt != 0 && *cnt != 0xff)
+					count = *cnt;
+			}
+			if (nmacs >= alloc) {
+				newp = realloc(macs, (alloc + 65536) * sizeof(*macs));
+				if (newp == NULL)
+					goto failed;
+				macs = newp;
+				alloc += 65536;
+			}
+			memset(&macs[nmacs], 0, sizeof(macs[nmacs]));
+			macs[nmacs].first = mac;
+			macs[nmacs].last = (mac + count - 1 > MAC_MASK ? MAC_MASK : mac + count - 1);
+			macs[nmacs].record = (uint32_t) r;
+			macs[nmacs].field = f;
+			nmacs += 1;
+		}
+	}
+	qsort(macs, nmacs, sizeof(*macs), mac_compare);
+	s->length = nmacs * (sizeof(*macs) + sizeof(uint64_t));
+	s->data = malloc(s->length ? s->length : 1);
+	if (s->data == NULL)
+		goto failed;
+	maxlast = (uint64_t *)(s->data + nmacs * sizeof(*macs));
+	fill_maxlast(macs, maxlast, 0, nmacs);
+	for (i = 0; i < nmacs; i++) {
+		maxlast[i] = htole64(maxlast[i]);
+		macs[i].first = htole64(macs[i].first);
+		macs[i].last = htole64(macs[i].last);
+		macs[i].record = htole32(macs[i].record);
+	}
+	memcpy(s->data, macs, nmacs * sizeof(*macs));
+	free(macs);
+	s->desc.kind = sect_macs;
+	s->desc.count = (uint32_t) nmacs;
+	return 0;
+
+  failed:
+	free(macs);
+	return -1;
+
+} /* build_macs */
+
+/*
+ * write_all
+ */
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+	const uint8_t *bp = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, bp, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		bp += n;
+		len -= n;
+	}
+	return 0;
+
+} /* write_all */
+
+/*
+ * eeprom_archive_index_build
+ *
+ * Builds the indexes for an archive and writes them to
+ * a file, replacing it atomically if it already exists.
+ */
+int
+eeprom_archive_index_build (eeprom_archive_t a, const char *pathname)
+{
+	struct build_section sects[INDEX_MAX_SECTIONS];
+	struct idx_header hdr;
+	char tmppath[PATH_MAX];
+	uint64_t offset;
+	unsigned int nsects = 0, i;
+	int fd = -1, field, ret = -1, save_errno;
+
+	if (eeprom_archive_count(a) > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	if ((size_t) snprintf(tmppath, sizeof(tmppath), "%s.tmp", pathname) >= sizeof(tmppath)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(sects, 0, sizeof(sects));
+	for (i = 0; i < DICT_FIELD_COUNT; i++) {
+		field = eeprom_layout_field_index(dict_fields[i]);
+		if (build_dict(a, field, &sects[nsects++]) < 0)
+			goto depart;
+	}
+	for (i = 0; i < bitmap_count; i++)
+		if (build_bitmap(a, i, &sects[nsects++]) < 0)
+			goto depart;
+	if (build_macs(a, &sects[nsects++]) < 0)
+		goto depart;
+
+	offset = ALIGN8(sizeof(hdr) + nsects * sizeof(struct idx_section));
+	for (i = 0; i < nsects; i++) {
+		sects[i].desc.offset = htole64(offset);
+		sects[i].desc.length = htole64(sects[i].length);
+		sects[i].desc.width = htole16(sects[i].desc.width);
+		sects[i].desc.count = htole32(sects[i].desc.count);
+		offset += ALIGN8(sects[i].length);
+	}
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(INDEX_VERSION);
+	hdr.nsections = htole32(nsects);
+	hdr.nrecords = htole64(eeprom_archive_count(a));
+	hdr.fingerprint = htole64(archive_fingerprint(a));
+
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto depart;
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+		goto depart;
+	for (i = 0; i < nsects; i++)
+		if (write_all(fd, &sects[i].desc, sizeof(sects[i].desc)) < 0)
+			goto depart;
+	for (i = 0; i < nsects; i++) {
+		if (lseek(fd, le64toh(sects[i].desc.offset), SEEK_SET) < 0 ||
+		    write_all(fd, sects[i].data, sects[i].length) < 0)
+			goto depart;
+	}
+	if (ftruncate(fd, offset) < 0 || fsync(fd) < 0)
+		goto depart;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto depart;
+	}
+	fd = -1;
+	if (rename(tmppath, pathname) < 0)
+		goto depart;
+	ret = 0;
+
+  depart:
+	save_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0)
+		unlink(tmppath);
+	for (i = 0; i < nsects; i++)
+		free(sects[i].data);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_archive_index_build */
+
+/*
+ * eeprom_archive_index_open
+ *
+ * Opens the index file for an archive.  Fails with ESTALE
+ * if it was built for a different version of the archive,
+ * or by a different version of the library.
+ */
+eeprom_archive_index_t
+eeprom_archive_index_open (eeprom_archive_t a, const char *pathname)
+{
+	eeprom_archive_index_t x;
+	const struct idx_header *hdr;
+	const struct idx_section *s;
+	struct stat st;
+	unsigned int i;
+	int fd, save_errno;
+
+	fd = open(pathname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	x = calloc(1, sizeof(*x));
+	if (x == NULL || fstat(fd, &st) < 0)
+		goto failed;
+	if (st.st_size < (off_t) sizeof(*hdr)) {
+		errno = EINVAL;
+		goto failed;
+	}
+	x->size = st.st_size;
+	x->map = mmap(NULL, x->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (x->map == MAP_FAILED) {
+		x->map = NULL;
+		goto failed;
+	}
+	close(fd);
+	fd = -1;
+	errno = EINVAL;
+	hdr = (const struct idx_header *) x->map;
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0)
+		goto failed;
+	// An index from another version of the library is rebuilt
+	if (le32toh(hdr->version) != INDEX_VERSION) {
+		errno = ESTALE;
+		goto failed;
+	}
+	x->nsections = le32toh(hdr->nsections);
+	x->nrecords = le64toh(hdr->nrecords);
+	if (x->nsections > INDEX_MAX_SECTIONS ||
+	    sizeof(*hdr) + x->nsections * sizeof(*s) > x->size)
+		goto failed;
+	x->sections = (const struct idx_section *)(x->map + sizeof(*hdr));
+	for (i = 0; i < x->nsections; i++) {
+		s = &x->sections[i];
+		if (le64toh(s->offset) % 8 != 0 || le64toh(s->offset) > x->size ||
+		    le64toh(s->length) > x->size - le64toh(s->offset))
+			goto failed;
+	}
+	if (x->nrecords != eeprom_archive_count(a) ||
+	    le64toh(hdr->fingerprint) != archive_fingerprint(a)) {
+		errno = ESTALE;
+		goto failed;
+	}
+	return x;
+
+  failed:
+	save_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	if (x != NULL) {
+		if (x->map != NULL)
+			munmap((void *) x->map, x->size);
+		free(x);
+	}
+	errno = save_errno;
+	return NULL;
+
+} /* eeprom_archive_index_open */
+
+/*
+ * find_section
+ */
+static const struct idx_section *
+find_section (eeprom_archive_index_t x, unsigned int kind, unsigned int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < x->nsections; i++)
+		if (x->sections[i].kind == kind && (kind == sect_macs || x->sections[i].id == id))
+			return &x->sections[i];
+	return NULL;
+
+} /* find_section */
+
+/*
+ * set_record
+ *
+ * Adds a record to a result bitmap, returning 1
+ * if it was not already there.
+ */
+static inline int
+set_record (uint64_t *bitmap, uint64_t r)
+{
+	uint64_t bit = 1ULL << (r % 64);
+
+	if (bitmap[r / 64] & bit)
+		return 0;
+	bitmap[r / 64] |= bit;
+	return 1;
+
+} /* set_record */
+
+/*
+ * lookup_dict
+ *
+ * Matches a shell-style pattern against the dictionary.
+ * The values sharing the pattern's literal prefix are
+ * found by binary search, and only those are matched.
+ */
+static int64_t
+lookup_dict (eeprom_archive_index_t x, const struct idx_section *s, const char *pattern, uint64_t *bitmap)
+{
+	const uint8_t *base = x->map + le64toh(s->offset);
+	unsigned int width = le16toh(s->width);
+	uint32_t count = le32toh(s->count);
+	size_t valbytes = ALIGN8((size_t) count * width);
+	const uint32_t *starts = (const uint32_t *)(base + valbytes);
+	const uint32_t *postings = (const uint32_t *)(base + valbytes +
+						      ALIGN8(((size_t) count + 1) * sizeof(uint32_t)));
+	char value[DICT_MAX_WIDTH+1];
+	size_t plen = strcspn(pattern, "*?[\\"), lo = 0, hi = count, mid, cmplen;
+	uint32_t p, r;
+	int64_t matched = 0;
+
+	if (width > DICT_MAX_WIDTH || valbytes + ALIGN8(((size_t) count + 1) * sizeof(uint32_t)) > le64toh(s->length) ||
+	    (const uint8_t *)(postings + le32toh(starts[count])) > base + le64toh(s->length)) {
+		errno = EINVAL;
+		return -1;
+	}
+	cmplen = (plen < width ? plen : width);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(base + mid * width, pattern, cmplen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < count && memcmp(base + lo * width, pattern, cmplen) == 0; lo++) {
+		memcpy(value, base + lo * width, width);
+		value[width] = '\0';
+		if (fnmatch(pattern, value, 0) != 0)
+			continue;
+		for (p = le32toh(starts[lo]); p < le32toh(starts[lo+1]) && p < le32toh(starts[count]); p++) {
+			r = le32toh(postings[p]);
+			if (r < x->nrecords)
+				matched += set_record(bitmap, r);
+		}
+	}
+	return matched;
+
+} /* lookup_dict */
+
+/*
+ * parse_attribute
+ *
+ * Parses a value of one of the bitmap-indexed attributes.
+ */
+static int
+parse_attribute (unsigned int which, const char *value)
+{
+	unsigned long v;
+	char *ep;
+
+	switch (which) {
+	case bitmap_layout_version:
+		v = strtoul(value, &ep, 0);
+		return (ep == value || *ep != '\0' || v > 255 ? -1 : (int) v);
+	case bitmap_module_type:
+		if (strcasecmp(value, "cvm") == 0)
+			return module_type_cvm;
+		if (strcasecmp(value, "cvb") == 0)
+			return module_type_cvb;
+		if (strcasecmp(value, "other") == 0)
+			return module_type_other;
+		break;
+	case bitmap_partnumber_type:
+		if (strcasecmp(value, "nvidia") == 0)
+			return partnum_type_nvidia;
+		if (strcasecmp(value, "customer") == 0)
+			return partnum_type_customer;
+		break;
+	default:
+		break;
+	}
+	return -1;
+
+} /* parse_attribute */
+
+/*
+ * eeprom_archive_index_lookup
+ *
+ * Adds the records whose named field or attribute matches
+ * the value to a bitmap (of eeprom_archive_count() bits,
+ * 64 to a word).  For the part number and serial number,
+ * the value is a shell-style pattern; for major-version,
+ * module-type, and partnumber-type it must match exactly.
+ *
+ * Returns the number of records added, or -1 on error
+ * (ENOENT if the field is not indexed).
+ */
+int64_t
+eeprom_archive_index_lookup (eeprom_archive_index_t x, const char *name, const char *value, uint64_t *bitmap)
+{
+	const struct idx_section *s;
+	const uint64_t *entry;
+	size_t nwords = (x->nrecords + 63) / 64, w;
+	unsigned int i;
+	uint32_t e;
+	int64_t matched = 0;
+	int field, v;
+
+	field = eeprom_layout_field_index(name);
+	s = (field < 0 ? NULL : find_section(x, sect_dict, field));
+	if (s != NULL)
+		return lookup_dict(x, s, value, bitmap);
+	for (i = 0; i < bitmap_count; i++)
+		if (strcasecmp(name, bitmap_names[i]) == 0)
+			break;
+	if (i >= bitmap_count || (s = find_section(x, sect_bitmap, i)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	v = parse_attribute(i, value);
+	if (v < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uint64_t) le32toh(s->count) * (nwords + 1) * sizeof(uint64_t) > le64toh(s->length)) {
+		errno = EINVAL;
+		return -1;
+	}
+	entry = (const uint64_t *)(x->map + le64toh(s->offset));
+	for (e = 0; e < le32toh(s->count); e++, entry += nwords + 1) {
+		if (le64toh(entry[0]) != (uint64_t) v)
+			continue;
+		for (w = 0; w < nwords; w++) {
+			matched += __builtin_popcountll(le64toh(entry[w+1]) & ~bitmap[w]);
+			bitmap[w] |= le64toh(entry[w+1]);
+		}
+		break;
+	}
+	return matched;
+
+} /* eeprom_archive_index_lookup */
+
+/*
+ * stab
+ *
+ * Interval tree search: adds the records with a range
+ * containing mac, in the subtree over entries lo
+ * through hi-1.
+ */
+static int64_t
+stab (const struct idx_mac *macs, const uint64_t *maxlast, size_t lo, size_t hi,
+      uint64_t mac, int field, uint64_t nrecords, uint64_t *bitmap)
+{
+	int64_t matched = 0;
+	size_t mid;
+	uint32_t r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (le64toh(maxlast[mid]) < mac)
+			break;
+		matched += stab(macs, maxlast, lo, mid, mac, field, nrecords, bitmap);
+		if (le64toh(macs[mid].first) > mac)
+			break;
+		r = le32toh(macs[mid].record);
+		if (le64toh(macs[mid].last) >= mac && (field < 0 || macs[mid].field == field) && r < nrecords)
+			matched += set_record(bitmap, r);
+		lo = mid + 1;
+	}
+	return matched;
+
+} /* stab */
+
+/*
+ * eeprom_archive_index_mac
+ *
+ * Adds the records holding a MAC address to a bitmap, either
+ * in the named MAC field or (with name NULL) in any of them.
+ * Ethernet MACs match anywhere in the range given by their
+ * counts.
+ *
+ * Returns the number of records added, or -1 on error.
+ */
+int64_t
+eeprom_archive_index_mac (eeprom_archive_index_t x, const char *name, uint64_t mac, uint64_t *bitmap)
+{
+	const struct idx_section *s = find_section(x, sect_macs, 0);
+	const struct idx_mac *macs;
+	int field = -1;
+	uint32_t count;
+
+	if (name != NULL) {
+		field = eeprom_layout_field_index(name);
+		if (field < 0 || eeprom_layout_fields[field].kind != layout_field_macaddr) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (s == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	count = le32toh(s->count);
+	if ((uint64_t) count * (sizeof(*macs) + sizeof(uint64_t)) > le64toh(s->length)) {
+		errno = EINVAL;
+		return -1;
+	}
+	macs = (const struct idx_mac *)(x->map + le64toh(s->offset));
+	return stab(macs, (const uint64_t *)(macs + count), 0, count, mac, field, x->nrecords, bitmap);
+
+} /* eeprom_archive_index_mac */
+
+/*
+ * eeprom_archive_index_close
+ */
+void
+eeprom_archive_index_close (eeprom_archive_index_t x)
+{
+	munmap((void *) x->map, x->size);
+	free(x);
+
+} /* eeprom_archive_index_close */
@@ -0,0 +1,903 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "eeprom-layout.h"
+#include "eeprom-archive.h"
+#include "eeprom-internal.h"
+
+/*
+ * File format (all integers little-endian):
+ *
+ *   header:     magic, version, records per group
+ *   groups:     for each group of up to ARCHIVE_GROUP_SIZE
+ *               records, a group header and column descriptors,
+ *               followed by the column data, 8-byte aligned
+ *   trailer:    offsets of the groups, then the record count,
+ *               group count, and trailing magic
+ *
+ * Column encodings:
+ *   raw:    the values, back to back
+ *   dict:   the distinct values, then an index into them for
+ *           each record (1, 2, or 4 bytes; none if there is
+ *           only one distinct value, as for the constant
+ *           signature fields)
+ *   delta:  each value as a little-endian integer, stored as
+ *           the zigzag varint of its difference from the
+ *           previous one, so sequential MACs take a byte each
+ *   prefix: for each value, varints for the length shared with
+ *           the previous value and the length of the remainder,
+ *           then the remainder, so sequential serial numbers
+ *           take only a few bytes each
+ *
+ * Raw and dict columns are read in place from the mapped
+ * file; delta and prefix columns are decoded the first time
+ * they are used.
+ */
+#define ARCHIVE_MAGIC		"TEGEEARC"
+#define ARCHIVE_END_MAGIC	"TEGEEEND"
+#define ARCHIVE_VERSION		1
+#define ARCHIVE_GROUP_SIZE	65536
+#define MAX_COLUMNS		64
+
+enum {
+	enc_raw,
+	enc_dict,
+	enc_delta,
+	enc_prefix,
+};
+
+struct arc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t group_size;
+} __attribute__((packed));
+
+struct arc_group_header {
+	uint32_t nrecords;
+	uint32_t ncolumns;
+} __attribute__((packed));
+
+struct arc_coldesc {
+	uint16_t offset;
+	uint16_t width;
+	uint8_t encoding;
+	uint8_t index_width;
+	uint16_t reserved;
+	uint32_t ndict;
+	uint32_t reserved2;
+	uint64_t data_offset;
+	uint64_t data_length;
+} __attribute__((packed));
+
+struct arc_trailer {
+	uint64_t nrecords;
+	uint32_t ngroups;
+	uint32_t reserved;
+	char magic[8];
+} __attribute__((packed));
+
+struct eeprom_archive_writer_s {
+	int fd;
+	uint64_t pos;
+	uint64_t total;
+	uint8_t *images;
+	uint32_t count;
+	uint64_t *group_offsets;
+	unsigned int ngroups;
+	unsigned int groups_alloc;
+	uint8_t *colbuf;
+	uint8_t *encbuf;
+	uint32_t *hashtab;
+	uint32_t *indices;
+};
+
+struct arc_column {
+	const uint8_t *data;
+	uint64_t length;
+	uint16_t offset;
+	uint16_t width;
+	uint8_t encoding;
+	uint8_t index_width;
+	uint32_t ndict;
+	_Atomic(uint8_t *) decoded;
+};
+
+struct arc_group {
+	uint32_t nrecords;
+	uint32_t ncolumns;
+	struct arc_column *columns;
+};
+
+struct eeprom_archive_s {
+	const uint8_t *map;
+	size_t size;
+	uint64_t nrecords;
+	uint32_t group_size;
+	unsigned int ngroups;
+	struct arc_group *groups;
+	pthread_mutex_t lock;
+};
+
+/*
+ * write_all
+ */
+static int
+write_all (eeprom_archive_writer_t w, const void *buf, size_t len)
+{
+	const uint8_t *bp = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(w->fd, bp, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		bp += n;
+		len -= n;
+		w->pos += n;
+	}
+	return 0;
+
+} /* write_all */
+
+/*
+ * write_padding
+ */
+static int
+write_padding (eeprom_archive_writer_t w)
+{
+	static const uint8_t zeros[8];
+
+	if (w->pos % 8 == 0)
+		return 0;
+	return write_all(w, zeros, 8 - w->pos % 8);
+
+} /* write_padding */
+
+/*
+ * put_varint
+ */
+static size_t
+put_varint (uint8_t *bp, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		bp[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	bp[n++] = val;
+	return n;
+
+} /* put_varint */
+
+/*
+ * get_varint
+ */
+static int
+get_varint (const uint8_t **bpp, const uint8_t *end, uint64_t *valp)
+{
+	const uint8_t *bp = *bpp;
+	uint64_t val = 0;
+	unsigned int shift = 0;
+
+	while (bp < end && shift < 64) {
+		val |= (uint64_t)(*bp & 0x7f) << shift;
+		if ((*bp++ & 0x80) == 0) {
+			*bpp = bp;
+			*valp = val;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+
+} /* get_varint */
+
+/*
+ * get_le
+ */
+static uint64_t
+get_le (const uint8_t *bp, unsigned int width)
+{
+	uint64_t val = 0;
+
+	while (width-- > 0)
+		val = (val << 8) | bp[width];
+	return val;
+
+} /* get_le */
+
+/*
+ * put_le
+ */
+static void
+put_le (uint8_t *bp, uint64_t val, unsigned int width)
+{
+	unsigned int i;
+
+	for (i = 0; i < width; i++, val >>= 8)
+		bp[i] = val & 0xff;
+
+} /* put_le */
+
+/*
+ * hash_value
+ */
+static uint32_t
+hash_value (const uint8_t *bp, unsigned int width)
+{
+	uint32_t h = 2166136261U;
+
+	while (width-- > 0)
+		h = (h ^ *bp++) * 16777619U;
+	return h;
+
+} /* hash_value */
+
+/*
+ * encode_dict
+ *
+ * Returns the encoded size, or 0 if there are too
+ * many distinct values for the encoding to be useful.
+ */
+static size_t
+encode_dict (eeprom_archive_writer_t w, const uint8_t *col, uint32_t count, unsigned int width,
+	     uint8_t *out, uint32_t *ndictp, uint8_t *iwp)
+{
+	uint32_t tabsize = 2 * ARCHIVE_GROUP_SIZE;
+	uint32_t ndict = 0, i, h, slot;
+	uint8_t iw;
+	size_t len;
+
+	memset(w->hashtab, 0xff, tabsize * sizeof(w->hashtab[0]));
+	for (i = 0; i < count; i++) {
+		h = hash_value(col + i * width, width) % tabsize;
+		for (;;) {
+			slot = w->hashtab[h];
+			if (slot == UINT32_MAX) {
+				w->hashtab[h] = i;
+				memcpy(out + ndict * width, col + i * width, width);
+				w->indices[i] = ndict++;
+				break;
+			}
+			if (memcmp(col + slot * width, col + i * width, width) == 0) {
+				w->indices[i] = w->indices[slot];
+				break;
+			}
+			h = (h + 1) % tabsize;
+		}
+		if (ndict > count / 2 + 1)
+			return 0;
+	}
+	iw = (ndict == 1 ? 0 : ndict <= 256 ? 1 : ndict <= 65536 ? 2 : 4);
+	len = ndict * width;
+	for (i = 0; iw != 0 && i < count; i++, len += iw)
+		put_le(out + len, w->indices[i], iw);
+	*ndictp = ndict;
+	*iwp = iw;
+	return len;
+
+} /* encode_dict */
+
+/*
+ * encode_delta
+ */
+static size_t
+encode_delta (const uint8_t *col, uint32_t count, unsigned int width, uint8_t *out)
+{
+	uint64_t prev = 0, val, diff;
+	size_t len = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		val = get_le(col + i * width, width);
+		diff = val - prev;
+		len += put_varint(out + len, (diff << 1) ^ (uint64_t)((int64_t) diff >> 63));
+		prev = val;
+	}
+	return len;
+
+} /* encode_delta */
+
+/*
+ * encode_prefix
+ */
+static size_t
+encode_prefix (const uint8_t *col, uint32_t count, unsigned int width, uint8_t *out)
+{
+	const uint8_t *prev = NULL, *val;
+	unsigned int shared;
+	size_t len = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		val = col + i * width;
+		shared = 0;
+		if (prev != NULL)
+			while (shared < width && prev[shared] == val[shared])
+				shared++;
+		len += put_varint(out + len, shared);
+		len += put_varint(out + len, width - shared);
+		memcpy(out + len, val + shared, width - shared);
+		len += width - shared;
+		prev = val;
+	}
+	return len;
+
+} /* encode_prefix */
+
+/*
+ * flush_group
+ *
+ * Writes out the buffered records, choosing the
+ * smallest encoding for each column.
+ */
+static int
+flush_group (eeprom_archive_writer_t w)
+{
+	struct arc_group_header gh;
+	struct arc_coldesc desc[MAX_COLUMNS];
+	const eeprom_layout_field_t *f;
+	uint64_t *offsets;
+	uint8_t *enc;
+	size_t best, len, slot;
+	uint32_t i, ndict;
+	unsigned int c, width;
+	uint8_t iw;
+	off_t descpos;
+
+	if (w->count == 0)
+		return 0;
+	if (w->ngroups >= w->groups_alloc) {
+		offsets = realloc(w->group_offsets, (w->groups_alloc + 16) * sizeof(uint64_t));
+		if (offsets == NULL)
+			return -1;
+		w->group_offsets = offsets;
+		w->groups_alloc += 16;
+	}
+	if (write_padding(w) < 0)
+		return -1;
+	w->group_offsets[w->ngroups++] = w->pos;
+	gh.nrecords = htole32(w->count);
+	gh.ncolumns = htole32(eeprom_layout_field_count);
+	memset(desc, 0, sizeof(desc));
+	if (write_all(w, &gh, sizeof(gh)) < 0)
+		return -1;
+	descpos = w->pos;
+	if (write_all(w, desc, eeprom_layout_field_count * sizeof(desc[0])) < 0)
+		return -1;
+
+	slot = (size_t) ARCHIVE_GROUP_SIZE * EEPROM_IMAGE_SIZE;
+	for (c = 0; c < eeprom_layout_field_count; c++) {
+		f = &eeprom_layout_fields[c];
+		width = f->size;
+		for (i = 0; i < w->count; i++)
+			memcpy(w->colbuf + i * width, w->images + i * EEPROM_IMAGE_SIZE + f->offset, width);
+		/*
+		 * encbuf holds one candidate encoding per slot:
+		 * dict in the first, delta or prefix in the second.
+		 */
+		enc = w->colbuf;
+		best = w->count * width;
+		desc[c].encoding = enc_raw;
+		len = encode_dict(w, w->colbuf, w->count, width, w->encbuf, &ndict, &iw);
+		if (len > 0 && len < best) {
+			enc = w->encbuf;
+			best = len;
+			desc[c].encoding = enc_dict;
+			desc[c].index_width = iw;
+			desc[c].ndict = htole32(ndict);
+		}
+		if ((f->kind == layout_field_macaddr || f->kind == layout_field_uint) && width <= 8)
+			len = encode_delta(w->colbuf, w->count, width, w->encbuf + slot);
+		else if (f->kind == layout_field_string)
+			len = encode_prefix(w->colbuf, w->count, width, w->encbuf + slot);
+		else
+			len = 0;
+		if (len > 0 && len < best) {
+			enc = w->encbuf + slot;
+			best = len;
+			desc[c].encoding = (f->kind == layout_field_string ? enc_prefix : enc_delta);
+			desc[c].index_width = 0;
+			desc[c].ndict = 0;
+		}
+		if (write_padding(w) < 0)
+			return -1;
+		desc[c].offset = htole16(f->offset);
+		desc[c].width = htole16(width);
+		desc[c].data_offset = htole64(w->pos);
+		desc[c].data_length = htole64(best);
+		if (write_all(w, enc, best) < 0)
+			return -1;
+	}
+	if (pwrite(w->fd, desc, eeprom_layout_field_count * sizeof(desc[0]), descpos) < 0)
+		return -1;
+	w->count = 0;
+	return 0;
+
+} /* flush_group */
+
+/*
+ * eeprom_archive_create
+ */
+eeprom_archive_writer_t
+eeprom_archive_create (const char *pathname)
+{
+	eeprom_archive_writer_t w;
+	struct arc_header hdr;
+	size_t groupbytes = (size_t) ARCHIVE_GROUP_SIZE * EEPROM_IMAGE_SIZE;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+	w->images = malloc(groupbytes);
+	w->colbuf = malloc(groupbytes);
+	// worst case for prefix/delta encodings is a few bytes per value over raw
+	w->encbuf = malloc(groupbytes + 2 * (groupbytes + ARCHIVE_GROUP_SIZE * 20));
+	w->hashtab = malloc(2 * ARCHIVE_GROUP_SIZE * sizeof(uint32_t));
+	w->indices = malloc(ARCHIVE_GROUP_SIZE * sizeof(uint32_t));
+	if (w->images == NULL || w->colbuf == NULL || w->encbuf == NULL ||
+	    w->hashtab == NULL || w->indices == NULL)
+		goto failed;
+	w->fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (w->fd < 0)
+		goto failed;
+	memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(ARCHIVE_VERSION);
+	hdr.group_size = htole32(ARCHIVE_GROUP_SIZE);
+	if (write_all(w, &hdr, sizeof(hdr)) < 0) {
+		close(w->fd);
+		goto failed;
+	}
+	return w;
+
+  failed:
+	free(w->images);
+	free(w->colbuf);
+	free(w->encbuf);
+	free(w->hashtab);
+	free(w->indices);
+	free(w);
+	return NULL;
+
+} /* eeprom_archive_create */
+
+/*
+ * eeprom_archive_add
+ *
+ * Adds an image (which must be EEPROM_IMAGE_SIZE bytes)
+ * to the archive.
+ */
+int
+eeprom_archive_add (eeprom_archive_writer_t w, const void *image, size_t len)
+{
+	if (len != EEPROM_IMAGE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(w->images + (size_t) w->count * EEPROM_IMAGE_SIZE, image, EEPROM_IMAGE_SIZE);
+	w->count += 1;
+	w->total += 1;
+	if (w->count >= ARCHIVE_GROUP_SIZE)
+		return flush_group(w);
+	return 0;
+
+} /* eeprom_archive_add */
+
+/*
+ * eeprom_archive_finish
+ *
+ * Writes out any remaining records and the trailer,
+ * and frees the writer.
+ */
+int
+eeprom_archive_finish (eeprom_archive_writer_t w)
+{
+	struct arc_trailer trailer;
+	unsigned int i;
+	int ret = -1, save_errno;
+
+	if (flush_group(w) < 0 || write_padding(w) < 0)
+		goto depart;
+	for (i = 0; i < w->ngroups; i++)
+		w->group_offsets[i] = htole64(w->group_offsets[i]);
+	if (w->ngroups > 0 && write_all(w, w->group_offsets, w->ngroups * sizeof(uint64_t)) < 0)
+		goto depart;
+	trailer.nrecords = htole64(w->total);
+	trailer.ngroups = htole32(w->ngroups);
+	trailer.reserved = 0;
+	memcpy(trailer.magic, ARCHIVE_END_MAGIC, sizeof(trailer.magic));
+	if (write_all(w, &trailer, sizeof(trailer)) < 0)
+		goto depart;
+	ret = 0;
+  depart:
+	save_errno = errno;
+	if (close(w->fd) < 0 && ret == 0) {
+		save_errno = errno;
+		ret = -1;
+	}
+	free(w->images);
+	free(w->colbuf);
+	free(w->encbuf);
+	free(w->hashtab);
+	free(w->indices);
+	free(w->group_offsets);
+	free(w);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_archive_finish */
+
+/*
+ * parse_group
+ */
+static int
+parse_group (eeprom_archive_t a, uint64_t offset, struct arc_group *g)
+{
+	const struct arc_group_header *gh;
+	const struct arc_coldesc *desc;
+	struct arc_column *col;
+	uint64_t end;
+	unsigned int c;
+
+	if (offset % 8 != 0 || offset + sizeof(*gh) > a->size)
+		return -1;
+	gh = (const struct arc_group_header *)(a->map + offset);
+	g->nrecords = le32toh(gh->nrecords);
+	g->ncolumns = le32toh(gh->ncolumns);
+	if (g->ncolumns == 0 || g->ncolumns > MAX_COLUMNS || g->nrecords > a->group_size ||
+	    offset + sizeof(*gh) + g->ncolumns * sizeof(*desc) > a->size)
+		return -1;
+	g->columns = calloc(g->ncolumns, sizeof(struct arc_column));
+	if (g->columns == NULL)
+		return -1;
+	desc = (const struct arc_coldesc *)(gh + 1);
+	for (c = 0; c < g->ncolumns; c++) {
+		col = &g->columns[c];
+		col->offset = le16toh(desc[c].offset);
+		col->width = le16toh(desc[c].width);
+		col->encoding = desc[c].encoding;
+		col->index_width = desc[c].index_width;
+		col->ndict = le32toh(desc[c].ndict);
+		col->length = le64toh(desc[c].data_length);
+		end = le64toh(desc[c].data_offset) + col->length;
+		if (col->width == 0 || col->offset + col->width > EEPROM_IMAGE_SIZE ||
+		    end > a->size || end < col->length)
+			return -1;
+		col->data = a->map + le64toh(desc[c].data_offset);
+		switch (col->encoding) {
+		case enc_raw:
+			if (col->length < (uint64_t) g->nrecords * col->width)
+				return -1;
+			break;
+		case enc_dict:
+			if (col->ndict == 0 ||
+			    (col->index_width != 0 && col->index_width != 1 &&
+			     col->index_width != 2 && col->index_width != 4) ||
+			    col->length < (uint64_t) col->ndict * col->width +
+			    (uint64_t) g->nrecords * col->index_width)
+				return -1;
+			break;
+		case enc_delta:
+			if (col->width > 8)
+				return -1;
+			break;
+		case enc_prefix:
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+
+} /* parse_group */
+
+/*
+ * eeprom_archive_open
+ *
+ * Maps an archive for reading.
+ */
+eeprom_archive_t
+eeprom_archive_open (const char *pathname)
+{
+	eeprom_archive_t a;
+	const struct arc_header *hdr;
+	const struct arc_trailer *trailer;
+	const uint64_t *offsets;
+	struct stat st;
+	uint64_t count = 0;
+	unsigned int i;
+	int fd, save_errno;
+
+	fd = open(pathname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	a = calloc(1, sizeof(*a));
+	if (a == NULL || fstat(fd, &st) < 0)
+		goto failed;
+	if (st.st_size < (off_t)(sizeof(*hdr) + sizeof(*trailer))) {
+		errno = EINVAL;
+		goto failed;
+	}
+	a->size = st.st_size;
+	a->map = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (a->map == MAP_FAILED) {
+		a->map = NULL;
+		goto failed;
+	}
+	close(fd);
+	fd = -1;
+	errno = EINVAL;
+	hdr = (const struct arc_header *) a->map;
+	trailer = (const struct arc_trailer *)(a->map + a->size - sizeof(*trailer));
+	if (memcmp(hdr->magic, ARCHIVE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    le32toh(hdr->version) != ARCHIVE_VERSION ||
+	    memcmp(trailer->magic, ARCHIVE_END_MAGIC, sizeof(trailer->magic)) != 0)
+		goto failed;
+	a->group_size = le32toh(hdr->group_size);
+	a->nrecords = le64toh(trailer->nrecords);
+	a->ngroups = le32toh(trailer->ngroups);
+	if (a->group_size == 0 ||
+	    (uint64_t) a->ngroups * sizeof(uint64_t) > a->size - sizeof(*hdr) - sizeof(*trailer))
+		goto failed;
+	offsets = (const uint64_t *)((const uint8_t *) trailer - a->ngroups * sizeof(uint64_t));
+	a->groups = calloc(a->ngroups + 1, sizeof(struct arc_group));
+	if (a->groups == NULL)
+		goto failed;
+	for (i = 0; i < a->ngroups; i++) {
+		errno = EINVAL;
+		if (parse_group(a, le64toh(offsets[i]), &a->groups[i]) < 0)
+			goto failed;
+		if (i + 1 < a->ngroups && a->groups[i].nrecords != a->group_size)
+			goto failed;
+		count += a->groups[i].nrecords;
+	}
+	if (count != a->nrecords)
+		goto failed;
+	pthread_mutex_init(&a->lock, NULL);
+	return a;
+
+  failed:
+	save_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	if (a != NULL) {
+		if (a->groups != NULL)
+			for (i = 0; i < a->ngroups; i++)
+				free(a->groups[i].columns);
+		free(a->groups);
+		if (a->map != NULL)
+			munmap((void *) a->map, a->size);
+		free(a);
+	}
+	errno = save_errno;
+	return NULL;
+
+} /* eeprom_archive_open */
+
+/*
+ * eeprom_archive_count
+ */
+uint64_t
+eeprom_archive_count (eeprom_archive_t a)
+{
+	return a->nrecords;
+
+} /* eeprom_archive_count */
+
+/*
+ * archive_fingerprint
+ *
+ * Hash of the archive's size, group offsets, and trailer,
+ * which change whenever records are added or changed; used
+ * to tell whether an index file is up to date.
+ */
+uint64_t
+archive_fingerprint (eeprom_archive_t a)
+{
+	size_t tail = a->ngroups * sizeof(uint64_t) + sizeof(struct arc_trailer);
+	const uint8_t *bp = a->map + a->size - tail;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(a->size); i++)
+		h = (h ^ ((uint64_t) a->size >> (i * 8) & 0xff)) * 1099511628211ULL;
+	for (i = 0; i < tail; i++)
+		h = (h ^ bp[i]) * 1099511628211ULL;
+	return h;
+
+} /* archive_fingerprint */
+
+/*
+ * eeprom_archive_column
+ *
+ * Returns the column number for a field name from
+ * eeprom_layout_fields[], or -1 if not present.
+ */
+int
+eeprom_archive_column (eeprom_archive_t a, const char *name)
+{
+	int i = eeprom_layout_field_index(name);
+	unsigned int c;
+
+	if (i < 0 || a->ngroups == 0)
+		return -1;
+	for (c = 0; c < a->groups[0].ncolumns; c++)
+		if (a->groups[0].columns[c].offset == eeprom_layout_fields[i].offset &&
+		    a->groups[0].columns[c].width == eeprom_layout_fields[i].size)
+			return (int) c;
+	return -1;
+
+} /* eeprom_archive_column */
+
+/*
+ * decode_column
+ *
+ * Expands a delta- or prefix-encoded column.
+ */
+static uint8_t *
+decode_column (const struct arc_column *col, uint32_t nrecords)
+{
+	const uint8_t *bp = col->data, *end = col->data + col->length;
+	uint8_t *out, *val;
+	uint64_t prev = 0, zz, shared, rest;
+	uint32_t i;
+
+	out = malloc((size_t) nrecords * col->width);
+	if (out == NULL)
+		return NULL;
+	for (i = 0; i < nrecords; i++) {
+		val = out + (size_t) i * col->width;
+		if (col->encoding == enc_delta) {
+			if (get_varint(&bp, end, &zz) < 0)
+				goto corrupt;
+			prev += (zz >> 1) ^ -(zz & 1);
+			put_le(val, prev, col->width);
+			continue;
+		}
+		if (get_varint(&bp, end, &shared) < 0 || get_varint(&bp, end, &rest) < 0 ||
+		    shared + rest != col->width || (i == 0 && shared != 0) ||
+		    (uint64_t)(end - bp) < rest)
+			goto corrupt;
+		if (shared > 0)
+			memcpy(val, val - col->width, shared);
+		memcpy(val + shared, bp, rest);
+		bp += rest;
+	}
+	return out;
+
+  corrupt:
+	free(out);
+	errno = EINVAL;
+	return NULL;
+
+} /* decode_column */
+
+/*
+ * eeprom_archive_field
+ *
+ * Returns a pointer to the value of one column for a record,
+ * with the width of the field stored through lenp (if non-NULL).
+ * Only that column is read.  For raw and dictionary-encoded
+ * columns, the pointer is into the mapped file.
+ */
+const uint8_t *
+eeprom_archive_field (eeprom_archive_t a, uint64_t record, int column, size_t *lenp)
+{
+	struct arc_group *g;
+	struct arc_column *col;
+	uint8_t *decoded;
+	uint32_t idx;
+
+	if (record >= a->nrecords) {
+		errno = ERANGE;
+		return NULL;
+	}
+	g = &a->groups[record / a->group_size];
+	idx = record % a->group_size;
+	if (column < 0 || (uint32_t) column >= g->ncolumns) {
+		errno = EINVAL;
+		return NULL;
+	}
+	col = &g->columns[column];
+	if (lenp != NULL)
+		*lenp = col->width;
+	switch (col->encoding) {
+	case enc_raw:
+		return col->data + (size_t) idx * col->width;
+	case enc_dict:
+		if (col->index_width != 0)
+			idx = get_le(col->data + (size_t) col->ndict * col->width +
+				     (size_t) idx * col->index_width, col->index_width);
+		else
+			idx = 0;
+		if (idx >= col->ndict) {
+			errno = EINVAL;
+			return NULL;
+		}
+		return col->data + (size_t) idx * col->width;
+	default:
+		break;
+	}
+	decoded = atomic_load_explicit(&col->decoded, memory_order_acquire);
+	if (decoded == NULL) {
+		pthread_mutex_lock(&a->lock);
+		decoded = atomic_load_explicit(&col->decoded, memory_order_relaxed);
+		if (decoded == NULL) {
+			decoded = decode_column(col, g->nrecords);
+			atomic_store_explicit(&col->decoded, decoded, memory_order_release);
+		}
+		pthread_mutex_unlock(&a->lock);
+		if (decoded == NULL)
+			return NULL;
+	}
+	return decoded + (size_t) idx * col->width;
+
+} /* eeprom_archive_field */
+
+/*
+ * eeprom_archive_image
+ *
+ * Reconstructs the raw image for a record.
+ */
+int
+eeprom_archive_image (eeprom_archive_t a, uint64_t record, void *buf, size_t len)
+{
+	struct arc_group *g;
+	const uint8_t *val;
+	unsigned int c;
+
+	if (len < EEPROM_IMAGE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (record >= a->nrecords) {
+		errno = ERANGE;
+		return -1;
+	}
+	g = &a->groups[record / a->group_size];
+	memset(buf, 0, EEPROM_IMAGE_SIZE);
+	for (c = 0; c < g->ncolumns; c++) {
+		val = eeprom_archive_field(a, record, c, NULL);
+		if (val == NULL)
+			return -1;
+		memcpy((uint8_t *) buf + g->columns[c].offset, val, g->columns[c].width);
+	}
+	return 0;
+
+} /* eeprom_archive_image */
+
+/*
+ * eeprom_archive_close
+ */
+void
+eeprom_archive_close (eeprom_archive_t a)
+{
+	unsigned int i, c;
+
+	for (i = 0; i < a->ngroups; i++) {
+		for (c = 0; c < a->groups[i].ncolumns; c++)
+			free(atomic_load(&a->groups[i].columns[c].decoded));
+		free(a->groups[i].columns);
+	}
+	free(a->groups);
+	munmap((void *) a->map, a->size);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+
+} /* eeprom_archive_close */
@@ -0,0 +1,373 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "eeprom.h"
+#include "eeprom-internal.h"
+
+/*
+ * Asynchronous operations.
+ *
+ * Each operation has a timerfd that becomes readable
+ * whenever eeprom_async_step() should be called: right
+ * away while there are chunks to transfer, or when a retry
+ * backoff (or the deadline) expires.  Each step transfers
+ * a single chunk, so many EEPROMs on different buses can
+ * be serviced from one event loop.
+ */
+struct eeprom_async_s {
+	eeprom_context_t ctx;
+	int is_open;
+	int timerfd;
+	int status;
+	int error;
+	struct xfer_s xfer;
+	int have_before;	// for the journal, on writes
+	struct module_eeprom_v1_raw before;
+	struct module_eeprom_v1_raw image;	// being written, cached once it is
+};
+
+/*
+ * async_arm
+ *
+ * Arms the timer for the next step: at the retry time
+ * if there is one pending (but no later than the deadline),
+ * otherwise immediately.  A zero 'when' disarms it.
+ */
+static int
+async_arm (eeprom_async_t op, const struct timespec *when)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (when != NULL)
+		its.it_value = *when;
+	return timerfd_settime(op->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+} /* async_arm */
+
+static int
+async_schedule (eeprom_async_t op)
+{
+	struct timespec when = op->xfer.not_before;
+	eeprom_context_t ctx = op->ctx;
+
+	if (ctx->have_deadline &&
+	    (when.tv_sec > ctx->deadline.tv_sec ||
+	     (when.tv_sec == ctx->deadline.tv_sec && when.tv_nsec > ctx->deadline.tv_nsec)))
+		when = ctx->deadline;
+	// An absolute time of zero would disarm the timer
+	if (when.tv_sec == 0 && when.tv_nsec == 0)
+		when.tv_nsec = 1;
+	return async_arm(op, &when);
+
+} /* async_schedule */
+
+/*
+ * async_new
+ */
+static eeprom_async_t
+async_new (eeprom_context_t ctx, int is_open)
+{
+	eeprom_async_t op;
+	int save_errno;
+
+	op = calloc(1, sizeof(*op));
+	if (op == NULL)
+		return NULL;
+	op->ctx = ctx;
+	op->is_open = is_open;
+	op->status = 1;
+	op->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (op->timerfd < 0) {
+		save_errno = errno;
+		free(op);
+		errno = save_errno;
+		return NULL;
+	}
+	op_start(ctx);
+	return op;
+
+} /* async_new */
+
+/*
+ * async_open_common
+ */
+static eeprom_async_t
+async_open_common (eeprom_context_t ctx)
+{
+	eeprom_async_t op;
+
+	if (ctx == NULL)
+		return NULL;
+	op = async_new(ctx, 1);
+	if (op == NULL) {
+		eeprom_close(ctx);
+		return NULL;
+	}
+	xfer_init_read(&op->xfer, (uint8_t *) &ctx->eeprom_data, ctx->validmap);
+	async_schedule(op);
+	return op;
+
+} /* async_open_common */
+
+/*
+ * eeprom_async_open_i2c
+ *
+ * Starts opening an EEPROM through the I2C driver.
+ * The context is available from eeprom_async_result()
+ * once the operation has completed.
+ */
+eeprom_async_t
+eeprom_async_open_i2c (unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+		       const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int fd = open_i2c_fd(bus, addr);
+
+	if (fd < 0)
+		return NULL;
+	ctx = open_context(fd, mtype, 1, transport_readfunc(transport_best_i2c(bus)), opts);
+	if (ctx != NULL) {
+		ctx->i2c_addr = addr;
+		lock_init_i2c(ctx, bus, addr);
+	}
+	return async_open_common(ctx);
+
+} /* eeprom_async_open_i2c */
+
+/*
+ * eeprom_async_open
+ *
+ * Starts opening an EEPROM through an EEPROM driver,
+ * or a file.
+ */
+eeprom_async_t
+eeprom_async_open (const char *pathname, eeprom_module_type_t mtype,
+		   const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int fd, readonly;
+
+	fd = open_path_fd(pathname, &readonly);
+	if (fd < 0)
+		return NULL;
+	ctx = open_context(fd, mtype, readonly, normal_read, opts);
+	if (ctx != NULL)
+		lock_init_path(ctx, pathname);
+	return async_open_common(ctx);
+
+} /* eeprom_async_open */
+
+/*
+ * eeprom_async_write
+ *
+ * Starts writing module EEPROM data to the device.
+ * The same caveats apply as for eeprom_write().  The
+ * context must not be used for anything else until
+ * the operation has completed.
+ */
+eeprom_async_t
+eeprom_async_write (eeprom_context_t ctx, module_eeprom_t *data)
+{
+	struct module_eeprom_v1_raw image, before;
+	eeprom_async_t op;
+	int ret, have_before;
+
+	pthread_mutex_lock(&ctx->oplock);
+	have_before = ctx->complete;
+	memcpy(&before, &ctx->eeprom_data, sizeof(before));
+	ret = encode_image(ctx, data, &image);
+	pthread_mutex_unlock(&ctx->oplock);
+	if (ret < 0)
+		return NULL;
+	op = async_new(ctx, 0);
+	if (op == NULL)
+		return NULL;
+	op->have_before = have_before;
+	op->before = before;
+	op->image = image;
+	xfer_init_write(&op->xfer, (uint8_t *) &op->image, -1);
+	async_schedule(op);
+	return op;
+
+} /* eeprom_async_write */
+
+/*
+ * eeprom_async_fd
+ *
+ * Returns a file descriptor to poll for readability;
+ * when readable, call eeprom_async_step().
+ */
+int
+eeprom_async_fd (eeprom_async_t op)
+{
+	return op->timerfd;
+
+} /* eeprom_async_fd */
+
+/*
+ * eeprom_async_step
+ *
+ * Advances the operation by (at most) one chunk.
+ *
+ * Returns 1 if the operation is still in progress,
+ * 0 if it has completed successfully, or -1 if
+ * it failed.
+ */
+int
+eeprom_async_step (eeprom_async_t op)
+{
+	struct timespec now;
+	uint64_t expirations;
+	int ret;
+
+	if (read(op->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return -1;
+	if (op->status <= 0) {
+		errno = op->error;
+		return op->status;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < op->xfer.not_before.tv_sec ||
+	    (now.tv_sec == op->xfer.not_before.tv_sec && now.tv_nsec < op->xfer.not_before.tv_nsec)) {
+		if (op_remaining_us(op->ctx) != 0) {
+			async_schedule(op);
+			return 1;
+		}
+	}
+	ret = xfer_step(op->ctx, &op->xfer);
+	if (ret > 0) {
+		async_schedule(op);
+		return 1;
+	}
+	async_arm(op, NULL);
+	if (ret < 0) {
+		op->status = -1;
+		op->error = errno;
+		if (!op->is_open) {
+			pthread_mutex_lock(&op->ctx->oplock);
+			write_failed(op->ctx, &op->xfer);
+			pthread_mutex_unlock(&op->ctx->oplock);
+		}
+		errno = op->error;
+		return -1;
+	}
+	if (op->is_open)
+		op->ctx->complete = 1;
+	else {
+		pthread_mutex_lock(&op->ctx->oplock);
+		write_done(op->ctx, &op->image, &op->before, op->have_before);
+		pthread_mutex_unlock(&op->ctx->oplock);
+	}
+	op->status = 0;
+	return 0;
+
+} /* eeprom_async_step */
+
+/*
+ * eeprom_async_complete
+ *
+ * Runs the operation to completion, blocking as needed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+eeprom_async_complete (eeprom_async_t op)
+{
+	struct pollfd pfd = { .fd = op->timerfd, .events = POLLIN };
+	int ret;
+
+	while ((ret = eeprom_async_step(op)) > 0)
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	return ret;
+
+} /* eeprom_async_complete */
+
+/*
+ * eeprom_async_cancel
+ *
+ * Cancels the operation; the next step fails
+ * with ECANCELED.  Does nothing once the operation
+ * has finished, so a cancellation is not left pending
+ * for the next operation on the context.
+ */
+void
+eeprom_async_cancel (eeprom_async_t op)
+{
+	if (op->status > 0) {
+		eeprom_cancel(op->ctx);
+		async_arm(op, &(struct timespec) { 0, 1 });
+	}
+
+} /* eeprom_async_cancel */
+
+/*
+ * eeprom_async_progress
+ *
+ * Returns the number of bytes transferred so far.
+ */
+size_t
+eeprom_async_progress (eeprom_async_t op)
+{
+	return (op->ctx == NULL ? 0 : op->ctx->bytes_completed);
+
+} /* eeprom_async_progress */
+
+/*
+ * eeprom_async_result
+ *
+ * Fetches the result of a completed operation.  For an open,
+ * the context is passed back through ctxp (and is then owned
+ * by the caller); with EEPROM_OPEN_PARTIAL, this happens even
+ * if the read failed, so it can be finished with eeprom_resume().
+ *
+ * Returns 0 if the operation succeeded, -1 if it failed (with
+ * errno set to EINPROGRESS if it has not yet completed).
+ */
+int
+eeprom_async_result (eeprom_async_t op, eeprom_context_t *ctxp)
+{
+	if (op->status > 0) {
+		errno = EINPROGRESS;
+		return -1;
+	}
+	if (op->is_open && ctxp != NULL && op->ctx != NULL &&
+	    (op->status == 0 || (op->ctx->opts.flags & EEPROM_OPEN_PARTIAL))) {
+		*ctxp = op->ctx;
+		op->ctx = NULL;
+	}
+	if (op->status < 0) {
+		errno = op->error;
+		return -1;
+	}
+	return 0;
+
+} /* eeprom_async_result */
+
+/*
+ * eeprom_async_free
+ *
+ * Cleans up the operation.  For an open whose context
+ * was not claimed with eeprom_async_result(), the context
+ * is closed.
+ */
+void
+eeprom_async_free (eeprom_async_t op)
+{
+	if (op->ctx != NULL)
+		xfer_abort(op->ctx, &op->xfer);
+	if (op->is_open && op->ctx != NULL)
+		eeprom_close(op->ctx);
+	close(op->timerfd);
+	free(op);
+
+} /* eeprom_async_free */
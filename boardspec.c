@@ -13,24 +13,24 @@
 #include <limits.h>
 #include "cvm.h"
 #include "eeprom.h"
+#include "boardspec.h"
 
 /*
- * tegra_boardspec
+ * tegra_boardspec_ex
  *
  * Formats the boardspec for the current system
- * into a caller-provided buffer.
+ * into a caller-provided buffer, using the given
+ * options (such as a timeout) for reading the EEPROM.
  *
  * Returns: length of string, or negative integer on error.
  */
 int
-tegra_boardspec (char *buf, unsigned int bufsiz)
+tegra_boardspec_ex (char *buf, unsigned int bufsiz, const eeprom_open_options_t *opts)
 {
 	eeprom_context_t ectx = NULL;
 	module_eeprom_t eeprom;
 	tegra_soctype_t soctype;
 	const cvm_i2c_address_t *addr;
-	ssize_t len;
-	char eeprompath[PATH_MAX];
 	char boardrev[4];
 
 	soctype = cvm_soctype();
@@ -40,16 +40,7 @@ tegra_boardspec (char *buf, unsigned int bufsiz)
 		return -1;
 	}
 
-	len = snprintf(eeprompath, sizeof(eeprompath)-1,
-		       "/sys/bus/i2c/devices/%d-%04x/eeprom",
-		       addr->busnum, addr->addr);
-	if (len > 0) {
-		eeprompath[len] = '\0';
-		if (access(eeprompath, F_OK) == 0)
-			ectx = eeprom_open(eeprompath, module_type_cvm);
-	}
-	if (ectx == NULL)
-		ectx = eeprom_open_i2c(addr->busnum, addr->addr, module_type_cvm);
+	ectx = eeprom_open_cvm_ex(NULL, opts);
 	if (ectx == NULL)
 		return -1;
 	if (eeprom_read(ectx, &eeprom) != 0) {
@@ -87,4 +78,11 @@ tegra_boardspec (char *buf, unsigned int bufsiz)
 			boardrev,
 			(soctype == TEGRA_SOCTYPE_194 ? 2 : 0));
 
+} /* tegra_boardspec_ex */
+
+int
+tegra_boardspec (char *buf, unsigned int bufsiz)
+{
+	return tegra_boardspec_ex(buf, bufsiz, NULL);
+
 } /* tegra_boardspec */
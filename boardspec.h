@@ -10,7 +10,10 @@ extern "C"
 {
 #endif
 
+#include "eeprom.h"
+
 int tegra_boardspec(char *buf, unsigned int bufsiz);
+int tegra_boardspec_ex(char *buf, unsigned int bufsiz, const eeprom_open_options_t *opts);
 
 #ifdef __cplusplus
 } /* extern "C" */
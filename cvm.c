@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "cvm.h"
 
 static const struct cvm_i2c_address_s cvm_addr[TEGRA_SOCTYPE_COUNT] = {
@@ -16,6 +17,9 @@ static const struct cvm_i2c_address_s cvm_addr[TEGRA_SOCTYPE_COUNT] = {
 	[TEGRA_SOCTYPE_234] = { 0, 0x50 },
 };
 
+static pthread_once_t soctype_once = PTHREAD_ONCE_INIT;
+static tegra_soctype_t soctype_cached = TEGRA_SOCTYPE_INVALID;
+
 static const struct {
     tegra_soctype_t soctype;
     const char *compat;
@@ -65,10 +69,10 @@ soctype_from_compat_strings (void)
 } /* soctype_from_compat_strings */
 
 /*
- * cvm_soctype
+ * soctype_probe
  */
-tegra_soctype_t
-cvm_soctype (void)
+static tegra_soctype_t
+soctype_probe (void)
 {
 	ssize_t typelen;
 	int fd;
@@ -99,6 +103,30 @@ cvm_soctype (void)
 	}
 	return TEGRA_SOCTYPE_INVALID;
 
+} /* soctype_probe */
+
+/*
+ * soctype_init
+ */
+static void
+soctype_init (void)
+{
+	soctype_cached = soctype_probe();
+
+} /* soctype_init */
+
+/*
+ * cvm_soctype
+ *
+ * The SoC type cannot change while we are running, so it
+ * is probed only once; safe to call from multiple threads.
+ */
+tegra_soctype_t
+cvm_soctype (void)
+{
+	pthread_once(&soctype_once, soctype_init);
+	return soctype_cached;
+
 } /* cvm_soctype */
 
 /*
@@ -0,0 +1,61 @@
+#ifndef eeprom_archive_h__
+#define eeprom_archive_h__
+
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Archives of raw EEPROM images, stored column-wise
+ * following the raw layout (see eeprom-layout.h), with
+ * each column in a group of records dictionary-, delta-,
+ * or prefix-encoded when that is smaller.  Images are
+ * reproduced bit-for-bit.
+ */
+struct eeprom_archive_writer_s;
+typedef struct eeprom_archive_writer_s *eeprom_archive_writer_t;
+struct eeprom_archive_s;
+typedef struct eeprom_archive_s *eeprom_archive_t;
+
+eeprom_archive_writer_t eeprom_archive_create(const char *pathname);
+int eeprom_archive_add(eeprom_archive_writer_t w, const void *image, size_t len);
+int eeprom_archive_finish(eeprom_archive_writer_t w);
+
+eeprom_archive_t eeprom_archive_open(const char *pathname);
+uint64_t eeprom_archive_count(eeprom_archive_t a);
+int eeprom_archive_column(eeprom_archive_t a, const char *name);
+const uint8_t *eeprom_archive_field(eeprom_archive_t a, uint64_t record, int column, size_t *lenp);
+int eeprom_archive_image(eeprom_archive_t a, uint64_t record, void *buf, size_t len);
+void eeprom_archive_close(eeprom_archive_t a);
+
+/*
+ * Persistent indexes for an archive, kept in a separate file:
+ * sorted dictionaries of the part numbers and serial numbers,
+ * bitmaps of the records by layout version, module type
+ * ("cvm", "cvb", or "other"), and part number type ("nvidia"
+ * or "customer"), and an interval tree of the MAC addresses.
+ * Lookups add the matching records to a bitmap of
+ * eeprom_archive_count() bits, 64 to a word.
+ */
+struct eeprom_archive_index_s;
+typedef struct eeprom_archive_index_s *eeprom_archive_index_t;
+
+int eeprom_archive_index_build(eeprom_archive_t a, const char *pathname);
+eeprom_archive_index_t eeprom_archive_index_open(eeprom_archive_t a, const char *pathname);
+int64_t eeprom_archive_index_lookup(eeprom_archive_index_t x, const char *name, const char *value, uint64_t *bitmap);
+int64_t eeprom_archive_index_mac(eeprom_archive_index_t x, const char *name, uint64_t mac, uint64_t *bitmap);
+void eeprom_archive_index_close(eeprom_archive_index_t x);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* eeprom_archive_h__ */
@@ -0,0 +1,171 @@
+#ifndef eeprom_internal_h__
+#define eeprom_internal_h__
+
+// Copyright (c) 2019-2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+/*
+ * Definitions shared among the library modules;
+ * not installed, and not part of the API.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "eeprom.h"
+#include "cvm.h"
+#include "eeprom-layout.h"
+#include "eeprom-archive.h"
+#include "eeprom-journal.h"
+
+#define EEPROM_SIZE EEPROM_IMAGE_SIZE
+#define THROTTLE_CHUNK_SIZE	8	// largest chunk when pacing to a duty cycle
+
+typedef ssize_t (*eeprom_readfunc_t)(eeprom_context_t ctx, void *buf, size_t offset, size_t len);
+
+/*
+ * State for a chunked transfer, advanced one chunk at a
+ * time by xfer_step(), so the same code drives both the
+ * blocking calls and the asynchronous API.
+ */
+struct xfer_s {
+	enum {
+		xfer_read,
+		xfer_verify,
+		xfer_write,
+		xfer_done,
+	} phase;
+	uint8_t *buf;
+	uint8_t *validmap;
+	int locked;
+	int expected_crc;	// for writes: -1, or the CRC the device must hold
+	size_t offset;
+	size_t attempted;	// for writes: end of the bytes sent to the device
+	unsigned int attempt;
+	unsigned int passes;
+	struct timespec not_before;
+	int timed;		// first_start is set
+	struct timespec first_start;
+	struct timespec last_end;
+	uint8_t reread[EEPROM_SIZE];
+	uint8_t rereadmap[EEPROM_SIZE / 8];
+};
+
+/*
+ * Index entry for a record in the extended area
+ */
+struct ext_record {
+	uint32_t offset;	// of the record header
+	uint16_t len;
+	uint8_t type;
+};
+
+struct nvmem_device;
+
+enum {
+	lock_bus,
+	lock_device,
+	lock_count,
+};
+
+/*
+ * The cached image (eeprom_data, validmap, and complete) is
+ * published under the seq sequence lock, so any number of
+ * threads can take snapshots of it without locking; anything
+ * that changes it, or does I/O on the device, holds oplock.
+ */
+struct eeprom_context_s {
+	pthread_mutex_t oplock;
+	atomic_uint seq;
+	int fd;
+	int readonly;
+	tegra_soctype_t soctype;
+	eeprom_module_type_t mtype;
+	eeprom_readfunc_t readfunc;
+	eeprom_transport_t transport;	// what readfunc reads through
+	int driver;		// fd is an EEPROM driver (or image) file
+	int i2cfd;		// userland I2C descriptor for the I2C readfuncs, or -1
+	unsigned int i2c_addr;
+	char device[EEPROM_JOURNAL_DEVICE_MAX];	// <bus>-<addr> or pathname, for the journal
+	int bus;		// I2C bus, or -1 if not known
+	struct timespec throttle_next;	// pacing for a context not on a known bus
+	eeprom_bus_usage_t usage;
+	const struct nvmem_device *nvmem;	// if opened through the nvmem subsystem
+	eeprom_open_options_t opts;
+	int complete;
+	atomic_int cancel;
+	int have_deadline;
+	struct timespec deadline;
+	size_t bytes_completed;
+	int lockfd[lock_count];
+	int lockheld[lock_count];
+	size_t devsize;		// 0 until probed
+	int ext_indexed;
+	int ext_signed;		// area signature present
+	unsigned int ext_count;
+	uint32_t ext_end;	// offset of the end marker
+	struct ext_record *ext_records;
+	uint8_t validmap[EEPROM_SIZE / 8];
+	struct module_eeprom_v1_raw eeprom_data;
+};
+
+/*
+ * The library's internal functions are not exported
+ * from the shared library.
+ */
+#pragma GCC visibility push(hidden)
+
+eeprom_context_t open_context(int fd, eeprom_module_type_t mtype, int readonly, eeprom_readfunc_t readfunc,
+			      const eeprom_open_options_t *opts);
+int open_i2c_fd(unsigned int bus, unsigned int addr);
+int open_path_fd(const char *pathname, int *readonly);
+ssize_t normal_read(eeprom_context_t ctx, void *buf, size_t offset, size_t len);
+ssize_t smbus_read(eeprom_context_t ctx, void *buf, size_t offset, size_t len);
+ssize_t i2c_block_read(eeprom_context_t ctx, void *buf, size_t offset, size_t len);
+ssize_t rdwr_read(eeprom_context_t ctx, void *buf, size_t offset, size_t len);
+eeprom_readfunc_t transport_readfunc(eeprom_transport_t transport);
+int transport_ranking(unsigned int bus, eeprom_transport_t *ranking);
+eeprom_transport_t transport_best_i2c(unsigned int bus);
+int encode_image(eeprom_context_t ctx, module_eeprom_t *data, struct module_eeprom_v1_raw *rawdata);
+void write_done(eeprom_context_t ctx, const struct module_eeprom_v1_raw *image,
+		const struct module_eeprom_v1_raw *before, int have_before);
+void write_failed(eeprom_context_t ctx, const struct xfer_s *x);
+uint8_t calc_crc8(const uint8_t *buf, size_t buflen);
+int lock_wait(eeprom_context_t ctx, int exclusive);
+void op_start(eeprom_context_t ctx);
+long op_remaining_us(eeprom_context_t ctx);
+void xfer_init_read(struct xfer_s *x, uint8_t *buf, uint8_t *validmap);
+void xfer_init_write(struct xfer_s *x, uint8_t *buf, int expected_crc);
+int xfer_step(eeprom_context_t ctx, struct xfer_s *x);
+void xfer_abort(eeprom_context_t ctx, struct xfer_s *x);
+void lock_init_i2c(eeprom_context_t ctx, unsigned int bus, unsigned int addr);
+void lock_init_path(eeprom_context_t ctx, const char *pathname);
+int lock_try(eeprom_context_t ctx, int exclusive);
+void lock_release(eeprom_context_t ctx);
+void lock_close(eeprom_context_t ctx);
+int trace_open(const char *pathname, int flags);
+int trace_close(int fd);
+int trace_ioctl(int fd, unsigned long request, void *arg);
+ssize_t trace_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t trace_pwrite(int fd, const void *buf, size_t len, off_t offset);
+tegra_soctype_t trace_soctype(void);
+int i2c_adapter_name(unsigned int bus, char *buf, size_t bufsiz);
+const struct nvmem_device *nvmem_lookup(unsigned int bus, unsigned int addr);
+int nvmem_cell_read(const struct nvmem_device *dev, void *buf, size_t offset, size_t len);
+uint64_t archive_fingerprint(eeprom_archive_t a);
+int throttle_bus_until(int bus, struct timespec *own, struct timespec *until);
+void throttle_bus_account(int bus, struct timespec *own, unsigned int duty_pct,
+			  const struct timespec *start, const struct timespec *end);
+int throttle_until(eeprom_context_t ctx, struct timespec *until);
+void throttle_account(eeprom_context_t ctx, struct xfer_s *x, const struct timespec *start,
+		      const struct timespec *end);
+void throttle_finish(eeprom_context_t ctx, struct xfer_s *x);
+void journal_log_write(eeprom_context_t ctx, const struct module_eeprom_v1_raw *before, int have_before,
+		       const struct module_eeprom_v1_raw *after);
+
+#pragma GCC visibility pop
+
+#endif /* eeprom_internal_h__ */
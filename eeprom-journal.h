@@ -0,0 +1,61 @@
+#ifndef eeprom_journal_h__
+#define eeprom_journal_h__
+
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Provisioning journal: an append-only, memory-mapped log of
+ * the images written to EEPROMs, with the time, the device,
+ * the station (host name) that wrote it, and the contents
+ * before and after.  Once eeprom_journal_log() has been called
+ * (or if $TEGRA_EEPROM_JOURNAL names a journal file), every
+ * successful full-image write made by this process is logged.
+ *
+ * A hash index, kept in a separate file (<journal>.idx) and
+ * brought up to date as entries are appended, maps the system
+ * serial number, asset ID, and MAC addresses in each image
+ * written to the entries holding them.  Lookups return entry
+ * numbers newest first.  eeprom_journal_open() opens a journal
+ * read-only, for lookups; if the index file is missing or out
+ * of date, it builds an index in memory rather than fixing it.
+ */
+#define EEPROM_JOURNAL_DEVICE_MAX	120
+#define EEPROM_JOURNAL_STATION_MAX	64
+
+struct eeprom_journal_s;
+typedef struct eeprom_journal_s *eeprom_journal_t;
+
+struct eeprom_journal_entry_s {
+	uint64_t time_ns;	// CLOCK_REALTIME
+	char device[EEPROM_JOURNAL_DEVICE_MAX];
+	char station[EEPROM_JOURNAL_STATION_MAX];
+	int have_before;	// 0 if the previous contents were not known
+	uint8_t crc;
+	uint8_t before[256];
+	uint8_t after[256];
+};
+typedef struct eeprom_journal_entry_s eeprom_journal_entry_t;
+
+int eeprom_journal_log(const char *pathname);
+eeprom_journal_t eeprom_journal_open(const char *pathname);
+uint64_t eeprom_journal_count(eeprom_journal_t j);
+int eeprom_journal_entry(eeprom_journal_t j, uint64_t idx, eeprom_journal_entry_t *entry);
+int64_t eeprom_journal_lookup(eeprom_journal_t j, const char *name, const char *value, uint64_t *ids, size_t maxids);
+int64_t eeprom_journal_mac(eeprom_journal_t j, uint64_t mac, uint64_t *ids, size_t maxids);
+void eeprom_journal_close(eeprom_journal_t j);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* eeprom_journal_h__ */
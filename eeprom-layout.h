@@ -0,0 +1,103 @@
+#ifndef eeprom_layout_h__
+#define eeprom_layout_h__
+
+// Copyright (c) 2019-2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+/*
+ * Raw layout of the ID EEPROM contents, for programs
+ * that work directly with EEPROM images.
+ */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#define LAYOUT_VERSION_V1	1U
+#define LAYOUT_VERSION_V2	2U
+#define LAYOUT_VERSION_NON_T234	LAYOUT_VERSION_V1
+#define LAYOUT_VERSION_T234	LAYOUT_VERSION_V2
+#define CFGBLK_LENGTH	28
+#define MACFMT_VERSION  0
+
+struct module_eeprom_v1_raw {
+	uint8_t  major_version;
+	uint8_t  minor_version;
+	uint16_t length;
+	uint8_t  reserved_1__[15];
+	uint8_t  ether_mac_count_v2;
+	char     partnumber[22];
+	uint8_t  padding[8]; // either 0 or FF
+	uint8_t  factory_default_wifi_mac[6]; // little-endian
+	uint8_t  factory_default_bt_mac[6];
+	uint8_t  factory_default_wifi_alt_mac[6];
+	uint8_t  factory_default_ether_mac[6];
+	char     asset_id[15]; // string padded with 0 or FF
+	uint8_t  reserved_2__[61];
+	// Begin vendor block
+	char     cfgblk_sig[4];
+	uint16_t cfgblk_len;
+	char     macfmt_tag[2];
+	uint16_t macfmt_version;
+	uint8_t  vendor_wifi_mac[6];
+	uint8_t  vendor_bt_mac[6];
+	uint8_t  vendor_ether_mac[6];
+	uint8_t  vendor_ether_mac_count_v2;
+	uint8_t  reserved_3__[21];
+	// End vendor block, begin system-level information
+	char     system_partnumber_v2[21];
+	char     system_serialnumber_v2[15];
+	uint8_t  reserved_4__[19];
+	uint8_t  crc8;
+} __attribute__((packed));
+
+#define EEPROM_IMAGE_SIZE 256
+
+/*
+ * Optional extended record area, on EEPROMs larger than the
+ * NVIDIA layout.  It starts right after the layout with a
+ * 4-byte signature, followed by records of:
+ *    type (1 byte), length (2 bytes, little-endian),
+ *    data (length bytes), CRC-8 over all of the above
+ * ending at a record type of 0xff (erased) or 0x00.
+ */
+#define EXT_AREA_OFFSET		EEPROM_IMAGE_SIZE
+#define EXT_AREA_SIG		"XTLV"
+#define EXT_AREA_SIG_LENGTH	4
+#define EXT_RECORD_HEADER	3
+#define EXT_RECORD_OVERHEAD	(EXT_RECORD_HEADER + 1)
+#define EXT_TYPE_END		0xff
+#define EXT_TYPE_EMPTY		0x00
+
+/*
+ * Descriptions of the fields in the raw layout, in order,
+ * covering every byte of the image.
+ */
+typedef enum {
+	layout_field_uint,
+	layout_field_string,
+	layout_field_macaddr,
+	layout_field_bytes,
+} eeprom_layout_field_kind_t;
+
+struct eeprom_layout_field_s {
+	const char *name;
+	uint16_t offset;
+	uint16_t size;
+	eeprom_layout_field_kind_t kind;
+};
+typedef struct eeprom_layout_field_s eeprom_layout_field_t;
+
+extern const eeprom_layout_field_t eeprom_layout_fields[];
+extern const unsigned int eeprom_layout_field_count;
+int eeprom_layout_field_index(const char *name);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* eeprom_layout_h__ */
@@ -7,65 +7,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <endian.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
 #include "eeprom.h"
 #include "cvm.h"
+#include "eeprom-internal.h"
 
-#define LAYOUT_VERSION_V1	1U
-#define LAYOUT_VERSION_V2	2U
-#define LAYOUT_VERSION_NON_T234	LAYOUT_VERSION_V1
-#define LAYOUT_VERSION_T234	LAYOUT_VERSION_V2
 static const char cfgblk_sig[4] = "NVCB";
 static const char cfgblk_none[4] = "FFFF";
-#define CFGBLK_LENGTH	28
 static const char macfmt_tag[2] = "M1";
 static const uint8_t macaddr_placeholder[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
-#define MACFMT_VERSION  0
-struct module_eeprom_v1_raw {
-	uint8_t  major_version;
-	uint8_t  minor_version;
-	uint16_t length;
-	uint8_t  reserved_1__[15];
-	uint8_t  ether_mac_count_v2;
-	char     partnumber[22];
-	uint8_t  padding[8]; // either 0 or FF
-	uint8_t  factory_default_wifi_mac[6]; // little-endian
-	uint8_t  factory_default_bt_mac[6];
-	uint8_t  factory_default_wifi_alt_mac[6];
-	uint8_t  factory_default_ether_mac[6];
-	char     asset_id[15]; // string padded with 0 or FF
-	uint8_t  reserved_2__[61];
-	// Begin vendor block
-	char     cfgblk_sig[4];
-	uint16_t cfgblk_len;
-	char     macfmt_tag[2];
-	uint16_t macfmt_version;
-	uint8_t  vendor_wifi_mac[6];
-	uint8_t  vendor_bt_mac[6];
-	uint8_t  vendor_ether_mac[6];
-	uint8_t  vendor_ether_mac_count_v2;
-	uint8_t  reserved_3__[21];
-	// End vendor block, begin system-level information
-	char     system_partnumber_v2[21];
-	char     system_serialnumber_v2[15];
-	uint8_t  reserved_4__[19];
-	uint8_t  crc8;
-} __attribute__((packed));
-
-struct eeprom_context_s {
-	int fd;
-	int readonly;
-	tegra_soctype_t soctype;
-	eeprom_module_type_t mtype;
-	struct module_eeprom_v1_raw eeprom_data;
-};
-
-typedef ssize_t (*eeprom_readfunc_t)(int fd, void *buf, size_t bufsize);
+#define EFIVAR_ATTR_SIZE 4
+#define DEFAULT_CHUNK_SIZE	32
+#define DEFAULT_RETRIES		3
+#define DEFAULT_RETRY_BACKOFF	1000
+#define MAX_RETRY_BACKOFF	1000000
+#define SLEEP_SLICE		10000
+#define LOCK_RETRY_INTERVAL	2000
+#define FIRMWARE_PATH_ENV "TEGRA_EEPROM_FIRMWARE_PATH"
+#define FIRMWARE_PATH_DEFAULT "/proc/device-tree/chosen/nvidia,cvm-eeprom:" \
+	"/sys/firmware/devicetree/base/chosen/nvidia,cvm-eeprom"
 
 /*
  * This table was generated using the Python code in the 'Jetson TX1/TX2 Module EEPROM Layout'
@@ -91,8 +60,8 @@ static const uint8_t crc_table[256] =
 	0x74, 0x2a, 0xc8, 0x96, 0x15, 0x4b, 0xa9, 0xf7, 0xb6, 0xe8, 0x0a, 0x54, 0xd7, 0x89, 0x6b, 0x35
 };
 
-static uint8_t
-calc_crc8 (uint8_t *buf, size_t buflen)
+uint8_t
+calc_crc8 (const uint8_t *buf, size_t buflen)
 {
 	uint8_t crc = 0;
 	while (buflen-- > 0)
@@ -102,23 +71,57 @@ calc_crc8 (uint8_t *buf, size_t buflen)
 } /* calc_crc8 */
 
 /*
- * eeprom_data_valid
+ * infer_layout
+ *
+ * Works out the SoC family and module type an image was
+ * written for from its header alone: the major version
+ * gives the layout (and so the family), the length must
+ * cover the whole layout, and an NVCB configuration block
+ * marks a module (CVM) EEPROM.  Carrier boards and other
+ * boards share a layout, so both come back as normal.
+ *
+ * Returns 0 on success, -1 if the header is not one we
+ * recognize.
+ */
+static int
+infer_layout (const struct module_eeprom_v1_raw *data, tegra_soctype_t *soctype, eeprom_module_type_t *mtype)
+{
+	uint16_t length = le16toh(data->length);
+
+	if (data->major_version != LAYOUT_VERSION_V1 && data->major_version != LAYOUT_VERSION_V2)
+		return -1;
+	if (length < sizeof(*data) - 1 || length == 0xffff)
+		return -1;
+	*soctype = (data->major_version == LAYOUT_VERSION_T234 ? TEGRA_SOCTYPE_234 : TEGRA_SOCTYPE_194);
+	*mtype = (memcmp(data->cfgblk_sig, cfgblk_sig, sizeof(cfgblk_sig)) == 0 ? module_type_cvm : module_type_normal);
+	return 0;
+
+} /* infer_layout */
+
+/*
+ * image_valid
  *
  * Verify CRC and check that the version and tag fields
- * are ones we recognize.
+ * of an image are ones we recognize for the context
+ * (or, for an offline context, for the layout the image
+ * itself claims).
  */
-int
-eeprom_data_valid (eeprom_context_t ctx)
+static int
+image_valid (eeprom_context_t ctx, const struct module_eeprom_v1_raw *data)
 {
-	struct module_eeprom_v1_raw *data = &ctx->eeprom_data;
-	if (data->crc8 != calc_crc8((uint8_t *) data, 255))
+	tegra_soctype_t soctype = ctx->soctype;
+	eeprom_module_type_t mtype = ctx->mtype;
+
+	if (data->crc8 != calc_crc8((const uint8_t *) data, 255))
 		return 0;
-	if (ctx->soctype == TEGRA_SOCTYPE_234) {
+	if ((ctx->opts.flags & EEPROM_OPEN_OFFLINE) && infer_layout(data, &soctype, &mtype) < 0)
+		return 0;
+	if (soctype == TEGRA_SOCTYPE_234) {
 		if (data->major_version != LAYOUT_VERSION_T234)
 			return 0;
 	} else if (data->major_version != LAYOUT_VERSION_NON_T234)
 		return 0;
-	if (ctx->mtype == module_type_cvm) {
+	if (mtype == module_type_cvm) {
 		if (memcmp(data->cfgblk_sig, cfgblk_sig, sizeof(cfgblk_sig)))
 			return 0;
 		if (memcmp(data->macfmt_tag, macfmt_tag, sizeof(macfmt_tag)))
@@ -128,8 +131,177 @@ eeprom_data_valid (eeprom_context_t ctx)
 	}
 	return 1;
 
+} /* image_valid */
+
+/*
+ * Snapshots of the cached image.  A writer (there is only
+ * one at a time, holding the context's oplock) makes the
+ * sequence number odd while it updates the image; a reader
+ * copies the image, and tries again if the sequence number
+ * was odd or changed while it was copying.  Readers never
+ * block each other or the writer, and never see a partly
+ * updated image.
+ */
+struct snapshot_s {
+	int complete;
+	struct module_eeprom_v1_raw data;
+	uint8_t validmap[EEPROM_SIZE / 8];
+};
+
+/*
+ * snapshot_take
+ */
+static void
+snapshot_take (eeprom_context_t ctx, struct snapshot_s *snap)
+{
+	unsigned int before, after;
+
+	for (;;) {
+		before = atomic_load_explicit(&ctx->seq, memory_order_acquire);
+		if (before & 1) {
+			sched_yield();
+			continue;
+		}
+		snap->complete = ctx->complete;
+		memcpy(&snap->data, &ctx->eeprom_data, sizeof(snap->data));
+		memcpy(snap->validmap, ctx->validmap, sizeof(snap->validmap));
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&ctx->seq, memory_order_relaxed);
+		if (after == before)
+			break;
+	}
+
+} /* snapshot_take */
+
+/*
+ * snapshot_publish
+ *
+ * Replaces the cached image (and, if validmap is
+ * not NULL, the map of the bytes read).  Called with
+ * the oplock held.
+ */
+static void
+snapshot_publish (eeprom_context_t ctx, const struct module_eeprom_v1_raw *data,
+		  const uint8_t *validmap, int complete)
+{
+	unsigned int seq = atomic_load_explicit(&ctx->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&ctx->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	if (data != &ctx->eeprom_data)
+		memcpy(&ctx->eeprom_data, data, sizeof(ctx->eeprom_data));
+	if (validmap != NULL)
+		memcpy(ctx->validmap, validmap, sizeof(ctx->validmap));
+	ctx->complete = complete;
+	atomic_store_explicit(&ctx->seq, seq + 2, memory_order_release);
+
+} /* snapshot_publish */
+
+/*
+ * eeprom_data_valid
+ *
+ * Check the contents read from the device.
+ */
+int
+eeprom_data_valid (eeprom_context_t ctx)
+{
+	struct snapshot_s snap;
+
+	snapshot_take(ctx, &snap);
+	return snap.complete && image_valid(ctx, &snap.data);
+
 } /* eeprom_data_valid */
 
+/*
+ * structure_checks
+ *
+ * Counts the structural checks (as in eeprom_data_valid,
+ * but without knowing the SoC or module type) that an
+ * image passes.
+ */
+static unsigned int
+structure_checks (const struct module_eeprom_v1_raw *data)
+{
+	unsigned int passed = 0;
+
+	if (data->major_version == LAYOUT_VERSION_V1 || data->major_version == LAYOUT_VERSION_V2)
+		passed += 1;
+	if (memcmp(data->cfgblk_sig, cfgblk_sig, sizeof(cfgblk_sig)) == 0)
+		passed += 1;
+	if (memcmp(data->macfmt_tag, macfmt_tag, sizeof(macfmt_tag)) == 0)
+		passed += 1;
+	if (le16toh(data->macfmt_version) == MACFMT_VERSION)
+		passed += 1;
+	return passed;
+
+} /* structure_checks */
+
+static int
+candidate_compare (const void *a, const void *b)
+{
+	const eeprom_repair_candidate_t *ca = a, *cb = b;
+	int ba = __builtin_popcount(ca->mask), bb = __builtin_popcount(cb->mask);
+
+	if (ca->checks_passed != cb->checks_passed)
+		return (ca->checks_passed < cb->checks_passed) - (ca->checks_passed > cb->checks_passed);
+	if (ba != bb)
+		return (ba > bb) - (ba < bb);
+	return (ca->offset > cb->offset) - (ca->offset < cb->offset);
+
+} /* candidate_compare */
+
+/*
+ * eeprom_repair_candidates
+ *
+ * The CRC has no initial value or final XOR, so it is linear:
+ * an error e at offset i changes it by the CRC of e followed
+ * by 254-i zero bytes, which is e run through the table 255-i
+ * times.  The table is a permutation, so for each offset there
+ * is exactly one byte correction matching the syndrome (stored
+ * XOR computed CRC), found by running the syndrome back through
+ * the inverse table, one offset at a time.  The single-bit
+ * corrections are the ones with one bit set.
+ *
+ * Returns the number of candidates (0 if the CRC matches),
+ * storing up to maxcands of them, or -1 on error.
+ */
+int
+eeprom_repair_candidates (const void *image, size_t len,
+			  eeprom_repair_candidate_t *cands, size_t maxcands)
+{
+	eeprom_repair_candidate_t all[EEPROM_SIZE];
+	struct module_eeprom_v1_raw trial;
+	uint8_t *tp = (uint8_t *) &trial;
+	uint8_t inverse[256], delta;
+	int i, n = 0;
+
+	if (image == NULL || len < EEPROM_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&trial, image, sizeof(trial));
+	delta = trial.crc8 ^ calc_crc8(tp, EEPROM_SIZE-1);
+	if (delta == 0)
+		return 0;
+	for (i = 0; i < 256; i++)
+		inverse[crc_table[i]] = i;
+	for (i = EEPROM_SIZE-1; i >= 0; i--) {
+		if (i < EEPROM_SIZE-1)
+			delta = inverse[delta];
+		tp[i] ^= delta;
+		all[n].offset = i;
+		all[n].mask = delta;
+		all[n].checks_passed = structure_checks(&trial);
+		tp[i] ^= delta;
+		n += 1;
+	}
+	qsort(all, n, sizeof(all[0]), candidate_compare);
+	if (cands != NULL)
+		memcpy(cands, all, (maxcands < (size_t) n ? maxcands : (size_t) n) * sizeof(all[0]));
+	return n;
+
+} /* eeprom_repair_candidates */
+
 /*
  * strings in the EEPROM fields may be padded with either
  * nulls or 0xff
@@ -173,19 +345,23 @@ extract_macaddr (uint8_t *dst, const uint8_t *src)
  * Used when we're talking through an EEPROM driver.
  */
 ssize_t
-normal_read (int fd, void *buf, size_t bufsize)
+normal_read (eeprom_context_t ctx, void *buf, size_t offset, size_t len)
 {
 	uint8_t *bp;
-	ssize_t len;
-	size_t offset;
+	ssize_t n;
+	size_t count;
 
-	for (bp = buf, offset = 0; offset < bufsize; offset += len, bp += len) {
-		len = read(fd, bp, bufsize-offset);
-		if (len < 0)
-			return len;
+	for (bp = buf, count = 0; count < len; count += n, bp += n) {
+		n = trace_pread(ctx->fd, bp, len-count, offset+count);
+		if (n < 0)
+			return n;
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
 	}
 
-	return bufsize;
+	return len;
 
 } /* normal_read */
 
@@ -193,12 +369,15 @@ normal_read (int fd, void *buf, size_t bufsize)
  * smbus_read
  *
  * Used when we're talking through the I2C driver.
+ * Reads are done a byte at a time, except that a two-byte
+ * read (used for probing the length field) is done as a
+ * single word transaction.
  */
 ssize_t
-smbus_read (int fd, void *buf, size_t bufsize)
+smbus_read (eeprom_context_t ctx, void *buf, size_t offset, size_t len)
 {
 	uint8_t *bp = buf;
-	size_t offset;
+	size_t count;
 	int err;
 
 	union i2c_smbus_data data;
@@ -208,225 +387,1194 @@ smbus_read (int fd, void *buf, size_t bufsize)
 		.data = &data,
 	};
 
-	for (offset = 0; offset < bufsize; offset += 1) {
+	if (len == 2) {
+		args.size = I2C_SMBUS_WORD_DATA;
 		args.command = offset;
-		err = ioctl(fd, I2C_SMBUS, &args);
+		err = trace_ioctl(ctx->i2cfd, I2C_SMBUS, &args);
+		if (err < 0)
+			return err;
+		bp[0] = data.word & 0xFF;
+		bp[1] = (data.word >> 8) & 0xFF;
+		return len;
+	}
+	for (count = 0; count < len; count += 1) {
+		args.command = offset + count;
+		err = trace_ioctl(ctx->i2cfd, I2C_SMBUS, &args);
 		if (err < 0)
 			return err;
 		*bp++ = data.byte & 0xFF;
 	}
-	return (ssize_t) offset;
+	return (ssize_t) count;
 
 } /* smbus_read */
 
 /*
- * open_common
+ * op_start
+ *
+ * Sets up the deadline (if any) for an operation.
  */
-static eeprom_context_t
-open_common (int fd, eeprom_module_type_t mtype, int readonly, eeprom_readfunc_t readfunc)
+void
+op_start (eeprom_context_t ctx)
 {
-	eeprom_context_t ctx;
-	tegra_soctype_t soctype = cvm_soctype();
-
-	if (soctype == TEGRA_SOCTYPE_INVALID) {
-		errno = EINVAL;
-		return NULL;
-	}
-	ctx = calloc(1, sizeof(struct eeprom_context_s));
-	if (ctx == NULL) {
-		close(fd);
-		return ctx;
-	}
-	ctx->soctype = soctype;
-	ctx->mtype = mtype;
-	ctx->fd = fd;
-	ctx->readonly = readonly;
-	if (readfunc(fd, &ctx->eeprom_data, sizeof(ctx->eeprom_data)) < 0) {
-		close(fd);
-		free(ctx);
-		return NULL;
+	ctx->bytes_completed = 0;
+	ctx->have_deadline = ctx->opts.timeout_ms != 0;
+	if (!ctx->have_deadline)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+	ctx->deadline.tv_sec += ctx->opts.timeout_ms / 1000;
+	ctx->deadline.tv_nsec += (ctx->opts.timeout_ms % 1000) * 1000000L;
+	if (ctx->deadline.tv_nsec >= 1000000000L) {
+		ctx->deadline.tv_sec += 1;
+		ctx->deadline.tv_nsec -= 1000000000L;
 	}
-	return ctx;
-}
+
+} /* op_start */
 
 /*
- * eeprom_open_i2c
+ * op_remaining_us
  *
- * for module EEPROMs that aren't controlled by a driver
+ * Microseconds left before the deadline (0 if passed),
+ * or -1 if there is no deadline.
  */
-eeprom_context_t
-eeprom_open_i2c (unsigned int bus, unsigned int addr, eeprom_module_type_t mtype)
+long
+op_remaining_us (eeprom_context_t ctx)
 {
-	char devname[32];
-	ssize_t len;
-	int fd;
+	struct timespec now;
+	long usec;
 
+	if (!ctx->have_deadline)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (ctx->deadline.tv_sec - now.tv_sec) * 1000000L +
+		(ctx->deadline.tv_nsec - now.tv_nsec) / 1000L;
+	return usec < 0 ? 0 : usec;
 
-	len = snprintf(devname, sizeof(devname)-1, "/dev/i2c-%u", bus);
-	if (len < 0)
-		return NULL;
-	fd = open(devname, O_RDWR);
-	if (fd < 0)
-		return NULL;
-	if (ioctl(fd, I2C_SLAVE_FORCE, addr) < 0) {
-		close(fd);
-		return NULL;
-	}
+} /* op_remaining_us */
 
-	return open_common(fd, mtype, 1, smbus_read);
+/*
+ * op_check
+ *
+ * Called between transactions: fails with ECANCELED
+ * if eeprom_cancel() has been called, or ETIMEDOUT if
+ * the deadline for the operation has passed.  A chunk
+ * already under way is not interrupted, so the deadline
+ * can be overrun by up to one chunk's transfer time.
+ */
+static int
+op_check (eeprom_context_t ctx)
+{
+	if (atomic_exchange(&ctx->cancel, 0)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	if (op_remaining_us(ctx) == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
 
-} /* eeprom_open_i2c */
+} /* op_check */
 
 /*
- * eeprom_open
- *
- * for module EEPROMs that are controlled by
- * an eeprom driver, or files that have EEPROM contents
+ * chunk_valid
  */
-eeprom_context_t
-eeprom_open (const char *pathname, eeprom_module_type_t mtype)
+static int
+chunk_valid (const uint8_t *validmap, size_t offset, size_t len)
 {
-	int fd;
-	int readonly = 0;
+	size_t i;
 
-	fd = open(pathname, O_RDWR);
-	if (fd < 0) {
-		fd = open(pathname, O_RDONLY);
-		readonly = 1;
-	}
-	if (fd < 0)
-		return NULL;
-	return open_common(fd, mtype, readonly, normal_read);
+	for (i = offset; i < offset + len; i++)
+		if (!(validmap[i / 8] & (1 << (i % 8))))
+			return 0;
+	return 1;
 
-} /* eeprom_open */
+} /* chunk_valid */
 
 /*
- * eeprom_close
+ * xfer_backoff
  *
- * Clean up context.
+ * Schedules the retry of a failed chunk, with
+ * exponential backoff.
  */
+static void
+xfer_delay (struct xfer_s *x, unsigned long usec)
+{
+	clock_gettime(CLOCK_MONOTONIC, &x->not_before);
+	x->not_before.tv_sec += usec / 1000000;
+	x->not_before.tv_nsec += (usec % 1000000) * 1000;
+	if (x->not_before.tv_nsec >= 1000000000L) {
+		x->not_before.tv_sec += 1;
+		x->not_before.tv_nsec -= 1000000000L;
+	}
+
+} /* xfer_delay */
+
+static void
+xfer_backoff (eeprom_context_t ctx, struct xfer_s *x)
+{
+	unsigned long usec = ctx->opts.retry_backoff_us;
+	unsigned int attempt = x->attempt;
+
+	while (attempt-- > 0 && usec < MAX_RETRY_BACKOFF)
+		usec <<= 1;
+	if (usec > MAX_RETRY_BACKOFF)
+		usec = MAX_RETRY_BACKOFF;
+	xfer_delay(x, usec);
+	x->attempt += 1;
+
+} /* xfer_backoff */
+
 void
-eeprom_close (eeprom_context_t ctx)
+xfer_init_read (struct xfer_s *x, uint8_t *buf, uint8_t *validmap)
 {
-	close(ctx->fd);
-	free(ctx);
+	memset(x, 0, sizeof(*x));
+	x->phase = xfer_read;
+	x->buf = buf;
+	x->validmap = validmap;
+	x->expected_crc = -1;
 
-} /* eeprom_close */
+} /* xfer_init_read */
 
 /*
- * eeprom_readonly
+ * xfer_init_write
  *
- * returns 1 if open read-only, 0 otherwise.
+ * If expected_crc is not -1, the write only proceeds if
+ * the CRC byte on the device (checked once the exclusive
+ * lock is held) has that value.
  */
-int
-eeprom_readonly (eeprom_context_t ctx)
+void
+xfer_init_write (struct xfer_s *x, uint8_t *buf, int expected_crc)
 {
-	return ctx->readonly;
+	memset(x, 0, sizeof(*x));
+	x->phase = xfer_write;
+	x->buf = buf;
+	x->expected_crc = expected_crc;
 
-} /* eeprom_readonly */
+} /* xfer_init_write */
 
 /*
- * eeprom_read
+ * xfer_chunk
  *
- * Validate the EEPROM data obtained from the device
- * and extract the important data from it, translating
- * from the raw form into something usable: mainly
- * converting MAC addresses from little-endian format
- * into the more-typical big-endian format.
+ * Transfers one chunk.  Reads skip chunks already marked
+ * in the valid map, and a failed chunk is retried (after
+ * x->not_before) up to the retry limit, so only the ranges
+ * that failed are ever re-read.  Once every chunk has been
+ * read, the CRC is checked over the full image; a mismatch
+ * could be a transfer error rather than bad contents, so
+ * the image is re-read until two successive reads agree.
+ *
+ * With a duty-cycle budget, a chunk waits (as with a
+ * retry) until the bus has been idle long enough.
  *
+ * Returns 1 if there is more to do, 0 when the transfer
+ * is complete, or -1 on error (including cancellation
+ * or timeout).
  */
-int
-eeprom_read (eeprom_context_t ctx, module_eeprom_t *data)
+static int
+xfer_chunk (eeprom_context_t ctx, struct xfer_s *x)
 {
-	struct module_eeprom_v1_raw *rawdata = &ctx->eeprom_data;
+	uint8_t *buf, *validmap;
+	struct timespec start, end;
+	size_t len, i;
+	ssize_t n;
 
-	memset(data, 0, sizeof(module_eeprom_t));
+	if (x->phase != xfer_done && throttle_until(ctx, &x->not_before))
+		return 1;
+	if (x->phase == xfer_write) {
+		len = EEPROM_SIZE - x->offset;
+		if (len > ctx->opts.chunk_size)
+			len = ctx->opts.chunk_size;
+		x->attempted = x->offset + len;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = trace_pwrite(ctx->fd, x->buf + x->offset, len, x->offset);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		throttle_account(ctx, x, &start, &end);
+		if (n < 0)
+			return -1;
+		ctx->bytes_completed += n;
+		x->offset += n;
+		if (x->offset < EEPROM_SIZE)
+			return 1;
+		x->phase = xfer_done;
+		return 0;
+	}
 
-	if (!eeprom_data_valid(ctx)) {
-		errno = EFAULT;
-		return -1;
+	buf = (x->phase == xfer_read ? x->buf : x->reread);
+	validmap = (x->phase == xfer_read ? x->validmap : x->rereadmap);
+	for (;;) {
+		len = EEPROM_SIZE - x->offset;
+		if (len > ctx->opts.chunk_size)
+			len = ctx->opts.chunk_size;
+		if (x->offset >= EEPROM_SIZE || !chunk_valid(validmap, x->offset, len))
+			break;
+		x->offset += len;
+	}
+	if (x->offset < EEPROM_SIZE) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = ctx->readfunc(ctx, buf + x->offset, x->offset, len);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		throttle_account(ctx, x, &start, &end);
+		if (n < 0) {
+			if (x->attempt < ctx->opts.retries) {
+				xfer_backoff(ctx, x);
+				return 1;
+			}
+			/*
+			 * If we can't complete a verification pass,
+			 * go with what we read the first time.
+			 */
+			if (x->phase == xfer_verify) {
+				x->phase = xfer_done;
+				return 0;
+			}
+			return -1;
+		}
+		for (i = 0; i < len; i++)
+			validmap[(x->offset + i) / 8] |= 1 << ((x->offset + i) % 8);
+		ctx->bytes_completed += len;
+		x->offset += len;
+		x->attempt = 0;
+		return 1;
 	}
 
-	if ((uint8_t) rawdata->partnumber[0] == 0xcc) {
-		data->partnumber_type = partnum_type_customer;
-		extract_string(data->partnumber, rawdata->partnumber+1, sizeof(rawdata->partnumber)-1);
+	if (x->phase == xfer_read) {
+		if (x->buf[EEPROM_SIZE-1] == calc_crc8(x->buf, EEPROM_SIZE-1) ||
+		    ctx->opts.retries == 0) {
+			x->phase = xfer_done;
+			return 0;
+		}
+		x->phase = xfer_verify;
 	} else {
-		data->partnumber_type = partnum_type_nvidia;
-		extract_string(data->partnumber, rawdata->partnumber, sizeof(rawdata->partnumber));
-	}
-	extract_string(data->asset_id, rawdata->asset_id, sizeof(rawdata->asset_id));
-	extract_macaddr(data->factory_default_wifi_mac, rawdata->factory_default_wifi_mac);
-	extract_macaddr(data->factory_default_bt_mac, rawdata->factory_default_bt_mac);
-	extract_macaddr(data->factory_default_wifi_alt_mac, rawdata->factory_default_wifi_alt_mac);
-	extract_macaddr(data->factory_default_ether_mac, rawdata->factory_default_ether_mac);
-	extract_macaddr(data->vendor_wifi_mac, rawdata->vendor_wifi_mac);
-	extract_macaddr(data->vendor_bt_mac, rawdata->vendor_bt_mac);
-	extract_macaddr(data->vendor_ether_mac, rawdata->vendor_ether_mac);
-	data->major_version = rawdata->major_version;
-	data->minor_version = rawdata->minor_version;
-	if (rawdata->major_version >= LAYOUT_VERSION_V2) {
-		data->factory_default_ether_mac_count = rawdata->ether_mac_count_v2;
-		data->vendor_ether_mac_count = rawdata->vendor_ether_mac_count_v2;
-		extract_string(data->system_partnumber, rawdata->system_partnumber_v2, sizeof(rawdata->system_partnumber_v2));
-		extract_string(data->system_serialnumber, rawdata->system_serialnumber_v2, sizeof(rawdata->system_serialnumber_v2));
+		if (memcmp(x->reread, x->buf, EEPROM_SIZE) == 0 ||
+		    ++x->passes >= ctx->opts.retries) {
+			x->phase = xfer_done;
+			return 0;
+		}
+		memcpy(x->buf, x->reread, EEPROM_SIZE);
 	}
-	return 0;
+	memset(x->rereadmap, 0, sizeof(x->rereadmap));
+	x->offset = 0;
+	return 1;
 
-} /* eeprom_read */
+} /* xfer_chunk */
 
 /*
- * eeprom_write
+ * xfer_abort
  *
- * Writes module EEPROM data to the device.
+ * Drops the locks held by a transfer that will not be
+ * stepped again, and counts its time in the bus usage.
+ */
+void
+xfer_abort (eeprom_context_t ctx, struct xfer_s *x)
+{
+	throttle_finish(ctx, x);
+	if (x->locked)
+		lock_release(ctx);
+	x->locked = 0;
+
+} /* xfer_abort */
+
+/*
+ * xfer_step
  *
- * WARNING:
- *    Performs a complete overwrite, so to prevent
- *    losing data, you MUST call eeprom_read() to
- *    populate the module_eeprom structure, make any
- *    updates you need to, then call this function.
+ * Advances a transfer by one chunk (see xfer_chunk), taking
+ * the locks for the device first: shared for reads, exclusive
+ * for writes.  If they are not available, the step is retried
+ * after a short interval, subject to the deadline.  For a
+ * conditional write, the device's CRC is checked once the
+ * lock is held, failing with ESTALE if it has changed.  The
+ * locks are dropped when the transfer completes or fails.
  *
+ * Returns 1 if there is more to do, 0 when the transfer
+ * is complete, or -1 on error (including cancellation
+ * or timeout).
  */
 int
-eeprom_write (eeprom_context_t ctx, module_eeprom_t *data)
+xfer_step (eeprom_context_t ctx, struct xfer_s *x)
 {
-	struct module_eeprom_v1_raw *rawdata = &ctx->eeprom_data;
-	uint8_t *bp;
-	size_t remain;
-	ssize_t n;
+	uint8_t crc8;
+	int ret;
 
-	if (ctx->readonly) {
-		errno = EROFS;
+	if (x->phase == xfer_done)
+		return 0;
+	if (op_check(ctx) < 0) {
+		xfer_abort(ctx, x);
 		return -1;
 	}
+	if (!x->locked) {
+		ret = lock_try(ctx, x->phase == xfer_write);
+		if (ret <= 0) {
+			lock_release(ctx);
+			if (ret < 0)
+				return -1;
+			xfer_delay(x, LOCK_RETRY_INTERVAL);
+			return 1;
+		}
+		x->locked = 1;
+		if (x->phase == xfer_write && x->expected_crc >= 0) {
+			if (ctx->readfunc(ctx, &crc8, offsetof(struct module_eeprom_v1_raw, crc8),
+					  sizeof(crc8)) < 0) {
+				xfer_abort(ctx, x);
+				return -1;
+			}
+			if (crc8 != x->expected_crc) {
+				xfer_abort(ctx, x);
+				errno = ESTALE;
+				return -1;
+			}
+		}
+	}
+	ret = xfer_chunk(ctx, x);
+	if (ret <= 0)
+		xfer_abort(ctx, x);
+	return ret;
 
-	if ((ctx->soctype == TEGRA_SOCTYPE_234 && data->major_version != LAYOUT_VERSION_T234) ||
-	    (ctx->soctype != TEGRA_SOCTYPE_234 && data->major_version != LAYOUT_VERSION_NON_T234)) {
-		errno = EINVAL;
-		return -1;
-	};
+} /* xfer_step */
 
-	if (!eeprom_data_valid(ctx)) {
-		memset(rawdata, 0, sizeof(*rawdata));
-		if (ctx->soctype == TEGRA_SOCTYPE_234)
-			rawdata->major_version = LAYOUT_VERSION_T234;
-		else
-			rawdata->major_version = LAYOUT_VERSION_NON_T234;
-		if (ctx->mtype == module_type_cvm) {
-			memcpy(rawdata->cfgblk_sig, cfgblk_sig, sizeof(rawdata->cfgblk_sig));
-			rawdata->cfgblk_len = CFGBLK_LENGTH;
-			memcpy(rawdata->macfmt_tag, macfmt_tag, sizeof(rawdata->macfmt_tag));
-			rawdata->macfmt_version = htole16(MACFMT_VERSION);
+/*
+ * xfer_run
+ *
+ * Runs a transfer to completion, sleeping through any
+ * retry backoff in slices so that cancellation is noticed
+ * promptly, and never past the deadline.
+ */
+static int
+xfer_run (eeprom_context_t ctx, struct xfer_s *x)
+{
+	struct timespec now, ts;
+	long usec, remaining;
+	int ret;
+
+	while ((ret = xfer_step(ctx, x)) > 0) {
+		for (;;) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			usec = (x->not_before.tv_sec - now.tv_sec) * 1000000L +
+				(x->not_before.tv_nsec - now.tv_nsec) / 1000L;
+			if (usec <= 0)
+				break;
+			if (op_check(ctx) < 0) {
+				xfer_abort(ctx, x);
+				return -1;
+			}
+			if (usec > SLEEP_SLICE)
+				usec = SLEEP_SLICE;
+			remaining = op_remaining_us(ctx);
+			if (remaining >= 0 && usec > remaining)
+				usec = remaining;
+			ts.tv_sec = 0;
+			ts.tv_nsec = usec * 1000;
+			nanosleep(&ts, NULL);
 		}
 	}
+	return ret;
 
-	if (data->partnumber_type == partnum_type_nvidia)
-		memcpy(rawdata->partnumber, data->partnumber, sizeof(rawdata->partnumber));
-	else {
-		rawdata->partnumber[0] = (char) 0xcc;
-		memcpy(&rawdata->partnumber[1], data->partnumber, sizeof(rawdata->partnumber)-1);
+} /* xfer_run */
+
+/*
+ * lock_wait
+ *
+ * Takes the device locks for a transaction outside of a
+ * transfer, waiting (subject to the deadline) if necessary.
+ */
+int
+lock_wait (eeprom_context_t ctx, int exclusive)
+{
+	struct timespec ts = { 0, LOCK_RETRY_INTERVAL * 1000 };
+	int ret;
+
+	for (;;) {
+		if (op_check(ctx) < 0)
+			return -1;
+		ret = lock_try(ctx, exclusive);
+		if (ret != 0)
+			return (ret < 0 ? -1 : 0);
+		lock_release(ctx);
+		nanosleep(&ts, NULL);
+	}
+
+} /* lock_wait */
+
+/*
+ * read_image
+ *
+ * Fills in whatever part of the cached image is missing.
+ * The transfer works on a copy, which is published when
+ * it is done (even if incomplete, so that a later resume
+ * picks up where this left off).  Called with the oplock
+ * held, or before the context has been handed out.
+ */
+static int
+read_image (eeprom_context_t ctx)
+{
+	struct module_eeprom_v1_raw data;
+	uint8_t validmap[EEPROM_SIZE / 8];
+	struct xfer_s xfer;
+	int ret, save_errno;
+
+	memcpy(&data, &ctx->eeprom_data, sizeof(data));
+	memcpy(validmap, ctx->validmap, sizeof(validmap));
+	xfer_init_read(&xfer, (uint8_t *) &data, validmap);
+	ret = xfer_run(ctx, &xfer);
+	save_errno = errno;
+	snapshot_publish(ctx, &data, validmap, ret == 0);
+	errno = save_errno;
+	return (ret < 0 ? -1 : 0);
+
+} /* read_image */
+
+/*
+ * eeprom_open_options_init
+ *
+ * Fills in the default options.
+ */
+void
+eeprom_open_options_init (eeprom_open_options_t *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->chunk_size = DEFAULT_CHUNK_SIZE;
+	opts->retries = DEFAULT_RETRIES;
+	opts->retry_backoff_us = DEFAULT_RETRY_BACKOFF;
+
+} /* eeprom_open_options_init */
+
+/*
+ * new_context
+ *
+ * An offline context never asks the host for its SoC
+ * type; each image's layout is inferred from the image.
+ */
+static eeprom_context_t
+new_context (int fd, eeprom_module_type_t mtype, int readonly, eeprom_readfunc_t readfunc,
+	     const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int offline = (opts != NULL && (opts->flags & EEPROM_OPEN_OFFLINE));
+	tegra_soctype_t soctype = (offline ? TEGRA_SOCTYPE_INVALID : trace_soctype());
+
+	if (!offline && soctype == TEGRA_SOCTYPE_INVALID) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ctx = calloc(1, sizeof(struct eeprom_context_s));
+	if (ctx == NULL)
+		return ctx;
+	ctx->soctype = soctype;
+	ctx->mtype = mtype;
+	ctx->fd = fd;
+	ctx->readonly = readonly;
+	ctx->readfunc = readfunc;
+	ctx->driver = (readfunc == normal_read);
+	ctx->i2cfd = (readfunc == NULL || readfunc == normal_read ? -1 : fd);
+	if (readfunc == NULL)
+		ctx->transport = eeprom_transport_none;
+	else if (readfunc == normal_read)
+		ctx->transport = eeprom_transport_sysfs;
+	else
+		ctx->transport = (readfunc == rdwr_read ? eeprom_transport_rdwr :
+				  readfunc == i2c_block_read ? eeprom_transport_i2c_block :
+				  eeprom_transport_smbus_byte);
+	ctx->lockfd[lock_bus] = ctx->lockfd[lock_device] = -1;
+	pthread_mutex_init(&ctx->oplock, NULL);
+	if (opts == NULL)
+		eeprom_open_options_init(&ctx->opts);
+	else
+		ctx->opts = *opts;
+	if (ctx->opts.chunk_size == 0 || ctx->opts.chunk_size > EEPROM_SIZE)
+		ctx->opts.chunk_size = EEPROM_SIZE;
+	if (ctx->opts.bus_duty_pct > 0 && ctx->opts.bus_duty_pct < 100 &&
+	    ctx->opts.chunk_size > THROTTLE_CHUNK_SIZE)
+		ctx->opts.chunk_size = THROTTLE_CHUNK_SIZE;
+	ctx->bus = -1;
+	return ctx;
+
+} /* new_context */
+
+/*
+ * open_context
+ *
+ * Sets up a context for an open device, without reading
+ * from it.  Closes the fd on failure.
+ */
+eeprom_context_t
+open_context (int fd, eeprom_module_type_t mtype, int readonly, eeprom_readfunc_t readfunc,
+	      const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int save_errno;
+
+	ctx = new_context(fd, mtype, readonly, readfunc, opts);
+	if (ctx == NULL) {
+		save_errno = errno;
+		trace_close(fd);
+		errno = save_errno;
+	}
+	return ctx;
+
+} /* open_context */
+
+/*
+ * open_common
+ *
+ * With EEPROM_OPEN_PARTIAL, the context is returned even if
+ * the contents could not be completely read, so the caller
+ * can finish the read later with eeprom_resume().  With
+ * EEPROM_OPEN_LAZY, nothing is read yet.
+ */
+static eeprom_context_t
+open_common (eeprom_context_t ctx)
+{
+	int save_errno;
+
+	if (ctx->opts.flags & EEPROM_OPEN_LAZY)
+		return ctx;
+	op_start(ctx);
+	if (read_image(ctx) < 0 && !(ctx->opts.flags & EEPROM_OPEN_PARTIAL)) {
+		save_errno = errno;
+		eeprom_close(ctx);
+		errno = save_errno;
+		return NULL;
+	}
+	return ctx;
+
+} /* open_common */
+
+/*
+ * read_firmware_copy
+ *
+ * Reads an EEPROM image published by the firmware.  This
+ * is normally a raw copy (such as a device tree property),
+ * but an efivar file carries a 4-byte attributes word ahead
+ * of the data, so a file of exactly that size has it skipped.
+ */
+static int
+read_firmware_copy (const char *pathname, struct module_eeprom_v1_raw *rawdata)
+{
+	uint8_t buf[sizeof(*rawdata) * 2];
+	size_t len, offset;
+	ssize_t n;
+	int fd;
+
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	for (len = 0; len < sizeof(buf); len += n) {
+		n = read(fd, buf + len, sizeof(buf) - len);
+		if (n < 0) {
+			close(fd);
+			return -1;
+		}
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	if (len < sizeof(*rawdata)) {
+		errno = ENODATA;
+		return -1;
+	}
+	offset = (len == sizeof(*rawdata) + EFIVAR_ATTR_SIZE ? EFIVAR_ATTR_SIZE : 0);
+	memcpy(rawdata, buf + offset, sizeof(*rawdata));
+	return 0;
+
+} /* read_firmware_copy */
+
+/*
+ * eeprom_open_firmware
+ *
+ * Opens the first valid EEPROM copy found in a colon-separated
+ * list of files published by the firmware, so the contents can be
+ * used without any bus access.  If searchpath is NULL, the
+ * TEGRA_EEPROM_FIRMWARE_PATH environment variable is used, if set,
+ * otherwise the default list.  The resulting context is read-only.
+ */
+eeprom_context_t
+eeprom_open_firmware (const char *searchpath, eeprom_module_type_t mtype)
+{
+	eeprom_context_t ctx;
+	char pathname[PATH_MAX];
+	const char *cp, *sep;
+	size_t len;
+
+	if (searchpath == NULL)
+		searchpath = getenv(FIRMWARE_PATH_ENV);
+	if (searchpath == NULL)
+		searchpath = FIRMWARE_PATH_DEFAULT;
+	ctx = new_context(-1, mtype, 1, NULL, NULL);
+	if (ctx == NULL)
+		return NULL;
+	ctx->complete = 1;
+	memset(ctx->validmap, 0xff, sizeof(ctx->validmap));
+	for (cp = searchpath; *cp != '\0'; cp = (*sep == '\0' ? sep : sep + 1)) {
+		sep = strchr(cp, ':');
+		if (sep == NULL)
+			sep = cp + strlen(cp);
+		len = sep - cp;
+		if (len == 0 || len >= sizeof(pathname))
+			continue;
+		memcpy(pathname, cp, len);
+		pathname[len] = '\0';
+		if (read_firmware_copy(pathname, &ctx->eeprom_data) == 0 &&
+		    eeprom_data_valid(ctx))
+			return ctx;
+	}
+	free(ctx);
+	errno = ENOENT;
+	return NULL;
+
+} /* eeprom_open_firmware */
+
+/*
+ * eeprom_open_image
+ *
+ * Opens a read-only context over an image in memory (at
+ * least EEPROM_IMAGE_SIZE bytes; anything past the layout
+ * is ignored), for analysis on any host: the context is
+ * offline, so the layout and module type are inferred from
+ * the image, and nothing is read from the host.
+ */
+eeprom_context_t
+eeprom_open_image (const void *image, size_t len)
+{
+	eeprom_open_options_t opts;
+	eeprom_context_t ctx;
+
+	if (len < EEPROM_IMAGE_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	eeprom_open_options_init(&opts);
+	opts.flags |= EEPROM_OPEN_OFFLINE;
+	ctx = new_context(-1, module_type_normal, 1, NULL, &opts);
+	if (ctx == NULL)
+		return NULL;
+	memcpy(&ctx->eeprom_data, image, sizeof(ctx->eeprom_data));
+	memset(ctx->validmap, 0xff, sizeof(ctx->validmap));
+	ctx->complete = 1;
+	infer_layout(&ctx->eeprom_data, &ctx->soctype, &ctx->mtype);
+	return ctx;
+
+} /* eeprom_open_image */
+
+/*
+ * open_i2c_fd
+ */
+int
+open_i2c_fd (unsigned int bus, unsigned int addr)
+{
+	char devname[32];
+	ssize_t len;
+	int fd;
+
+
+	len = snprintf(devname, sizeof(devname)-1, "/dev/i2c-%u", bus);
+	if (len < 0)
+		return -1;
+	fd = trace_open(devname, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (trace_ioctl(fd, I2C_SLAVE_FORCE, (void *) (uintptr_t) addr) < 0) {
+		trace_close(fd);
+		return -1;
+	}
+	return fd;
+
+} /* open_i2c_fd */
+
+/*
+ * eeprom_open_i2c_ex
+ *
+ * for module EEPROMs that aren't controlled by a driver.
+ * Reads through the fastest I2C method calibrated for
+ * the bus, or byte reads if it has not been calibrated.
+ */
+eeprom_context_t
+eeprom_open_i2c_ex (unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+		    const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int fd = open_i2c_fd(bus, addr);
+
+	if (fd < 0)
+		return NULL;
+	ctx = open_context(fd, mtype, 1, transport_readfunc(transport_best_i2c(bus)), opts);
+	if (ctx == NULL)
+		return NULL;
+	ctx->i2c_addr = addr;
+	lock_init_i2c(ctx, bus, addr);
+	return open_common(ctx);
+
+} /* eeprom_open_i2c_ex */
+
+eeprom_context_t
+eeprom_open_i2c (unsigned int bus, unsigned int addr, eeprom_module_type_t mtype)
+{
+	return eeprom_open_i2c_ex(bus, addr, mtype, NULL);
+
+} /* eeprom_open_i2c */
+
+/*
+ * open_path_fd
+ */
+int
+open_path_fd (const char *pathname, int *readonly)
+{
+	int fd;
+
+	*readonly = 0;
+	fd = trace_open(pathname, O_RDWR);
+	if (fd < 0) {
+		fd = trace_open(pathname, O_RDONLY);
+		*readonly = 1;
+	}
+	return fd;
+
+} /* open_path_fd */
+
+/*
+ * eeprom_open_ex
+ *
+ * for module EEPROMs that are controlled by
+ * an eeprom driver, or files that have EEPROM contents
+ */
+eeprom_context_t
+eeprom_open_ex (const char *pathname, eeprom_module_type_t mtype,
+		const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	int fd, readonly;
+
+	fd = open_path_fd(pathname, &readonly);
+	if (fd < 0)
+		return NULL;
+	ctx = open_context(fd, mtype, readonly, normal_read, opts);
+	if (ctx == NULL)
+		return NULL;
+	lock_init_path(ctx, pathname);
+	return open_common(ctx);
+
+} /* eeprom_open_ex */
+
+eeprom_context_t
+eeprom_open (const char *pathname, eeprom_module_type_t mtype)
+{
+	return eeprom_open_ex(pathname, mtype, NULL);
+
+} /* eeprom_open */
+
+/*
+ * eeprom_resume
+ *
+ * Completes a read that was left incomplete by an open
+ * with EEPROM_OPEN_PARTIAL, or by a write that was cut
+ * short, re-reading only the chunks that are still missing.
+ *
+ * Returns 0 once the contents have been completely read,
+ * -1 on error.
+ */
+int
+eeprom_resume (eeprom_context_t ctx)
+{
+	int ret = 0, save_errno;
+
+	pthread_mutex_lock(&ctx->oplock);
+	if (!ctx->complete) {
+		op_start(ctx);
+		ret = read_image(ctx);
+	}
+	save_errno = errno;
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_resume */
+
+/*
+ * eeprom_bytes_read
+ *
+ * Returns the number of bytes of the contents
+ * read so far.
+ */
+size_t
+eeprom_bytes_read (eeprom_context_t ctx)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < EEPROM_SIZE; i++)
+		if (ctx->validmap[i / 8] & (1 << (i % 8)))
+			count += 1;
+	return count;
+
+} /* eeprom_bytes_read */
+
+/*
+ * eeprom_bytes_completed
+ *
+ * Returns the number of bytes transferred by the most
+ * recent operation on the context, for reporting progress
+ * after a timeout or cancellation.
+ */
+size_t
+eeprom_bytes_completed (eeprom_context_t ctx)
+{
+	return ctx->bytes_completed;
+
+} /* eeprom_bytes_completed */
+
+/*
+ * eeprom_cancel
+ *
+ * Requests cancellation of the operation in progress on
+ * the context (or the next one, if none is in progress),
+ * which then fails with ECANCELED at the next transaction
+ * boundary.  Safe to call from another thread.
+ */
+void
+eeprom_cancel (eeprom_context_t ctx)
+{
+	atomic_store(&ctx->cancel, 1);
+
+} /* eeprom_cancel */
+
+/*
+ * eeprom_open_addr_ex
+ *
+ * Opens the EEPROM at an I2C address the best way available:
+ * through the nvmem subsystem, then the EEPROM driver's sysfs
+ * file, then userland I2C access.  If calibration found a
+ * userland I2C method to be faster than the driver for this
+ * bus, the contents are read through that instead, with the
+ * driver still used for writes and the extended area.
+ */
+eeprom_context_t
+eeprom_open_addr_ex (unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+		     const eeprom_open_options_t *opts)
+{
+	const struct nvmem_device *nvmem;
+	eeprom_transport_t ranking[eeprom_transport_count];
+	eeprom_context_t ctx;
+	char eeprompath[PATH_MAX];
+	int fd = -1, readonly, len;
+
+	nvmem = nvmem_lookup(bus, addr);
+	if (nvmem != NULL && eeprom_nvmem_path(bus, addr, eeprompath, sizeof(eeprompath)) == 0)
+		fd = open_path_fd(eeprompath, &readonly);
+	if (fd < 0) {
+		nvmem = NULL;
+		len = snprintf(eeprompath, sizeof(eeprompath), "/sys/bus/i2c/devices/%u-%04x/eeprom", bus, addr);
+		if (len > 0 && (size_t) len < sizeof(eeprompath) && access(eeprompath, F_OK) == 0)
+			fd = open_path_fd(eeprompath, &readonly);
+		if (fd < 0)
+			return eeprom_open_i2c_ex(bus, addr, mtype, opts);
+	}
+	ctx = open_context(fd, mtype, readonly, normal_read, opts);
+	if (ctx == NULL)
+		return NULL;
+	ctx->nvmem = nvmem;
+	ctx->i2c_addr = addr;
+	lock_init_i2c(ctx, bus, addr);
+	if (transport_ranking(bus, ranking) > 0 && ranking[0] != eeprom_transport_sysfs) {
+		ctx->i2cfd = open_i2c_fd(bus, addr);
+		if (ctx->i2cfd >= 0) {
+			ctx->readfunc = transport_readfunc(ranking[0]);
+			ctx->transport = ranking[0];
+		}
+	}
+	return open_common(ctx);
+
+} /* eeprom_open_addr_ex */
+
+/*
+ * eeprom_open_cvm_ex
+ *
+ * Opens the module (CVM) EEPROM, preferring the copy
+ * published by the firmware, then the EEPROM driver,
+ * then userland I2C access.
+ */
+eeprom_context_t
+eeprom_open_cvm_ex (const char *searchpath, const eeprom_open_options_t *opts)
+{
+	eeprom_context_t ctx;
+	const cvm_i2c_address_t *addr;
+
+	ctx = eeprom_open_firmware(searchpath, module_type_cvm);
+	if (ctx != NULL)
+		return ctx;
+	addr = cvm_i2c_address();
+	if (addr == NULL) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return eeprom_open_addr_ex(addr->busnum, addr->addr, module_type_cvm, opts);
+
+} /* eeprom_open_cvm_ex */
+
+eeprom_context_t
+eeprom_open_cvm (const char *searchpath)
+{
+	return eeprom_open_cvm_ex(searchpath, NULL);
+
+} /* eeprom_open_cvm */
+
+/*
+ * eeprom_close
+ *
+ * Clean up context.
+ */
+void
+eeprom_close (eeprom_context_t ctx)
+{
+	lock_close(ctx);
+	free(ctx->ext_records);
+	if (ctx->i2cfd >= 0 && ctx->i2cfd != ctx->fd)
+		trace_close(ctx->i2cfd);
+	if (ctx->fd >= 0)
+		trace_close(ctx->fd);
+	pthread_mutex_destroy(&ctx->oplock);
+	free(ctx);
+
+} /* eeprom_close */
+
+/*
+ * eeprom_readonly
+ *
+ * returns 1 if open read-only, 0 otherwise.
+ */
+int
+eeprom_readonly (eeprom_context_t ctx)
+{
+	return ctx->readonly;
+
+} /* eeprom_readonly */
+
+/*
+ * eeprom_changed
+ *
+ * Cheap check for whether the EEPROM has been reprogrammed
+ * since we last read it: only the length and CRC bytes are
+ * fetched from the device, and the full contents are re-read
+ * only if those differ from our cached copy.
+ *
+ * Returns 1 if the contents changed (and were re-read),
+ * 0 if not, -1 on error.
+ */
+int
+eeprom_changed (eeprom_context_t ctx)
+{
+	struct module_eeprom_v1_raw *rawdata = &ctx->eeprom_data;
+	struct module_eeprom_v1_raw newdata;
+	uint8_t newmap[EEPROM_SIZE / 8];
+	struct xfer_s xfer;
+	uint16_t length;
+	uint8_t crc8;
+	ssize_t ret;
+	int save_errno;
+
+	/*
+	 * Firmware-provided copies never change
+	 */
+	if (ctx->readfunc == NULL)
+		return 0;
+	pthread_mutex_lock(&ctx->oplock);
+	op_start(ctx);
+	ret = lock_wait(ctx, 0);
+	if (ret >= 0) {
+		ret = ctx->readfunc(ctx, &length, offsetof(struct module_eeprom_v1_raw, length), sizeof(length));
+		if (ret >= 0)
+			ret = ctx->readfunc(ctx, &crc8, offsetof(struct module_eeprom_v1_raw, crc8), sizeof(crc8));
+		lock_release(ctx);
+	}
+	if (ret >= 0) {
+		if (ctx->complete && length == rawdata->length && crc8 == rawdata->crc8)
+			ret = 0;
+		else {
+			memset(newmap, 0, sizeof(newmap));
+			xfer_init_read(&xfer, (uint8_t *) &newdata, newmap);
+			ret = xfer_run(ctx, &xfer);
+			if (ret >= 0) {
+				snapshot_publish(ctx, &newdata, newmap, 1);
+				ret = 1;
+			}
+		}
+	}
+	save_errno = errno;
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return (ret < 0 ? -1 : (int) ret);
+
+} /* eeprom_changed */
+
+/*
+ * eeprom_read
+ *
+ * Validate the EEPROM data obtained from the device
+ * and extract the important data from it, translating
+ * from the raw form into something usable: mainly
+ * converting MAC addresses from little-endian format
+ * into the more-typical big-endian format.
+ *
+ */
+int
+eeprom_read (eeprom_context_t ctx, module_eeprom_t *data)
+{
+	struct snapshot_s snap;
+	struct module_eeprom_v1_raw *rawdata = &snap.data;
+
+	memset(data, 0, sizeof(module_eeprom_t));
+
+	snapshot_take(ctx, &snap);
+	if (!snap.complete || !image_valid(ctx, rawdata)) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	if ((uint8_t) rawdata->partnumber[0] == 0xcc) {
+		data->partnumber_type = partnum_type_customer;
+		extract_string(data->partnumber, rawdata->partnumber+1, sizeof(rawdata->partnumber)-1);
+	} else {
+		data->partnumber_type = partnum_type_nvidia;
+		extract_string(data->partnumber, rawdata->partnumber, sizeof(rawdata->partnumber));
+	}
+	extract_string(data->asset_id, rawdata->asset_id, sizeof(rawdata->asset_id));
+	extract_macaddr(data->factory_default_wifi_mac, rawdata->factory_default_wifi_mac);
+	extract_macaddr(data->factory_default_bt_mac, rawdata->factory_default_bt_mac);
+	extract_macaddr(data->factory_default_wifi_alt_mac, rawdata->factory_default_wifi_alt_mac);
+	extract_macaddr(data->factory_default_ether_mac, rawdata->factory_default_ether_mac);
+	extract_macaddr(data->vendor_wifi_mac, rawdata->vendor_wifi_mac);
+	extract_macaddr(data->vendor_bt_mac, rawdata->vendor_bt_mac);
+	extract_macaddr(data->vendor_ether_mac, rawdata->vendor_ether_mac);
+	data->major_version = rawdata->major_version;
+	data->minor_version = rawdata->minor_version;
+	if (rawdata->major_version >= LAYOUT_VERSION_V2) {
+		data->factory_default_ether_mac_count = rawdata->ether_mac_count_v2;
+		data->vendor_ether_mac_count = rawdata->vendor_ether_mac_count_v2;
+		extract_string(data->system_partnumber, rawdata->system_partnumber_v2, sizeof(rawdata->system_partnumber_v2));
+		extract_string(data->system_serialnumber, rawdata->system_serialnumber_v2, sizeof(rawdata->system_serialnumber_v2));
+	}
+	return 0;
+
+} /* eeprom_read */
+
+/*
+ * eeprom_field_read
+ *
+ * Copies out the raw bytes of one field of the layout (see
+ * eeprom-layout.h), reading only that field from the device
+ * if it has not been read yet: through a device tree cell
+ * for exactly that field when the EEPROM was opened through
+ * the nvmem subsystem and declares one, otherwise at the
+ * field's offset.  The bytes read are added to the cached
+ * image.  No CRC check is possible on part of an image; use
+ * eeprom_resume() to read the rest and eeprom_data_valid()
+ * to validate it.
+ *
+ * Returns the size of the field, or -1 on error (ENOENT
+ * if there is no field by that name, EINVAL if it does not
+ * fit in the buffer).
+ */
+ssize_t
+eeprom_field_read (eeprom_context_t ctx, const char *name, void *buf, size_t bufsiz)
+{
+	const eeprom_layout_field_t *f;
+	struct snapshot_s snap;
+	uint8_t fieldbuf[EEPROM_SIZE];
+	ssize_t ret;
+	size_t i;
+	int idx, save_errno;
+
+	idx = eeprom_layout_field_index(name);
+	if (idx < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	f = &eeprom_layout_fields[idx];
+	if (bufsiz < f->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	snapshot_take(ctx, &snap);
+	if (chunk_valid(snap.validmap, f->offset, f->size)) {
+		memcpy(buf, (uint8_t *) &snap.data + f->offset, f->size);
+		return f->size;
+	}
+	if (ctx->readfunc == NULL) {
+		errno = EIO;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->oplock);
+	op_start(ctx);
+	ret = lock_wait(ctx, 0);
+	if (ret >= 0) {
+		if (ctx->nvmem == NULL || nvmem_cell_read(ctx->nvmem, fieldbuf, f->offset, f->size) < 0)
+			ret = ctx->readfunc(ctx, fieldbuf, f->offset, f->size);
+		lock_release(ctx);
+	}
+	if (ret >= 0) {
+		memcpy(&snap.data, &ctx->eeprom_data, sizeof(snap.data));
+		memcpy(snap.validmap, ctx->validmap, sizeof(snap.validmap));
+		memcpy((uint8_t *) &snap.data + f->offset, fieldbuf, f->size);
+		for (i = f->offset; i < f->offset + f->size; i++)
+			snap.validmap[i / 8] |= 1 << (i % 8);
+		snapshot_publish(ctx, &snap.data, snap.validmap,
+				 ctx->complete || chunk_valid(snap.validmap, 0, EEPROM_SIZE));
+		memcpy(buf, fieldbuf, f->size);
+		ret = f->size;
+	}
+	save_errno = errno;
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_field_read */
+
+/*
+ * encode_raw
+ *
+ * Updates a raw image from the decoded contents.
+ */
+static int
+encode_raw (eeprom_context_t ctx, module_eeprom_t *data, struct module_eeprom_v1_raw *rawdata)
+{
+	tegra_soctype_t soctype = ctx->soctype, oldsoc;
+	eeprom_module_type_t mtype = ctx->mtype, oldtype;
+
+	/*
+	 * Offline, the layout follows the contents being encoded,
+	 * and whether it is a CVM's follows the image they replace
+	 */
+	if (ctx->opts.flags & EEPROM_OPEN_OFFLINE) {
+		soctype = (data->major_version == LAYOUT_VERSION_T234 ? TEGRA_SOCTYPE_234 : TEGRA_SOCTYPE_194);
+		if (image_valid(ctx, rawdata) && infer_layout(rawdata, &oldsoc, &oldtype) == 0 &&
+		    (oldtype == module_type_cvm || mtype == module_type_cvm))
+			mtype = oldtype;
+	}
+	if ((soctype == TEGRA_SOCTYPE_234 && data->major_version != LAYOUT_VERSION_T234) ||
+	    (soctype != TEGRA_SOCTYPE_234 && data->major_version != LAYOUT_VERSION_NON_T234)) {
+		errno = EINVAL;
+		return -1;
+	};
+
+	if (!image_valid(ctx, rawdata) || rawdata->major_version != data->major_version) {
+		memset(rawdata, 0, sizeof(*rawdata));
+		if (soctype == TEGRA_SOCTYPE_234)
+			rawdata->major_version = LAYOUT_VERSION_T234;
+		else
+			rawdata->major_version = LAYOUT_VERSION_NON_T234;
+		if (mtype == module_type_cvm) {
+			memcpy(rawdata->cfgblk_sig, cfgblk_sig, sizeof(rawdata->cfgblk_sig));
+			rawdata->cfgblk_len = CFGBLK_LENGTH;
+			memcpy(rawdata->macfmt_tag, macfmt_tag, sizeof(rawdata->macfmt_tag));
+			rawdata->macfmt_version = htole16(MACFMT_VERSION);
+		}
+	}
+
+	if (data->partnumber_type == partnum_type_nvidia)
+		memcpy(rawdata->partnumber, data->partnumber, sizeof(rawdata->partnumber));
+	else {
+		rawdata->partnumber[0] = (char) 0xcc;
+		memcpy(&rawdata->partnumber[1], data->partnumber, sizeof(rawdata->partnumber)-1);
 	}
 	memcpy(rawdata->asset_id, data->asset_id, sizeof(rawdata->asset_id));
-	if (ctx->mtype == module_type_cvm) {
+	if (mtype == module_type_cvm) {
 		extract_macaddr(rawdata->factory_default_wifi_mac, data->factory_default_wifi_mac);
 		extract_macaddr(rawdata->factory_default_bt_mac, data->factory_default_bt_mac);
 		extract_macaddr(rawdata->factory_default_wifi_alt_mac, data->factory_default_wifi_alt_mac);
@@ -450,7 +1598,7 @@ eeprom_write (eeprom_context_t ctx, module_eeprom_t *data)
 		rawdata->vendor_ether_mac_count_v2 = data->vendor_ether_mac_count;
 		// Per the L4T documentation, is field applies only to
 		// carrier boards sold as part of NVIDIA development kits
-		if (ctx->mtype == module_type_cvb)
+		if (mtype == module_type_cvb)
 			memcpy(rawdata->system_partnumber_v2, data->system_partnumber,
 			       sizeof(rawdata->system_partnumber_v2));
 		memcpy(rawdata->system_serialnumber_v2, data->system_serialnumber,
@@ -459,14 +1607,350 @@ eeprom_write (eeprom_context_t ctx, module_eeprom_t *data)
 	rawdata->length = htole16(sizeof(*rawdata) - 1);
 	rawdata->crc8 = calc_crc8((uint8_t *) rawdata, 255);
 
-	if (lseek(ctx->fd, 0, SEEK_SET) < 0)
+	return 0;
+
+} /* encode_raw */
+
+/*
+ * encode_image
+ *
+ * Produces the raw image to write to the device from the
+ * decoded contents, based on the cached image.  The cache
+ * is left alone until the write succeeds; see write_done().
+ * Called with the oplock held.
+ */
+int
+encode_image (eeprom_context_t ctx, module_eeprom_t *data, struct module_eeprom_v1_raw *rawdata)
+{
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	/*
+	 * Don't overwrite contents we haven't been able to read
+	 */
+	if (!ctx->complete) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memcpy(rawdata, &ctx->eeprom_data, sizeof(*rawdata));
+	return encode_raw(ctx, data, rawdata);
+
+} /* encode_image */
+
+/*
+ * write_done
+ *
+ * Makes a successfully written image the cached one, and
+ * logs the write to the journal.  Called with the oplock
+ * held.
+ */
+void
+write_done (eeprom_context_t ctx, const struct module_eeprom_v1_raw *image,
+	    const struct module_eeprom_v1_raw *before, int have_before)
+{
+	uint8_t validmap[EEPROM_SIZE / 8];
+
+	memset(validmap, 0xff, sizeof(validmap));
+	snapshot_publish(ctx, image, validmap, 1);
+	journal_log_write(ctx, before, have_before, &ctx->eeprom_data);
+
+} /* write_done */
+
+/*
+ * write_failed
+ *
+ * Accounts for a failed write.  One that failed before
+ * sending anything to the device (ESTALE, or a timeout
+ * waiting for the lock) leaves the cached contents alone.
+ * Otherwise the device holds a mix of old and new contents,
+ * so the range the write reached is marked unread, and the
+ * context left incomplete until eeprom_resume() re-reads
+ * it.  Called with the oplock held.
+ */
+void
+write_failed (eeprom_context_t ctx, const struct xfer_s *x)
+{
+	uint8_t validmap[EEPROM_SIZE / 8];
+	size_t i;
+
+	if (x->attempted == 0)
+		return;
+	memcpy(validmap, ctx->validmap, sizeof(validmap));
+	for (i = 0; i < x->attempted; i++)
+		validmap[i / 8] &= ~(1 << (i % 8));
+	snapshot_publish(ctx, &ctx->eeprom_data, validmap, 0);
+
+} /* write_failed */
+
+/*
+ * eeprom_encode
+ *
+ * Produces the raw image that eeprom_write() would write
+ * for the decoded contents, without writing it or changing
+ * the context.  Works on read-only contexts, so one device's
+ * contents can serve as the basis for images written to others.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+eeprom_encode (eeprom_context_t ctx, module_eeprom_t *data, void *buf, size_t bufsiz)
+{
+	struct snapshot_s snap;
+
+	if (bufsiz < sizeof(snap.data)) {
+		errno = EINVAL;
+		return -1;
+	}
+	snapshot_take(ctx, &snap);
+	if (!snap.complete) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (encode_raw(ctx, data, &snap.data) < 0)
+		return -1;
+	memcpy(buf, &snap.data, sizeof(snap.data));
+	return 0;
+
+} /* eeprom_encode */
+
+/*
+ * eeprom_encode_new
+ *
+ * Produces the raw image that eeprom_write() would write
+ * to a blank device, without needing a device.  The layout
+ * (and so the SoC family) follows data->major_version.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+eeprom_encode_new (eeprom_module_type_t mtype, module_eeprom_t *data, void *buf, size_t bufsiz)
+{
+	struct eeprom_context_s ctx;
+
+	if (bufsiz < sizeof(ctx.eeprom_data)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.mtype = mtype;
+	ctx.soctype = (data->major_version == LAYOUT_VERSION_T234 ? TEGRA_SOCTYPE_234 : TEGRA_SOCTYPE_194);
+	if (encode_raw(&ctx, data, &ctx.eeprom_data) < 0)
+		return -1;
+	memcpy(buf, &ctx.eeprom_data, sizeof(ctx.eeprom_data));
+	return 0;
+
+} /* eeprom_encode_new */
+
+/*
+ * eeprom_image_crc
+ *
+ * Computes the CRC for a raw image (of EEPROM_IMAGE_SIZE
+ * bytes); the value that belongs in its last byte.
+ */
+uint8_t
+eeprom_image_crc (const void *image)
+{
+	return calc_crc8(image, EEPROM_SIZE - 1);
+
+} /* eeprom_image_crc */
+
+/*
+ * eeprom_infer_layout
+ *
+ * Works out, from an image's header alone, the layout
+ * version (and so the SoC family) and module type it was
+ * written for, as an offline context does.  Does not check
+ * the CRC.
+ *
+ * Returns 0 on success, -1 (EINVAL) if the header is not
+ * one we recognize.
+ */
+int
+eeprom_infer_layout (const void *image, size_t len, unsigned int *major_version, eeprom_module_type_t *mtype)
+{
+	struct module_eeprom_v1_raw data;
+	tegra_soctype_t soctype;
+
+	if (len < sizeof(data)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&data, image, sizeof(data));
+	if (infer_layout(&data, &soctype, mtype) < 0) {
+		errno = EINVAL;
 		return -1;
-	bp = (uint8_t *) rawdata;
-	for (remain = sizeof(*rawdata); remain > 0; remain -= n, bp += n) {
-		n = write(ctx->fd, bp, remain);
-		if (n < 0)
-			return -1;
 	}
+	*major_version = data.major_version;
 	return 0;
 
+} /* eeprom_infer_layout */
+
+/*
+ * eeprom_get_raw
+ *
+ * Copies out the raw contents as read from the device.
+ *
+ * Returns the number of bytes copied, or -1 on failure.
+ */
+ssize_t
+eeprom_get_raw (eeprom_context_t ctx, void *buf, size_t bufsiz)
+{
+	struct snapshot_s snap;
+
+	snapshot_take(ctx, &snap);
+	if (!snap.complete) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (bufsiz > sizeof(snap.data))
+		bufsiz = sizeof(snap.data);
+	memcpy(buf, &snap.data, bufsiz);
+	return (ssize_t) bufsiz;
+
+} /* eeprom_get_raw */
+
+/*
+ * eeprom_set_raw
+ *
+ * Writes a complete raw image to the device.  The image
+ * must pass the same checks as eeprom_data_valid() (with
+ * EINVAL if it does not), so a corrupted or mismatched
+ * image is never written.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+eeprom_set_raw (eeprom_context_t ctx, const void *buf, size_t len)
+{
+	struct module_eeprom_v1_raw image, before;
+	struct xfer_s xfer;
+	int ret, save_errno, have_before;
+
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (len != sizeof(ctx->eeprom_data) || !image_valid(ctx, buf)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&image, buf, sizeof(image));
+	pthread_mutex_lock(&ctx->oplock);
+	have_before = ctx->complete;
+	memcpy(&before, &ctx->eeprom_data, sizeof(before));
+	op_start(ctx);
+	xfer_init_write(&xfer, (uint8_t *) &image, -1);
+	ret = xfer_run(ctx, &xfer);
+	save_errno = errno;
+	if (ret == 0)
+		write_done(ctx, &image, &before, have_before);
+	else
+		write_failed(ctx, &xfer);
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_set_raw */
+
+/*
+ * eeprom_write
+ *
+ * Writes module EEPROM data to the device.
+ *
+ * WARNING:
+ *    Performs a complete overwrite, so to prevent
+ *    losing data, you MUST call eeprom_read() to
+ *    populate the module_eeprom structure, make any
+ *    updates you need to, then call this function.
+ *
+ */
+int
+eeprom_write (eeprom_context_t ctx, module_eeprom_t *data)
+{
+	struct module_eeprom_v1_raw image, before;
+	struct xfer_s xfer;
+	int ret, save_errno, have_before;
+
+	pthread_mutex_lock(&ctx->oplock);
+	have_before = ctx->complete;
+	memcpy(&before, &ctx->eeprom_data, sizeof(before));
+	ret = encode_image(ctx, data, &image);
+	if (ret == 0) {
+		op_start(ctx);
+		xfer_init_write(&xfer, (uint8_t *) &image, -1);
+		ret = xfer_run(ctx, &xfer);
+		if (ret < 0)
+			write_failed(ctx, &xfer);
+	}
+	save_errno = errno;
+	if (ret == 0)
+		write_done(ctx, &image, &before, have_before);
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return ret;
+
 } /* eeprom_write */
+
+/*
+ * eeprom_write_if
+ *
+ * Like eeprom_write(), but the write is done only if the
+ * CRC byte currently on the device matches expected_crc
+ * (normally obtained with eeprom_crc() when the contents
+ * were read), checked while holding the write lock.  This
+ * lets concurrent updaters detect that someone else has
+ * written the device since they read it.
+ *
+ * Returns 0 on success, -1 on failure, with errno set to
+ * ESTALE if the device contents have changed.
+ */
+int
+eeprom_write_if (eeprom_context_t ctx, module_eeprom_t *data, uint8_t expected_crc)
+{
+	struct module_eeprom_v1_raw image, before;
+	struct xfer_s xfer;
+	int ret, save_errno, have_before;
+
+	pthread_mutex_lock(&ctx->oplock);
+	have_before = ctx->complete;
+	memcpy(&before, &ctx->eeprom_data, sizeof(before));
+	ret = encode_image(ctx, data, &image);
+	if (ret == 0) {
+		op_start(ctx);
+		xfer_init_write(&xfer, (uint8_t *) &image, expected_crc);
+		ret = xfer_run(ctx, &xfer);
+		if (ret < 0)
+			write_failed(ctx, &xfer);
+	}
+	save_errno = errno;
+	if (ret == 0)
+		write_done(ctx, &image, &before, have_before);
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_write_if */
+
+/*
+ * eeprom_crc
+ *
+ * Returns the CRC byte of the contents as last read
+ * from (or written to) the device, or -1 if the contents
+ * have not been completely read.
+ */
+int
+eeprom_crc (eeprom_context_t ctx)
+{
+	struct snapshot_s snap;
+
+	snapshot_take(ctx, &snap);
+	if (!snap.complete) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return snap.data.crc8;
+
+} /* eeprom_crc */
@@ -11,6 +11,8 @@ extern "C"
 #endif
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 typedef enum {
 	module_type_cvm,
@@ -48,13 +50,215 @@ struct module_eeprom_s {
 };
 typedef struct module_eeprom_s module_eeprom_t;
 
+/*
+ * Options for reading the EEPROM contents.  Reads are done in
+ * chunks of chunk_size bytes; a chunk that fails is retried up
+ * to 'retries' times, with the delay starting at retry_backoff_us
+ * and doubling on each attempt.  If timeout_ms is non-zero, each
+ * open, read, or write operation fails with ETIMEDOUT once that
+ * much time has passed.  The deadline (like eeprom_cancel()) is
+ * checked between chunks, so it can be overrun by the time one
+ * chunk takes.  A write that fails after it has started changing
+ * the device leaves the context incomplete (eeprom_crc() returns
+ * -1) until eeprom_resume() re-reads what the device now holds;
+ * one that fails before then leaves the context as it was.  If
+ * bus_duty_pct is between 1 and 99,
+ * transfers are paced so that this process's throttled traffic
+ * on the (root) I2C bus keeps it busy no more than that share
+ * of the time: chunks are cut to a few bytes, and after each
+ * one the bus is left alone until the duty cycle is back
+ * within budget.  Initialize with eeprom_open_options_init()
+ * before changing any settings.
+ */
+struct eeprom_open_options_s {
+	unsigned int chunk_size;
+	unsigned int retries;
+	unsigned int retry_backoff_us;
+	unsigned int flags;
+	unsigned int timeout_ms;
+	unsigned int bus_duty_pct;	// 0 (or 100) for no pacing
+};
+typedef struct eeprom_open_options_s eeprom_open_options_t;
+// Return the context even if the read is incomplete; see eeprom_resume()
+#define EEPROM_OPEN_PARTIAL	(1U << 0)
+// Read nothing at open; fields are read on demand with eeprom_field_read()
+#define EEPROM_OPEN_LAZY	(1U << 1)
+// Infer each image's layout and module type from the image, not the host
+#define EEPROM_OPEN_OFFLINE	(1U << 2)
+
+void eeprom_open_options_init(eeprom_open_options_t *opts);
+eeprom_context_t eeprom_open_i2c_ex(unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+				    const eeprom_open_options_t *opts);
+eeprom_context_t eeprom_open_ex(const char *pathname, eeprom_module_type_t mtype,
+				const eeprom_open_options_t *opts);
+eeprom_context_t eeprom_open_cvm_ex(const char *searchpath, const eeprom_open_options_t *opts);
+eeprom_context_t eeprom_open_addr_ex(unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+				     const eeprom_open_options_t *opts);
+int eeprom_nvmem_path(unsigned int bus, unsigned int addr, char *buf, size_t bufsiz);
+ssize_t eeprom_field_read(eeprom_context_t ctx, const char *name, void *buf, size_t bufsiz);
+int eeprom_resume(eeprom_context_t ctx);
+size_t eeprom_bytes_read(eeprom_context_t ctx);
+size_t eeprom_bytes_completed(eeprom_context_t ctx);
+void eeprom_cancel(eeprom_context_t ctx);
+
+/*
+ * Bus usage by a context's transfers: the time spent in
+ * them, and the time from the start of the first transfer
+ * to the end of the last in each operation, so that
+ * busy_ns / elapsed_ns is the realized duty cycle.
+ */
+struct eeprom_bus_usage_s {
+	uint64_t busy_ns;
+	uint64_t elapsed_ns;
+	unsigned long transfers;
+};
+typedef struct eeprom_bus_usage_s eeprom_bus_usage_t;
+
+void eeprom_bus_usage(eeprom_context_t ctx, eeprom_bus_usage_t *usage);
 eeprom_context_t eeprom_open_i2c(unsigned int bus, unsigned int addr, eeprom_module_type_t mtype);
 eeprom_context_t eeprom_open(const char *pathname, eeprom_module_type_t mtype);
+eeprom_context_t eeprom_open_firmware(const char *searchpath, eeprom_module_type_t mtype);
+eeprom_context_t eeprom_open_cvm(const char *searchpath);
+eeprom_context_t eeprom_open_image(const void *image, size_t len);
 int eeprom_data_valid(eeprom_context_t ctx);
 int eeprom_read(eeprom_context_t ctx, module_eeprom_t *data);
 int eeprom_write(eeprom_context_t ctx, module_eeprom_t *data);
+int eeprom_write_if(eeprom_context_t ctx, module_eeprom_t *data, uint8_t expected_crc);
+int eeprom_crc(eeprom_context_t ctx);
+int eeprom_encode(eeprom_context_t ctx, module_eeprom_t *data, void *buf, size_t bufsiz);
+int eeprom_encode_new(eeprom_module_type_t mtype, module_eeprom_t *data, void *buf, size_t bufsiz);
+uint8_t eeprom_image_crc(const void *image);
+int eeprom_infer_layout(const void *image, size_t len, unsigned int *major_version, eeprom_module_type_t *mtype);
+ssize_t eeprom_get_raw(eeprom_context_t ctx, void *buf, size_t bufsiz);
+int eeprom_set_raw(eeprom_context_t ctx, const void *buf, size_t len);
 void eeprom_close(eeprom_context_t ctx);
 int eeprom_readonly(eeprom_context_t ctx);
+int eeprom_changed(eeprom_context_t ctx);
+
+/*
+ * Repair analysis for raw images whose CRC does not match.
+ * Each candidate is a value to XOR into one byte (offset 255
+ * being the stored CRC itself) that makes the CRC match;
+ * checks_passed counts the version, NVCB signature, M1 tag,
+ * and MAC format version checks that the corrected image
+ * passes.  Candidates are ordered best first: most checks
+ * passed, then fewest bits changed.
+ */
+struct eeprom_repair_candidate_s {
+	uint16_t offset;
+	uint8_t mask;
+	uint8_t checks_passed;
+};
+typedef struct eeprom_repair_candidate_s eeprom_repair_candidate_t;
+#define EEPROM_REPAIR_CHECKS		4
+#define EEPROM_REPAIR_MAX_CANDIDATES	256
+
+int eeprom_repair_candidates(const void *image, size_t len,
+			     eeprom_repair_candidate_t *cands, size_t maxcands);
+
+/*
+ * Extended record area on EEPROMs larger than the NVIDIA
+ * layout (see eeprom-layout.h).  Records are identified by
+ * their type (1-254); each has its own CRC, and is read from
+ * the EEPROM only when asked for.  Not available when the
+ * EEPROM is accessed directly over I2C (ENOTSUP).
+ */
+ssize_t eeprom_size(eeprom_context_t ctx);
+int eeprom_ext_count(eeprom_context_t ctx);
+int eeprom_ext_entry(eeprom_context_t ctx, unsigned int idx, uint8_t *type, size_t *lenp);
+ssize_t eeprom_ext_read(eeprom_context_t ctx, uint8_t type, void *buf, size_t bufsiz);
+int eeprom_ext_write(eeprom_context_t ctx, uint8_t type, const void *data, size_t len);
+int eeprom_ext_delete(eeprom_context_t ctx, uint8_t type);
+
+/*
+ * I2C topology, discovered from sysfs.  Adapters created by
+ * I2C mux drivers (such as the PCA954x) are mapped to the mux
+ * and channel they sit behind, and to the root adapter that
+ * carries their traffic.  The list is in topology order: each
+ * root adapter, followed by the adapters behind it, ordered
+ * by mux address and channel, depth first.  Work done in that
+ * order switches mux channels as little as possible.
+ */
+struct eeprom_i2c_adapter_s {
+	unsigned int bus;
+	unsigned int parent;	// same as bus for a root adapter
+	unsigned int root;
+	int mux_addr;		// address of the mux on the parent bus, or -1
+	int channel;		// mux channel, or -1
+	unsigned int depth;	// number of muxes between the root and this adapter
+};
+typedef struct eeprom_i2c_adapter_s eeprom_i2c_adapter_t;
+
+int eeprom_i2c_topology(const eeprom_i2c_adapter_t **adapters);
+const eeprom_i2c_adapter_t *eeprom_i2c_adapter(unsigned int bus);
+#define EEPROM_I2C_PRESENT	1	// answered a probe
+#define EEPROM_I2C_CLAIMED	2	// bound to a kernel driver, so not probed
+int eeprom_i2c_probe(unsigned int bus, unsigned int first, unsigned int last, uint8_t *present);
+int eeprom_i2c_probe_ex(unsigned int bus, unsigned int first, unsigned int last, uint8_t *present,
+			const eeprom_open_options_t *opts);
+
+/*
+ * Read methods ("transports").  eeprom_calibrate() tries each
+ * way of reading the EEPROM at an I2C address, times the ones
+ * that work and return the same contents, and saves the
+ * ranking in a cache file (/var/cache/tegra-eeprom/transports,
+ * or $TEGRA_EEPROM_TRANSPORT_CACHE), keyed by bus number and
+ * adapter name.  eeprom_open_addr_ex() and eeprom_open_i2c_ex()
+ * then read through the fastest method the cache lists for
+ * the bus.  Writes always go through the EEPROM driver.
+ */
+typedef enum {
+	eeprom_transport_sysfs,		// EEPROM driver (nvmem or sysfs file)
+	eeprom_transport_rdwr,		// I2C_RDWR: offset write, repeated start, read
+	eeprom_transport_i2c_block,	// SMBus I2C block reads
+	eeprom_transport_smbus_byte,	// SMBus byte reads
+	eeprom_transport_count,
+	eeprom_transport_none = -1,	// firmware-provided copy
+} eeprom_transport_t;
+
+struct eeprom_transport_result_s {
+	eeprom_transport_t transport;
+	int supported;
+	int error;		// errno, if not supported
+	double bytes_per_sec;
+};
+typedef struct eeprom_transport_result_s eeprom_transport_result_t;
+
+int eeprom_calibrate(unsigned int bus, unsigned int addr, eeprom_transport_result_t results[eeprom_transport_count]);
+const char *eeprom_transport_name(eeprom_transport_t transport);
+eeprom_transport_t eeprom_transport(eeprom_context_t ctx);
+
+/*
+ * Transaction tracing: record every device transaction to a
+ * file, or replay a recorded trace in place of the devices
+ * (with the same timing) on any machine.  Process-wide; start
+ * before opening any EEPROMs, and stop after closing them.
+ */
+int eeprom_trace_record(const char *pathname);
+int eeprom_trace_replay(const char *pathname);
+int eeprom_trace_stop(void);
+
+/*
+ * Non-blocking API, for use from an event loop: start an
+ * operation, poll eeprom_async_fd() for readability and call
+ * eeprom_async_step() each time it is readable, until the step
+ * returns 0 (done) or -1 (failed), then collect the result.
+ */
+struct eeprom_async_s;
+typedef struct eeprom_async_s *eeprom_async_t;
+
+eeprom_async_t eeprom_async_open_i2c(unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+				     const eeprom_open_options_t *opts);
+eeprom_async_t eeprom_async_open(const char *pathname, eeprom_module_type_t mtype,
+				 const eeprom_open_options_t *opts);
+eeprom_async_t eeprom_async_write(eeprom_context_t ctx, module_eeprom_t *data);
+int eeprom_async_fd(eeprom_async_t op);
+int eeprom_async_step(eeprom_async_t op);
+int eeprom_async_complete(eeprom_async_t op);
+void eeprom_async_cancel(eeprom_async_t op);
+size_t eeprom_async_progress(eeprom_async_t op);
+int eeprom_async_result(eeprom_async_t op, eeprom_context_t *ctxp);
+void eeprom_async_free(eeprom_async_t op);
 
 #ifdef __cplusplus
 } /* extern "C" */
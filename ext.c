@@ -0,0 +1,491 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "eeprom-internal.h"
+
+/*
+ * Extended record area (see eeprom-layout.h), for EEPROMs
+ * larger than the NVIDIA layout.  This is only available on
+ * EEPROMs accessed through a driver (or files); the direct I2C
+ * access uses 8-bit SMBus addressing, which cannot reach past
+ * the first 256 bytes.
+ *
+ * The size of the EEPROM is probed by reading at successive
+ * powers of two until the read fails or returns a copy of the
+ * start of the EEPROM, which means the address has wrapped
+ * around.  The index of records is built from the record
+ * headers alone, and a record's data is read only when asked
+ * for.  Updates are compared against the current contents and
+ * written a page at a time, skipping pages that do not change.
+ */
+#define EXT_MAX_SIZE	65536
+#define EXT_PAGE_SIZE	16	// smallest page of the EEPROMs big enough to have the area
+
+/*
+ * ext_read
+ *
+ * Through the driver (or file) descriptor; ext_prepare()
+ * refuses contexts that do not have one.  The NVIDIA layout
+ * of such a context may still be read through userland I2C,
+ * if calibration found that faster.
+ */
+static int
+ext_read (eeprom_context_t ctx, void *buf, size_t offset, size_t len)
+{
+	return normal_read(ctx, buf, offset, len) < 0 ? -1 : 0;
+
+} /* ext_read */
+
+/*
+ * ext_probe
+ *
+ * Finds the size of the EEPROM.  An image file is the size
+ * it is; for a device, the size the driver reports (if any)
+ * is an upper bound, since the driver may have been configured
+ * for a larger part than is actually fitted.  Driver (sysfs
+ * and nvmem) files stat as regular files too, so a file on
+ * an I2C device, or opened through nvmem, is probed.
+ */
+static int
+ext_probe (eeprom_context_t ctx)
+{
+	uint8_t first[EEPROM_SIZE], block[EEPROM_SIZE];
+	struct stat st;
+	size_t limit, size;
+
+	if (ctx->devsize != 0)
+		return 0;
+	if (fstat(ctx->fd, &st) < 0)
+		return -1;
+	if (S_ISREG(st.st_mode) && ctx->bus < 0 && ctx->nvmem == NULL) {
+		ctx->devsize = (st.st_size > EXT_MAX_SIZE ? EXT_MAX_SIZE : st.st_size);
+		return 0;
+	}
+	limit = (st.st_size > EEPROM_SIZE && st.st_size < EXT_MAX_SIZE ? st.st_size : EXT_MAX_SIZE);
+	if (ext_read(ctx, first, 0, sizeof(first)) < 0)
+		return -1;
+	for (size = EEPROM_SIZE; size < limit; size *= 2)
+		if (ext_read(ctx, block, size, sizeof(block)) < 0 ||
+		    memcmp(block, first, sizeof(block)) == 0)
+			break;
+	ctx->devsize = (size > limit ? limit : size);
+	return 0;
+
+} /* ext_probe */
+
+/*
+ * ext_scan
+ *
+ * Builds the index of records from their headers.  A record
+ * that would run past the end of the EEPROM is taken to be
+ * the end of the area, so it will be overwritten by the next
+ * update.
+ */
+static int
+ext_scan (eeprom_context_t ctx)
+{
+	struct ext_record *records = NULL, *newrecords;
+	uint8_t hdr[EXT_RECORD_HEADER], sig[EXT_AREA_SIG_LENGTH];
+	unsigned int count = 0, alloc = 0;
+	size_t offset;
+	uint16_t len;
+
+	ctx->ext_indexed = 0;
+	ctx->ext_count = 0;
+	ctx->ext_signed = 0;
+	ctx->ext_end = EXT_AREA_OFFSET;
+	if (ctx->devsize < EXT_AREA_OFFSET + EXT_AREA_SIG_LENGTH + 1) {
+		ctx->ext_indexed = 1;
+		return 0;
+	}
+	if (ext_read(ctx, sig, EXT_AREA_OFFSET, sizeof(sig)) < 0)
+		return -1;
+	if (memcmp(sig, EXT_AREA_SIG, sizeof(sig)) != 0) {
+		ctx->ext_indexed = 1;
+		return 0;
+	}
+	for (offset = EXT_AREA_OFFSET + EXT_AREA_SIG_LENGTH;
+	     offset + EXT_RECORD_OVERHEAD <= ctx->devsize; offset += EXT_RECORD_OVERHEAD + len) {
+		if (ext_read(ctx, hdr, offset, sizeof(hdr)) < 0) {
+			free(records);
+			return -1;
+		}
+		if (hdr[0] == EXT_TYPE_END || hdr[0] == EXT_TYPE_EMPTY)
+			break;
+		len = hdr[1] | (hdr[2] << 8);
+		if (offset + EXT_RECORD_OVERHEAD + len > ctx->devsize)
+			break;
+		if (count >= alloc) {
+			alloc = (alloc == 0 ? 16 : alloc * 2);
+			newrecords = realloc(records, alloc * sizeof(*records));
+			if (newrecords == NULL) {
+				free(records);
+				return -1;
+			}
+			records = newrecords;
+		}
+		records[count].offset = offset;
+		records[count].len = len;
+		records[count].type = hdr[0];
+		count += 1;
+	}
+	free(ctx->ext_records);
+	ctx->ext_records = records;
+	ctx->ext_count = count;
+	ctx->ext_end = offset;
+	ctx->ext_signed = 1;
+	ctx->ext_indexed = 1;
+	return 0;
+
+} /* ext_scan */
+
+/*
+ * ext_find
+ */
+static struct ext_record *
+ext_find (eeprom_context_t ctx, uint8_t type)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->ext_count; i++)
+		if (ctx->ext_records[i].type == type)
+			return &ctx->ext_records[i];
+	return NULL;
+
+} /* ext_find */
+
+/*
+ * ext_prepare
+ *
+ * Takes the context's oplock and the device locks, then
+ * probes and indexes if that has not already been done
+ * (or, if rescan is set, even if it has).
+ */
+static int
+ext_prepare (eeprom_context_t ctx, int exclusive, int rescan)
+{
+	int save_errno;
+
+	if (!ctx->driver) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->oplock);
+	op_start(ctx);
+	if (lock_wait(ctx, exclusive) < 0 || ext_probe(ctx) < 0 ||
+	    ((rescan || !ctx->ext_indexed) && ext_scan(ctx) < 0)) {
+		save_errno = errno;
+		lock_release(ctx);
+		pthread_mutex_unlock(&ctx->oplock);
+		errno = save_errno;
+		return -1;
+	}
+	return 0;
+
+} /* ext_prepare */
+
+/*
+ * ext_finish
+ *
+ * Releases what ext_prepare() took.
+ */
+static void
+ext_finish (eeprom_context_t ctx)
+{
+	int save_errno = errno;
+
+	lock_release(ctx);
+	pthread_mutex_unlock(&ctx->oplock);
+	errno = save_errno;
+
+} /* ext_finish */
+
+/*
+ * eeprom_size
+ *
+ * Returns the size of the EEPROM in bytes (probing for
+ * it the first time), or -1 on error.  Without a driver,
+ * only the NVIDIA layout is reachable, so that is the size.
+ */
+ssize_t
+eeprom_size (eeprom_context_t ctx)
+{
+	ssize_t size;
+
+	if (!ctx->driver)
+		return EEPROM_SIZE;
+	if (ext_prepare(ctx, 0, 0) < 0)
+		return -1;
+	size = ctx->devsize;
+	ext_finish(ctx);
+	return size;
+
+} /* eeprom_size */
+
+/*
+ * eeprom_ext_count
+ *
+ * Returns the number of records in the extended area,
+ * or -1 on error (ENOTSUP if the EEPROM is not accessed
+ * in a way that reaches the area).
+ */
+int
+eeprom_ext_count (eeprom_context_t ctx)
+{
+	int count;
+
+	if (ext_prepare(ctx, 0, 0) < 0)
+		return -1;
+	count = (int) ctx->ext_count;
+	ext_finish(ctx);
+	return count;
+
+} /* eeprom_ext_count */
+
+/*
+ * eeprom_ext_entry
+ *
+ * Returns the type and length of the idx'th record.
+ */
+int
+eeprom_ext_entry (eeprom_context_t ctx, unsigned int idx, uint8_t *type, size_t *lenp)
+{
+	int ret = 0;
+
+	if (ext_prepare(ctx, 0, 0) < 0)
+		return -1;
+	if (idx < ctx->ext_count) {
+		*type = ctx->ext_records[idx].type;
+		*lenp = ctx->ext_records[idx].len;
+	} else {
+		errno = ENOENT;
+		ret = -1;
+	}
+	ext_finish(ctx);
+	return ret;
+
+} /* eeprom_ext_entry */
+
+/*
+ * eeprom_ext_read
+ *
+ * Reads the data for a record, checking its CRC.  If the
+ * record has moved (because the area was updated by someone
+ * else), the index is rebuilt.
+ *
+ * Returns the length of the data, or -1 on error, with
+ * errno set to ENOENT if there is no record of that type,
+ * EBADMSG if its CRC is bad, or EINVAL if it does not fit
+ * in the buffer.
+ */
+ssize_t
+eeprom_ext_read (eeprom_context_t ctx, uint8_t type, void *buf, size_t bufsiz)
+{
+	struct ext_record *rec;
+	uint8_t *raw = NULL;
+	ssize_t ret = -1;
+	int pass, save_errno;
+
+	if (ext_prepare(ctx, 0, 0) < 0)
+		return -1;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass > 0 && ext_scan(ctx) < 0)
+			goto depart;
+		rec = ext_find(ctx, type);
+		if (rec == NULL)
+			continue;
+		free(raw);
+		raw = malloc(rec->len + EXT_RECORD_OVERHEAD);
+		if (raw == NULL)
+			goto depart;
+		if (ext_read(ctx, raw, rec->offset, rec->len + EXT_RECORD_OVERHEAD) < 0)
+			goto depart;
+		if (raw[0] != type || (raw[1] | (raw[2] << 8)) != rec->len)
+			continue;
+		if (calc_crc8(raw, rec->len + EXT_RECORD_HEADER) != raw[rec->len + EXT_RECORD_HEADER]) {
+			errno = EBADMSG;
+			goto depart;
+		}
+		if (bufsiz < rec->len) {
+			errno = EINVAL;
+			goto depart;
+		}
+		memcpy(buf, raw + EXT_RECORD_HEADER, rec->len);
+		ret = rec->len;
+		break;
+	}
+	if (pass >= 2)
+		errno = ENOENT;
+
+  depart:
+	save_errno = errno;
+	free(raw);
+	ext_finish(ctx);
+	errno = save_errno;
+	return ret;
+
+} /* eeprom_ext_read */
+
+/*
+ * ext_write_pages
+ *
+ * Writes new contents for a range of the EEPROM, a page at
+ * a time, skipping the pages whose contents are unchanged.
+ */
+static int
+ext_write_pages (eeprom_context_t ctx, const uint8_t *newdata, const uint8_t *olddata,
+		 size_t offset, size_t len)
+{
+	size_t pos, seglen, done;
+	ssize_t n;
+
+	for (pos = 0; pos < len; pos += seglen) {
+		seglen = EXT_PAGE_SIZE - ((offset + pos) % EXT_PAGE_SIZE);
+		if (seglen > len - pos)
+			seglen = len - pos;
+		if (memcmp(newdata + pos, olddata + pos, seglen) == 0)
+			continue;
+		for (done = 0; done < seglen; done += n) {
+			n = trace_pwrite(ctx->fd, newdata + pos + done, seglen - done, offset + pos + done);
+			if (n < 0)
+				return -1;
+		}
+		ctx->bytes_completed += seglen;
+	}
+	return 0;
+
+} /* ext_write_pages */
+
+/*
+ * ext_update
+ *
+ * Replaces the record of a type (removing it, if data is
+ * NULL), shifting the records after it as needed.  Only
+ * the part of the area from that record on is rewritten,
+ * and only the pages of it that change.
+ */
+static int
+ext_update (eeprom_context_t ctx, uint8_t type, const void *data, size_t len)
+{
+	struct ext_record *rec;
+	uint8_t *newarea = NULL, *oldarea = NULL;
+	size_t start, tailstart, taillen, newlen, pos;
+	int ret = -1, save_errno;
+
+	if (type == EXT_TYPE_END || type == EXT_TYPE_EMPTY || len > UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+	// always re-index under the write lock, in case another writer got there first
+	if (ext_prepare(ctx, 1, 1) < 0)
+		return -1;
+	rec = ext_find(ctx, type);
+	if (rec == NULL && data == NULL) {
+		errno = ENOENT;
+		goto depart;
+	}
+	if (!ctx->ext_signed) {
+		start = EXT_AREA_OFFSET;
+		tailstart = taillen = 0;
+	} else {
+		start = (rec == NULL ? ctx->ext_end : rec->offset);
+		tailstart = (rec == NULL ? ctx->ext_end : rec->offset + EXT_RECORD_OVERHEAD + rec->len);
+		taillen = ctx->ext_end - tailstart;
+	}
+	newlen = (ctx->ext_signed ? 0 : EXT_AREA_SIG_LENGTH) + taillen + 1;
+	if (data != NULL)
+		newlen += EXT_RECORD_OVERHEAD + len;
+	// the end marker can be left off if the records exactly fill the EEPROM
+	if (start + newlen == ctx->devsize + 1)
+		newlen -= 1;
+	if (start + newlen > ctx->devsize) {
+		errno = ENOSPC;
+		goto depart;
+	}
+
+	newarea = malloc(newlen);
+	oldarea = malloc(newlen);
+	if (newarea == NULL || oldarea == NULL)
+		goto depart;
+	if (ext_read(ctx, oldarea, start, newlen) < 0)
+		goto depart;
+	pos = 0;
+	if (!ctx->ext_signed) {
+		memcpy(newarea, EXT_AREA_SIG, EXT_AREA_SIG_LENGTH);
+		pos += EXT_AREA_SIG_LENGTH;
+	}
+	if (data != NULL) {
+		newarea[pos] = type;
+		newarea[pos+1] = len & 0xff;
+		newarea[pos+2] = (len >> 8) & 0xff;
+		memcpy(newarea + pos + EXT_RECORD_HEADER, data, len);
+		newarea[pos + EXT_RECORD_HEADER + len] = calc_crc8(newarea + pos, EXT_RECORD_HEADER + len);
+		pos += EXT_RECORD_OVERHEAD + len;
+	}
+	if (taillen > 0) {
+		// the records after this one: where they were is either in oldarea or past it
+		if (tailstart >= start && tailstart + taillen <= start + newlen)
+			memmove(newarea + pos, oldarea + (tailstart - start), taillen);
+		else if (ext_read(ctx, newarea + pos, tailstart, taillen) < 0)
+			goto depart;
+		pos += taillen;
+	}
+	if (pos < newlen)
+		newarea[pos] = EXT_TYPE_END;
+	if (ext_write_pages(ctx, newarea, oldarea, start, newlen) < 0)
+		goto depart;
+	ret = 0;
+
+  depart:
+	save_errno = errno;
+	ctx->ext_indexed = 0;
+	free(newarea);
+	free(oldarea);
+	ext_finish(ctx);
+	errno = save_errno;
+	return ret;
+
+} /* ext_update */
+
+/*
+ * eeprom_ext_write
+ *
+ * Adds a record to the extended area, or replaces the
+ * existing record of the same type.
+ *
+ * Returns 0 on success, -1 on error (ENOSPC if the
+ * record does not fit).
+ */
+int
+eeprom_ext_write (eeprom_context_t ctx, uint8_t type, const void *data, size_t len)
+{
+	if (data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return ext_update(ctx, type, data, len);
+
+} /* eeprom_ext_write */
+
+/*
+ * eeprom_ext_delete
+ *
+ * Removes a record from the extended area.
+ */
+int
+eeprom_ext_delete (eeprom_context_t ctx, uint8_t type)
+{
+	return ext_update(ctx, type, NULL, 0);
+
+} /* eeprom_ext_delete */
@@ -0,0 +1,826 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "eeprom-internal.h"
+#include "eeprom-journal.h"
+
+/*
+ * Provisioning journal.
+ *
+ * The journal file is a header followed by fixed-size
+ * entries, grown JOURNAL_GROW entries at a time; only the
+ * first 'count' entries (per the header) are valid, and
+ * entries are never changed once written.
+ *
+ * The index file is a header, a table of chain heads
+ * (nbuckets, a power of two), and a link array with
+ * JOURNAL_KEYS links per entry, one for each key extracted
+ * from the image written: the system serial number (V2
+ * layouts only), the asset ID, and each MAC address that is
+ * set.  Each key hashes to a bucket, and a new entry's links
+ * are pushed on the front of their buckets' chains, so the
+ * chains run newest first.  The hash is kept in the link, so
+ * an entry's keys are re-extracted (from the mapped journal)
+ * only on a hash match.  When the entries outnumber half the
+ * buckets, the index is rebuilt with twice as many, so the
+ * chains stay short.  The index can always be rebuilt from
+ * the journal, and is, if it does not match.
+ *
+ * Both files are mapped shared, and all access is under a
+ * flock() on the journal: exclusive for appending (or for
+ * bringing the index up to date), shared for lookups.  Files
+ * changed by another process are remapped after locking.
+ * Appends are not fsync()ed; the kernel writes them back.
+ * A journal opened for lookups only is opened read-only, and
+ * if its index file is missing or out of date, it builds an
+ * index of its own in memory instead.
+ */
+#define JOURNAL_MAGIC		"TEGEEJNL"
+#define JOURNAL_INDEX_MAGIC	"TEGEEJIX"
+#define JOURNAL_VERSION		1
+#define JOURNAL_ENV		"TEGRA_EEPROM_JOURNAL"
+#define JOURNAL_GROW		256
+#define JOURNAL_KEYS		9	// serial, asset ID, and the 7 MAC fields
+#define JOURNAL_MIN_BUCKETS	4096
+
+struct journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t id;		// ties the index to this journal
+	uint64_t count;
+	uint8_t reserved[32];
+};
+
+struct journal_record {
+	uint64_t time_ns;
+	uint32_t flags;
+	uint8_t crc;
+	uint8_t reserved[3];
+	char device[EEPROM_JOURNAL_DEVICE_MAX];
+	char station[EEPROM_JOURNAL_STATION_MAX];
+	uint8_t before[EEPROM_IMAGE_SIZE];
+	uint8_t after[EEPROM_IMAGE_SIZE];
+};
+#define RECORD_HAVE_BEFORE	(1U << 0)
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbuckets;
+	uint64_t id;
+	uint64_t count;		// entries indexed
+	uint64_t capacity;	// entries the link array has room for
+	uint8_t reserved[24];
+};
+
+struct index_link {
+	uint64_t next;		// link number + 1, or 0 at the end of the chain
+	uint32_t hash;
+	uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct journal_header) == 64, "journal header size");
+_Static_assert(sizeof(struct index_header) == 64, "journal index header size");
+_Static_assert(sizeof(struct journal_record) % 8 == 0, "journal record alignment");
+
+enum {
+	key_serial,
+	key_asset_id,
+	key_mac,
+};
+
+struct journal_key {
+	uint8_t type;
+	uint8_t len;
+	uint8_t value[22];
+};
+
+struct eeprom_journal_s {
+	pthread_mutex_t lock;
+	int readonly;
+	int fd;
+	int xfd;		// -1 if a read-only journal has no index file
+	uint8_t *map;
+	size_t maplen;
+	uint8_t *xmap;
+	size_t xmaplen;
+	int xprivate;		// index is in memory, not mapped from the file
+};
+
+#define JHDR(j)		((struct journal_header *) (j)->map)
+#define XHDR(j)		((struct index_header *) (j)->xmap)
+#define RECORD(j, i)	((struct journal_record *) ((j)->map + sizeof(struct journal_header)) + (i))
+#define HEADS(j)	((uint64_t *) ((j)->xmap + sizeof(struct index_header)))
+#define LINKS(j)	((struct index_link *) (HEADS(j) + XHDR(j)->nbuckets))
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static eeprom_journal_t log_journal;
+static int log_configured;
+static char log_station[EEPROM_JOURNAL_STATION_MAX];
+
+/*
+ * string_key
+ *
+ * Sets up a key from a string field, which ends at the
+ * first NUL or 0xFF.  Returns 0 if the string is empty.
+ */
+static int
+string_key (struct journal_key *key, uint8_t type, const void *value, size_t len)
+{
+	const uint8_t *cp = value;
+	size_t n;
+
+	for (n = 0; n < len && n < sizeof(key->value) && cp[n] != 0 && cp[n] != 0xff; n++);
+	if (n == 0)
+		return 0;
+	key->type = type;
+	key->len = n;
+	memcpy(key->value, cp, n);
+	return 1;
+
+} /* string_key */
+
+/*
+ * entry_keys
+ *
+ * Extracts the keys from an image, in a fixed order,
+ * returning how many there are.
+ */
+static unsigned int
+entry_keys (const uint8_t *image, struct journal_key *keys)
+{
+	const struct module_eeprom_v1_raw *raw = (const struct module_eeprom_v1_raw *) image;
+	const eeprom_layout_field_t *f;
+	const uint8_t *mac;
+	unsigned int n = 0, i, k, ones, zeros;
+
+	if (raw->major_version >= LAYOUT_VERSION_V2)
+		n += string_key(&keys[n], key_serial, raw->system_serialnumber_v2, sizeof(raw->system_serialnumber_v2));
+	n += string_key(&keys[n], key_asset_id, raw->asset_id, sizeof(raw->asset_id));
+	for (i = 0; i < eeprom_layout_field_count && n < JOURNAL_KEYS; i++) {
+		f = &eeprom_layout_fields[i];
+		if (f->kind != layout_field_macaddr)
+			continue;
+		mac = image + f->offset;
+		for (k = ones = zeros = 0; k < 6; k++) {
+			ones += (mac[k] == 0xff);
+			zeros += (mac[k] == 0);
+		}
+		if (ones == 6 || zeros == 6)
+			continue;
+		// stored little-endian; keyed in display order
+		keys[n].type = key_mac;
+		keys[n].len = 6;
+		for (k = 0; k < 6; k++)
+			keys[n].value[k] = mac[5-k];
+		n += 1;
+	}
+	return n;
+
+} /* entry_keys */
+
+/*
+ * key_hash
+ *
+ * FNV-1a over the key type and value.
+ */
+static uint32_t
+key_hash (const struct journal_key *key)
+{
+	uint32_t h = 2166136261U;
+	unsigned int i;
+
+	h = (h ^ key->type) * 16777619U;
+	for (i = 0; i < key->len; i++)
+		h = (h ^ key->value[i]) * 16777619U;
+	return h;
+
+} /* key_hash */
+
+/*
+ * remap
+ *
+ * Maps a file (read-only, unless 'writable' is set),
+ * or remaps it if its size has changed.
+ */
+static int
+remap (int fd, int writable, uint8_t **mapp, size_t *lenp)
+{
+	struct stat st;
+	void *newmap;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (st.st_size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (*mapp != NULL && (size_t) st.st_size == *lenp)
+		return 0;
+	newmap = mmap(NULL, st.st_size, (writable ? PROT_READ|PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0);
+	if (newmap == MAP_FAILED)
+		return -1;
+	if (*mapp != NULL)
+		munmap(*mapp, *lenp);
+	*mapp = newmap;
+	*lenp = st.st_size;
+	return 0;
+
+} /* remap */
+
+/*
+ * index_unmap
+ *
+ * Drops the index mapping, for when the index file has
+ * been cut to nothing: the old mapping is no longer backed.
+ */
+static void
+index_unmap (eeprom_journal_t j)
+{
+	if (j->xmap != NULL)
+		munmap(j->xmap, j->xmaplen);
+	j->xmap = NULL;
+	j->xmaplen = 0;
+	j->xprivate = 0;
+
+} /* index_unmap */
+
+/*
+ * index_size
+ */
+static size_t
+index_size (uint32_t nbuckets, uint64_t capacity)
+{
+	return sizeof(struct index_header) + nbuckets * sizeof(uint64_t) +
+		capacity * JOURNAL_KEYS * sizeof(struct index_link);
+
+} /* index_size */
+
+/*
+ * index_resize
+ *
+ * Resizes the index, emptying it if 'clear' is set.  For
+ * a read-only journal, the index is moved into memory (a
+ * copy of the mapped file, unless cleared) instead.
+ */
+static int
+index_resize (eeprom_journal_t j, size_t size, int clear)
+{
+	uint8_t *newmap;
+
+	if (!j->readonly) {
+		if ((clear && ftruncate(j->xfd, 0) < 0) || ftruncate(j->xfd, size) < 0)
+			return -1;
+		return remap(j->xfd, 1, &j->xmap, &j->xmaplen);
+	}
+	newmap = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (newmap == MAP_FAILED)
+		return -1;
+	if (!clear && j->xmap != NULL)
+		memcpy(newmap, j->xmap, (j->xmaplen < size ? j->xmaplen : size));
+	index_unmap(j);
+	j->xmap = newmap;
+	j->xmaplen = size;
+	j->xprivate = 1;
+	return 0;
+
+} /* index_resize */
+
+/*
+ * index_reset
+ *
+ * Recreates the index, empty, with the given number
+ * of buckets and room for 'count' entries.
+ */
+static int
+index_reset (eeprom_journal_t j, uint32_t nbuckets, uint64_t count)
+{
+	struct index_header *xh;
+	uint64_t capacity = (count + JOURNAL_GROW) / JOURNAL_GROW * JOURNAL_GROW;
+
+	if (index_resize(j, index_size(nbuckets, capacity), 1) < 0)
+		return -1;
+	xh = XHDR(j);
+	memcpy(xh->magic, JOURNAL_INDEX_MAGIC, sizeof(xh->magic));
+	xh->version = JOURNAL_VERSION;
+	xh->nbuckets = nbuckets;
+	xh->id = JHDR(j)->id;
+	xh->count = 0;
+	xh->capacity = capacity;
+	return 0;
+
+} /* index_reset */
+
+/*
+ * index_valid
+ */
+static int
+index_valid (eeprom_journal_t j)
+{
+	const struct index_header *xh = XHDR(j);
+
+	return (j->xmaplen >= sizeof(*xh) &&
+		memcmp(xh->magic, JOURNAL_INDEX_MAGIC, sizeof(xh->magic)) == 0 &&
+		xh->version == JOURNAL_VERSION && xh->id == JHDR(j)->id &&
+		xh->nbuckets >= JOURNAL_MIN_BUCKETS && (xh->nbuckets & (xh->nbuckets - 1)) == 0 &&
+		xh->count <= JHDR(j)->count && xh->count <= xh->capacity &&
+		j->xmaplen == index_size(xh->nbuckets, xh->capacity));
+
+} /* index_valid */
+
+/*
+ * index_insert
+ */
+static void
+index_insert (eeprom_journal_t j, uint64_t idx)
+{
+	struct journal_key keys[JOURNAL_KEYS];
+	struct index_link *links = LINKS(j);
+	uint64_t *heads = HEADS(j), link;
+	unsigned int n, k;
+	uint32_t h;
+
+	n = entry_keys(RECORD(j, idx)->after, keys);
+	for (k = 0; k < n; k++) {
+		link = idx * JOURNAL_KEYS + k;
+		h = key_hash(&keys[k]);
+		links[link].hash = h;
+		links[link].next = heads[h & (XHDR(j)->nbuckets - 1)];
+		heads[h & (XHDR(j)->nbuckets - 1)] = link + 1;
+	}
+
+} /* index_insert */
+
+/*
+ * index_update
+ *
+ * Brings the index up to date with the journal,
+ * rebuilding it if it is invalid or needs more buckets.
+ * Called with the journal locked exclusively (or, for a
+ * read-only journal's index in memory, shared).
+ */
+static int
+index_update (eeprom_journal_t j)
+{
+	uint64_t count = JHDR(j)->count, capacity;
+	uint32_t nbuckets;
+	struct index_header *xh;
+
+	if (j->xmap == NULL || !index_valid(j)) {
+		for (nbuckets = JOURNAL_MIN_BUCKETS; count > nbuckets / 2; nbuckets *= 2);
+		if (index_reset(j, nbuckets, count) < 0)
+			return -1;
+	} else if (count > XHDR(j)->nbuckets / 2) {
+		for (nbuckets = XHDR(j)->nbuckets; count > nbuckets / 2; nbuckets *= 2);
+		if (index_reset(j, nbuckets, count) < 0)
+			return -1;
+	} else if (count > XHDR(j)->capacity) {
+		capacity = XHDR(j)->capacity * 2;
+		if (capacity < count)
+			capacity = count;
+		if (index_resize(j, index_size(XHDR(j)->nbuckets, capacity), 0) < 0)
+			return -1;
+		XHDR(j)->capacity = capacity;
+	}
+	xh = XHDR(j);
+	while (xh->count < count) {
+		index_insert(j, xh->count);
+		xh->count += 1;
+	}
+	return 0;
+
+} /* index_update */
+
+/*
+ * journal_lock
+ *
+ * Takes the journal lock and remaps the files if another
+ * process has changed them.  With exclusive access, the
+ * index is brought up to date as well.  A read-only journal
+ * only ever locks shared, and brings its own index (in
+ * memory) up to date if the index file will not do.
+ */
+static int
+journal_lock (eeprom_journal_t j, int exclusive)
+{
+	int save_errno;
+
+	pthread_mutex_lock(&j->lock);
+	if (flock(j->fd, (exclusive ? LOCK_EX : LOCK_SH)) < 0)
+		goto failed;
+	if (remap(j->fd, !j->readonly, &j->map, &j->maplen) < 0)
+		goto unlock;
+	if (j->maplen < sizeof(struct journal_header) + JHDR(j)->count * sizeof(struct journal_record)) {
+		errno = EINVAL;
+		goto unlock;
+	}
+	if (j->xfd >= 0 && !j->xprivate && remap(j->xfd, !j->readonly, &j->xmap, &j->xmaplen) < 0) {
+		if (errno != EINVAL)
+			goto unlock;
+		index_unmap(j);
+	}
+	if (j->readonly) {
+		if (j->xmap != NULL && index_valid(j) && XHDR(j)->count == JHDR(j)->count)
+			return 0;
+		// missing or behind; catch up on a copy in memory
+		if (j->xmap != NULL && !j->xprivate && index_valid(j) && index_resize(j, j->xmaplen, 0) < 0)
+			goto unlock;
+		if (index_update(j) < 0)
+			goto unlock;
+	} else if (exclusive) {
+		if (index_update(j) < 0)
+			goto unlock;
+	} else if (j->xmap == NULL || !index_valid(j) || XHDR(j)->count != JHDR(j)->count) {
+		// index missing or behind; fix it up
+		flock(j->fd, LOCK_UN);
+		pthread_mutex_unlock(&j->lock);
+		return journal_lock(j, 1);
+	}
+	return 0;
+
+  unlock:
+	save_errno = errno;
+	flock(j->fd, LOCK_UN);
+	errno = save_errno;
+  failed:
+	save_errno = errno;
+	pthread_mutex_unlock(&j->lock);
+	errno = save_errno;
+	return -1;
+
+} /* journal_lock */
+
+/*
+ * journal_unlock
+ */
+static void
+journal_unlock (eeprom_journal_t j)
+{
+	flock(j->fd, LOCK_UN);
+	pthread_mutex_unlock(&j->lock);
+
+} /* journal_unlock */
+
+/*
+ * journal_attach
+ *
+ * Opens a journal and its index, for appending (creating
+ * them, if necessary) if 'create' is set, otherwise for
+ * lookups only, read-only.
+ */
+static eeprom_journal_t
+journal_attach (const char *pathname, int create)
+{
+	struct journal_header hdr;
+	eeprom_journal_t j;
+	struct timespec now;
+	struct stat st;
+	char xpath[PATH_MAX];
+	int save_errno;
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL)
+		return NULL;
+	pthread_mutex_init(&j->lock, NULL);
+	j->readonly = !create;
+	j->xfd = -1;
+	j->fd = open(pathname, (create ? O_RDWR|O_CREAT : O_RDONLY)|O_CLOEXEC, 0644);
+	if (j->fd < 0)
+		goto failed;
+	if (snprintf(xpath, sizeof(xpath), "%s.idx", pathname) >= (int) sizeof(xpath)) {
+		errno = ENAMETOOLONG;
+		goto failed;
+	}
+	// without an index file, a read-only journal builds its index in memory
+	j->xfd = open(xpath, (create ? O_RDWR|O_CREAT : O_RDONLY)|O_CLOEXEC, 0644);
+	if (j->xfd < 0 && create)
+		goto failed;
+	if (flock(j->fd, (create ? LOCK_EX : LOCK_SH)) < 0 || fstat(j->fd, &st) < 0)
+		goto failed;
+	if (st.st_size == 0 && create) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+		hdr.version = JOURNAL_VERSION;
+		hdr.entry_size = sizeof(struct journal_record);
+		clock_gettime(CLOCK_REALTIME, &now);
+		hdr.id = ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec) ^ ((uint64_t) getpid() << 32);
+		if (ftruncate(j->fd, sizeof(hdr) + JOURNAL_GROW * sizeof(struct journal_record)) < 0 ||
+		    pwrite(j->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto failed;
+	}
+	flock(j->fd, LOCK_UN);
+	if (remap(j->fd, create, &j->map, &j->maplen) < 0)
+		goto failed;
+	if (j->maplen < sizeof(hdr) || memcmp(JHDR(j)->magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    JHDR(j)->version != JOURNAL_VERSION || JHDR(j)->entry_size != sizeof(struct journal_record)) {
+		errno = EINVAL;
+		goto failed;
+	}
+	if (journal_lock(j, create) < 0)
+		goto failed;
+	journal_unlock(j);
+	return j;
+
+  failed:
+	save_errno = errno;
+	eeprom_journal_close(j);
+	errno = save_errno;
+	return NULL;
+
+} /* journal_attach */
+
+/*
+ * journal_append
+ */
+static int
+journal_append (eeprom_journal_t j, const struct journal_record *rec)
+{
+	uint64_t count;
+	size_t needed;
+	int ret = -1;
+
+	if (journal_lock(j, 1) < 0)
+		return -1;
+	count = JHDR(j)->count;
+	needed = sizeof(struct journal_header) + (count + 1) * sizeof(*rec);
+	if (needed > j->maplen &&
+	    (ftruncate(j->fd, needed + (JOURNAL_GROW - 1) * sizeof(*rec)) < 0 ||
+	     remap(j->fd, 1, &j->map, &j->maplen) < 0))
+		goto depart;
+	memcpy(RECORD(j, count), rec, sizeof(*rec));
+	JHDR(j)->count = count + 1;
+	ret = index_update(j);
+  depart:
+	journal_unlock(j);
+	return ret;
+
+} /* journal_append */
+
+/*
+ * journal_log_write
+ *
+ * Logs a successful write of a full image to the process's
+ * journal, if there is one.  Failures are not reported;
+ * the write itself has already succeeded.
+ */
+void
+journal_log_write (eeprom_context_t ctx, const struct module_eeprom_v1_raw *before, int have_before,
+		   const struct module_eeprom_v1_raw *after)
+{
+	struct journal_record rec;
+	struct timespec now;
+	const char *path;
+
+	pthread_mutex_lock(&log_lock);
+	if (!log_configured) {
+		path = getenv(JOURNAL_ENV);
+		if (path != NULL && *path != '\0')
+			log_journal = journal_attach(path, 1);
+		log_configured = 1;
+	}
+	if (log_journal == NULL) {
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+	if (log_station[0] == '\0' && gethostname(log_station, sizeof(log_station) - 1) < 0)
+		strcpy(log_station, "unknown");
+	memset(&rec, 0, sizeof(rec));
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec.time_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if (have_before) {
+		rec.flags |= RECORD_HAVE_BEFORE;
+		memcpy(rec.before, before, sizeof(rec.before));
+	}
+	memcpy(rec.after, after, sizeof(rec.after));
+	rec.crc = after->crc8;
+	snprintf(rec.device, sizeof(rec.device), "%s", ctx->device);
+	memcpy(rec.station, log_station, sizeof(rec.station) - 1);
+	journal_append(log_journal, &rec);
+	pthread_mutex_unlock(&log_lock);
+
+} /* journal_log_write */
+
+/*
+ * eeprom_journal_log
+ *
+ * Starts logging this process's writes to a journal,
+ * creating it if necessary, or stops logging if pathname
+ * is NULL.  Overrides $TEGRA_EEPROM_JOURNAL.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+eeprom_journal_log (const char *pathname)
+{
+	eeprom_journal_t j = NULL, old;
+
+	if (pathname != NULL) {
+		j = journal_attach(pathname, 1);
+		if (j == NULL)
+			return -1;
+	}
+	pthread_mutex_lock(&log_lock);
+	old = log_journal;
+	log_journal = j;
+	log_configured = 1;
+	pthread_mutex_unlock(&log_lock);
+	if (old != NULL)
+		eeprom_journal_close(old);
+	return 0;
+
+} /* eeprom_journal_log */
+
+/*
+ * eeprom_journal_open
+ *
+ * Opens an existing journal for lookups.  Neither file
+ * is written: if the index file is missing or out of
+ * date, an index is built in memory instead.
+ */
+eeprom_journal_t
+eeprom_journal_open (const char *pathname)
+{
+	return journal_attach(pathname, 0);
+
+} /* eeprom_journal_open */
+
+/*
+ * eeprom_journal_count
+ */
+uint64_t
+eeprom_journal_count (eeprom_journal_t j)
+{
+	uint64_t count;
+
+	if (journal_lock(j, 0) < 0)
+		return 0;
+	count = JHDR(j)->count;
+	journal_unlock(j);
+	return count;
+
+} /* eeprom_journal_count */
+
+/*
+ * eeprom_journal_entry
+ *
+ * Copies out a journal entry.
+ *
+ * Returns 0 on success, -1 on error (ERANGE if
+ * there is no such entry).
+ */
+int
+eeprom_journal_entry (eeprom_journal_t j, uint64_t idx, eeprom_journal_entry_t *entry)
+{
+	const struct journal_record *rec;
+
+	if (journal_lock(j, 0) < 0)
+		return -1;
+	if (idx >= JHDR(j)->count) {
+		journal_unlock(j);
+		errno = ERANGE;
+		return -1;
+	}
+	rec = RECORD(j, idx);
+	memset(entry, 0, sizeof(*entry));
+	entry->time_ns = rec->time_ns;
+	memcpy(entry->device, rec->device, sizeof(entry->device) - 1);
+	memcpy(entry->station, rec->station, sizeof(entry->station) - 1);
+	entry->have_before = (rec->flags & RECORD_HAVE_BEFORE) != 0;
+	entry->crc = rec->crc;
+	memcpy(entry->before, rec->before, sizeof(entry->before));
+	memcpy(entry->after, rec->after, sizeof(entry->after));
+	journal_unlock(j);
+	return 0;
+
+} /* eeprom_journal_entry */
+
+/*
+ * journal_find
+ *
+ * Walks the chain for a key, collecting the entries
+ * whose images hold it, newest first.
+ */
+static int64_t
+journal_find (eeprom_journal_t j, const struct journal_key *key, uint64_t *ids, size_t maxids)
+{
+	struct journal_key keys[JOURNAL_KEYS];
+	const struct index_link *links;
+	uint64_t link, nlinks, idx, last = 0;
+	uint32_t h = key_hash(key);
+	unsigned int n, slot;
+	int64_t found = 0;
+
+	if (journal_lock(j, 0) < 0)
+		return -1;
+	links = LINKS(j);
+	nlinks = XHDR(j)->count * JOURNAL_KEYS;
+	for (link = HEADS(j)[h & (XHDR(j)->nbuckets - 1)]; link != 0 && link <= nlinks; link = links[link-1].next) {
+		if (links[link-1].hash != h)
+			continue;
+		idx = (link - 1) / JOURNAL_KEYS;
+		slot = (link - 1) % JOURNAL_KEYS;
+		n = entry_keys(RECORD(j, idx)->after, keys);
+		if (slot >= n || keys[slot].type != key->type || keys[slot].len != key->len ||
+		    memcmp(keys[slot].value, key->value, key->len) != 0)
+			continue;
+		// the same MAC in two fields of one entry
+		if (found > 0 && idx == last)
+			continue;
+		if ((size_t) found < maxids)
+			ids[found] = idx;
+		found += 1;
+		last = idx;
+	}
+	journal_unlock(j);
+	return found;
+
+} /* journal_find */
+
+/*
+ * eeprom_journal_lookup
+ *
+ * Finds the entries that wrote images with the given
+ * value for a field ("system-serialnumber" or "asset-id"),
+ * newest first, storing up to maxids entry numbers.
+ *
+ * Returns the number of entries found (which may be more
+ * than maxids), or -1 on error (ENOENT if the field is
+ * not indexed).
+ */
+int64_t
+eeprom_journal_lookup (eeprom_journal_t j, const char *name, const char *value, uint64_t *ids, size_t maxids)
+{
+	struct journal_key key;
+	uint8_t type;
+
+	if (strcmp(name, "system-serialnumber") == 0)
+		type = key_serial;
+	else if (strcmp(name, "asset-id") == 0)
+		type = key_asset_id;
+	else {
+		errno = ENOENT;
+		return -1;
+	}
+	memset(&key, 0, sizeof(key));
+	if (!string_key(&key, type, value, strlen(value)))
+		return 0;
+	return journal_find(j, &key, ids, maxids);
+
+} /* eeprom_journal_lookup */
+
+/*
+ * eeprom_journal_mac
+ *
+ * Finds the entries that wrote images with a MAC address
+ * (in any of the MAC fields), newest first.  The address
+ * is in display order, first octet most significant.
+ */
+int64_t
+eeprom_journal_mac (eeprom_journal_t j, uint64_t mac, uint64_t *ids, size_t maxids)
+{
+	struct journal_key key;
+	unsigned int i;
+
+	memset(&key, 0, sizeof(key));
+	key.type = key_mac;
+	key.len = 6;
+	for (i = 0; i < 6; i++)
+		key.value[i] = (uint8_t) (mac >> (8 * (5 - i)));
+	return journal_find(j, &key, ids, maxids);
+
+} /* eeprom_journal_mac */
+
+/*
+ * eeprom_journal_close
+ */
+void
+eeprom_journal_close (eeprom_journal_t j)
+{
+	if (j == NULL)
+		return;
+	if (j->map != NULL)
+		munmap(j->map, j->maplen);
+	if (j->xmap != NULL)
+		munmap(j->xmap, j->xmaplen);
+	if (j->fd >= 0)
+		close(j->fd);
+	if (j->xfd >= 0)
+		close(j->xfd);
+	pthread_mutex_destroy(&j->lock);
+	free(j);
+
+} /* eeprom_journal_close */
@@ -0,0 +1,62 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stddef.h>
+#include <strings.h>
+#include "eeprom-layout.h"
+
+_Static_assert(sizeof(struct module_eeprom_v1_raw) == EEPROM_IMAGE_SIZE,
+	       "raw EEPROM layout size mismatch");
+
+#define FIELD(name_, member_, kind_) \
+	{ name_, offsetof(struct module_eeprom_v1_raw, member_), \
+	  sizeof(((struct module_eeprom_v1_raw *) 0)->member_), kind_ }
+
+const eeprom_layout_field_t eeprom_layout_fields[] = {
+	FIELD("major-version", major_version, layout_field_uint),
+	FIELD("minor-version", minor_version, layout_field_uint),
+	FIELD("length", length, layout_field_uint),
+	FIELD("reserved-1", reserved_1__, layout_field_bytes),
+	FIELD("factory-default-ether-mac-count", ether_mac_count_v2, layout_field_uint),
+	FIELD("partnumber", partnumber, layout_field_string),
+	FIELD("padding", padding, layout_field_bytes),
+	FIELD("factory-default-wifi-mac", factory_default_wifi_mac, layout_field_macaddr),
+	FIELD("factory-default-bt-mac", factory_default_bt_mac, layout_field_macaddr),
+	FIELD("factory-default-wifi-alt-mac", factory_default_wifi_alt_mac, layout_field_macaddr),
+	FIELD("factory-default-ether-mac", factory_default_ether_mac, layout_field_macaddr),
+	FIELD("asset-id", asset_id, layout_field_string),
+	FIELD("reserved-2", reserved_2__, layout_field_bytes),
+	FIELD("cfgblk-sig", cfgblk_sig, layout_field_string),
+	FIELD("cfgblk-len", cfgblk_len, layout_field_uint),
+	FIELD("macfmt-tag", macfmt_tag, layout_field_string),
+	FIELD("macfmt-version", macfmt_version, layout_field_uint),
+	FIELD("vendor-wifi-mac", vendor_wifi_mac, layout_field_macaddr),
+	FIELD("vendor-bt-mac", vendor_bt_mac, layout_field_macaddr),
+	FIELD("vendor-ether-mac", vendor_ether_mac, layout_field_macaddr),
+	FIELD("vendor-ether-mac-count", vendor_ether_mac_count_v2, layout_field_uint),
+	FIELD("reserved-3", reserved_3__, layout_field_bytes),
+	FIELD("system-partnumber", system_partnumber_v2, layout_field_string),
+	FIELD("system-serialnumber", system_serialnumber_v2, layout_field_string),
+	FIELD("reserved-4", reserved_4__, layout_field_bytes),
+	FIELD("crc8", crc8, layout_field_uint),
+};
+const unsigned int eeprom_layout_field_count = sizeof(eeprom_layout_fields)/sizeof(eeprom_layout_fields[0]);
+
+/*
+ * eeprom_layout_field_index
+ *
+ * Returns the index in eeprom_layout_fields[] of the
+ * named field, or -1 if there is no such field.
+ */
+int
+eeprom_layout_field_index (const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < eeprom_layout_field_count; i++)
+		if (strcasecmp(name, eeprom_layout_fields[i].name) == 0)
+			return (int) i;
+	return -1;
+
+} /* eeprom_layout_field_index */
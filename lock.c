@@ -0,0 +1,220 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "eeprom-internal.h"
+
+/*
+ * Advisory locking, so that separate processes (or separate
+ * contexts in one process) do not interleave a read with a
+ * write on the same device.  There are lock files for each
+ * bus and each device: transfers on a device take a shared
+ * lock on its bus, then a shared (read) or exclusive (write)
+ * lock on the device, so readers never wait for each other.
+ * Nothing in the library takes a bus lock exclusively; the
+ * shared one is there so that a program that needs the whole
+ * bus to itself can hold off EEPROM transfers by taking it
+ * exclusively.
+ *
+ * The locks are advisory: if the lock files cannot be
+ * opened (no lock directory, or no permission), transfers
+ * proceed without them.
+ */
+#define LOCK_DIR_ENV		"TEGRA_EEPROM_LOCK_DIR"
+#define LOCK_DIR_DEFAULT	"/run/lock"
+#define LOCK_PREFIX		"tegra-eeprom"
+
+/*
+ * lock_dir
+ */
+static const char *
+lock_dir (void)
+{
+	const char *dir = getenv(LOCK_DIR_ENV);
+
+	return (dir == NULL || *dir == '\0' ? LOCK_DIR_DEFAULT : dir);
+
+} /* lock_dir */
+
+/*
+ * lock_open_file
+ *
+ * Opens a lock file, creating it if necessary.  A new
+ * file is given mode 0666 regardless of the umask,
+ * so that other users' processes can open it too.
+ */
+static int
+lock_open_file (const char *name)
+{
+	char pathname[PATH_MAX];
+	int fd, len;
+
+	len = snprintf(pathname, sizeof(pathname), "%s/%s-%s.lock", lock_dir(), LOCK_PREFIX, name);
+	if (len < 0 || (size_t) len >= sizeof(pathname))
+		return -1;
+	// flock() works on read-only descriptors, so other users' lock files are usable
+	fd = open(pathname, O_RDONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if (fd >= 0) {
+		fchmod(fd, 0666);
+		return fd;
+	}
+	if (errno != EEXIST)
+		return -1;
+	return open(pathname, O_RDONLY|O_CLOEXEC);
+
+} /* lock_open_file */
+
+/*
+ * lock_init_i2c
+ *
+ * Sets up the locks for a device at an I2C address,
+ * names the device <bus>-<addr> for the journal, and
+ * notes the bus for pacing.
+ */
+void
+lock_init_i2c (eeprom_context_t ctx, unsigned int bus, unsigned int addr)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "i2c-%u", bus);
+	ctx->lockfd[lock_bus] = lock_open_file(name);
+	snprintf(name, sizeof(name), "%u-%04x", bus, addr);
+	ctx->lockfd[lock_device] = lock_open_file(name);
+	snprintf(ctx->device, sizeof(ctx->device), "%s", name);
+	ctx->bus = (int) bus;
+
+} /* lock_init_i2c */
+
+/*
+ * path_i2c_device
+ *
+ * Looks for an I2C device directory (<bus>-<addr>, with
+ * a 4-digit address) among the components of a path.
+ *
+ * Returns 1 (setting *bus and *addr) if one is found, 0 if not.
+ */
+static int
+path_i2c_device (const char *path, unsigned int *bus, unsigned int *addr)
+{
+	const char *cp;
+	size_t len;
+	int n;
+
+	for (cp = path; cp != NULL; cp = strchr(cp, '/')) {
+		if (*cp == '/')
+			cp += 1;
+		len = strcspn(cp, "/");
+		if (sscanf(cp, "%u-%x%n", bus, addr, &n) == 2 &&
+		    (size_t) n == len && n >= 6 && cp[n-5] == '-')
+			return 1;
+	}
+	return 0;
+
+} /* path_i2c_device */
+
+/*
+ * lock_init_path
+ *
+ * Sets up the locks for a device opened by path name.
+ * For an EEPROM driver's sysfs file, the bus and address
+ * come from the I2C device directory in the path (as
+ * resolved, or as given if it cannot be), so these are
+ * the same locks as for userland I2C access, and the bus
+ * is the one the context's transfers are paced on; any
+ * other file is locked by its device and inode numbers.
+ * The journal names the device by its I2C address, if it
+ * has one, otherwise by the path name.
+ */
+void
+lock_init_path (eeprom_context_t ctx, const char *pathname)
+{
+	char resolved[PATH_MAX], name[64];
+	struct stat st;
+	unsigned int bus, addr;
+
+	snprintf(ctx->device, sizeof(ctx->device), "%s", pathname);
+	if ((realpath(pathname, resolved) != NULL && path_i2c_device(resolved, &bus, &addr)) ||
+	    path_i2c_device(pathname, &bus, &addr)) {
+		lock_init_i2c(ctx, bus, addr);
+		ctx->bus = (int) bus;
+		return;
+	}
+	if (fstat(ctx->fd, &st) < 0)
+		return;
+	snprintf(name, sizeof(name), "dev-%llx-%llx", (unsigned long long) st.st_dev,
+		 (unsigned long long) st.st_ino);
+	ctx->lockfd[lock_device] = lock_open_file(name);
+
+} /* lock_init_path */
+
+/*
+ * lock_try
+ *
+ * Attempts, without blocking, to take the bus lock
+ * (shared) and the device lock (shared or exclusive).
+ *
+ * Returns 1 if the locks are held, 0 if another holder
+ * is in the way, or -1 on error.
+ */
+int
+lock_try (eeprom_context_t ctx, int exclusive)
+{
+	int i, op;
+
+	for (i = 0; i < lock_count; i++) {
+		if (ctx->lockfd[i] < 0 || ctx->lockheld[i])
+			continue;
+		op = (i == lock_device && exclusive ? LOCK_EX : LOCK_SH);
+		if (flock(ctx->lockfd[i], op | LOCK_NB) < 0) {
+			if (errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			return -1;
+		}
+		ctx->lockheld[i] = 1;
+	}
+	return 1;
+
+} /* lock_try */
+
+/*
+ * lock_release
+ */
+void
+lock_release (eeprom_context_t ctx)
+{
+	int i, save_errno = errno;
+
+	for (i = lock_count - 1; i >= 0; i--) {
+		if (ctx->lockheld[i])
+			flock(ctx->lockfd[i], LOCK_UN);
+		ctx->lockheld[i] = 0;
+	}
+	errno = save_errno;
+
+} /* lock_release */
+
+/*
+ * lock_close
+ */
+void
+lock_close (eeprom_context_t ctx)
+{
+	int i;
+
+	lock_release(ctx);
+	for (i = 0; i < lock_count; i++) {
+		if (ctx->lockfd[i] >= 0)
+			close(ctx->lockfd[i]);
+		ctx->lockfd[i] = -1;
+	}
+
+} /* lock_close */
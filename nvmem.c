@@ -0,0 +1,269 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "eeprom-internal.h"
+
+/*
+ * nvmem subsystem support.  Newer kernels register each
+ * EEPROM driven by at24 as an nvmem device, whose directory
+ * sits under the I2C client's (so its real path contains
+ * <bus>-<address>), with the contents in its 'nvmem' file.
+ * Cells declared in the device tree appear in its 'cells'
+ * directory as name@offset (or name@offset,bit) files, each
+ * holding just that cell's bytes.  The index of devices and
+ * their cells is built once per process, on first use.
+ */
+#define NVMEM_DIR_ENV		"TEGRA_EEPROM_NVMEM_DEVICES"
+#define NVMEM_DIR_DEFAULT	"/sys/bus/nvmem/devices"
+
+struct nvmem_cell {
+	char *path;
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct nvmem_device {
+	unsigned int bus;
+	unsigned int addr;
+	char *path;
+	struct nvmem_cell *cells;
+	unsigned int ncells;
+};
+
+static pthread_once_t nvmem_once = PTHREAD_ONCE_INIT;
+static struct nvmem_device *nvmem_devices;
+static unsigned int nvmem_count;
+
+/*
+ * nvmem_dir
+ */
+static const char *
+nvmem_dir (void)
+{
+	const char *dir = getenv(NVMEM_DIR_ENV);
+
+	return (dir == NULL || *dir == '\0' ? NVMEM_DIR_DEFAULT : dir);
+
+} /* nvmem_dir */
+
+/*
+ * client_address
+ *
+ * Extracts the bus and address from an I2C client
+ * directory name (<bus>-<4-digit address>).
+ */
+static int
+client_address (const char *name, unsigned int *bus, unsigned int *addr)
+{
+	int n;
+
+	if (sscanf(name, "%u-%x%n", bus, addr, &n) != 2 || name[n] != '\0' || n < 6 || name[n-5] != '-')
+		return -1;
+	return 0;
+
+} /* client_address */
+
+/*
+ * read_cells
+ *
+ * Indexes the byte-aligned cells of a device.
+ */
+static void
+read_cells (struct nvmem_device *dev, const char *devpath)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	const char *at;
+	unsigned long offset, bit;
+	unsigned int alloc = 0;
+	char *ep;
+	void *newp;
+	DIR *dir;
+	int n;
+
+	n = snprintf(path, sizeof(path), "%s/cells", devpath);
+	if (n < 0 || (size_t) n >= sizeof(path))
+		return;
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		at = strrchr(de->d_name, '@');
+		if (at == NULL)
+			continue;
+		offset = strtoul(at + 1, &ep, 16);
+		bit = 0;
+		if (ep != at + 1 && *ep == ',')
+			bit = strtoul(ep + 1, &ep, 16);
+		if (ep == at + 1 || *ep != '\0' || bit != 0)
+			continue;
+		n = snprintf(path, sizeof(path), "%s/cells/%s", devpath, de->d_name);
+		if (n < 0 || (size_t) n >= sizeof(path) || stat(path, &st) < 0 || st.st_size <= 0)
+			continue;
+		if (dev->ncells >= alloc) {
+			newp = realloc(dev->cells, (alloc + 16) * sizeof(*dev->cells));
+			if (newp == NULL)
+				break;
+			dev->cells = newp;
+			alloc += 16;
+		}
+		dev->cells[dev->ncells].path = strdup(path);
+		if (dev->cells[dev->ncells].path == NULL)
+			break;
+		dev->cells[dev->ncells].offset = (uint32_t) offset;
+		dev->cells[dev->ncells].size = (uint32_t) st.st_size;
+		dev->ncells += 1;
+	}
+	closedir(dir);
+
+} /* read_cells */
+
+/*
+ * nvmem_build
+ */
+static void
+nvmem_build (void)
+{
+	const char *dirname = nvmem_dir();
+	char path[PATH_MAX], resolved[PATH_MAX];
+	struct nvmem_device *dev;
+	struct dirent *de;
+	unsigned int alloc = 0, bus, addr;
+	char *slash, *parent;
+	void *newp;
+	DIR *dir;
+	int n;
+
+	dir = opendir(dirname);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		n = snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		if (n < 0 || (size_t) n >= sizeof(path) || realpath(path, resolved) == NULL)
+			continue;
+		slash = strrchr(resolved, '/');
+		if (slash == NULL || slash == resolved)
+			continue;
+		*slash = '\0';
+		parent = strrchr(resolved, '/');
+		parent = (parent == NULL ? resolved : parent + 1);
+		n = client_address(parent, &bus, &addr);
+		*slash = '/';
+		if (n < 0)
+			continue;
+		n = snprintf(path, sizeof(path), "%s/nvmem", resolved);
+		if (n < 0 || (size_t) n >= sizeof(path) || access(path, F_OK) != 0)
+			continue;
+		if (nvmem_count >= alloc) {
+			newp = realloc(nvmem_devices, (alloc + 16) * sizeof(*nvmem_devices));
+			if (newp == NULL)
+				break;
+			nvmem_devices = newp;
+			alloc += 16;
+		}
+		dev = &nvmem_devices[nvmem_count];
+		memset(dev, 0, sizeof(*dev));
+		dev->bus = bus;
+		dev->addr = addr;
+		dev->path = strdup(path);
+		if (dev->path == NULL)
+			break;
+		read_cells(dev, resolved);
+		nvmem_count += 1;
+	}
+	closedir(dir);
+
+} /* nvmem_build */
+
+/*
+ * nvmem_lookup
+ */
+const struct nvmem_device *
+nvmem_lookup (unsigned int bus, unsigned int addr)
+{
+	unsigned int i;
+
+	pthread_once(&nvmem_once, nvmem_build);
+	for (i = 0; i < nvmem_count; i++)
+		if (nvmem_devices[i].bus == bus && nvmem_devices[i].addr == addr)
+			return &nvmem_devices[i];
+	return NULL;
+
+} /* nvmem_lookup */
+
+/*
+ * nvmem_cell_read
+ *
+ * Reads a byte range through the device tree cell that
+ * covers exactly that range, if there is one.
+ *
+ * Returns 0 on success, or -1 (ENOENT if there is no
+ * such cell).
+ */
+int
+nvmem_cell_read (const struct nvmem_device *dev, void *buf, size_t offset, size_t len)
+{
+	unsigned int i;
+	ssize_t n;
+	int fd, save_errno;
+
+	for (i = 0; i < dev->ncells; i++)
+		if (dev->cells[i].offset == offset && dev->cells[i].size == len)
+			break;
+	if (i >= dev->ncells) {
+		errno = ENOENT;
+		return -1;
+	}
+	fd = trace_open(dev->cells[i].path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = trace_pread(fd, buf, len, 0);
+	save_errno = errno;
+	trace_close(fd);
+	if (n >= 0 && (size_t) n != len)
+		save_errno = EIO;
+	errno = save_errno;
+	return (n == (ssize_t) len ? 0 : -1);
+
+} /* nvmem_cell_read */
+
+/*
+ * eeprom_nvmem_path
+ *
+ * Finds the nvmem file for the EEPROM at an I2C address.
+ *
+ * Returns 0 on success, or -1 with errno set to ENOENT if
+ * the EEPROM is not registered with the nvmem subsystem.
+ */
+int
+eeprom_nvmem_path (unsigned int bus, unsigned int addr, char *buf, size_t bufsiz)
+{
+	const struct nvmem_device *dev = nvmem_lookup(bus, addr);
+	int n;
+
+	if (dev == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	n = snprintf(buf, bufsiz, "%s", dev->path);
+	if (n < 0 || (size_t) n >= bufsiz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+
+} /* eeprom_nvmem_path */
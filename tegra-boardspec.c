@@ -10,16 +10,19 @@
 #include "boardspec.h"
 
 static struct option options[] = {
+	{ "timeout",		required_argument,	0, 't' },
 	{ "help",		no_argument,		0, 'h' },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":h";
+static const char *shortopts = ":t:h";
 
 static char *optarghelp[] = {
+	"--timeout <ms>       ",
 	"--help               ",
 };
 
 static char *opthelp[] = {
+	"fail if reading the EEPROM takes longer than this",
 	"display this help text",
 };
 
@@ -52,8 +55,11 @@ main (int argc, char * const argv[])
 	int c, which, ret, len;
 	char specbuf[128];
 	char *argv0_copy = strdup(argv[0]);
+	eeprom_open_options_t opts;
+	char *ep;
 
 	progname = basename(argv0_copy);
+	eeprom_open_options_init(&opts);
 
 	for (;;) {
 		c = getopt_long_only(argc, argv, shortopts, options, &which);
@@ -67,6 +73,14 @@ main (int argc, char * const argv[])
 			print_usage();
 			ret = 0;
 			goto depart;
+		case 't':
+			opts.timeout_ms = strtoul(optarg, &ep, 10);
+			if (ep == optarg || *ep != '\0') {
+				fprintf(stderr, "Error: invalid timeout '%s'\n", optarg);
+				ret = 1;
+				goto depart;
+			}
+			break;
 		default:
 			fprintf(stderr, "Error: unrecognized option\n");
 			print_usage();
@@ -78,7 +92,7 @@ main (int argc, char * const argv[])
 	argc -= optind;
 	argv += optind;
 
-	len = tegra_boardspec(specbuf, sizeof(specbuf)-1);
+	len = tegra_boardspec_ex(specbuf, sizeof(specbuf)-1, &opts);
 	if (len < 0) {
 		perror("tegra_boardspec");
 		ret = 1;
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <getopt.h>
 #include <string.h>
 #include <strings.h>
@@ -15,7 +16,16 @@
 #include <ctype.h>
 #include <locale.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include "eeprom.h"
+#include "eeprom-layout.h"
+#include "eeprom-archive.h"
+#include "eeprom-journal.h"
 #include "cvm.h"
 
 struct context_s {
@@ -23,12 +33,14 @@ struct context_s {
 	eeprom_module_type_t mtype;
 	module_eeprom_t data;
 	int havedata;
+	int basecrc;	// CRC of the contents as read, for conditional writes
 	int readonly;
 	int data_modified;
 };
 typedef struct context_s *context_t;
 
 typedef int (*option_routine_t)(context_t ctx, int argc, char * const argv[]);
+typedef int (*mode_routine_t)(eeprom_module_type_t mtype, int argc, char * const argv[]);
 
 static int do_help(context_t ctx, int argc, char * const argv[]);
 static int do_show(context_t ctx, int argc, char * const argv[]);
@@ -36,6 +48,25 @@ static int do_verify(context_t ctx, int argc, char * const argv[]);
 static int do_get(context_t ctx, int argc, char * const argv[]);
 static int do_set(context_t ctx, int argc, char * const argv[]);
 static int do_write(context_t ctx, int argc, char * const argv[]);
+static int do_watch(context_t ctx, int argc, char * const argv[]);
+static int do_refresh(context_t ctx, int argc, char * const argv[]);
+static int do_dump(context_t ctx, int argc, char * const argv[]);
+static int do_load(context_t ctx, int argc, char * const argv[]);
+static int do_records(context_t ctx, int argc, char * const argv[]);
+static int do_record(context_t ctx, int argc, char * const argv[]);
+static int do_provision(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_clone(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_export(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_import(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_audit(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_diff(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_query(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_repair(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_generate(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_scan(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_calibrate(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_history(eeprom_module_type_t mtype, int argc, char * const argv[]);
+static int do_validate(eeprom_module_type_t mtype, int argc, char * const argv[]);
 
 static struct {
 	const char *name;
@@ -85,32 +116,98 @@ static struct {
 	{ "set",	do_set, 	"set a value for an EEPROM field" },
 	{ "help",	do_help, 	"display extended help" },
 	{ "verify",	do_verify, 	"verify EEPROM contents" },
+	{ "watch",	do_watch,	"watch for EEPROM changes [--interval <seconds>]" },
+	{ "dump",	do_dump,	"dump raw EEPROM contents [hex|base64|binary]" },
+	{ "load",	do_load,	"write a raw image from a file (or '-' for stdin)" },
+	{ "records",	do_records,	"list the records in the extended area" },
+	{ "record",	do_record,	"show a record [hex|base64|binary], or 'set' it from a file or 'delete' it" },
 	// commands not for use in oneshot mode follow
 	{ "write",	do_write, 	"write updated EEPROM contents" },
+	{ "refresh",	do_refresh,	"re-read EEPROM contents if changed" },
 	{ "quit",	NULL,		"exit from program" },
 };
-static const int non_oneshot_commands = 2;
+static const int non_oneshot_commands = 3;
+
+/*
+ * Batch modes operate on multiple devices or images,
+ * so they do not use the --device option.
+ */
+static struct {
+	const char *cmd;
+	mode_routine_t rtn;
+	const char *args;
+	const char *help;
+} modes[] = {
+	{ "provision",	do_provision,	"<manifest>",	"program multiple EEPROMs from a CSV or JSON manifest" },
+	{ "clone",	do_clone,	"--from <dev> --to <dev>... [--override <field>=<value>]...",
+	  "copy one EEPROM's contents to others" },
+	{ "export",	do_export,	"<archive> <image-or-dir>...",	"pack raw EEPROM images into an archive" },
+	{ "import",	do_import,	"<archive> <dir>",	"unpack the images in an archive into a directory" },
+	{ "audit",	do_audit,	"<image-dir-or-archive>...",	"check images for duplicate MACs, serial numbers, and asset IDs" },
+	{ "diff",	do_diff,	"[--key serial|asset-id] [--output <csv>] <old-images> <new-images>",
+	  "report changes between two sets of images, matched by key" },
+	{ "query",	do_query,	"[--index <file>] [--reindex] [--count] <archive> <predicate>",
+	  "list the records in an archive matching a predicate, using its indexes" },
+	{ "repair",	do_repair,	"[--all] <image-dir-or-archive>...",	"find corrections for images with bad CRCs" },
+	{ "generate",	do_generate,	"--count <n> (--dir <dir> | --archive <file>) [--seed <n>] [--corrupt <fraction>] "
+	  "[--duplicate-macs <fraction>] [--manifest <csv>]",	"generate synthetic EEPROM images for testing" },
+	{ "scan",	do_scan,	"[--bus <n>]... [--addresses <first>-<last>]",
+	  "find EEPROMs on I2C buses, including behind muxes" },
+	{ "calibrate",	do_calibrate,	"<bus>-<addr>...",
+	  "time each read method on the EEPROMs' buses and cache the fastest" },
+	{ "history",	do_history,	"[--images] <journal> (serial|asset-id|mac)=<value>",
+	  "list the journaled writes of images with a serial number, asset ID, or MAC address" },
+	{ "validate",	do_validate,	"[--list] <image-dir-or-archive>...",
+	  "validate and decode images of any layout, inferring each one's from its header" },
+};
 
 static struct option options[] = {
 	{ "device",		required_argument,	0, 'd' },
 	{ "cvm",		no_argument,		0, 'c' },
+	{ "firmware-path",	required_argument,	0, 'f' },
+	{ "jobs",		required_argument,	0, 'j' },
+	{ "timeout",		required_argument,	0, 't' },
+	{ "record",		required_argument,	0, 'r' },
+	{ "replay",		required_argument,	0, 'R' },
+	{ "journal",		required_argument,	0, 'J' },
+	{ "duty-cycle",		required_argument,	0, 'D' },
+	{ "offline",		no_argument,		0, 'O' },
 	{ "help",		no_argument,		0, 'h' },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":d:ch";
+static const char *shortopts = "+:d:cf:j:t:r:R:J:D:Oh";
 
 static char *optarghelp[] = {
 	"--device             ",
 	"--cvm                ",
+	"--firmware-path <p>  ",
+	"--jobs <n>           ",
+	"--timeout <ms>       ",
+	"--record <trace>     ",
+	"--replay <trace>     ",
+	"--journal <file>     ",
+	"--duty-cycle <pct>   ",
+	"--offline            ",
 	"--help               ",
 };
 
 static char *opthelp[] = {
 	"either an I2C address (<b>-<hexaddr>) or the pathname of an EEPROM or file (REQUIRED)",
 	"EEPROM is for a SoM ('cvm' type) rather than a board",
+	"colon-separated list of firmware-provided CVM EEPROM copies to try when no device is specified",
+	"maximum number of parallel workers for batch modes (default 8)",
+	"fail any EEPROM read or write that takes longer than this",
+	"record all EEPROM device transactions to a trace file",
+	"replay a recorded trace in place of the EEPROM devices",
+	"log every EEPROM write to a journal file (default $TEGRA_EEPROM_JOURNAL)",
+	"pace EEPROM transfers to keep each I2C bus busy at most this percent of the time",
+	"take the layout and module type from the EEPROM contents rather than this host",
 	"display this help text",
 };
 
+#define MAX_JOBS 256
+static unsigned int batch_jobs = 8;
+static eeprom_open_options_t open_opts;
 static char *progname;
 static char promptstr[256];
 static int continuation;
@@ -212,11 +309,17 @@ print_usage (int oneshot)
 	if (oneshot) {
 		cmdcount -= non_oneshot_commands;
 		printf("\nUsage:\n");
-		printf("\t%s <option> [<command> [<key>] [<value>]]\n\n", progname);
+		printf("\t%s <option> [<command> [<key>] [<value>]]\n", progname);
+		printf("\t%s <option> <mode> [<args>]\n\n", progname);
 	}
 	printf("Commands:\n");
 	for (i = 0; i < cmdcount; i++)
 		printf(" %s\t\t%s\n", commands[i].cmd, commands[i].help);
+	if (oneshot) {
+		printf("\nModes:\n");
+		for (i = 0; i < (int) (sizeof(modes)/sizeof(modes[0])); i++)
+			printf(" %s %s\n\t\t%s\n", modes[i].cmd, modes[i].args, modes[i].help);
+	}
 	if (oneshot) {
 		printf("\nOptions:\n");
 		for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
@@ -323,103 +426,130 @@ do_get (context_t ctx, int argc, char * const argv[])
 
 
 /*
- * do_set
+ * set_field
  *
- * Set a single value
+ * Parse a value for field i into the decoded EEPROM contents.
+ * For the partnumber field, pntype (if non-NULL) is 'nvidia'
+ * or 'customer'.  Returns 0 on success, or -1 with an error
+ * message formatted into errbuf.
  */
 static int
-do_set (context_t ctx, int argc, char * const argv[])
+set_field (module_eeprom_t *eeprom, eeprom_module_type_t mtype, int i,
+	   const char *pntype, const char *value, char *errbuf, size_t errlen)
 {
-	int i, valindex;
-	uint8_t *data = (uint8_t *) &ctx->data;
+	uint8_t *data = (uint8_t *) eeprom;
 	uint8_t addr[6];
 	size_t len;
-	unsigned long value;
+	unsigned long ulval;
 
-	if (argc < 2) {
-		fprintf(stderr, "missing required arguments: <field-name> <value>\n");
-		return 1;
-	}
-	i = parse_fieldname(argv[0]);
-	if (i < 0) {
-		fprintf(stderr, "unrecognized field name: %s\n", argv[0]);
-		return 1;
-	}
-	if (ctx->readonly) {
-		fprintf(stderr, "Error: EEPROM is read-only\n");
-		return 1;
-	}
-	if ((ctx->mtype != module_type_cvm && eeprom_fields[i].moduletype == cvm_only) ||
-	    (ctx->mtype != module_type_cvb && eeprom_fields[i].moduletype == cvb_only)) {
-		fprintf(stderr, "Error: field not supported for this module type\n");
-		return 1;
+	if ((mtype != module_type_cvm && eeprom_fields[i].moduletype == cvm_only) ||
+	    (mtype != module_type_cvb && eeprom_fields[i].moduletype == cvb_only)) {
+		snprintf(errbuf, errlen, "field not supported for this module type");
+		return -1;
 	}
-	if (ctx->data.major_version < eeprom_fields[i].min_layout_version) {
-		fprintf(stderr, "Error: field requires EEPROM layout version >= %u\n",
-			eeprom_fields[i].min_layout_version);
-		return 1;
+	if (eeprom->major_version < eeprom_fields[i].min_layout_version) {
+		snprintf(errbuf, errlen, "field requires EEPROM layout version >= %u",
+			 eeprom_fields[i].min_layout_version);
+		return -1;
 	}
-	valindex = 1;
 	/*
 	 * partnumber also takes 'nvidia' or 'customer'
 	 */
-	if (i == PARTNUMBER_FIELD) {
-		if (argc < 3) {
-			fprintf(stderr, "missing required arguments: <field-name> {nvidia|customer} <value>\n");
-			return 1;
-		}
-		valindex = 2;
-		len = strlen(argv[1]);
-		if (strncasecmp(argv[1], "customer", len) == 0) {
-			ctx->data.partnumber_type = partnum_type_customer;
-		} else if (strncasecmp(argv[1], "nvidia", len) == 0) {
-			ctx->data.partnumber_type = partnum_type_nvidia;
+	if (i == PARTNUMBER_FIELD && pntype != NULL) {
+		len = strlen(pntype);
+		if (len > 0 && strncasecmp(pntype, "customer", len) == 0) {
+			eeprom->partnumber_type = partnum_type_customer;
+		} else if (len > 0 && strncasecmp(pntype, "nvidia", len) == 0) {
+			eeprom->partnumber_type = partnum_type_nvidia;
 		} else {
-			fprintf(stderr, "partnumber type must be either 'nvidia' or 'customer'\n");
-			return 1;
+			snprintf(errbuf, errlen, "partnumber type must be either 'nvidia' or 'customer'");
+			return -1;
 		}
 	}
 
 	switch (eeprom_fields[i].fieldtype) {
 	case char_string:
-		len = strlen(argv[valindex]);
+		len = strlen(value);
 		if (len > eeprom_fields[i].length) {
-			fprintf(stderr, "Error: value longer than field length (%zu)\n", eeprom_fields[i].length);
-			return 1;
+			snprintf(errbuf, errlen, "value longer than field length (%zu)", eeprom_fields[i].length);
+			return -1;
 		}
-		memcpy(data + eeprom_fields[i].offset, argv[valindex], len);
+		memcpy(data + eeprom_fields[i].offset, value, len);
 		while (len < eeprom_fields[i].length) {
 			*(data + eeprom_fields[i].offset + len) = '\0';
 			len += 1;
 		}
 		break;
 	case mac_address:
-		if (parse_macaddr(addr, argv[valindex]) < 0) {
-			fprintf(stderr, "Error: could not parse MAC addresss '%s'\n", argv[valindex]);
-			return 1;
+		if (parse_macaddr(addr, value) < 0) {
+			snprintf(errbuf, errlen, "could not parse MAC addresss '%s'", value);
+			return -1;
 		}
 		memcpy(data + eeprom_fields[i].offset, addr, sizeof(addr));
 		break;
 	case int_decimal:
 	case int_hex:
-		value = strtoul(argv[valindex], NULL, (eeprom_fields[i].fieldtype == int_hex ? 16 : 10));
-		if (value == ULONG_MAX) {
-			fprintf(stderr, "Error: could not parse integer value from '%s'\n", argv[valindex]);
-			return 1;
+		ulval = strtoul(value, NULL, (eeprom_fields[i].fieldtype == int_hex ? 16 : 10));
+		if (ulval == ULONG_MAX) {
+			snprintf(errbuf, errlen, "could not parse integer value from '%s'", value);
+			return -1;
 		}
-		if ((eeprom_fields[i].length == sizeof(uint8_t) && value > 255) ||
-		    (eeprom_fields[i].length == sizeof(uint16_t) && value > 65536)) {
-			fprintf(stderr, "Error: value '%s' out of range\n", argv[valindex]);
-			return 1;
+		if ((eeprom_fields[i].length == sizeof(uint8_t) && ulval > 255) ||
+		    (eeprom_fields[i].length == sizeof(uint16_t) && ulval > 65536)) {
+			snprintf(errbuf, errlen, "value '%s' out of range", value);
+			return -1;
 		}
 		if (eeprom_fields[i].length == sizeof(uint8_t))
-			*(uint8_t *)(data + eeprom_fields[i].offset) = (uint8_t) value;
+			*(uint8_t *)(data + eeprom_fields[i].offset) = (uint8_t) ulval;
 		else
-			*(uint16_t *)(data + eeprom_fields[i].offset) = (uint16_t) value;
+			*(uint16_t *)(data + eeprom_fields[i].offset) = (uint16_t) ulval;
 		break;
 	default:
-		fprintf(stderr, "Internal error: unrecognized field type for '%s'\n", eeprom_fields[i].name);
-		return 2;
+		snprintf(errbuf, errlen, "Internal error: unrecognized field type for '%s'", eeprom_fields[i].name);
+		return -1;
+	}
+
+	return 0;
+
+} /* set_field */
+
+/*
+ * do_set
+ *
+ * Set a single value
+ */
+static int
+do_set (context_t ctx, int argc, char * const argv[])
+{
+	int i, valindex;
+	const char *pntype = NULL;
+	char errbuf[256];
+
+	if (argc < 2) {
+		fprintf(stderr, "missing required arguments: <field-name> <value>\n");
+		return 1;
+	}
+	i = parse_fieldname(argv[0]);
+	if (i < 0) {
+		fprintf(stderr, "unrecognized field name: %s\n", argv[0]);
+		return 1;
+	}
+	if (ctx->readonly) {
+		fprintf(stderr, "Error: EEPROM is read-only\n");
+		return 1;
+	}
+	valindex = 1;
+	if (i == PARTNUMBER_FIELD) {
+		if (argc < 3) {
+			fprintf(stderr, "missing required arguments: <field-name> {nvidia|customer} <value>\n");
+			return 1;
+		}
+		pntype = argv[1];
+		valindex = 2;
+	}
+	if (set_field(&ctx->data, ctx->mtype, i, pntype, argv[valindex], errbuf, sizeof(errbuf)) < 0) {
+		fprintf(stderr, "Error: %s\n", errbuf);
+		return 1;
 	}
 
 	ctx->data_modified = 1;
@@ -456,6 +586,8 @@ do_verify (context_t ctx, int argc, char * const argv[])
 static int
 do_write (context_t ctx, int argc, char * const argv[])
 {
+	int err;
+
 	if (ctx->readonly) {
 		fprintf(stderr, "Error: EEPROM is read-only\n");
 		return 1;
@@ -472,222 +604,5064 @@ do_write (context_t ctx, int argc, char * const argv[])
 		fprintf(stderr, "Error: no updates to write\n");
 		return 1;
 	}
-	if (eeprom_write(ctx->e, &ctx->data) < 0) {
-		fprintf(stderr, "Error: EEPROM write failed: %s\n", strerror(errno));
+	if ((ctx->basecrc < 0 ? eeprom_write(ctx->e, &ctx->data) :
+	     eeprom_write_if(ctx->e, &ctx->data, ctx->basecrc)) < 0) {
+		err = errno;
+		if (err == ESTALE)
+			fprintf(stderr, "Error: EEPROM contents changed since they were read; not written\n");
+		else if ((err == ETIMEDOUT || err == ECANCELED) && eeprom_crc(ctx->e) < 0)
+			fprintf(stderr, "Error: EEPROM write failed: %s (partly written, %zu bytes; contents now mixed)\n",
+				strerror(err), eeprom_bytes_completed(ctx->e));
+		else if (err == ETIMEDOUT || err == ECANCELED)
+			fprintf(stderr, "Error: EEPROM write failed: %s (nothing written)\n", strerror(err));
+		else
+			fprintf(stderr, "Error: EEPROM write failed: %s\n", strerror(err));
 		return 1;
 	}
 	ctx->havedata = 1;
+	ctx->basecrc = eeprom_crc(ctx->e);
 	ctx->data_modified = 0;
 	return 0;
 
 } /* do_write */
 
-static char *prompt (EditLine *e)
-{
-	return promptstr + (continuation ? 0 : 1);
-}
 /*
- * command_loop
+ * do_refresh
  *
+ * Re-read the EEPROM contents if they have changed
+ * since we last read them.
  */
 static int
-command_loop (context_t ctx)
+do_refresh (context_t ctx, int argc, char * const argv[])
 {
-	option_routine_t dispatch;
-	EditLine *el;
-	History *hist;
-	HistEvent ev;
-	const LineInfo *li;
-	Tokenizer *tok;
-	char *editor;
-	const char *line, **argv;
-	size_t promptlen;
-	int argc, alldone, llen, which, ret = 0, n;
-
-	setlocale(LC_CTYPE, "");
-	promptlen = snprintf(promptstr, sizeof(promptstr)-2, "_%s> ", progname);
-	promptstr[promptlen] = '\0';
-	el = el_init(progname, stdin, stdout, stderr);
+	int changed;
 
-	el_set(el, EL_PROMPT, &prompt);
-	editor = getenv("EDITOR");
-	if (editor != NULL && strchr(editor, ' ') != NULL) {
-		char *edtemp = strdup(editor);
-		char *sp = strchr(edtemp, ' ');
-		*sp = '\0';
-		el_set(el, EL_EDITOR, edtemp);
-		free(edtemp);
-	} else if (editor != NULL)
-		el_set(el, EL_EDITOR, editor);
-	hist = history_init();
-	if (hist != NULL) {
-		history(hist, &ev, H_SETSIZE, 100);
-		el_set(el, EL_HIST, history, hist);
+	if (ctx->data_modified) {
+		fprintf(stderr, "Error: pending changes, write before refreshing\n");
+		return 1;
 	}
-	el_set(el, EL_SIGNAL, 1);
-	tok = tok_init(NULL);
-	continuation = alldone = 0;
-	while (!alldone && (line = el_gets(el, &llen)) != NULL && llen != 0) {
-		li = el_line(el);
-		if (!continuation && llen == 1)
-			continue;
-		argc = 0;
-		n = tok_line(tok, li, &argc, &argv, NULL, NULL);
-		if (n < 0) {
-			fprintf(stderr, "internal error\n");
-			continuation = 0;
-			continue;
+	changed = eeprom_changed(ctx->e);
+	if (changed < 0) {
+		fprintf(stderr, "Error: could not check EEPROM: %s\n", strerror(errno));
+		return 1;
+	}
+	if (changed) {
+		ctx->havedata = eeprom_read(ctx->e, &ctx->data) == 0;
+		ctx->basecrc = eeprom_crc(ctx->e);
+		printf("EEPROM contents refreshed\n");
+	} else
+		printf("EEPROM contents unchanged\n");
+	return 0;
+
+} /* do_refresh */
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * dump_bytes
+ *
+ * Writes raw data to stdout as a hex dump, base64,
+ * or binary.
+ */
+static int
+dump_bytes (const uint8_t *buf, size_t len, const char *format)
+{
+	uint32_t triple;
+	size_t i, col;
+
+	if (format == NULL || strcasecmp(format, "hex") == 0) {
+		for (i = 0; i < len; i++) {
+			if (i % 16 == 0)
+				printf("%04zx:", i);
+			printf(" %02x", buf[i]);
+			if (i % 16 == 15 || i == len - 1)
+				putchar('\n');
 		}
-		history(hist, &ev, (continuation ? H_APPEND : H_ENTER), line);
-		continuation = n;
-		if (continuation)
-			continue;
-		dispatch = NULL;
-		for (which = 0; which < sizeof(commands)/sizeof(commands[0]); which++) {
-			if (strcmp(argv[0], commands[which].cmd) == 0) {
-				dispatch = commands[which].rtn;
-				if (dispatch == NULL)
-					alldone = 1;
-				break;
+	} else if (strcasecmp(format, "base64") == 0) {
+		for (i = col = 0; i < len; i += 3) {
+			triple = buf[i] << 16;
+			if (i + 1 < len)
+				triple |= buf[i+1] << 8;
+			if (i + 2 < len)
+				triple |= buf[i+2];
+			putchar(base64_chars[(triple >> 18) & 0x3f]);
+			putchar(base64_chars[(triple >> 12) & 0x3f]);
+			putchar(i + 1 < len ? base64_chars[(triple >> 6) & 0x3f] : '=');
+			putchar(i + 2 < len ? base64_chars[triple & 0x3f] : '=');
+			col += 4;
+			if (col >= 76) {
+				putchar('\n');
+				col = 0;
 			}
 		}
-		if (which >= sizeof(commands)/sizeof(commands[0]))
-			fprintf(stderr, "unrecognized command: %s\n", argv[0]);
-		else if (alldone || dispatch == NULL)
-			break;
-		else
-			ret = dispatch(ctx, argc-1, (char * const *)&argv[1]);
-
-		tok_reset(tok);
+		if (col > 0)
+			putchar('\n');
+	} else if (strcasecmp(format, "binary") == 0) {
+		if (isatty(fileno(stdout))) {
+			fprintf(stderr, "Error: not writing binary output to a terminal\n");
+			return 1;
+		}
+		if ((len > 0 && fwrite(buf, len, 1, stdout) != 1) || fflush(stdout) != 0) {
+			perror("stdout");
+			return 1;
+		}
+	} else {
+		fprintf(stderr, "Error: format must be one of 'hex', 'base64', or 'binary'\n");
+		return 1;
 	}
-	if (line == NULL && isatty(fileno(stdin)))
-		printf("\n");
-	el_end(el);
-	tok_end(tok);
-	history_end(hist);
-	return ret;
+	return 0;
 
-} /* command_loop */
+} /* dump_bytes */
 
 /*
- * main program
+ * do_dump
+ *
+ * Write the raw EEPROM contents to stdout, as a
+ * hex dump (the default), base64, or binary.
  */
-int
-main (int argc, char * const argv[])
+static int
+do_dump (context_t ctx, int argc, char * const argv[])
 {
-	int c, which, ret;
-	context_t ctx = NULL;
-	option_routine_t dispatch = NULL;
-	char *argv0_copy = strdup(argv[0]);
-        char *eeprom_device = NULL;
-	cvm_i2c_address_t i2c_address;
-	const cvm_i2c_address_t *i2caddr;
-	int use_i2c;
-	ssize_t len;
-	char eeprompath[PATH_MAX];
-	eeprom_module_type_t mtype = module_type_normal;
-
-	progname = basename(argv0_copy);
+	uint8_t image[EEPROM_IMAGE_SIZE];
 
-	for (;;) {
-		c = getopt_long_only(argc, argv, shortopts, options, &which);
-		if (c == -1)
-			break;
+	if (eeprom_get_raw(ctx->e, image, sizeof(image)) != sizeof(image)) {
+		fprintf(stderr, "Error: EEPROM contents not available: %s\n", strerror(errno));
+		return 1;
+	}
+	return dump_bytes(image, sizeof(image), (argc < 1 ? NULL : argv[0]));
 
+} /* do_dump */
 
-		switch (c) {
+/*
+ * parse_hex_image
+ *
+ * Parses a hex dump, as produced by 'dump hex' (anything up
+ * to a colon on each line is taken to be an offset, and ignored),
+ * or just hex digits.  Returns the number of bytes parsed, or -1
+ * if the text is not hex.
+ */
+static ssize_t
+parse_hex_image (const char *text, size_t len, uint8_t *image, size_t imagesize)
+{
+	const char *cp = text, *end = text + len, *eol, *colon;
+	size_t count = 0;
+	int hi = -1, v;
 
-		case 'h':
-			print_usage(1);
-			ret = 0;
-			goto depart;
-		case 'd':
-			eeprom_device = optarg;
-			break;
-		case 'c':
-			mtype = module_type_cvm;
-			break;
-		default:
-			fprintf(stderr, "Error: unrecognized option\n");
-			print_usage(1);
-			ret = 1;
-			goto depart;
+	while (cp < end) {
+		eol = memchr(cp, '\n', end - cp);
+		if (eol == NULL)
+			eol = end;
+		colon = memchr(cp, ':', eol - cp);
+		if (colon != NULL)
+			cp = colon + 1;
+		for (; cp < eol; cp++) {
+			if (isspace((unsigned char) *cp))
+				continue;
+			if (!isxdigit((unsigned char) *cp))
+				return -1;
+			v = (isdigit((unsigned char) *cp) ? *cp - '0' : tolower((unsigned char) *cp) - 'a' + 10);
+			if (hi < 0) {
+				hi = v;
+				continue;
+			}
+			if (count >= imagesize)
+				return -1;
+			image[count++] = (hi << 4) | v;
+			hi = -1;
 		}
+		cp = eol + 1;
 	}
+	return (hi < 0 ? (ssize_t) count : -1);
 
-	argc -= optind;
-	argv += optind;
+} /* parse_hex_image */
 
-	/*
-	 * If no device specified, assume CVM is desired.
-	 * Otherwise, if the device looks like an I2C address, use that.
-	 */
-	i2caddr = NULL;
-	use_i2c = 0;
-	if (eeprom_device == NULL) {
-		i2caddr = cvm_i2c_address();
-		if (i2caddr == NULL) {
-			fprintf(stderr, "Error: no EEPROM device specified and cannot identify CVM location\n");
-			print_usage(1);
-			ret = 1;
-			goto depart;
-		}
-		mtype = module_type_cvm;
-	} else if (sscanf(eeprom_device, "%d-%04x", &i2c_address.busnum, &i2c_address.addr) == 2)
-			i2caddr = &i2c_address;
+/*
+ * parse_base64_image
+ */
+static ssize_t
+parse_base64_image (const char *text, size_t len, uint8_t *image, size_t imagesize)
+{
+	const char *p;
+	uint32_t accum = 0;
+	size_t i, count = 0;
+	int bits = 0, padding = 0;
 
-	/*
-	 * If we have an I2C address, see if there's an EEPROM driver loaded for it.
-	 * If so, prefer using that rather than userland I2C calls.
-	 */
-	if (i2caddr != NULL) {
-		len = snprintf(eeprompath, sizeof(eeprompath)-1, "/sys/bus/i2c/devices/%d-%04x/eeprom",
-			       i2caddr->busnum, i2caddr->addr);
-		if (len < 0) {
-			fprintf(stderr, "Error: could not format path name for EEPROM\n");
-			ret = 1;
-			goto depart;
+	for (i = 0; i < len; i++) {
+		if (isspace((unsigned char) text[i]))
+			continue;
+		if (text[i] == '=') {
+			padding += 1;
+			continue;
+		}
+		if (text[i] == '\0' || padding > 0 || (p = strchr(base64_chars, text[i])) == NULL)
+			return -1;
+		accum = (accum << 6) | (p - base64_chars);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (count >= imagesize)
+				return -1;
+			image[count++] = (accum >> bits) & 0xff;
 		}
-		eeprompath[len] = '\0';
-		if (access(eeprompath, F_OK) == 0)
-			eeprom_device = eeprompath;
-		else
-			use_i2c = 1;
 	}
+	return (ssize_t) count;
 
-	ctx = calloc(1, sizeof(struct context_s));
-	if (ctx == NULL) {
-		perror("allocating context structure");
-		return errno;
-	}
-	if (use_i2c)
-		ctx->e = eeprom_open_i2c(i2caddr->busnum, i2caddr->addr, mtype);
-	else
-		ctx->e = eeprom_open(eeprom_device, mtype);
-	if (ctx->e == NULL) {
-		perror(eeprom_device);
-		free(ctx);
-		return errno;
+} /* parse_base64_image */
+
+/*
+ * read_input
+ *
+ * Reads up to bufsize bytes from a file, or stdin if the
+ * name is '-'.  Returns the number of bytes read, or -1.
+ */
+static ssize_t
+read_input (const char *name, void *buf, size_t bufsize)
+{
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	fd = (strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY|O_CLOEXEC));
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+	while (len < bufsize) {
+		n = read(fd, (char *) buf + len, bufsize - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror(name);
+			if (fd != STDIN_FILENO)
+				close(fd);
+			return -1;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return (ssize_t) len;
+
+} /* read_input */
+
+/*
+ * read_image_input
+ *
+ * Reads a raw image from a file, or stdin if the name
+ * is '-', in binary, hex dump, or base64 form.
+ */
+static int
+read_image_input (const char *name, uint8_t image[EEPROM_IMAGE_SIZE])
+{
+	char buf[16384];
+	ssize_t len;
+
+	len = read_input(name, buf, sizeof(buf));
+	if (len < 0)
+		return -1;
+	if (len == EEPROM_IMAGE_SIZE) {
+		memcpy(image, buf, len);
+		return 0;
+	}
+	if (parse_hex_image(buf, len, image, EEPROM_IMAGE_SIZE) == EEPROM_IMAGE_SIZE ||
+	    parse_base64_image(buf, len, image, EEPROM_IMAGE_SIZE) == EEPROM_IMAGE_SIZE)
+		return 0;
+	fprintf(stderr, "%s: not a %d-byte EEPROM image (binary, hex, or base64)\n",
+		name, EEPROM_IMAGE_SIZE);
+	return -1;
+
+} /* read_image_input */
+
+/*
+ * do_load
+ *
+ * Write a raw image, from a file or stdin, to the EEPROM.
+ * The image is validated before writing.
+ */
+static int
+do_load (context_t ctx, int argc, char * const argv[])
+{
+	uint8_t image[EEPROM_IMAGE_SIZE];
+
+	if (argc < 1) {
+		fprintf(stderr, "missing required argument: file (or '-' for stdin)\n");
+		return 1;
+	}
+	if (ctx->readonly) {
+		fprintf(stderr, "Error: EEPROM is read-only\n");
+		return 1;
+	}
+	if (ctx->data_modified) {
+		fprintf(stderr, "Error: pending changes, write before loading\n");
+		return 1;
+	}
+	if (read_image_input(argv[0], image) < 0)
+		return 1;
+	if (eeprom_set_raw(ctx->e, image, sizeof(image)) < 0) {
+		if (errno == EINVAL)
+			fprintf(stderr, "Error: %s: not a valid EEPROM image for this device\n", argv[0]);
+		else
+			fprintf(stderr, "Error: EEPROM write failed: %s\n", strerror(errno));
+		return 1;
 	}
-	ctx->mtype = mtype;
 	ctx->havedata = eeprom_read(ctx->e, &ctx->data) == 0;
-	ctx->readonly = eeprom_readonly(ctx->e);
+	ctx->basecrc = eeprom_crc(ctx->e);
+	return 0;
+
+} /* do_load */
+
+/*
+ * do_records
+ *
+ * List the records in the extended area.
+ */
+static int
+do_records (context_t ctx, int argc, char * const argv[])
+{
+	ssize_t size;
+	size_t len;
+	uint8_t type;
+	int i, count;
+
+	size = eeprom_size(ctx->e);
+	count = eeprom_ext_count(ctx->e);
+	if (size < 0 || count < 0) {
+		fprintf(stderr, "Error: %s\n", (errno == ENOTSUP ? "extended area not accessible on this device" : strerror(errno)));
+		return 1;
+	}
+	printf("EEPROM size: %zd bytes\n", size);
+	for (i = 0; i < count; i++) {
+		if (eeprom_ext_entry(ctx->e, i, &type, &len) < 0) {
+			fprintf(stderr, "Error: %s\n", strerror(errno));
+			return 1;
+		}
+		printf("  record %3u: %zu byte%s\n", type, len, (len == 1 ? "" : "s"));
+	}
+	if (count == 0)
+		printf("  (no records)\n");
+	return 0;
+
+} /* do_records */
+
+/*
+ * do_record
+ *
+ * Show, set, or delete a record in the extended area.
+ * Changes are written immediately.
+ */
+static int
+do_record (context_t ctx, int argc, char * const argv[])
+{
+	static uint8_t buf[UINT16_MAX + 1];
+	unsigned long type;
+	ssize_t len;
+	char *ep;
 
 	if (argc < 1) {
-		ret = command_loop(ctx);
-		goto depart;
+		fprintf(stderr, "missing required argument: record type\n");
+		return 1;
+	}
+	type = strtoul(argv[0], &ep, 0);
+	if (ep == argv[0] || *ep != '\0' || type < 1 || type > 254) {
+		fprintf(stderr, "Error: record type must be between 1 and 254\n");
+		return 1;
+	}
+	if (argc > 1 && (strcmp(argv[1], "set") == 0 || strcmp(argv[1], "delete") == 0)) {
+		if (ctx->readonly) {
+			fprintf(stderr, "Error: EEPROM is read-only\n");
+			return 1;
+		}
+		if (argv[1][0] == 'd') {
+			if (eeprom_ext_delete(ctx->e, type) < 0) {
+				fprintf(stderr, "Error: %s\n", strerror(errno));
+				return 1;
+			}
+			return 0;
+		}
+		if (argc < 3) {
+			fprintf(stderr, "missing required argument: file (or '-' for stdin)\n");
+			return 1;
+		}
+		len = read_input(argv[2], buf, sizeof(buf));
+		if (len < 0)
+			return 1;
+		if (len > UINT16_MAX) {
+			fprintf(stderr, "Error: %s: record data limited to %u bytes\n", argv[2], UINT16_MAX);
+			return 1;
+		}
+		if (eeprom_ext_write(ctx->e, type, buf, len) < 0) {
+			fprintf(stderr, "Error: %s\n", (errno == ENOSPC ? "not enough room in the extended area" : strerror(errno)));
+			return 1;
+		}
+		return 0;
+	}
+	len = eeprom_ext_read(ctx->e, type, buf, sizeof(buf));
+	if (len < 0) {
+		fprintf(stderr, "Error: record %lu: %s\n", type,
+			(errno == EBADMSG ? "CRC mismatch" : strerror(errno)));
+		return 1;
+	}
+	return dump_bytes(buf, len, (argc > 1 ? argv[1] : NULL));
+
+} /* do_record */
+
+/*
+ * do_watch
+ *
+ * Poll the EEPROM for changes, showing the new
+ * contents each time they change.
+ */
+static int
+do_watch (context_t ctx, int argc, char * const argv[])
+{
+	struct timespec interval;
+	double seconds = 5.0;
+	char *valstr, *ep, tstamp[64];
+	time_t now;
+	int i, changed;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--interval") == 0) {
+			if (i + 1 >= argc) {
+				fprintf(stderr, "missing value for --interval\n");
+				return 1;
+			}
+			valstr = argv[++i];
+		} else if (strncmp(argv[i], "--interval=", 11) == 0)
+			valstr = argv[i] + 11;
+		else {
+			fprintf(stderr, "unrecognized argument: %s\n", argv[i]);
+			return 1;
+		}
+		seconds = strtod(valstr, &ep);
+		if (ep == valstr || *ep != '\0' || seconds <= 0.0) {
+			fprintf(stderr, "Error: invalid interval '%s'\n", valstr);
+			return 1;
+		}
+	}
+	interval.tv_sec = (time_t) seconds;
+	interval.tv_nsec = (long) ((seconds - interval.tv_sec) * 1000000000.0);
+
+	if (ctx->havedata)
+		do_show(ctx, 0, NULL);
+	else
+		printf("No valid EEPROM contents\n");
+	fflush(stdout);
+	for (;;) {
+		nanosleep(&interval, NULL);
+		changed = eeprom_changed(ctx->e);
+		if (changed < 0) {
+			fprintf(stderr, "Error: could not check EEPROM: %s\n", strerror(errno));
+			return 1;
+		}
+		if (!changed)
+			continue;
+		now = time(NULL);
+		strftime(tstamp, sizeof(tstamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+		printf("\nEEPROM contents changed at %s\n", tstamp);
+		ctx->havedata = eeprom_read(ctx->e, &ctx->data) == 0;
+		ctx->basecrc = eeprom_crc(ctx->e);
+		if (ctx->havedata)
+			do_show(ctx, 0, NULL);
+		else
+			printf("No valid EEPROM contents\n");
+		fflush(stdout);
+	}
+	return 0;
+
+} /* do_watch */
+
+/*
+ * open_device
+ *
+ * Opens an EEPROM given either an I2C address (<b>-<hexaddr>)
+ * or a pathname.  For an I2C address, the library prefers the
+ * nvmem subsystem or the EEPROM driver to userland I2C calls.
+ */
+static eeprom_context_t
+open_device (const char *device, eeprom_module_type_t mtype)
+{
+	cvm_i2c_address_t i2c_address;
+
+	if (sscanf(device, "%d-%04x", &i2c_address.busnum, &i2c_address.addr) != 2)
+		return eeprom_open_ex(device, mtype, &open_opts);
+	return eeprom_open_addr_ex(i2c_address.busnum, i2c_address.addr, mtype, &open_opts);
+
+} /* open_device */
+
+/*
+ * Provisioning support.
+ *
+ * A manifest lists, for each device, the field values to
+ * be programmed.  Devices are grouped by root I2C bus (with
+ * devices behind muxes counted as on the bus carrying the mux),
+ * and each group is handled by a single worker, so there is
+ * never more than one operation in flight on any bus, while
+ * separate buses are programmed in parallel.  Within a group,
+ * devices are taken in topology order, so that each mux channel
+ * is selected once.
+ */
+struct prov_field {
+	int field;
+	char *value;
+};
+
+struct prov_job {
+	char *device;
+	char *pntype;
+	struct prov_field *fields;
+	unsigned int nfields;
+	int buskey;
+	unsigned int order;	// position in the I2C topology
+	enum {
+		stage_read,
+		stage_modify,
+		stage_write,
+		stage_verify,
+		stage_done,
+	} stage;
+	int err;
+	char errmsg[256];
+	double read_ms, write_ms, verify_ms, total_ms;
+};
+
+struct manifest_s {
+	struct prov_job *jobs;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+struct prov_group {
+	int buskey;
+	unsigned int *jobs;
+	unsigned int count;
+};
+
+struct prov_state {
+	struct manifest_s *manifest;
+	eeprom_module_type_t mtype;
+	struct prov_group *groups;
+	unsigned int ngroups;
+	unsigned int next_group;
+	pthread_mutex_t lock;
+};
+
+static const char *stage_names[] = {
+	[stage_read] = "read",
+	[stage_modify] = "modify",
+	[stage_write] = "write",
+	[stage_verify] = "verify",
+	[stage_done] = "done",
+};
+
+static double
+elapsed_ms (const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+
+} /* elapsed_ms */
+
+/*
+ * manifest_new_job
+ */
+static struct prov_job *
+manifest_new_job (struct manifest_s *m)
+{
+	struct prov_job *jobs;
+
+	if (m->count >= m->alloc) {
+		unsigned int newalloc = (m->alloc == 0 ? 16 : m->alloc * 2);
+		jobs = realloc(m->jobs, newalloc * sizeof(*jobs));
+		if (jobs == NULL)
+			return NULL;
+		m->jobs = jobs;
+		m->alloc = newalloc;
+	}
+	memset(&m->jobs[m->count], 0, sizeof(m->jobs[0]));
+	return &m->jobs[m->count++];
+
+} /* manifest_new_job */
+
+/*
+ * manifest_add_value
+ *
+ * Records a column value for a job.  Fields are kept in
+ * eeprom_fields[] order, so that major-version is always
+ * applied before the fields that depend on it.
+ */
+static int
+manifest_add_value (struct prov_job *job, const char *name, const char *value,
+		    char *errbuf, size_t errlen)
+{
+	struct prov_field *fields;
+	unsigned int j;
+	int i;
+
+	if (strcasecmp(name, "device") == 0) {
+		free(job->device);
+		job->device = strdup(value);
+		return job->device == NULL ? -1 : 0;
+	}
+	if (strcasecmp(name, "partnumber-type") == 0) {
+		free(job->pntype);
+		job->pntype = strdup(value);
+		return job->pntype == NULL ? -1 : 0;
+	}
+	i = parse_fieldname(name);
+	if (i < 0) {
+		snprintf(errbuf, errlen, "unrecognized field name: %s", name);
+		return -1;
+	}
+	fields = realloc(job->fields, (job->nfields + 1) * sizeof(*fields));
+	if (fields == NULL) {
+		snprintf(errbuf, errlen, "%s", strerror(errno));
+		return -1;
+	}
+	job->fields = fields;
+	for (j = job->nfields; j > 0 && fields[j-1].field > i; j--)
+		fields[j] = fields[j-1];
+	fields[j].field = i;
+	fields[j].value = strdup(value);
+	job->nfields += 1;
+	return fields[j].value == NULL ? -1 : 0;
+
+} /* manifest_add_value */
+
+/*
+ * csv_next_cell
+ *
+ * Extracts the next cell from a CSV line, handling
+ * double-quoted values.  Returns a pointer past the
+ * cell's terminating comma, or NULL at end of line.
+ */
+static char *
+csv_next_cell (char *cp, char **cellp)
+{
+	char *dst;
+
+	while (*cp == ' ' || *cp == '\t')
+		cp++;
+	if (*cp == '"') {
+		*cellp = dst = ++cp;
+		while (*cp != '\0') {
+			if (*cp == '"' && *(cp+1) == '"')
+				cp++;
+			else if (*cp == '"')
+				break;
+			*dst++ = *cp++;
+		}
+		if (*cp == '"')
+			cp++;
+		while (*cp != '\0' && *cp != ',')
+			cp++;
+		*dst = '\0';
+	} else {
+		*cellp = cp;
+		while (*cp != '\0' && *cp != ',')
+			cp++;
+		for (dst = cp; dst > *cellp && (*(dst-1) == ' ' || *(dst-1) == '\t'); dst--);
+		if (*cp == ',') {
+			*dst = '\0';
+			return cp + 1;
+		}
+		*dst = '\0';
+		return NULL;
+	}
+	return (*cp == ',' ? cp + 1 : NULL);
+
+} /* csv_next_cell */
+
+/*
+ * parse_csv_manifest
+ *
+ * The first non-comment line names the columns: 'device',
+ * optionally 'partnumber-type', and EEPROM field names.
+ * Empty cells leave the corresponding field unchanged.
+ */
+static int
+parse_csv_manifest (struct manifest_s *m, char *text, char *errbuf, size_t errlen)
+{
+	char *line, *next, *cp, *cell;
+	char *columns[64];
+	unsigned int ncols = 0, col, lineno = 0;
+	struct prov_job *job;
+
+	for (line = text; line != NULL; line = next) {
+		lineno += 1;
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		cp = line + strlen(line);
+		if (cp > line && *(cp-1) == '\r')
+			*(cp-1) = '\0';
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++);
+		if (*cp == '\0' || *cp == '#')
+			continue;
+		if (ncols == 0) {
+			while (cp != NULL && ncols < sizeof(columns)/sizeof(columns[0])) {
+				cp = csv_next_cell(cp, &cell);
+				columns[ncols++] = cell;
+			}
+			if (cp != NULL) {
+				snprintf(errbuf, errlen, "line %u: too many columns", lineno);
+				return -1;
+			}
+			for (col = 0; col < ncols && strcasecmp(columns[col], "device") != 0; col++);
+			if (col >= ncols) {
+				snprintf(errbuf, errlen, "line %u: no 'device' column", lineno);
+				return -1;
+			}
+			continue;
+		}
+		job = manifest_new_job(m);
+		if (job == NULL) {
+			snprintf(errbuf, errlen, "%s", strerror(errno));
+			return -1;
+		}
+		for (col = 0; cp != NULL; col++) {
+			cp = csv_next_cell(cp, &cell);
+			if (col >= ncols) {
+				snprintf(errbuf, errlen, "line %u: too many values", lineno);
+				return -1;
+			}
+			if (*cell == '\0')
+				continue;
+			if (manifest_add_value(job, columns[col], cell, errbuf, errlen) < 0) {
+				snprintf(errbuf + strlen(errbuf), errlen - strlen(errbuf), " (line %u)", lineno);
+				return -1;
+			}
+		}
+		if (job->device == NULL) {
+			snprintf(errbuf, errlen, "line %u: no device specified", lineno);
+			return -1;
+		}
+	}
+	return 0;
+
+} /* parse_csv_manifest */
+
+static char *
+json_skipws (char *cp)
+{
+	while (*cp == ' ' || *cp == '\t' || *cp == '\r' || *cp == '\n')
+		cp++;
+	return cp;
+
+} /* json_skipws */
+
+/*
+ * json_scalar
+ *
+ * Parses a JSON string, number, or boolean in place,
+ * returning a pointer past it, or NULL on a syntax error.
+ * Only ASCII \u escapes are supported.
+ */
+static char *
+json_scalar (char *cp, char **valp)
+{
+	char *dst;
+	unsigned int u;
+
+	if (*cp != '"') {
+		*valp = cp;
+		while (*cp != '\0' && *cp != ',' && *cp != '}' && *cp != ']' &&
+		       *cp != ' ' && *cp != '\t' && *cp != '\r' && *cp != '\n')
+			cp++;
+		if (cp == *valp)
+			return NULL;
+		if (*cp == '\0')
+			return cp;
+		/*
+		 * Terminating in place would clobber the delimiter,
+		 * so shift the token back over its first character.
+		 */
+		memmove(*valp - 1, *valp, cp - *valp);
+		*valp -= 1;
+		*(cp-1) = '\0';
+		return json_skipws(cp);
+	}
+	*valp = dst = ++cp;
+	while (*cp != '"') {
+		if (*cp == '\0')
+			return NULL;
+		if (*cp == '\\') {
+			cp++;
+			switch (*cp) {
+			case 'n': *dst++ = '\n'; break;
+			case 't': *dst++ = '\t'; break;
+			case 'r': *dst++ = '\r'; break;
+			case 'b': *dst++ = '\b'; break;
+			case 'f': *dst++ = '\f'; break;
+			case 'u':
+				if (sscanf(cp+1, "%4x", &u) != 1 || u > 0x7f)
+					return NULL;
+				*dst++ = (char) u;
+				cp += 4;
+				break;
+			case '\0':
+				return NULL;
+			default:
+				*dst++ = *cp;
+				break;
+			}
+			cp++;
+		} else
+			*dst++ = *cp++;
 	}
+	*dst = '\0';
+	return json_skipws(cp + 1);
+
+} /* json_scalar */
+
+/*
+ * parse_json_manifest
+ *
+ * The manifest is an array of flat objects, each with a
+ * "device" member plus EEPROM field names as keys.
+ */
+static int
+parse_json_manifest (struct manifest_s *m, char *text, char *errbuf, size_t errlen)
+{
+	char *cp = json_skipws(text);
+	char *np, *name, *value;
+	struct prov_job *job;
 
-	for (which = 0; which < sizeof(commands)/sizeof(commands[0])-non_oneshot_commands; which++) {
-		if (strcmp(argv[0], commands[which].cmd) == 0) {
-			dispatch = commands[which].rtn;
+	if (*cp++ != '[')
+		goto syntax_error;
+	cp = json_skipws(cp);
+	if (*cp == ']')
+		return 0;
+	for (;;) {
+		if (*cp++ != '{')
+			goto syntax_error;
+		job = manifest_new_job(m);
+		if (job == NULL) {
+			snprintf(errbuf, errlen, "%s", strerror(errno));
+			return -1;
+		}
+		cp = json_skipws(cp);
+		while (*cp != '}') {
+			if (*cp != '"' || (np = json_scalar(cp, &name)) == NULL || *np != ':')
+				goto syntax_error;
+			cp = json_skipws(np + 1);
+			if ((np = json_scalar(cp, &value)) == NULL)
+				goto syntax_error;
+			cp = np;
+			if (strcmp(value, "null") != 0 &&
+			    manifest_add_value(job, name, value, errbuf, errlen) < 0)
+				return -1;
+			if (*cp == ',')
+				cp = json_skipws(cp + 1);
+			else if (*cp != '}')
+				goto syntax_error;
+		}
+		if (job->device == NULL) {
+			snprintf(errbuf, errlen, "entry %u: no device specified", m->count);
+			return -1;
+		}
+		cp = json_skipws(cp + 1);
+		if (*cp == ']')
 			break;
+		if (*cp++ != ',')
+			goto syntax_error;
+		cp = json_skipws(cp);
+	}
+	return 0;
+
+  syntax_error:
+	snprintf(errbuf, errlen, "JSON syntax error at offset %zd", cp - text);
+	return -1;
+
+} /* parse_json_manifest */
+
+/*
+ * load_manifest
+ */
+static int
+load_manifest (struct manifest_s *m, const char *pathname, char *errbuf, size_t errlen)
+{
+	FILE *fp;
+	char *text = NULL, *cp;
+	size_t len = 0, alloc = 0, n;
+	int ret;
+
+	fp = (strcmp(pathname, "-") == 0 ? stdin : fopen(pathname, "r"));
+	if (fp == NULL) {
+		snprintf(errbuf, errlen, "%s: %s", pathname, strerror(errno));
+		return -1;
+	}
+	do {
+		if (alloc - len < 4096) {
+			cp = realloc(text, alloc + 65536);
+			if (cp == NULL) {
+				free(text);
+				if (fp != stdin)
+					fclose(fp);
+				snprintf(errbuf, errlen, "%s", strerror(errno));
+				return -1;
+			}
+			text = cp;
+			alloc += 65536;
+		}
+		n = fread(text + len, 1, alloc - len - 1, fp);
+		len += n;
+	} while (n > 0);
+	if (fp != stdin)
+		fclose(fp);
+	text[len] = '\0';
+	for (cp = text; *cp == ' ' || *cp == '\t' || *cp == '\r' || *cp == '\n'; cp++);
+	if (*cp == '[')
+		ret = parse_json_manifest(m, text, errbuf, errlen);
+	else
+		ret = parse_csv_manifest(m, text, errbuf, errlen);
+	free(text);
+	return ret;
+
+} /* load_manifest */
+
+static void
+free_manifest (struct manifest_s *m)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < m->count; i++) {
+		for (j = 0; j < m->jobs[i].nfields; j++)
+			free(m->jobs[i].fields[j].value);
+		free(m->jobs[i].fields);
+		free(m->jobs[i].device);
+		free(m->jobs[i].pntype);
+	}
+	free(m->jobs);
+
+} /* free_manifest */
+
+/*
+ * provision_one
+ *
+ * Read, modify, write, and verify a single device.
+ */
+static void
+provision_one (struct prov_job *job, eeprom_module_type_t mtype)
+{
+	struct timespec start, t_read, t_write, t_verify;
+	eeprom_context_t e;
+	module_eeprom_t data, written, readback;
+	unsigned int j;
+	int crc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	job->stage = stage_read;
+	e = open_device(job->device, mtype);
+	if (e == NULL) {
+		job->err = errno;
+		return;
+	}
+	eeprom_read(e, &data);
+	crc = eeprom_crc(e);
+	clock_gettime(CLOCK_MONOTONIC, &t_read);
+	job->read_ms = elapsed_ms(&start, &t_read);
+
+	job->stage = stage_modify;
+	for (j = 0; j < job->nfields; j++) {
+		if (set_field(&data, mtype, job->fields[j].field, job->pntype, job->fields[j].value,
+			      job->errmsg, sizeof(job->errmsg)) < 0) {
+			eeprom_close(e);
+			return;
 		}
 	}
 
-	if (dispatch == NULL) {
-		fprintf(stderr, "Unrecognized command\n");
-		ret = 1;
+	job->stage = stage_write;
+	// fails with ESTALE if someone else has written the device since we read it
+	if ((crc < 0 ? eeprom_write(e, &data) : eeprom_write_if(e, &data, crc)) < 0 ||
+	    eeprom_read(e, &written) < 0) {
+		job->err = errno;
+		eeprom_close(e);
+		return;
+	}
+	eeprom_close(e);
+	clock_gettime(CLOCK_MONOTONIC, &t_write);
+	job->write_ms = elapsed_ms(&t_read, &t_write);
+
+	job->stage = stage_verify;
+	e = open_device(job->device, mtype);
+	if (e == NULL) {
+		job->err = errno;
+		return;
+	}
+	if (eeprom_read(e, &readback) < 0) {
+		job->err = errno;
+		eeprom_close(e);
+		return;
+	}
+	eeprom_close(e);
+	if (memcmp(&written, &readback, sizeof(written)) != 0) {
+		snprintf(job->errmsg, sizeof(job->errmsg), "contents read back do not match");
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_verify);
+	job->verify_ms = elapsed_ms(&t_write, &t_verify);
+	job->total_ms = elapsed_ms(&start, &t_verify);
+	job->stage = stage_done;
+
+} /* provision_one */
+
+/*
+ * provision_worker
+ *
+ * Takes one bus group at a time and works through
+ * its devices sequentially.
+ */
+static void *
+provision_worker (void *arg)
+{
+	struct prov_state *state = arg;
+	struct prov_group *group;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		group = (state->next_group < state->ngroups ? &state->groups[state->next_group++] : NULL);
+		pthread_mutex_unlock(&state->lock);
+		if (group == NULL)
+			break;
+		for (i = 0; i < group->count; i++)
+			provision_one(&state->manifest->jobs[group->jobs[i]], state->mtype);
+	}
+	return NULL;
+
+} /* provision_worker */
+
+static int
+group_compare (const void *a, const void *b)
+{
+	const struct prov_group *ga = a, *gb = b;
+	return (ga->count < gb->count) - (ga->count > gb->count);
+
+} /* group_compare */
+
+/*
+ * do_provision
+ *
+ * Program a set of devices from a manifest, in parallel
+ * across buses.
+ */
+static int
+do_provision (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct manifest_s manifest;
+	struct prov_state state;
+	struct prov_job *job;
+	pthread_t *threads = NULL;
+	struct timespec start, end;
+	char errbuf[256];
+	const eeprom_i2c_adapter_t *adapters, *adapter;
+	unsigned int i, j, g, nthreads, failed = 0;
+	int bus, addr, ret = 1;
+
+	if (argc < 1) {
+		fprintf(stderr, "missing required argument: manifest\n");
+		return 1;
+	}
+	memset(&manifest, 0, sizeof(manifest));
+	memset(&state, 0, sizeof(state));
+	errbuf[0] = '\0';
+	if (load_manifest(&manifest, argv[0], errbuf, sizeof(errbuf)) < 0) {
+		fprintf(stderr, "Error: %s: %s\n", argv[0], errbuf);
+		goto depart;
+	}
+	if (manifest.count == 0) {
+		fprintf(stderr, "Error: %s: no devices in manifest\n", argv[0]);
+		goto depart;
+	}
+
+	/*
+	 * Group the devices by root bus, keeping each group in
+	 * topology order.  Anything that isn't an I2C address gets
+	 * a group to itself.  Groups are started longest-first, so
+	 * the total time approaches that of the busiest bus.
+	 */
+	if (eeprom_i2c_topology(&adapters) < 0)
+		adapters = NULL;
+	state.groups = calloc(manifest.count, sizeof(state.groups[0]));
+	if (state.groups == NULL) {
+		perror("allocating groups");
+		goto depart;
+	}
+	for (i = 0; i < manifest.count; i++) {
+		job = &manifest.jobs[i];
+		job->order = UINT_MAX;
+		if (sscanf(job->device, "%d-%04x", &bus, &addr) == 2) {
+			job->buskey = bus;
+			adapter = (adapters == NULL ? NULL : eeprom_i2c_adapter(bus));
+			if (adapter != NULL) {
+				job->buskey = (int) adapter->root;
+				job->order = (unsigned int) (adapter - adapters);
+			}
+		} else
+			job->buskey = -1 - (int) i;
+		for (g = 0; g < state.ngroups && state.groups[g].buskey != job->buskey; g++);
+		if (g >= state.ngroups) {
+			state.groups[g].buskey = job->buskey;
+			state.groups[g].jobs = calloc(manifest.count, sizeof(unsigned int));
+			if (state.groups[g].jobs == NULL) {
+				perror("allocating groups");
+				goto depart;
+			}
+			state.ngroups += 1;
+		}
+		for (j = state.groups[g].count; j > 0 &&
+			     manifest.jobs[state.groups[g].jobs[j-1]].order > job->order; j--)
+			state.groups[g].jobs[j] = state.groups[g].jobs[j-1];
+		state.groups[g].jobs[j] = i;
+		state.groups[g].count += 1;
+	}
+	qsort(state.groups, state.ngroups, sizeof(state.groups[0]), group_compare);
+
+	state.manifest = &manifest;
+	state.mtype = mtype;
+	pthread_mutex_init(&state.lock, NULL);
+	nthreads = (batch_jobs < state.ngroups ? batch_jobs : state.ngroups);
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("allocating threads");
+		goto depart;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, provision_worker, &state) != 0) {
+			fprintf(stderr, "Error: could not create worker thread\n");
+			break;
+		}
+	}
+	if (i == 0)
+		provision_worker(&state);
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_destroy(&state.lock);
+
+	for (i = 0; i < manifest.count; i++) {
+		job = &manifest.jobs[i];
+		if (job->stage == stage_done) {
+			printf("%s: ok (read %.1f ms, write %.1f ms, verify %.1f ms, total %.1f ms)\n",
+			       job->device, job->read_ms, job->write_ms, job->verify_ms, job->total_ms);
+			continue;
+		}
+		failed += 1;
+		printf("%s: FAILED at %s: %s\n", job->device, stage_names[job->stage],
+		       (job->err != 0 ? strerror(job->err) : job->errmsg));
+	}
+	printf("Provisioned %u of %u devices on %u bus%s in %.1f ms\n",
+	       manifest.count - failed, manifest.count, state.ngroups,
+	       (state.ngroups == 1 ? "" : "es"), elapsed_ms(&start, &end));
+	ret = (failed == 0 ? 0 : 1);
+
+  depart:
+	free(threads);
+	if (state.groups != NULL) {
+		for (g = 0; g < state.ngroups; g++)
+			free(state.groups[g].jobs);
+		free(state.groups);
+	}
+	free_manifest(&manifest);
+	return ret;
+
+} /* do_provision */
+
+/*
+ * do_clone
+ *
+ * Copy one device's raw contents to any number of others,
+ * reading the source only once.  Overrides given before the
+ * first --to apply to every target; those following a --to
+ * apply only to that target.
+ */
+static int
+do_clone (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct {
+		int field;
+		const char *value;
+		int target;	// -1 for all targets
+	} *overrides = NULL;
+	const char **targets = NULL;
+	const char *source = NULL;
+	eeprom_context_t src, e;
+	module_eeprom_t srcdata, data;
+	uint8_t srcimage[EEPROM_IMAGE_SIZE], image[EEPROM_IMAGE_SIZE];
+	struct timespec start, end;
+	char errbuf[256];
+	const char *eq;
+	char fieldname[64];
+	int i, j, ntargets = 0, noverrides = 0, havedata, failed = 0, ret = 1;
+
+	targets = calloc(argc + 1, sizeof(*targets));
+	overrides = calloc(argc + 1, sizeof(*overrides));
+	if (targets == NULL || overrides == NULL) {
+		perror("allocating targets");
+		goto depart;
+	}
+	for (i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) == 0 && i + 1 >= argc) {
+			fprintf(stderr, "Error: missing value for %s\n", argv[i]);
+			goto depart;
+		}
+		if (strcmp(argv[i], "--from") == 0)
+			source = argv[++i];
+		else if (strcmp(argv[i], "--to") == 0)
+			targets[ntargets++] = argv[++i];
+		else if (strcmp(argv[i], "--override") == 0) {
+			i += 1;
+			eq = strchr(argv[i], '=');
+			if (eq == NULL || (size_t) (eq - argv[i]) >= sizeof(fieldname)) {
+				fprintf(stderr, "Error: override must be field=value: %s\n", argv[i]);
+				goto depart;
+			}
+			memcpy(fieldname, argv[i], eq - argv[i]);
+			fieldname[eq - argv[i]] = '\0';
+			overrides[noverrides].field = parse_fieldname(fieldname);
+			if (overrides[noverrides].field < 0) {
+				fprintf(stderr, "unrecognized field name: %s\n", fieldname);
+				goto depart;
+			}
+			overrides[noverrides].value = eq + 1;
+			overrides[noverrides].target = ntargets - 1;
+			noverrides += 1;
+		} else {
+			fprintf(stderr, "Error: unrecognized argument: %s\n", argv[i]);
+			goto depart;
+		}
+	}
+	if (source == NULL || ntargets == 0) {
+		fprintf(stderr, "Error: clone requires --from and at least one --to\n");
+		goto depart;
+	}
+
+	src = open_device(source, mtype);
+	if (src == NULL) {
+		perror(source);
+		goto depart;
+	}
+	havedata = eeprom_read(src, &srcdata) == 0;
+	if (eeprom_get_raw(src, srcimage, sizeof(srcimage)) != sizeof(srcimage) || !havedata) {
+		fprintf(stderr, "Error: %s: no valid EEPROM contents to clone\n", source);
+		eeprom_close(src);
+		goto depart;
+	}
+
+	for (i = 0; i < ntargets; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		memcpy(image, srcimage, sizeof(image));
+		memcpy(&data, &srcdata, sizeof(data));
+		errbuf[0] = '\0';
+		for (j = 0; j < noverrides; j++) {
+			if (overrides[j].target >= 0 && overrides[j].target != i)
+				continue;
+			if (set_field(&data, mtype, overrides[j].field, NULL, overrides[j].value,
+				      errbuf, sizeof(errbuf)) < 0)
+				break;
+			if (eeprom_encode(src, &data, image, sizeof(image)) < 0) {
+				snprintf(errbuf, sizeof(errbuf), "%s", strerror(errno));
+				break;
+			}
+		}
+		if (errbuf[0] == '\0') {
+			e = open_device(targets[i], mtype);
+			if (e == NULL || eeprom_set_raw(e, image, sizeof(image)) < 0)
+				snprintf(errbuf, sizeof(errbuf), "%s", strerror(errno));
+			if (e != NULL)
+				eeprom_close(e);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (errbuf[0] != '\0') {
+			printf("%s: FAILED: %s\n", targets[i], errbuf);
+			failed += 1;
+		} else
+			printf("%s: ok (%.1f ms)\n", targets[i], elapsed_ms(&start, &end));
+	}
+	eeprom_close(src);
+	printf("Cloned %s to %d of %d device%s\n", source, ntargets - failed, ntargets,
+	       (ntargets == 1 ? "" : "s"));
+	ret = (failed == 0 ? 0 : 1);
+
+  depart:
+	free(targets);
+	free(overrides);
+	return ret;
+
+} /* do_clone */
+
+/*
+ * Sets of images for the batch modes, built from image
+ * files, directories of image files, and archives.  Each
+ * image has an index in the set; files that are larger than
+ * an image (plus some slack for dumps with trailing data)
+ * are checked for the archive format.
+ */
+#define IMAGE_FILE_MAX 1024
+
+struct image_source {
+	char *path;
+	eeprom_archive_t archive;
+	uint64_t first;
+	uint64_t count;
+};
+
+struct image_set {
+	struct image_source *sources;
+	unsigned int count;
+	unsigned int alloc;
+	uint64_t total;
+};
+
+/*
+ * image_set_append
+ */
+static int
+image_set_append (struct image_set *set, const char *path, off_t size)
+{
+	struct image_source *src;
+	eeprom_archive_t a = NULL;
+
+	if (size > IMAGE_FILE_MAX) {
+		a = eeprom_archive_open(path);
+		if (a == NULL && errno != EINVAL) {
+			perror(path);
+			return -1;
+		}
+	}
+	if (set->count >= set->alloc) {
+		src = realloc(set->sources, (set->alloc + 256) * sizeof(*src));
+		if (src == NULL) {
+			perror("allocating image set");
+			if (a != NULL)
+				eeprom_archive_close(a);
+			return -1;
+		}
+		set->sources = src;
+		set->alloc += 256;
+	}
+	src = &set->sources[set->count];
+	src->path = strdup(path);
+	if (src->path == NULL) {
+		perror("allocating image set");
+		if (a != NULL)
+			eeprom_archive_close(a);
+		return -1;
+	}
+	src->archive = a;
+	src->first = set->total;
+	src->count = (a == NULL ? 1 : eeprom_archive_count(a));
+	set->total += src->count;
+	set->count += 1;
+	return 0;
+
+} /* image_set_append */
+
+static int
+regular_file (const struct dirent *de)
+{
+	return de->d_type == DT_REG || de->d_type == DT_UNKNOWN;
+
+} /* regular_file */
+
+/*
+ * image_set_add
+ *
+ * Adds a file, archive, or directory to a set.
+ * Directories are scanned (not recursively), in
+ * name order.
+ */
+static int
+image_set_add (struct image_set *set, const char *path)
+{
+	struct dirent **names;
+	struct stat st;
+	char fullpath[PATH_MAX];
+	int i, n, ret = 0;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return image_set_append(set, path, st.st_size);
+	n = scandir(path, &names, regular_file, alphasort);
+	if (n < 0) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", path, names[i]->d_name);
+		free(names[i]);
+		if (ret != 0 || stat(fullpath, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		ret = image_set_append(set, fullpath, st.st_size);
+	}
+	free(names);
+	return ret;
+
+} /* image_set_add */
+
+/*
+ * image_set_source
+ *
+ * Locates the source holding an image.
+ */
+static struct image_source *
+image_set_source (struct image_set *set, uint64_t idx)
+{
+	unsigned int lo = 0, hi = set->count, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (set->sources[mid].first <= idx)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &set->sources[lo];
+
+} /* image_set_source */
+
+/*
+ * image_set_read
+ *
+ * Reads an image from a set.  Safe to call from
+ * multiple threads.
+ */
+static int
+image_set_read (struct image_set *set, uint64_t idx, uint8_t image[EEPROM_IMAGE_SIZE])
+{
+	struct image_source *src = image_set_source(set, idx);
+	size_t total = 0;
+	ssize_t n = 0;
+	int fd;
+
+	if (src->archive != NULL)
+		return eeprom_archive_image(src->archive, idx - src->first, image, EEPROM_IMAGE_SIZE);
+	fd = open(src->path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while (total < EEPROM_IMAGE_SIZE) {
+		n = read(fd, image + total, EEPROM_IMAGE_SIZE - total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	close(fd);
+	if (total < EEPROM_IMAGE_SIZE) {
+		if (n == 0)
+			errno = ENODATA;
+		return -1;
+	}
+	return 0;
+
+} /* image_set_read */
+
+/*
+ * image_set_name
+ *
+ * Formats a name for an image in a set: the file
+ * name, or the archive name and record number.
+ */
+static const char *
+image_set_name (struct image_set *set, uint64_t idx, char *buf, size_t bufsize)
+{
+	struct image_source *src = image_set_source(set, idx);
+
+	if (src->archive == NULL)
+		return src->path;
+	snprintf(buf, bufsize, "%s[%llu]", src->path, (unsigned long long)(idx - src->first));
+	return buf;
+
+} /* image_set_name */
+
+/*
+ * image_set_free
+ */
+static void
+image_set_free (struct image_set *set)
+{
+	unsigned int i;
+
+	for (i = 0; i < set->count; i++) {
+		if (set->sources[i].archive != NULL)
+			eeprom_archive_close(set->sources[i].archive);
+		free(set->sources[i].path);
+	}
+	free(set->sources);
+	memset(set, 0, sizeof(*set));
+
+} /* image_set_free */
+
+/*
+ * do_export
+ *
+ * Pack raw images into an archive.  Archives can be
+ * given as input, to merge them.
+ */
+static int
+do_export (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	eeprom_archive_writer_t w;
+	struct image_set set;
+	struct stat st;
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	char namebuf[PATH_MAX+32];
+	uint64_t i;
+	int arg, ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "missing required arguments: archive, images\n");
+		return 1;
+	}
+	memset(&set, 0, sizeof(set));
+	for (arg = 1; arg < argc; arg++)
+		if (image_set_add(&set, argv[arg]) < 0) {
+			image_set_free(&set);
+			return 1;
+		}
+	w = eeprom_archive_create(argv[0]);
+	if (w == NULL) {
+		perror(argv[0]);
+		image_set_free(&set);
+		return 1;
+	}
+	for (i = 0; i < set.total && ret == 0; i++) {
+		if (image_set_read(&set, i, image) < 0) {
+			fprintf(stderr, "%s: %s\n", image_set_name(&set, i, namebuf, sizeof(namebuf)),
+				(errno == ENODATA ? "too short for an EEPROM image" : strerror(errno)));
+			ret = 1;
+		} else if (eeprom_archive_add(w, image, sizeof(image)) < 0) {
+			perror("writing archive");
+			ret = 1;
+		}
+	}
+	if (eeprom_archive_finish(w) < 0) {
+		perror(argv[0]);
+		ret = 1;
+	}
+	if (ret != 0)
+		unlink(argv[0]);
+	else if (stat(argv[0], &st) == 0)
+		printf("Exported %llu image%s to %s (%lld bytes)\n", (unsigned long long) set.total,
+		       (set.total == 1 ? "" : "s"), argv[0], (long long) st.st_size);
+	image_set_free(&set);
+	return ret;
+
+} /* do_export */
+
+/*
+ * do_import
+ *
+ * Unpack the images in an archive into a directory,
+ * one file per image, numbered in archive order.
+ */
+static int
+do_import (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	eeprom_archive_t a;
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	char path[PATH_MAX];
+	uint64_t i, count;
+	int fd, ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "missing required arguments: archive, directory\n");
+		return 1;
+	}
+	a = eeprom_archive_open(argv[0]);
+	if (a == NULL) {
+		perror(argv[0]);
+		return 1;
+	}
+	if (mkdir(argv[1], 0755) < 0 && errno != EEXIST) {
+		perror(argv[1]);
+		eeprom_archive_close(a);
+		return 1;
+	}
+	count = eeprom_archive_count(a);
+	for (i = 0; i < count; i++) {
+		if (eeprom_archive_image(a, i, image, sizeof(image)) < 0) {
+			fprintf(stderr, "%s: record %llu: %s\n", argv[0], (unsigned long long) i, strerror(errno));
+			ret = 1;
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/%08llu.bin", argv[1], (unsigned long long) i);
+		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if (fd < 0 || write(fd, image, sizeof(image)) != sizeof(image)) {
+			perror(path);
+			if (fd >= 0)
+				close(fd);
+			ret = 1;
+			break;
+		}
+		if (close(fd) < 0) {
+			perror(path);
+			ret = 1;
+			break;
+		}
+	}
+	if (ret == 0)
+		printf("Imported %llu image%s into %s\n", (unsigned long long) count,
+		       (count == 1 ? "" : "s"), argv[1]);
+	eeprom_archive_close(a);
+	return ret;
+
+} /* do_import */
+
+/*
+ * Query support.  A query is a predicate over the fields
+ * of the records in an archive:
+ *
+ *    expr:    term [or term]...
+ *    term:    factor [and factor]...
+ *    factor:  not factor | ( expr ) | field = value | field != value
+ *
+ * where field is one of the names in eeprom_fields[], or
+ * module-type (cvm, cvb, or other), partnumber-type (nvidia or
+ * customer), or mac (any MAC address field, with ethernet
+ * MACs matching anywhere in their range).  Values of string
+ * fields may be shell-style patterns.
+ *
+ * Queries are answered from the archive's index file where
+ * possible.  Each subexpression is evaluated only over the
+ * records that could still match (for 'and', the records
+ * matching its left side), so fields that are not indexed
+ * are read only for those records.
+ */
+enum {
+	query_or,
+	query_and,
+	query_not,
+	query_match,
+};
+
+enum {
+	qtok_end,
+	qtok_word,
+	qtok_lparen,
+	qtok_rparen,
+	qtok_eq,
+	qtok_ne,
+};
+
+struct query_node {
+	int op;
+	struct query_node *left, *right;
+	char *field;
+	char *value;
+};
+
+struct query_parser {
+	const char *cp;
+	int tok;
+	char word[256];
+};
+
+struct query_state {
+	eeprom_archive_t a;
+	eeprom_archive_index_t x;
+	uint64_t nrecords;
+	size_t nwords;
+	uint64_t scanned;
+};
+
+static struct query_node *query_parse_expr(struct query_parser *p);
+
+/*
+ * query_next
+ *
+ * Reads the next token.  Words may be double-quoted.
+ */
+static int
+query_next (struct query_parser *p)
+{
+	size_t len = 0;
+	int quoted = 0;
+
+	while (isspace(*p->cp))
+		p->cp += 1;
+	p->word[0] = '\0';
+	switch (*p->cp) {
+	case '\0':
+		return (p->tok = qtok_end);
+	case '(':
+		p->cp += 1;
+		return (p->tok = qtok_lparen);
+	case ')':
+		p->cp += 1;
+		return (p->tok = qtok_rparen);
+	case '=':
+		p->cp += 1;
+		return (p->tok = qtok_eq);
+	case '!':
+		if (p->cp[1] == '=') {
+			p->cp += 2;
+			return (p->tok = qtok_ne);
+		}
+		break;
+	default:
+		break;
+	}
+	while (*p->cp != '\0') {
+		if (*p->cp == '"') {
+			quoted = !quoted;
+			p->cp += 1;
+			continue;
+		}
+		if (!quoted && (isspace(*p->cp) || strchr("()=!", *p->cp) != NULL))
+			break;
+		if (len < sizeof(p->word) - 1)
+			p->word[len++] = *p->cp;
+		p->cp += 1;
+	}
+	p->word[len] = '\0';
+	return (p->tok = qtok_word);
+
+} /* query_next */
+
+/*
+ * query_free
+ */
+static void
+query_free (struct query_node *n)
+{
+	if (n == NULL)
+		return;
+	query_free(n->left);
+	query_free(n->right);
+	free(n->field);
+	free(n->value);
+	free(n);
+
+} /* query_free */
+
+/*
+ * query_node_new
+ */
+static struct query_node *
+query_node_new (int op, struct query_node *left, struct query_node *right)
+{
+	struct query_node *n = calloc(1, sizeof(*n));
+
+	if (n == NULL) {
+		perror("query");
+		query_free(left);
+		query_free(right);
+		return NULL;
+	}
+	n->op = op;
+	n->left = left;
+	n->right = right;
+	return n;
+
+} /* query_node_new */
+
+/*
+ * query_field_valid
+ */
+static int
+query_field_valid (const char *name)
+{
+	unsigned int i;
+
+	if (strcasecmp(name, "mac") == 0 || strcasecmp(name, "module-type") == 0 ||
+	    strcasecmp(name, "partnumber-type") == 0)
+		return 1;
+	for (i = 0; i < EEPROM_FIELD_COUNT; i++)
+		if (strcasecmp(name, eeprom_fields[i].name) == 0)
+			return 1;
+	return 0;
+
+} /* query_field_valid */
+
+/*
+ * query_parse_factor
+ */
+static struct query_node *
+query_parse_factor (struct query_parser *p)
+{
+	struct query_node *n;
+	int negate;
+
+	if (p->tok == qtok_lparen) {
+		query_next(p);
+		n = query_parse_expr(p);
+		if (n == NULL)
+			return NULL;
+		if (p->tok != qtok_rparen) {
+			fprintf(stderr, "query: missing ')'\n");
+			query_free(n);
+			return NULL;
+		}
+		query_next(p);
+		return n;
+	}
+	if (p->tok != qtok_word) {
+		fprintf(stderr, "query: expected a field name\n");
+		return NULL;
+	}
+	if (strcasecmp(p->word, "not") == 0) {
+		query_next(p);
+		n = query_parse_factor(p);
+		return (n == NULL ? NULL : query_node_new(query_not, n, NULL));
+	}
+	if (!query_field_valid(p->word)) {
+		fprintf(stderr, "query: unrecognized field: %s\n", p->word);
+		return NULL;
+	}
+	n = query_node_new(query_match, NULL, NULL);
+	if (n == NULL)
+		return NULL;
+	n->field = strdup(p->word);
+	query_next(p);
+	if (p->tok != qtok_eq && p->tok != qtok_ne) {
+		fprintf(stderr, "query: expected '=' or '!=' after %s\n", n->field);
+		query_free(n);
+		return NULL;
+	}
+	negate = (p->tok == qtok_ne);
+	if (query_next(p) != qtok_word) {
+		fprintf(stderr, "query: missing value for %s\n", n->field);
+		query_free(n);
+		return NULL;
+	}
+	n->value = strdup(p->word);
+	if (n->field == NULL || n->value == NULL) {
+		perror("query");
+		query_free(n);
+		return NULL;
+	}
+	query_next(p);
+	return (negate ? query_node_new(query_not, n, NULL) : n);
+
+} /* query_parse_factor */
+
+/*
+ * query_parse_term
+ */
+static struct query_node *
+query_parse_term (struct query_parser *p)
+{
+	struct query_node *n, *right;
+
+	n = query_parse_factor(p);
+	while (n != NULL && p->tok == qtok_word && strcasecmp(p->word, "and") == 0) {
+		query_next(p);
+		right = query_parse_factor(p);
+		if (right == NULL) {
+			query_free(n);
+			return NULL;
+		}
+		n = query_node_new(query_and, n, right);
+	}
+	return n;
+
+} /* query_parse_term */
+
+/*
+ * query_parse_expr
+ */
+static struct query_node *
+query_parse_expr (struct query_parser *p)
+{
+	struct query_node *n, *right;
+
+	n = query_parse_term(p);
+	while (n != NULL && p->tok == qtok_word && strcasecmp(p->word, "or") == 0) {
+		query_next(p);
+		right = query_parse_term(p);
+		if (right == NULL) {
+			query_free(n);
+			return NULL;
+		}
+		n = query_node_new(query_or, n, right);
+	}
+	return n;
+
+} /* query_parse_expr */
+
+/*
+ * query_scan
+ *
+ * Matches a field that is not indexed, by reading its
+ * column for each of the candidate records.
+ */
+static int
+query_scan (struct query_state *state, const struct query_node *n, const uint64_t *mask, uint64_t *result)
+{
+	int f = eeprom_layout_field_index(n->field);
+	int column = eeprom_archive_column(state->a, n->field);
+	int vcolumn = eeprom_archive_column(state->a, "major-version");
+	unsigned int minversion = 0, i;
+	const uint8_t *val, *ver;
+	char str[64];
+	unsigned long v;
+	uint64_t r, bits;
+	size_t w, len;
+
+	if (f < 0 || column < 0 || vcolumn < 0) {
+		fprintf(stderr, "query: %s: not in archive\n", n->field);
+		return -1;
+	}
+	for (i = 0; i < EEPROM_FIELD_COUNT; i++)
+		if (strcasecmp(n->field, eeprom_fields[i].name) == 0)
+			minversion = eeprom_fields[i].min_layout_version;
+	for (w = 0; w < state->nwords; w++) {
+		for (bits = mask[w]; bits != 0; bits &= bits - 1) {
+			r = w * 64 + __builtin_ctzll(bits);
+			val = eeprom_archive_field(state->a, r, column, NULL);
+			ver = eeprom_archive_field(state->a, r, vcolumn, NULL);
+			if (val == NULL || ver == NULL) {
+				fprintf(stderr, "query: record %llu: %s\n", (unsigned long long) r, strerror(errno));
+				return -1;
+			}
+			state->scanned += 1;
+			if (*ver < minversion)
+				continue;
+			if (eeprom_layout_fields[f].kind == layout_field_uint) {
+				for (v = 0, i = eeprom_layout_fields[f].size; i > 0; i--)
+					v = (v << 8) | val[i-1];
+				snprintf(str, sizeof(str), "%lu", v);
+			} else {
+				len = eeprom_layout_fields[f].size;
+				if (len >= sizeof(str))
+					len = sizeof(str) - 1;
+				while (len > 0 && (val[len-1] == 0 || val[len-1] == 0xff || val[len-1] == ' '))
+					len -= 1;
+				memcpy(str, val, len);
+				str[len] = '\0';
+			}
+			if (fnmatch(n->value, str, 0) == 0)
+				result[w] |= 1ULL << (r % 64);
+		}
+	}
+	return 0;
+
+} /* query_scan */
+
+/*
+ * query_eval
+ *
+ * Returns a bitmap of the records in mask that match
+ * the expression, or NULL on error.
+ */
+static uint64_t *
+query_eval (struct query_state *state, const struct query_node *n, const uint64_t *mask)
+{
+	uint64_t *result, *other;
+	uint8_t macbytes[6];
+	uint64_t mac;
+	int64_t found;
+	size_t w;
+	int f;
+
+	if (n->op == query_and) {
+		other = query_eval(state, n->left, mask);
+		if (other == NULL)
+			return NULL;
+		result = query_eval(state, n->right, other);
+		free(other);
+		return result;
+	}
+	result = calloc(state->nwords ? state->nwords : 1, sizeof(uint64_t));
+	if (result == NULL) {
+		perror("query");
+		return NULL;
+	}
+	switch (n->op) {
+	case query_or:
+	case query_not:
+		other = query_eval(state, n->left, mask);
+		if (other == NULL)
+			break;
+		for (w = 0; w < state->nwords; w++)
+			result[w] = (n->op == query_not ? mask[w] & ~other[w] : other[w]);
+		free(other);
+		if (n->op == query_not)
+			return result;
+		other = query_eval(state, n->right, mask);
+		if (other == NULL)
+			break;
+		for (w = 0; w < state->nwords; w++)
+			result[w] |= other[w];
+		free(other);
+		return result;
+	case query_match:
+		f = eeprom_layout_field_index(n->field);
+		if (strcasecmp(n->field, "mac") == 0 ||
+		    (f >= 0 && eeprom_layout_fields[f].kind == layout_field_macaddr)) {
+			if (parse_macaddr(macbytes, n->value) < 0) {
+				fprintf(stderr, "query: invalid MAC address: %s\n", n->value);
+				break;
+			}
+			for (mac = 0, w = 0; w < 6; w++)
+				mac = (mac << 8) | macbytes[w];
+			found = eeprom_archive_index_mac(state->x, (f < 0 ? NULL : n->field), mac, result);
+		} else {
+			found = eeprom_archive_index_lookup(state->x, n->field, n->value, result);
+			if (found < 0 && errno == ENOENT) {
+				if (query_scan(state, n, mask, result) < 0)
+					break;
+				return result;
+			}
+		}
+		if (found < 0) {
+			fprintf(stderr, "query: %s=%s: %s\n", n->field, n->value, strerror(errno));
+			break;
+		}
+		for (w = 0; w < state->nwords; w++)
+			result[w] &= mask[w];
+		return result;
+	default:
+		break;
+	}
+	free(result);
+	return NULL;
+
+} /* query_eval */
+
+/*
+ * do_query
+ *
+ * List the records in an archive matching a query,
+ * building (or rebuilding) its index file if needed.
+ */
+static int
+do_query (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct query_state state;
+	struct query_parser parser;
+	struct query_node *query = NULL;
+	struct timespec start, end;
+	const char *archive = NULL, *indexpath = NULL;
+	char defaultindex[PATH_MAX], *text = NULL, *newp;
+	uint64_t *all = NULL, *result = NULL, matched = 0, r, bits;
+	size_t textlen = 0, w;
+	int arg, reindex = 0, countonly = 0, ret = 1;
+
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++) {
+		if (archive == NULL && strcmp(argv[arg], "--index") == 0) {
+			if (++arg >= argc) {
+				fprintf(stderr, "missing value for --index\n");
+				return 1;
+			}
+			indexpath = argv[arg];
+		} else if (archive == NULL && strcmp(argv[arg], "--reindex") == 0)
+			reindex = 1;
+		else if (archive == NULL && strcmp(argv[arg], "--count") == 0)
+			countonly = 1;
+		else if (archive == NULL)
+			archive = argv[arg];
+		else {
+			newp = realloc(text, textlen + strlen(argv[arg]) + 2);
+			if (newp == NULL) {
+				perror("query");
+				goto depart;
+			}
+			text = newp;
+			textlen += sprintf(text + textlen, "%s%s", (textlen > 0 ? " " : ""), argv[arg]);
+		}
+	}
+	if (archive == NULL || text == NULL) {
+		fprintf(stderr, "required: archive and query\n");
+		goto depart;
+	}
+	if (indexpath == NULL) {
+		if ((size_t) snprintf(defaultindex, sizeof(defaultindex), "%s.idx", archive) >= sizeof(defaultindex)) {
+			fprintf(stderr, "%s: %s\n", archive, strerror(ENAMETOOLONG));
+			goto depart;
+		}
+		indexpath = defaultindex;
+	}
+	parser.cp = text;
+	query_next(&parser);
+	query = query_parse_expr(&parser);
+	if (query == NULL)
+		goto depart;
+	if (parser.tok != qtok_end) {
+		fprintf(stderr, "query: unexpected '%s'\n", (parser.tok == qtok_word ? parser.word :
+							       parser.tok == qtok_rparen ? ")" : "="));
+		goto depart;
+	}
+
+	state.a = eeprom_archive_open(archive);
+	if (state.a == NULL) {
+		perror(archive);
+		goto depart;
+	}
+	state.nrecords = eeprom_archive_count(state.a);
+	state.nwords = (state.nrecords + 63) / 64;
+	if (!reindex) {
+		state.x = eeprom_archive_index_open(state.a, indexpath);
+		if (state.x == NULL && errno != ENOENT && errno != ESTALE) {
+			perror(indexpath);
+			goto depart;
+		}
+	}
+	if (state.x == NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (eeprom_archive_index_build(state.a, indexpath) < 0 ||
+		    (state.x = eeprom_archive_index_open(state.a, indexpath)) == NULL) {
+			perror(indexpath);
+			goto depart;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stderr, "Indexed %llu records into %s in %.1f ms\n", (unsigned long long) state.nrecords,
+			indexpath, elapsed_ms(&start, &end));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	all = calloc(state.nwords ? state.nwords : 1, sizeof(uint64_t));
+	if (all == NULL) {
+		perror("query");
+		goto depart;
+	}
+	for (r = 0; r < state.nrecords; r++)
+		all[r / 64] |= 1ULL << (r % 64);
+	result = query_eval(&state, query, all);
+	if (result == NULL)
+		goto depart;
+	for (w = 0; w < state.nwords; w++) {
+		for (bits = result[w]; bits != 0; bits &= bits - 1) {
+			matched += 1;
+			if (!countonly)
+				printf("%s[%llu]\n", archive, (unsigned long long) (w * 64 + __builtin_ctzll(bits)));
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (countonly)
+		printf("%llu\n", (unsigned long long) matched);
+	fprintf(stderr, "%llu of %llu records matched in %.1f ms (%llu column values read)\n",
+		(unsigned long long) matched, (unsigned long long) state.nrecords,
+		elapsed_ms(&start, &end), (unsigned long long) state.scanned);
+	ret = (matched > 0 ? 0 : 1);
+
+  depart:
+	free(all);
+	free(result);
+	free(text);
+	query_free(query);
+	if (state.x != NULL)
+		eeprom_archive_index_close(state.x);
+	if (state.a != NULL)
+		eeprom_archive_close(state.a);
+	return ret;
+
+} /* do_query */
+
+/*
+ * Audit support.  Each identifying value in an image (every
+ * MAC address, expanding the ethernet MAC ranges, and the
+ * serial number and asset ID) is a key.  Images are processed
+ * in batches: worker threads extract keys from their share of
+ * the batch into per-shard lists, then each shard of the index
+ * is updated by a single thread, so no locking is needed.  The
+ * index holds one entry per distinct key, recording the first
+ * image it was seen in.
+ */
+#define AUDIT_SHARDS	64
+#define AUDIT_BATCH	65536
+#define AUDIT_KEYLEN	15
+
+enum {
+	audit_mac,
+	audit_serial,
+	audit_asset,
+};
+
+static const struct {
+	const char *name;
+	size_t offset;
+	size_t length;
+	size_t countoffset;	// 0 if not a range
+	int kind;
+	uint8_t min_layout_version;
+} audit_fields[] = {
+	{ "factory-default-wifi-mac", offsetof(struct module_eeprom_v1_raw, factory_default_wifi_mac), 6, 0, audit_mac, 1 },
+	{ "factory-default-bt-mac", offsetof(struct module_eeprom_v1_raw, factory_default_bt_mac), 6, 0, audit_mac, 1 },
+	{ "factory-default-wifi-alt-mac", offsetof(struct module_eeprom_v1_raw, factory_default_wifi_alt_mac), 6, 0, audit_mac, 1 },
+	{ "factory-default-ether-mac", offsetof(struct module_eeprom_v1_raw, factory_default_ether_mac), 6,
+	  offsetof(struct module_eeprom_v1_raw, ether_mac_count_v2), audit_mac, 1 },
+	{ "vendor-wifi-mac", offsetof(struct module_eeprom_v1_raw, vendor_wifi_mac), 6, 0, audit_mac, 1 },
+	{ "vendor-bt-mac", offsetof(struct module_eeprom_v1_raw, vendor_bt_mac), 6, 0, audit_mac, 1 },
+	{ "vendor-ether-mac", offsetof(struct module_eeprom_v1_raw, vendor_ether_mac), 6,
+	  offsetof(struct module_eeprom_v1_raw, vendor_ether_mac_count_v2), audit_mac, 1 },
+	{ "asset-id", offsetof(struct module_eeprom_v1_raw, asset_id), 15, 0, audit_asset, 1 },
+	{ "system-serialnumber", offsetof(struct module_eeprom_v1_raw, system_serialnumber_v2), 15, 0, audit_serial, 2 },
+};
+#define AUDIT_FIELD_COUNT (sizeof(audit_fields)/sizeof(audit_fields[0]))
+
+struct audit_key {
+	uint64_t hash;
+	uint64_t record;
+	uint8_t kind;
+	uint8_t field;
+	uint8_t len;	// 0 marks an empty index slot
+	uint8_t value[AUDIT_KEYLEN];
+};
+
+struct audit_hit {
+	struct audit_key first;
+	uint64_t record;
+	uint8_t field;
+};
+
+struct audit_list {
+	struct audit_key *keys;
+	size_t count;
+	size_t alloc;
+};
+
+struct audit_shard {
+	struct audit_key *table;
+	size_t size;
+	size_t used;
+	struct audit_hit *hits;
+	size_t nhits;
+	size_t hitalloc;
+	int failed;
+};
+
+struct audit_state {
+	struct image_set *set;
+	uint64_t batch_start;
+	uint64_t batch_end;
+	unsigned int nthreads;
+	struct audit_list (*lists)[AUDIT_SHARDS];
+	uint64_t *keycounts;
+	uint64_t *readfailures;
+	struct audit_shard shards[AUDIT_SHARDS];
+};
+
+struct audit_worker {
+	struct audit_state *state;
+	unsigned int index;
+};
+
+static uint64_t
+audit_hash (const struct audit_key *k)
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned int i;
+
+	h = (h ^ k->kind) * 1099511628211ULL;
+	for (i = 0; i < k->len; i++)
+		h = (h ^ k->value[i]) * 1099511628211ULL;
+	return h;
+
+} /* audit_hash */
+
+/*
+ * audit_add_key
+ *
+ * Queues a key for the shard chosen by the top bits
+ * of its hash; the low bits pick the index slot.
+ */
+static int
+audit_add_key (struct audit_state *state, unsigned int t, struct audit_key *k)
+{
+	struct audit_list *list;
+	struct audit_key *keys;
+
+	k->hash = audit_hash(k);
+	list = &state->lists[t][k->hash >> 58];
+	if (list->count >= list->alloc) {
+		keys = realloc(list->keys, (list->alloc + 1024) * sizeof(*keys));
+		if (keys == NULL)
+			return -1;
+		list->keys = keys;
+		list->alloc += 1024;
+	}
+	list->keys[list->count++] = *k;
+	state->keycounts[t] += 1;
+	return 0;
+
+} /* audit_add_key */
+
+/*
+ * audit_extract
+ *
+ * Adds the keys for one image.  MAC addresses that are
+ * unset (all zeros or all ones) and empty strings are
+ * skipped.
+ */
+static int
+audit_extract (struct audit_state *state, unsigned int t, uint64_t record, const uint8_t *image)
+{
+	const struct module_eeprom_v1_raw *raw = (const struct module_eeprom_v1_raw *) image;
+	struct audit_key k;
+	uint64_t mac;
+	unsigned int f, i, count;
+	size_t len;
+
+	memset(&k, 0, sizeof(k));
+	k.record = record;
+	for (f = 0; f < AUDIT_FIELD_COUNT; f++) {
+		if (raw->major_version < audit_fields[f].min_layout_version)
+			continue;
+		k.kind = audit_fields[f].kind;
+		k.field = f;
+		if (k.kind != audit_mac) {
+			len = audit_fields[f].length;
+			while (len > 0 && (image[audit_fields[f].offset+len-1] == 0 ||
+					   image[audit_fields[f].offset+len-1] == 0xff ||
+					   image[audit_fields[f].offset+len-1] == ' '))
+				len -= 1;
+			if (len == 0)
+				continue;
+			memcpy(k.value, image + audit_fields[f].offset, len);
+			k.len = len;
+			if (audit_add_key(state, t, &k) < 0)
+				return -1;
+			continue;
+		}
+		// stored little-endian
+		for (mac = 0, i = 0; i < 6; i++)
+			mac = (mac << 8) | image[audit_fields[f].offset+5-i];
+		if (mac == 0 || mac == 0xffffffffffffULL)
+			continue;
+		count = 1;
+		if (audit_fields[f].countoffset != 0 && raw->major_version >= LAYOUT_VERSION_V2 &&
+		    image[audit_fields[f].countoffset] != 0 && image[audit_fields[f].countoffset] != 0xff)
+			count = image[audit_fields[f].countoffset];
+		k.len = 6;
+		for (i = 0; i < count; i++, mac = (mac + 1) & 0xffffffffffffULL) {
+			k.value[0] = mac >> 40;
+			k.value[1] = mac >> 32;
+			k.value[2] = mac >> 24;
+			k.value[3] = mac >> 16;
+			k.value[4] = mac >> 8;
+			k.value[5] = mac;
+			if (audit_add_key(state, t, &k) < 0)
+				return -1;
+		}
+	}
+	return 0;
+
+} /* audit_extract */
+
+/*
+ * audit_extract_worker
+ */
+static void *
+audit_extract_worker (void *arg)
+{
+	struct audit_worker *w = arg;
+	struct audit_state *state = w->state;
+	uint64_t n = state->batch_end - state->batch_start;
+	uint64_t first = state->batch_start + n * w->index / state->nthreads;
+	uint64_t last = state->batch_start + n * (w->index + 1) / state->nthreads;
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	char namebuf[PATH_MAX+32];
+	uint64_t i;
+
+	for (i = first; i < last; i++) {
+		if (image_set_read(state->set, i, image) < 0) {
+			fprintf(stderr, "%s: %s\n", image_set_name(state->set, i, namebuf, sizeof(namebuf)),
+				(errno == ENODATA ? "too short for an EEPROM image" : strerror(errno)));
+			state->readfailures[w->index] += 1;
+			continue;
+		}
+		if (audit_extract(state, w->index, i, image) < 0) {
+			state->readfailures[w->index] += 1;
+			perror("allocating keys");
+			break;
+		}
+	}
+	return NULL;
+
+} /* audit_extract_worker */
+
+/*
+ * audit_insert
+ */
+static int
+audit_insert (struct audit_shard *shard, const struct audit_key *k)
+{
+	struct audit_key *table, *slot;
+	struct audit_hit *hits;
+	size_t i, newsize;
+
+	if ((shard->used + 1) * 2 > shard->size) {
+		newsize = (shard->size == 0 ? 1024 : shard->size * 2);
+		table = calloc(newsize, sizeof(*table));
+		if (table == NULL)
+			return -1;
+		for (i = 0; i < shard->size; i++) {
+			if (shard->table[i].len == 0)
+				continue;
+			slot = &table[shard->table[i].hash & (newsize - 1)];
+			while (slot->len != 0)
+				slot = (slot == &table[newsize-1] ? table : slot + 1);
+			*slot = shard->table[i];
+		}
+		free(shard->table);
+		shard->table = table;
+		shard->size = newsize;
+	}
+	slot = &shard->table[k->hash & (shard->size - 1)];
+	while (slot->len != 0) {
+		if (slot->hash == k->hash && slot->kind == k->kind && slot->len == k->len &&
+		    memcmp(slot->value, k->value, k->len) == 0) {
+			if (slot->record == k->record)
+				return 0;
+			if (shard->nhits >= shard->hitalloc) {
+				hits = realloc(shard->hits, (shard->hitalloc + 256) * sizeof(*hits));
+				if (hits == NULL)
+					return -1;
+				shard->hits = hits;
+				shard->hitalloc += 256;
+			}
+			shard->hits[shard->nhits].first = *slot;
+			shard->hits[shard->nhits].record = k->record;
+			shard->hits[shard->nhits].field = k->field;
+			shard->nhits += 1;
+			return 0;
+		}
+		slot = (slot == &shard->table[shard->size-1] ? shard->table : slot + 1);
+	}
+	*slot = *k;
+	shard->used += 1;
+	return 0;
+
+} /* audit_insert */
+
+/*
+ * audit_insert_worker
+ *
+ * Updates every nthreads'th shard with the keys queued by
+ * all of the extraction workers, in thread order (and so in
+ * image order).
+ */
+static void *
+audit_insert_worker (void *arg)
+{
+	struct audit_worker *w = arg;
+	struct audit_state *state = w->state;
+	struct audit_list *list;
+	unsigned int s, t;
+	size_t i;
+
+	for (s = w->index; s < AUDIT_SHARDS; s += state->nthreads) {
+		for (t = 0; t < state->nthreads; t++) {
+			list = &state->lists[t][s];
+			for (i = 0; i < list->count && !state->shards[s].failed; i++)
+				if (audit_insert(&state->shards[s], &list->keys[i]) < 0)
+					state->shards[s].failed = 1;
+			list->count = 0;
+		}
+	}
+	return NULL;
+
+} /* audit_insert_worker */
+
+/*
+ * run_phase
+ *
+ * Runs a phase of a batch job across the worker threads
+ * (one per element of the workers array), falling back to
+ * the calling thread for any that cannot be created.
+ */
+static void
+run_phase (unsigned int nthreads, void *workers, size_t workersize,
+	   pthread_t *threads, void *(*routine)(void *))
+{
+	unsigned int i, n;
+
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, routine, (char *) workers + n * workersize) != 0)
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	for (i = n; i < nthreads; i++)
+		routine((char *) workers + i * workersize);
+
+} /* run_phase */
+
+static uint64_t
+mac_value (const uint8_t *v)
+{
+	return ((uint64_t) v[0] << 40) | ((uint64_t) v[1] << 32) | ((uint64_t) v[2] << 24) |
+		((uint64_t) v[3] << 16) | ((uint64_t) v[4] << 8) | v[5];
+
+} /* mac_value */
+
+static int
+hit_compare (const void *a, const void *b)
+{
+	const struct audit_hit *ha = a, *hb = b;
+
+	if (ha->first.kind != hb->first.kind)
+		return (ha->first.kind > hb->first.kind) - (ha->first.kind < hb->first.kind);
+	if (ha->first.record != hb->first.record)
+		return (ha->first.record > hb->first.record) - (ha->first.record < hb->first.record);
+	if (ha->record != hb->record)
+		return (ha->record > hb->record) - (ha->record < hb->record);
+	if (ha->first.field != hb->first.field)
+		return (ha->first.field > hb->first.field) - (ha->first.field < hb->first.field);
+	if (ha->field != hb->field)
+		return (ha->field > hb->field) - (ha->field < hb->field);
+	return memcmp(ha->first.value, hb->first.value, AUDIT_KEYLEN);
+
+} /* hit_compare */
+
+/*
+ * audit_report
+ *
+ * Prints the collisions, combining runs of consecutive
+ * MAC addresses between the same pair of fields into
+ * a single overlapping-range report.  Returns the number
+ * of collisions reported.
+ */
+static size_t
+audit_report (struct audit_state *state)
+{
+	struct audit_hit *hits, *h;
+	char name1[PATH_MAX+32], name2[PATH_MAX+32], mac1[32], mac2[32];
+	const char *n1, *n2;
+	size_t nhits = 0, i, j, reported = 0;
+	unsigned int s;
+
+	for (s = 0; s < AUDIT_SHARDS; s++)
+		nhits += state->shards[s].nhits;
+	if (nhits == 0)
+		return 0;
+	hits = malloc(nhits * sizeof(*hits));
+	if (hits == NULL) {
+		perror("allocating report");
+		return nhits;
+	}
+	for (nhits = 0, s = 0; s < AUDIT_SHARDS; s++) {
+		memcpy(hits + nhits, state->shards[s].hits, state->shards[s].nhits * sizeof(*hits));
+		nhits += state->shards[s].nhits;
+	}
+	qsort(hits, nhits, sizeof(*hits), hit_compare);
+
+	for (i = 0; i < nhits; i = j) {
+		h = &hits[i];
+		for (j = i + 1; h->first.kind == audit_mac && j < nhits; j++)
+			if (hits[j].first.kind != audit_mac || hits[j].first.record != h->first.record ||
+			    hits[j].record != h->record || hits[j].first.field != h->first.field ||
+			    hits[j].field != h->field ||
+			    mac_value(hits[j].first.value) != mac_value(hits[j-1].first.value) + 1)
+				break;
+		n1 = image_set_name(state->set, h->first.record, name1, sizeof(name1));
+		n2 = image_set_name(state->set, h->record, name2, sizeof(name2));
+		reported += 1;
+		if (h->first.kind != audit_mac) {
+			printf("duplicate %s '%.*s': %s, %s\n", audit_fields[h->first.field].name,
+			       h->first.len, (const char *) h->first.value, n1, n2);
+			continue;
+		}
+		format_macaddr(mac1, sizeof(mac1), h->first.value);
+		if (j - i == 1) {
+			printf("duplicate MAC %s: %s (%s), %s (%s)\n", mac1,
+			       n1, audit_fields[h->first.field].name, n2, audit_fields[h->field].name);
+			continue;
+		}
+		format_macaddr(mac2, sizeof(mac2), hits[j-1].first.value);
+		printf("overlapping MAC ranges %s-%s (%zu addresses): %s (%s), %s (%s)\n", mac1, mac2, j - i,
+		       n1, audit_fields[h->first.field].name, n2, audit_fields[h->field].name);
+	}
+	free(hits);
+	return reported;
+
+} /* audit_report */
+
+/*
+ * do_audit
+ *
+ * Check a set of images for duplicated MAC addresses,
+ * serial numbers, and asset IDs.
+ */
+static int
+do_audit (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct image_set set;
+	struct audit_state state;
+	struct audit_worker *workers = NULL;
+	pthread_t *threads = NULL;
+	struct timespec start, end;
+	uint64_t keys = 0, distinct = 0, failures = 0;
+	size_t collisions;
+	unsigned int i, s;
+	int arg, ret = 1;
+
+	if (argc < 1) {
+		fprintf(stderr, "missing required argument: images\n");
+		return 1;
+	}
+	memset(&set, 0, sizeof(set));
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++)
+		if (image_set_add(&set, argv[arg]) < 0)
+			goto depart;
+	state.set = &set;
+	state.nthreads = batch_jobs;
+	state.lists = calloc(state.nthreads, sizeof(state.lists[0]));
+	state.keycounts = calloc(state.nthreads, sizeof(uint64_t));
+	state.readfailures = calloc(state.nthreads, sizeof(uint64_t));
+	workers = calloc(state.nthreads, sizeof(*workers));
+	threads = calloc(state.nthreads, sizeof(pthread_t));
+	if (state.lists == NULL || state.keycounts == NULL || state.readfailures == NULL ||
+	    workers == NULL || threads == NULL) {
+		perror("allocating audit state");
+		goto depart;
+	}
+	for (i = 0; i < state.nthreads; i++) {
+		workers[i].state = &state;
+		workers[i].index = i;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (state.batch_start = 0; state.batch_start < set.total; state.batch_start = state.batch_end) {
+		state.batch_end = state.batch_start + AUDIT_BATCH;
+		if (state.batch_end > set.total)
+			state.batch_end = set.total;
+		run_phase(state.nthreads, workers, sizeof(*workers), threads, audit_extract_worker);
+		run_phase(state.nthreads, workers, sizeof(*workers), threads, audit_insert_worker);
+		for (s = 0; s < AUDIT_SHARDS; s++)
+			if (state.shards[s].failed) {
+				fprintf(stderr, "Error: out of memory building index\n");
+				goto depart;
+			}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	collisions = audit_report(&state);
+	for (i = 0; i < state.nthreads; i++) {
+		keys += state.keycounts[i];
+		failures += state.readfailures[i];
+	}
+	for (s = 0; s < AUDIT_SHARDS; s++)
+		distinct += state.shards[s].used;
+	printf("Audited %llu image%s (%llu keys, %llu distinct) in %.1f ms: %zu collision%s",
+	       (unsigned long long)(set.total - failures), (set.total - failures == 1 ? "" : "s"),
+	       (unsigned long long) keys, (unsigned long long) distinct, elapsed_ms(&start, &end),
+	       collisions, (collisions == 1 ? "" : "s"));
+	if (failures > 0)
+		printf(", %llu unreadable", (unsigned long long) failures);
+	printf("\n");
+	ret = (collisions == 0 && failures == 0 ? 0 : 1);
+
+  depart:
+	if (state.lists != NULL) {
+		for (i = 0; i < state.nthreads; i++)
+			for (s = 0; s < AUDIT_SHARDS; s++)
+				free(state.lists[i][s].keys);
+		free(state.lists);
+	}
+	for (s = 0; s < AUDIT_SHARDS; s++) {
+		free(state.shards[s].table);
+		free(state.shards[s].hits);
+	}
+	free(state.keycounts);
+	free(state.readfailures);
+	free(workers);
+	free(threads);
+	image_set_free(&set);
+	return ret;
+
+} /* do_audit */
+
+/*
+ * Diff support.  Two image sets (say, nightly snapshots of a
+ * fleet) are joined on a key field with a hash join: the old
+ * set is loaded into an index sharded by key hash, then the
+ * new set is probed against it, in batches, with the keys
+ * extracted by all the workers and each shard handled by a
+ * single thread, as for audits.  Images are compared by CRC,
+ * length, and a digest of the whole image first, and field by
+ * field only when those differ.  The change report is a CSV
+ * file, one row per changed field, written out as each batch
+ * is finished.
+ */
+#define DIFF_SHARDS	64
+#define DIFF_BATCH	65536
+#define DIFF_KEYLEN	15
+#define DIFF_VALLEN	(EEPROM_IMAGE_SIZE * 2 + 1)	// a field's value, in hex if need be
+#define DIFF_CELLLEN	(2 * (PATH_MAX + 32) + 3)	// an image name, quoted
+
+struct diff_entry {
+	uint64_t hash;
+	uint64_t digest;
+	uint64_t record;
+	uint16_t length;
+	uint8_t crc;
+	uint8_t keylen;		// 0 marks an empty index slot
+	uint8_t matched;
+	uint8_t key[DIFF_KEYLEN];
+};
+
+struct diff_list {
+	struct diff_entry *entries;
+	size_t count;
+	size_t alloc;
+};
+
+struct diff_shard {
+	struct diff_entry *table;
+	size_t size;
+	size_t used;
+	char *out;
+	size_t outlen;
+	size_t outalloc;
+	uint64_t unchanged, changed, added, removed, duplicates;
+	int failed;
+};
+
+struct diff_state {
+	struct image_set *sets[2];
+	int side;		// set the current batch is from
+	int keyfield;
+	uint64_t batch_start;
+	uint64_t batch_end;
+	uint8_t *images;	// the current batch
+	unsigned int nthreads;
+	struct diff_list (*lists)[DIFF_SHARDS];
+	uint64_t *unkeyed;	// per thread and side
+	uint64_t *readfailures;
+	struct diff_shard shards[DIFF_SHARDS];
+};
+
+struct diff_worker {
+	struct diff_state *state;
+	unsigned int index;
+};
+
+/*
+ * diff_digest
+ *
+ * 64-bit digest of a whole image, to tell images with the
+ * same CRC and length apart.
+ */
+static uint64_t
+diff_digest (const uint8_t *image)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+	unsigned int i;
+
+	for (i = 0; i < EEPROM_IMAGE_SIZE; i += sizeof(w)) {
+		memcpy(&w, image + i, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return h;
+
+} /* diff_digest */
+
+/*
+ * diff_extract_worker
+ *
+ * Reads this worker's share of the batch, and queues
+ * an entry for each image by the shard for its key.
+ * Images with an empty key field are counted and
+ * otherwise skipped.
+ */
+static void *
+diff_extract_worker (void *arg)
+{
+	struct diff_worker *w = arg;
+	struct diff_state *state = w->state;
+	struct image_set *set = state->sets[state->side];
+	const eeprom_layout_field_t *kf = &eeprom_layout_fields[state->keyfield];
+	uint64_t n = state->batch_end - state->batch_start;
+	uint64_t first = state->batch_start + n * w->index / state->nthreads;
+	uint64_t last = state->batch_start + n * (w->index + 1) / state->nthreads;
+	struct diff_list *list;
+	struct diff_entry e, *entries;
+	char namebuf[PATH_MAX+32];
+	uint8_t *image;
+	size_t len;
+	uint64_t i;
+	unsigned int k;
+
+	memset(&e, 0, sizeof(e));
+	for (i = first; i < last; i++) {
+		image = state->images + (i - state->batch_start) * EEPROM_IMAGE_SIZE;
+		if (image_set_read(set, i, image) < 0) {
+			fprintf(stderr, "%s: %s\n", image_set_name(set, i, namebuf, sizeof(namebuf)),
+				(errno == ENODATA ? "too short for an EEPROM image" : strerror(errno)));
+			state->readfailures[w->index] += 1;
+			continue;
+		}
+		len = kf->size;
+		while (len > 0 && (image[kf->offset+len-1] == 0 || image[kf->offset+len-1] == 0xff ||
+				   image[kf->offset+len-1] == ' '))
+			len -= 1;
+		if (len == 0) {
+			state->unkeyed[w->index * 2 + state->side] += 1;
+			continue;
+		}
+		e.keylen = len;
+		memset(e.key, 0, sizeof(e.key));
+		memcpy(e.key, image + kf->offset, len);
+		e.hash = 14695981039346656037ULL;
+		for (k = 0; k < len; k++)
+			e.hash = (e.hash ^ e.key[k]) * 1099511628211ULL;
+		e.record = i;
+		e.crc = image[EEPROM_IMAGE_SIZE-1];
+		e.length = image[offsetof(struct module_eeprom_v1_raw, length)] |
+			(image[offsetof(struct module_eeprom_v1_raw, length)+1] << 8);
+		e.digest = diff_digest(image);
+		list = &state->lists[w->index][e.hash >> 58];
+		if (list->count >= list->alloc) {
+			entries = realloc(list->entries, (list->alloc + 1024) * sizeof(*entries));
+			if (entries == NULL) {
+				perror("allocating keys");
+				state->readfailures[w->index] += last - i;
+				break;
+			}
+			list->entries = entries;
+			list->alloc += 1024;
+		}
+		list->entries[list->count++] = e;
+	}
+	return NULL;
+
+} /* diff_extract_worker */
+
+/*
+ * diff_out
+ *
+ * Appends to a shard's pending output.
+ */
+static void
+diff_out (struct diff_shard *shard, const char *fmt, ...)
+{
+	va_list ap;
+	char *newp;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(shard->out + shard->outlen, shard->outalloc - shard->outlen, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (shard->outlen + n < shard->outalloc)
+			break;
+		newp = realloc(shard->out, shard->outalloc + n + 65536);
+		if (newp == NULL) {
+			shard->failed = 1;
+			return;
+		}
+		shard->out = newp;
+		shard->outalloc += n + 65536;
+	}
+	shard->outlen += n;
+
+} /* diff_out */
+
+/*
+ * diff_csv
+ *
+ * Formats a value as a CSV cell, quoting it if needed.
+ * A value that does not fit is cut short and ends
+ * with "...".
+ */
+static const char *
+diff_csv (char *buf, size_t bufsize, const char *value)
+{
+	size_t o = 0;
+
+	if (strpbrk(value, ",\"\n") == NULL)
+		return value;
+	buf[o++] = '"';
+	for (; *value != '\0'; value++) {
+		if (o + (*value == '"' ? 2 : 1) + 5 > bufsize) {
+			memcpy(buf + o, "...", 3);
+			o += 3;
+			break;
+		}
+		if (*value == '"')
+			buf[o++] = '"';
+		buf[o++] = *value;
+	}
+	buf[o++] = '"';
+	buf[o] = '\0';
+	return buf;
+
+} /* diff_csv */
+
+/*
+ * diff_format_field
+ *
+ * Formats a field of a raw image for the report.  Any
+ * field fits in DIFF_VALLEN; in a smaller buffer, a value
+ * that does not fit is cut short and ends with "...".
+ */
+static void
+diff_format_field (char *buf, size_t bufsize, const eeprom_layout_field_t *f, const uint8_t *image)
+{
+	const uint8_t *v = image + f->offset;
+	size_t len, i, o = 0;
+	unsigned long val = 0;
+
+	switch (f->kind) {
+	case layout_field_uint:
+		for (i = f->size; i > 0; i--)
+			val = (val << 8) | v[i-1];
+		snprintf(buf, bufsize, "%lu", val);
+		return;
+	case layout_field_macaddr:
+		snprintf(buf, bufsize, "%02x:%02x:%02x:%02x:%02x:%02x", v[5], v[4], v[3], v[2], v[1], v[0]);
+		return;
+	case layout_field_string:
+		len = f->size;
+		while (len > 0 && (v[len-1] == 0 || v[len-1] == 0xff))
+			len -= 1;
+		for (i = 0; i < len && isprint(v[i]); i++);
+		if (i >= len && len < bufsize) {
+			memcpy(buf, v, len);
+			buf[len] = '\0';
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+	for (i = 0; i < f->size; i++) {
+		if (o + 6 > bufsize) {
+			strcpy(buf + o, "...");
+			return;
+		}
+		o += snprintf(buf + o, bufsize - o, "%02x", v[i]);
+	}
+	buf[o] = '\0';
+
+} /* diff_format_field */
+
+/*
+ * diff_row
+ *
+ * Adds a row to the report.
+ */
+static void
+diff_row (struct diff_state *state, struct diff_shard *shard, const struct diff_entry *e,
+	  const char *change, const char *field, const char *oldval, const char *newval,
+	  int64_t oldrec, int64_t newrec)
+{
+	char key[DIFF_KEYLEN+1], namebuf[2][PATH_MAX+32], cells[5][DIFF_CELLLEN];
+
+	memcpy(key, e->key, e->keylen);
+	key[e->keylen] = '\0';
+	diff_out(shard, "%s,%s,%s,%s,%s,%s,%s\n", diff_csv(cells[0], sizeof(cells[0]), key), change, field,
+		 diff_csv(cells[1], sizeof(cells[1]), oldval), diff_csv(cells[2], sizeof(cells[2]), newval),
+		 (oldrec < 0 ? "" : diff_csv(cells[3], sizeof(cells[3]),
+					     image_set_name(state->sets[0], oldrec, namebuf[0], sizeof(namebuf[0])))),
+		 (newrec < 0 ? "" : diff_csv(cells[4], sizeof(cells[4]),
+					     image_set_name(state->sets[1], newrec, namebuf[1], sizeof(namebuf[1])))));
+
+} /* diff_row */
+
+/*
+ * diff_lookup
+ *
+ * Finds the slot for a key in a shard's index: either
+ * the entry with that key, or the empty slot for it.
+ */
+static struct diff_entry *
+diff_lookup (struct diff_shard *shard, const struct diff_entry *e)
+{
+	struct diff_entry *slot = &shard->table[e->hash & (shard->size - 1)];
+
+	while (slot->keylen != 0) {
+		if (slot->hash == e->hash && slot->keylen == e->keylen &&
+		    memcmp(slot->key, e->key, e->keylen) == 0)
+			break;
+		slot = (slot == &shard->table[shard->size-1] ? shard->table : slot + 1);
+	}
+	return slot;
+
+} /* diff_lookup */
+
+/*
+ * diff_insert
+ *
+ * Adds an old image's entry to a shard's index.  A key
+ * that is already there is reported as a duplicate.
+ */
+static int
+diff_insert (struct diff_state *state, struct diff_shard *shard, const struct diff_entry *e)
+{
+	struct diff_entry *table, *slot;
+	size_t i, newsize;
+
+	if ((shard->used + 1) * 2 > shard->size) {
+		newsize = (shard->size == 0 ? 1024 : shard->size * 2);
+		table = calloc(newsize, sizeof(*table));
+		if (table == NULL)
+			return -1;
+		for (i = 0; i < shard->size; i++) {
+			if (shard->table[i].keylen == 0)
+				continue;
+			slot = &table[shard->table[i].hash & (newsize - 1)];
+			while (slot->keylen != 0)
+				slot = (slot == &table[newsize-1] ? table : slot + 1);
+			*slot = shard->table[i];
+		}
+		free(shard->table);
+		shard->table = table;
+		shard->size = newsize;
+	}
+	slot = diff_lookup(shard, e);
+	if (slot->keylen != 0) {
+		diff_row(state, shard, e, "duplicate-old", "", "", "", e->record, -1);
+		shard->duplicates += 1;
+		return 0;
+	}
+	*slot = *e;
+	shard->used += 1;
+	return 0;
+
+} /* diff_insert */
+
+/*
+ * diff_compare
+ *
+ * Compares a new image with the old one that has the
+ * same key, reporting each field that differs.
+ */
+static void
+diff_compare (struct diff_state *state, struct diff_shard *shard, struct diff_entry *old,
+	      const struct diff_entry *e)
+{
+	const uint8_t *newimage = state->images + (e->record - state->batch_start) * EEPROM_IMAGE_SIZE;
+	uint8_t oldimage[EEPROM_IMAGE_SIZE];
+	char oldval[DIFF_VALLEN], newval[DIFF_VALLEN];
+	const eeprom_layout_field_t *f;
+	unsigned int i;
+
+	if (old->crc == e->crc && old->length == e->length && old->digest == e->digest) {
+		shard->unchanged += 1;
+		return;
+	}
+	if (image_set_read(state->sets[0], old->record, oldimage) < 0) {
+		diff_row(state, shard, e, "unreadable", "", "", "", old->record, e->record);
+		shard->changed += 1;
+		return;
+	}
+	if (memcmp(oldimage, newimage, EEPROM_IMAGE_SIZE) == 0) {
+		shard->unchanged += 1;
+		return;
+	}
+	shard->changed += 1;
+	for (i = 0; i < eeprom_layout_field_count; i++) {
+		f = &eeprom_layout_fields[i];
+		if (f->offset == offsetof(struct module_eeprom_v1_raw, crc8) ||
+		    memcmp(oldimage + f->offset, newimage + f->offset, f->size) == 0)
+			continue;
+		diff_format_field(oldval, sizeof(oldval), f, oldimage);
+		diff_format_field(newval, sizeof(newval), f, newimage);
+		diff_row(state, shard, e, "changed", f->name, oldval, newval, old->record, e->record);
+	}
+
+} /* diff_compare */
+
+/*
+ * diff_join_worker
+ *
+ * Handles every nthreads'th shard: inserts the queued
+ * entries when loading the old set, or probes with them
+ * when going through the new set.  The queues are taken
+ * in thread order, and so in image order.
+ */
+static void *
+diff_join_worker (void *arg)
+{
+	struct diff_worker *w = arg;
+	struct diff_state *state = w->state;
+	struct diff_shard *shard;
+	struct diff_list *list;
+	struct diff_entry *slot;
+	unsigned int s, t;
+	size_t i;
+
+	for (s = w->index; s < DIFF_SHARDS; s += state->nthreads) {
+		shard = &state->shards[s];
+		for (t = 0; t < state->nthreads; t++) {
+			list = &state->lists[t][s];
+			for (i = 0; i < list->count && !shard->failed; i++) {
+				if (state->side == 0) {
+					if (diff_insert(state, shard, &list->entries[i]) < 0)
+						shard->failed = 1;
+					continue;
+				}
+				slot = (shard->size == 0 ? NULL : diff_lookup(shard, &list->entries[i]));
+				if (slot == NULL || slot->keylen == 0) {
+					diff_row(state, shard, &list->entries[i], "added", "", "", "",
+						 -1, list->entries[i].record);
+					shard->added += 1;
+				} else if (slot->matched) {
+					diff_row(state, shard, &list->entries[i], "duplicate-new", "", "", "",
+						 -1, list->entries[i].record);
+					shard->duplicates += 1;
+				} else {
+					slot->matched = 1;
+					diff_compare(state, shard, slot, &list->entries[i]);
+				}
+			}
+			list->count = 0;
+		}
+	}
+	return NULL;
+
+} /* diff_join_worker */
+
+/*
+ * diff_removed_worker
+ *
+ * Reports the old images whose keys were not
+ * found in the new set.
+ */
+static void *
+diff_removed_worker (void *arg)
+{
+	struct diff_worker *w = arg;
+	struct diff_state *state = w->state;
+	struct diff_shard *shard;
+	unsigned int s;
+	size_t i;
+
+	for (s = w->index; s < DIFF_SHARDS; s += state->nthreads) {
+		shard = &state->shards[s];
+		for (i = 0; i < shard->size; i++) {
+			if (shard->table[i].keylen == 0 || shard->table[i].matched)
+				continue;
+			diff_row(state, shard, &shard->table[i], "removed", "", "", "", shard->table[i].record, -1);
+			shard->removed += 1;
+		}
+	}
+	return NULL;
+
+} /* diff_removed_worker */
+
+/*
+ * diff_flush
+ *
+ * Writes out the shards' pending report rows, in shard
+ * order.  Returns -1 if a shard ran out of memory.
+ */
+static int
+diff_flush (struct diff_state *state, FILE *fp)
+{
+	unsigned int s;
+	int ret = 0;
+
+	for (s = 0; s < DIFF_SHARDS; s++) {
+		if (state->shards[s].outlen > 0)
+			fwrite(state->shards[s].out, 1, state->shards[s].outlen, fp);
+		state->shards[s].outlen = 0;
+		if (state->shards[s].failed)
+			ret = -1;
+	}
+	fflush(fp);
+	return ret;
+
+} /* diff_flush */
+
+/*
+ * do_diff
+ *
+ * Report the changes between two sets of images,
+ * matched up by serial number or asset ID.
+ */
+static int
+do_diff (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct image_set sets[2];
+	struct diff_state state;
+	struct diff_worker *workers = NULL;
+	pthread_t *threads = NULL;
+	struct timespec start, end;
+	struct diff_shard *shard;
+	const char *keyname = "system-serialnumber", *output = NULL, *paths[2];
+	FILE *fp = stdout, *summary;
+	uint64_t unchanged = 0, changed = 0, added = 0, removed = 0, duplicates = 0;
+	uint64_t unkeyed[2] = { 0, 0 }, failures = 0;
+	unsigned int i, s, npaths = 0;
+	int arg, side, ret = 1;
+
+	memset(sets, 0, sizeof(sets));
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--key") == 0 || strcmp(argv[arg], "--output") == 0) {
+			if (arg + 1 >= argc) {
+				fprintf(stderr, "missing value for %s\n", argv[arg]);
+				return 1;
+			}
+			if (strcmp(argv[arg], "--key") == 0)
+				keyname = argv[++arg];
+			else
+				output = argv[++arg];
+		} else if (npaths < 2)
+			paths[npaths++] = argv[arg];
+		else {
+			fprintf(stderr, "unrecognized argument: %s\n", argv[arg]);
+			return 1;
+		}
+	}
+	if (npaths != 2) {
+		fprintf(stderr, "required: old and new image sets\n");
+		return 1;
+	}
+	if (strcasecmp(keyname, "serial") == 0)
+		keyname = "system-serialnumber";
+	state.keyfield = eeprom_layout_field_index(keyname);
+	if (state.keyfield < 0 || (strcasecmp(keyname, "system-serialnumber") != 0 &&
+				   strcasecmp(keyname, "asset-id") != 0)) {
+		fprintf(stderr, "key must be system-serialnumber (serial) or asset-id\n");
+		return 1;
+	}
+	for (side = 0; side < 2; side++) {
+		if (image_set_add(&sets[side], paths[side]) < 0)
+			goto depart;
+		state.sets[side] = &sets[side];
+	}
+	state.nthreads = batch_jobs;
+	state.lists = calloc(state.nthreads, sizeof(state.lists[0]));
+	state.unkeyed = calloc(state.nthreads * 2, sizeof(uint64_t));
+	state.readfailures = calloc(state.nthreads, sizeof(uint64_t));
+	state.images = malloc((size_t) DIFF_BATCH * EEPROM_IMAGE_SIZE);
+	workers = calloc(state.nthreads, sizeof(*workers));
+	threads = calloc(state.nthreads, sizeof(pthread_t));
+	if (state.lists == NULL || state.unkeyed == NULL || state.readfailures == NULL ||
+	    state.images == NULL || workers == NULL || threads == NULL) {
+		perror("allocating diff state");
+		goto depart;
+	}
+	for (i = 0; i < state.nthreads; i++) {
+		workers[i].state = &state;
+		workers[i].index = i;
+	}
+	if (output != NULL) {
+		fp = fopen(output, "w");
+		if (fp == NULL) {
+			perror(output);
+			goto depart;
+		}
+	}
+	fprintf(fp, "key,change,field,old,new,old_image,new_image\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (side = 0; side < 2; side++) {
+		state.side = side;
+		for (state.batch_start = 0; state.batch_start < sets[side].total; state.batch_start = state.batch_end) {
+			state.batch_end = state.batch_start + DIFF_BATCH;
+			if (state.batch_end > sets[side].total)
+				state.batch_end = sets[side].total;
+			run_phase(state.nthreads, workers, sizeof(*workers), threads, diff_extract_worker);
+			run_phase(state.nthreads, workers, sizeof(*workers), threads, diff_join_worker);
+			if (diff_flush(&state, fp) < 0) {
+				fprintf(stderr, "Error: out of memory building index\n");
+				goto depart;
+			}
+		}
+	}
+	run_phase(state.nthreads, workers, sizeof(*workers), threads, diff_removed_worker);
+	if (diff_flush(&state, fp) < 0) {
+		fprintf(stderr, "Error: out of memory reporting changes\n");
+		goto depart;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (s = 0; s < DIFF_SHARDS; s++) {
+		shard = &state.shards[s];
+		unchanged += shard->unchanged;
+		changed += shard->changed;
+		added += shard->added;
+		removed += shard->removed;
+		duplicates += shard->duplicates;
+	}
+	for (i = 0; i < state.nthreads; i++) {
+		unkeyed[0] += state.unkeyed[i * 2];
+		unkeyed[1] += state.unkeyed[i * 2 + 1];
+		failures += state.readfailures[i];
+	}
+	summary = (output == NULL ? stderr : stdout);
+	fprintf(summary, "Compared %llu old and %llu new images by %s in %.1f ms: "
+		"%llu unchanged, %llu changed, %llu added, %llu removed",
+		(unsigned long long) sets[0].total, (unsigned long long) sets[1].total,
+		eeprom_layout_fields[state.keyfield].name, elapsed_ms(&start, &end),
+		(unsigned long long) unchanged, (unsigned long long) changed,
+		(unsigned long long) added, (unsigned long long) removed);
+	if (duplicates > 0)
+		fprintf(summary, ", %llu duplicate keys", (unsigned long long) duplicates);
+	if (unkeyed[0] + unkeyed[1] > 0)
+		fprintf(summary, ", %llu/%llu without a key", (unsigned long long) unkeyed[0],
+			(unsigned long long) unkeyed[1]);
+	if (failures > 0)
+		fprintf(summary, ", %llu unreadable", (unsigned long long) failures);
+	fprintf(summary, "\n");
+	ret = (changed + added + removed + duplicates + failures == 0 ? 0 : 1);
+
+  depart:
+	if (fp != stdout && fp != NULL)
+		fclose(fp);
+	if (state.lists != NULL) {
+		for (i = 0; i < state.nthreads; i++)
+			for (s = 0; s < DIFF_SHARDS; s++)
+				free(state.lists[i][s].entries);
+		free(state.lists);
+	}
+	for (s = 0; s < DIFF_SHARDS; s++) {
+		free(state.shards[s].table);
+		free(state.shards[s].out);
+	}
+	free(state.unkeyed);
+	free(state.readfailures);
+	free(state.images);
+	free(workers);
+	free(threads);
+	image_set_free(&sets[0]);
+	image_set_free(&sets[1]);
+	return ret;
+
+} /* do_diff */
+
+/*
+ * Repair analysis.  Workers take images from the set one at
+ * a time, and print the analysis for each image with a CRC
+ * mismatch as a unit.
+ */
+struct repair_state {
+	struct image_set *set;
+	int list_all;
+	pthread_mutex_t lock;
+	uint64_t next;
+	uint64_t valid;
+	uint64_t unique;
+	uint64_t ambiguous;
+	uint64_t failed;
+};
+
+static const char *
+layout_field_name (unsigned int offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < eeprom_layout_field_count; i++)
+		if (offset >= eeprom_layout_fields[i].offset &&
+		    offset < eeprom_layout_fields[i].offset + eeprom_layout_fields[i].size)
+			return eeprom_layout_fields[i].name;
+	return "?";
+
+} /* layout_field_name */
+
+/*
+ * repair_worker
+ */
+static void *
+repair_worker (void *arg)
+{
+	struct repair_state *state = arg;
+	eeprom_repair_candidate_t cands[EEPROM_REPAIR_MAX_CANDIDATES];
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	char namebuf[PATH_MAX+32], out[32768];
+	const char *name;
+	size_t len;
+	uint64_t idx;
+	int i, n, bits, singles, best;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		idx = state->next++;
+		pthread_mutex_unlock(&state->lock);
+		if (idx >= state->set->total)
+			break;
+		name = image_set_name(state->set, idx, namebuf, sizeof(namebuf));
+		if (image_set_read(state->set, idx, image) < 0 ||
+		    (n = eeprom_repair_candidates(image, sizeof(image), cands, EEPROM_REPAIR_MAX_CANDIDATES)) < 0) {
+			fprintf(stderr, "%s: %s\n", name, (errno == ENODATA ? "too short for an EEPROM image" : strerror(errno)));
+			pthread_mutex_lock(&state->lock);
+			state->failed += 1;
+			pthread_mutex_unlock(&state->lock);
+			continue;
+		}
+		if (n == 0) {
+			pthread_mutex_lock(&state->lock);
+			state->valid += 1;
+			pthread_mutex_unlock(&state->lock);
+			continue;
+		}
+		len = snprintf(out, sizeof(out), "%s: CRC mismatch\n", name);
+		for (i = singles = best = 0; i < n; i++) {
+			bits = __builtin_popcount(cands[i].mask);
+			if (bits == 1 && cands[i].checks_passed == cands[0].checks_passed)
+				best += 1;
+			if (bits == 1)
+				singles += 1;
+			else if (!state->list_all)
+				continue;
+			if (len < sizeof(out))
+				len += snprintf(out + len, sizeof(out) - len,
+						"    offset %3u (%s): xor 0x%02x, %d bit%s, %u/%u checks\n",
+						cands[i].offset, layout_field_name(cands[i].offset), cands[i].mask,
+						bits, (bits == 1 ? "" : "s"), cands[i].checks_passed, EEPROM_REPAIR_CHECKS);
+		}
+		if (!state->list_all && len < sizeof(out))
+			snprintf(out + len, sizeof(out) - len, "    (%d single-byte candidates not shown)\n", n - singles);
+		pthread_mutex_lock(&state->lock);
+		fputs(out, stdout);
+		if (best == 1)
+			state->unique += 1;
+		else
+			state->ambiguous += 1;
+		pthread_mutex_unlock(&state->lock);
+	}
+	return NULL;
+
+} /* repair_worker */
+
+/*
+ * do_repair
+ *
+ * Report the single-bit (and, with --all, single-byte)
+ * corrections that would make each image's CRC match.
+ */
+static int
+do_repair (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct image_set set;
+	struct repair_state state;
+	pthread_t *threads = NULL;
+	unsigned int i, nthreads;
+	int arg, ret = 1;
+
+	memset(&set, 0, sizeof(set));
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--all") == 0)
+			state.list_all = 1;
+		else if (image_set_add(&set, argv[arg]) < 0)
+			goto depart;
+	}
+	if (set.count == 0) {
+		fprintf(stderr, "missing required argument: images\n");
+		goto depart;
+	}
+	state.set = &set;
+	pthread_mutex_init(&state.lock, NULL);
+	nthreads = (set.total < batch_jobs ? (unsigned int) set.total : batch_jobs);
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("allocating threads");
+		pthread_mutex_destroy(&state.lock);
+		goto depart;
+	}
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, repair_worker, &state) != 0)
+			break;
+	if (i == 0)
+		repair_worker(&state);
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&state.lock);
+	printf("Checked %llu image%s: %llu valid, %llu with a unique single-bit repair, %llu ambiguous",
+	       (unsigned long long) set.total, (set.total == 1 ? "" : "s"),
+	       (unsigned long long) state.valid, (unsigned long long) state.unique,
+	       (unsigned long long) state.ambiguous);
+	if (state.failed > 0)
+		printf(", %llu unreadable", (unsigned long long) state.failed);
+	printf("\n");
+	ret = (state.failed == 0 ? 0 : 1);
+
+  depart:
+	free(threads);
+	image_set_free(&set);
+	return ret;
+
+} /* do_repair */
+
+/*
+ * Synthetic image generation, for testing the batch modes at
+ * scale.  Every choice made for image i comes from a random
+ * stream seeded by the corpus seed and i, so images can be
+ * generated in parallel and any one of them reproduced by
+ * itself.  The module type and the duplicated-MAC choice have
+ * streams of their own, so that a duplicate can find the MAC
+ * address of the image it copies without generating all of it.
+ *
+ * Each CVM image is assigned a block of GEN_MACS_PER_IMAGE
+ * addresses (WiFi, Bluetooth, then the ethernet range), so
+ * apart from the deliberate duplicates, no addresses collide.
+ * Serial numbers and asset IDs are unique.  Corruption is a
+ * single bit flipped after the CRC is computed.
+ */
+#define GEN_BATCH		65536
+#define GEN_SLICE		1024
+#define GEN_MACS_PER_IMAGE	8
+#define GEN_MAC_BASE		0x48b02d000000ULL
+#define GEN_SERIAL_BASE		1420000000000ULL
+#define GEN_ASSET_BASE		1650000000000ULL
+
+enum {
+	gen_stream_fields,
+	gen_stream_type,
+	gen_stream_duplicate,
+};
+
+static const unsigned int gen_cvm_boards[] = { 2888, 3448, 3668, 3701, 3767 };
+static const unsigned int gen_cvb_boards[] = { 2822, 3449, 3509, 3737, 3768 };
+static const char *gen_revisions[] = { "200", "300", "400", "500", "A00", "B01" };
+
+/*
+ * Fields whose padding varies between NUL and 0xff
+ */
+static const struct {
+	size_t offset;
+	size_t size;
+	unsigned int min_layout_version;
+} gen_padded_fields[] = {
+	{ offsetof(struct module_eeprom_v1_raw, partnumber), 22, 1 },
+	{ offsetof(struct module_eeprom_v1_raw, asset_id), 15, 1 },
+	{ offsetof(struct module_eeprom_v1_raw, system_partnumber_v2), 21, 2 },
+	{ offsetof(struct module_eeprom_v1_raw, system_serialnumber_v2), 15, 2 },
+};
+
+struct gen_truth {
+	module_eeprom_t data;
+	eeprom_module_type_t mtype;
+	int padff;
+	int64_t duplicate_of;
+	int corrupt_offset;
+	uint8_t corrupt_mask;
+};
+
+struct gen_state {
+	uint64_t seed;
+	uint64_t first;
+	uint64_t count;
+	double corrupt;
+	double duplicate;
+	const char *dir;
+	uint8_t *images;
+	struct gen_truth *truth;
+	pthread_mutex_t lock;
+	uint64_t next;
+	int failed;
+};
+
+/*
+ * gen_random
+ *
+ * splitmix64
+ */
+static uint64_t
+gen_random (uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+
+} /* gen_random */
+
+/*
+ * gen_stream
+ */
+static uint64_t
+gen_stream (uint64_t seed, uint64_t idx, unsigned int which)
+{
+	uint64_t state = seed ^ (idx * 0xd1b54a32d192ed03ULL) ^ ((uint64_t) which << 56);
+
+	return gen_random(&state);
+
+} /* gen_stream */
+
+/*
+ * gen_chance
+ *
+ * Returns 1 with the given probability.
+ */
+static int
+gen_chance (uint64_t *state, double probability)
+{
+	return (gen_random(state) >> 11) * 0x1.0p-53 < probability;
+
+} /* gen_chance */
+
+/*
+ * gen_is_cvm
+ */
+static int
+gen_is_cvm (uint64_t seed, uint64_t idx)
+{
+	uint64_t state = gen_stream(seed, idx, gen_stream_type);
+
+	return (gen_random(&state) & 1) == 0;
+
+} /* gen_is_cvm */
+
+/*
+ * gen_duplicate_source
+ *
+ * Returns the (CVM) image whose ethernet MAC address this
+ * (CVM) image duplicates, or -1.
+ */
+static int64_t
+gen_duplicate_source (uint64_t seed, uint64_t idx, double fraction)
+{
+	uint64_t state = gen_stream(seed, idx, gen_stream_duplicate);
+	uint64_t src;
+	int tries;
+
+	if (idx == 0 || !gen_chance(&state, fraction))
+		return -1;
+	for (tries = 0; tries < 8; tries++) {
+		src = gen_random(&state) % idx;
+		if (gen_is_cvm(seed, src))
+			return (int64_t) src;
+	}
+	return -1;
+
+} /* gen_duplicate_source */
+
+/*
+ * gen_macaddr
+ */
+static void
+gen_macaddr (uint8_t addr[6], uint64_t value)
+{
+	int i;
+
+	for (i = 5; i >= 0; i--, value >>= 8)
+		addr[i] = value & 0xff;
+
+} /* gen_macaddr */
+
+/*
+ * gen_image
+ *
+ * Generates one image and its ground truth.
+ */
+static int
+gen_image (struct gen_state *state, uint64_t idx, uint8_t image[EEPROM_IMAGE_SIZE], struct gen_truth *truth)
+{
+	module_eeprom_t *data = &truth->data;
+	uint64_t rng = gen_stream(state->seed, idx, gen_stream_fields);
+	uint64_t macbase, owner;
+	int64_t src;
+	unsigned int board, i, j;
+	int len;
+
+	memset(truth, 0, sizeof(*truth));
+	truth->mtype = (gen_is_cvm(state->seed, idx) ? module_type_cvm : module_type_cvb);
+	truth->duplicate_of = -1;
+	truth->corrupt_offset = -1;
+	data->major_version = (gen_random(&rng) & 1) ? LAYOUT_VERSION_V2 : LAYOUT_VERSION_V1;
+	if (gen_chance(&rng, 0.25)) {
+		data->partnumber_type = partnum_type_customer;
+		snprintf(data->partnumber, sizeof(data->partnumber), "CUST-%05u-%c%02u",
+			 (unsigned int) (gen_random(&rng) % 100000), 'A' + (int) (gen_random(&rng) % 26),
+			 (unsigned int) (gen_random(&rng) % 100));
+	} else {
+		data->partnumber_type = partnum_type_nvidia;
+		if (truth->mtype == module_type_cvm)
+			board = gen_cvm_boards[gen_random(&rng) % (sizeof(gen_cvm_boards)/sizeof(gen_cvm_boards[0]))];
+		else
+			board = gen_cvb_boards[gen_random(&rng) % (sizeof(gen_cvb_boards)/sizeof(gen_cvb_boards[0]))];
+		snprintf(data->partnumber, sizeof(data->partnumber), "699-1%04u-%04u-%s", board,
+			 (unsigned int) (gen_random(&rng) % 6),
+			 gen_revisions[gen_random(&rng) % (sizeof(gen_revisions)/sizeof(gen_revisions[0]))]);
+	}
+	snprintf(data->asset_id, sizeof(data->asset_id), "%013llu",
+		 (unsigned long long) (GEN_ASSET_BASE + idx));
+	if (data->major_version >= LAYOUT_VERSION_V2) {
+		snprintf(data->system_serialnumber, sizeof(data->system_serialnumber), "%013llu",
+			 (unsigned long long) (GEN_SERIAL_BASE + idx));
+		if (truth->mtype == module_type_cvb)
+			snprintf(data->system_partnumber, sizeof(data->system_partnumber), "945-1%04u-%04u-000",
+				 gen_cvb_boards[gen_random(&rng) % (sizeof(gen_cvb_boards)/sizeof(gen_cvb_boards[0]))],
+				 (unsigned int) (gen_random(&rng) % 6));
+	}
+	if (truth->mtype == module_type_cvm) {
+		macbase = GEN_MAC_BASE + idx * GEN_MACS_PER_IMAGE;
+		gen_macaddr(data->factory_default_wifi_mac, macbase);
+		gen_macaddr(data->factory_default_bt_mac, macbase + 1);
+		/*
+		 * A duplicate takes the ethernet address of the image
+		 * that first had it, following any chain of duplicates.
+		 */
+		owner = idx;
+		while ((src = gen_duplicate_source(state->seed, owner, state->duplicate)) >= 0)
+			owner = (uint64_t) src;
+		if (owner != idx)
+			truth->duplicate_of = (int64_t) owner;
+		gen_macaddr(data->factory_default_ether_mac, GEN_MAC_BASE + owner * GEN_MACS_PER_IMAGE + 2);
+		if (data->major_version >= LAYOUT_VERSION_V2)
+			data->factory_default_ether_mac_count = 1 + gen_random(&rng) % (GEN_MACS_PER_IMAGE - 2);
+	}
+	if (eeprom_encode_new(truth->mtype, data, image, EEPROM_IMAGE_SIZE) < 0)
+		return -1;
+
+	truth->padff = gen_random(&rng) & 1;
+	if (truth->padff) {
+		for (i = 0; i < sizeof(gen_padded_fields)/sizeof(gen_padded_fields[0]); i++) {
+			if (data->major_version < gen_padded_fields[i].min_layout_version)
+				continue;
+			for (j = gen_padded_fields[i].size; j > 0 && image[gen_padded_fields[i].offset + j - 1] == 0; j--)
+				image[gen_padded_fields[i].offset + j - 1] = 0xff;
+		}
+		image[EEPROM_IMAGE_SIZE-1] = eeprom_image_crc(image);
+	}
+	if (gen_chance(&rng, state->corrupt)) {
+		len = gen_random(&rng) % (EEPROM_IMAGE_SIZE * 8);
+		truth->corrupt_offset = len / 8;
+		truth->corrupt_mask = 1 << (len % 8);
+		image[truth->corrupt_offset] ^= truth->corrupt_mask;
+	}
+	return 0;
+
+} /* gen_image */
+
+/*
+ * gen_worker
+ *
+ * Generates slices of the current batch, writing the
+ * image files when the output is a directory.
+ */
+static void *
+gen_worker (void *arg)
+{
+	struct gen_state *state = arg;
+	uint8_t *image;
+	char path[PATH_MAX];
+	uint64_t start, end, i;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		start = state->next;
+		state->next += GEN_SLICE;
+		pthread_mutex_unlock(&state->lock);
+		if (start >= state->count)
+			break;
+		end = (start + GEN_SLICE < state->count ? start + GEN_SLICE : state->count);
+		for (i = start; i < end; i++) {
+			image = state->images + i * EEPROM_IMAGE_SIZE;
+			if (gen_image(state, state->first + i, image, &state->truth[i]) < 0) {
+				fprintf(stderr, "image %llu: %s\n", (unsigned long long) (state->first + i), strerror(errno));
+				goto failed;
+			}
+			if (state->dir == NULL)
+				continue;
+			snprintf(path, sizeof(path), "%s/%08llu.bin", state->dir, (unsigned long long) (state->first + i));
+			fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+			if (fd < 0 || write(fd, image, EEPROM_IMAGE_SIZE) != EEPROM_IMAGE_SIZE || close(fd) < 0) {
+				perror(path);
+				if (fd >= 0)
+					close(fd);
+				goto failed;
+			}
+		}
+	}
+	return NULL;
+
+  failed:
+	pthread_mutex_lock(&state->lock);
+	state->failed = 1;
+	state->next = state->count;
+	pthread_mutex_unlock(&state->lock);
+	return NULL;
+
+} /* gen_worker */
+
+/*
+ * gen_manifest_line
+ *
+ * Writes the ground truth for one image as a CSV line;
+ * names are as the other batch modes would print them.
+ */
+static void
+gen_manifest_line (FILE *fp, const char *output, int is_archive, uint64_t idx, const struct gen_truth *t)
+{
+	char mac[32];
+
+	if (is_archive)
+		fprintf(fp, "%llu,%s[%llu],", (unsigned long long) idx, output, (unsigned long long) idx);
+	else
+		fprintf(fp, "%llu,%s/%08llu.bin,", (unsigned long long) idx, output, (unsigned long long) idx);
+	if (t->mtype == module_type_cvm)
+		format_macaddr(mac, sizeof(mac), (uint8_t *) t->data.factory_default_ether_mac);
+	else
+		mac[0] = '\0';
+	fprintf(fp, "%u,%s,%s,%s,%s,%s,%s,%s,%u,", t->data.major_version,
+		(t->mtype == module_type_cvm ? "cvm" : "cvb"),
+		(t->data.partnumber_type == partnum_type_customer ? "customer" : "nvidia"),
+		t->data.partnumber, t->data.system_serialnumber, t->data.asset_id,
+		(t->padff ? "ff" : "00"), mac,
+		(t->mtype != module_type_cvm ? 0 : t->data.major_version >= LAYOUT_VERSION_V2 ?
+		 t->data.factory_default_ether_mac_count : 1));
+	if (t->duplicate_of >= 0)
+		fprintf(fp, "%lld", (long long) t->duplicate_of);
+	if (t->corrupt_offset >= 0)
+		fprintf(fp, ",%d,0x%02x\n", t->corrupt_offset, t->corrupt_mask);
+	else
+		fprintf(fp, ",,\n");
+
+} /* gen_manifest_line */
+
+/*
+ * do_generate
+ *
+ * Generate a corpus of synthetic images, with a manifest
+ * of what each one contains.
+ */
+static int
+do_generate (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct gen_state state;
+	eeprom_archive_writer_t w = NULL;
+	const char *archive = NULL, *manifest = NULL;
+	FILE *mfp = NULL;
+	pthread_t *threads = NULL;
+	uint64_t total = 0, done, i;
+	unsigned int n, nthreads;
+	char *ep;
+	int arg, ret = 1;
+
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++) {
+		if (arg + 1 >= argc) {
+			fprintf(stderr, "missing value for %s\n", argv[arg]);
+			return 1;
+		}
+		ep = NULL;
+		if (strcmp(argv[arg], "--count") == 0)
+			total = strtoull(argv[++arg], &ep, 10);
+		else if (strcmp(argv[arg], "--seed") == 0)
+			state.seed = strtoull(argv[++arg], &ep, 0);
+		else if (strcmp(argv[arg], "--corrupt") == 0)
+			state.corrupt = strtod(argv[++arg], &ep);
+		else if (strcmp(argv[arg], "--duplicate-macs") == 0)
+			state.duplicate = strtod(argv[++arg], &ep);
+		else if (strcmp(argv[arg], "--dir") == 0)
+			state.dir = argv[++arg];
+		else if (strcmp(argv[arg], "--archive") == 0)
+			archive = argv[++arg];
+		else if (strcmp(argv[arg], "--manifest") == 0)
+			manifest = argv[++arg];
+		else {
+			fprintf(stderr, "unrecognized argument: %s\n", argv[arg]);
+			return 1;
+		}
+		if (ep != NULL && (ep == argv[arg] || *ep != '\0')) {
+			fprintf(stderr, "invalid value for %s: %s\n", argv[arg-1], argv[arg]);
+			return 1;
+		}
+	}
+	if (total == 0 || (state.dir == NULL) == (archive == NULL)) {
+		fprintf(stderr, "required: --count, and one of --dir or --archive\n");
+		return 1;
+	}
+	if (state.corrupt < 0 || state.corrupt > 1 || state.duplicate < 0 || state.duplicate > 1) {
+		fprintf(stderr, "fractions must be between 0 and 1\n");
+		return 1;
+	}
+
+	state.images = malloc(GEN_BATCH * EEPROM_IMAGE_SIZE);
+	state.truth = calloc(GEN_BATCH, sizeof(*state.truth));
+	threads = calloc(batch_jobs, sizeof(pthread_t));
+	if (state.images == NULL || state.truth == NULL || threads == NULL) {
+		perror("allocating buffers");
+		goto depart;
+	}
+	if (state.dir != NULL && mkdir(state.dir, 0755) < 0 && errno != EEXIST) {
+		perror(state.dir);
+		goto depart;
+	}
+	if (archive != NULL && (w = eeprom_archive_create(archive)) == NULL) {
+		perror(archive);
+		goto depart;
+	}
+	if (manifest != NULL) {
+		mfp = fopen(manifest, "w");
+		if (mfp == NULL) {
+			perror(manifest);
+			goto depart;
+		}
+		fprintf(mfp, "index,name,layout,type,partnumber_type,partnumber,serial,asset_id,"
+			"padding,ether_mac,ether_mac_count,duplicate_of,corrupt_offset,corrupt_mask\n");
+	}
+	pthread_mutex_init(&state.lock, NULL);
+	for (done = 0; done < total && !state.failed; done += state.count) {
+		state.first = done;
+		state.count = (total - done < GEN_BATCH ? total - done : GEN_BATCH);
+		state.next = 0;
+		nthreads = (state.count + GEN_SLICE - 1) / GEN_SLICE;
+		if (nthreads > batch_jobs)
+			nthreads = batch_jobs;
+		for (n = 0; n < nthreads; n++)
+			if (pthread_create(&threads[n], NULL, gen_worker, &state) != 0)
+				break;
+		if (n == 0)
+			gen_worker(&state);
+		for (i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		if (state.failed)
+			break;
+		for (i = 0; i < state.count; i++) {
+			if (w != NULL && eeprom_archive_add(w, state.images + i * EEPROM_IMAGE_SIZE, EEPROM_IMAGE_SIZE) < 0) {
+				perror("writing archive");
+				state.failed = 1;
+				break;
+			}
+			if (mfp != NULL)
+				gen_manifest_line(mfp, (archive == NULL ? state.dir : archive), archive != NULL,
+						  done + i, &state.truth[i]);
+		}
+	}
+	pthread_mutex_destroy(&state.lock);
+	if (w != NULL && eeprom_archive_finish(w) < 0) {
+		perror(archive);
+		state.failed = 1;
+	}
+	w = NULL;
+	if (mfp != NULL && fclose(mfp) != 0) {
+		perror(manifest);
+		state.failed = 1;
+	}
+	mfp = NULL;
+	if (!state.failed) {
+		printf("Generated %llu image%s in %s\n", (unsigned long long) total, (total == 1 ? "" : "s"),
+		       (archive == NULL ? state.dir : archive));
+		ret = 0;
+	} else if (archive != NULL)
+		unlink(archive);
+
+  depart:
+	if (w != NULL) {
+		eeprom_archive_finish(w);
+		unlink(archive);
+	}
+	if (mfp != NULL)
+		fclose(mfp);
+	free(threads);
+	free(state.truth);
+	free(state.images);
+	return ret;
+
+} /* do_generate */
+
+/*
+ * Scanning.
+ *
+ * Adapters are grouped by root bus, and each group is
+ * handled by a single worker, which takes its adapters in
+ * topology order, so that each mux channel is selected
+ * only once, and opens each adapter once to probe all of
+ * the addresses.  Separate root buses are scanned in
+ * parallel.
+ */
+#define SCAN_FIRST_DEFAULT	0x50
+#define SCAN_LAST_DEFAULT	0x57
+
+struct scan_device {
+	unsigned int addr;
+	int claimed;		// bound to a kernel driver
+	int valid;
+	char partnumber[32];
+	char asset_id[16];
+};
+
+struct scan_adapter {
+	const eeprom_i2c_adapter_t *adapter;
+	struct scan_device *devices;
+	unsigned int ndevices;
+	int err;
+	double ms;
+	eeprom_bus_usage_t usage;	// of the devices' reads
+};
+
+struct scan_state {
+	struct scan_adapter *adapters;
+	unsigned int count;
+	unsigned int *groups;	// first adapter in each root bus group
+	unsigned int ngroups;
+	unsigned int next_group;
+	unsigned int first, last;
+	eeprom_module_type_t mtype;
+	pthread_mutex_t lock;
+};
+
+/*
+ * scan_on_ancestor
+ *
+ * Checks whether a device at an address was already found
+ * on one of the adapters an adapter sits behind.  Devices on
+ * a parent bus answer on every mux channel below it, so they
+ * are reported only where they are.  The ancestors belong to
+ * the same root bus group, so have already been scanned by
+ * the same worker.
+ */
+static int
+scan_on_ancestor (struct scan_state *state, const eeprom_i2c_adapter_t *adapter, unsigned int addr)
+{
+	struct scan_adapter *sa;
+	unsigned int i, j, hop, hops = adapter->depth;
+
+	for (hop = 0; hop < hops && adapter->mux_addr >= 0; hop++) {
+		adapter = eeprom_i2c_adapter(adapter->parent);
+		if (adapter == NULL)
+			break;
+		for (i = 0, sa = NULL; i < state->count && sa == NULL; i++)
+			if (state->adapters[i].adapter->bus == adapter->bus)
+				sa = &state->adapters[i];
+		if (sa == NULL)
+			continue;
+		for (j = 0; j < sa->ndevices; j++)
+			if (sa->devices[j].addr == addr)
+				return 1;
+	}
+	return 0;
+
+} /* scan_on_ancestor */
+
+/*
+ * scan_one
+ *
+ * Probes an adapter's address range, and reads the
+ * contents of each device found, skipping those that
+ * belong to a parent bus.
+ */
+static void
+scan_one (struct scan_state *state, struct scan_adapter *sa)
+{
+	uint8_t present[128];
+	struct timespec start, end;
+	module_eeprom_t data;
+	struct scan_device *dev;
+	eeprom_bus_usage_t usage;
+	eeprom_context_t e;
+	char name[32];
+	unsigned int addr;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	n = eeprom_i2c_probe_ex(sa->adapter->bus, state->first, state->last, present, &open_opts);
+	if (n < 0) {
+		sa->err = errno;
+		return;
+	}
+	sa->devices = calloc((n > 0 ? n : 1), sizeof(*sa->devices));
+	if (sa->devices == NULL) {
+		sa->err = errno;
+		return;
+	}
+	for (addr = state->first; addr <= state->last; addr++) {
+		if (!present[addr - state->first] || scan_on_ancestor(state, sa->adapter, addr))
+			continue;
+		dev = &sa->devices[sa->ndevices++];
+		dev->addr = addr;
+		dev->claimed = (present[addr - state->first] == EEPROM_I2C_CLAIMED);
+		snprintf(name, sizeof(name), "%u-%04x", sa->adapter->bus, addr);
+		e = open_device(name, state->mtype);
+		if (e == NULL)
+			continue;
+		if (eeprom_read(e, &data) == 0) {
+			dev->valid = 1;
+			snprintf(dev->partnumber, sizeof(dev->partnumber), "%.*s",
+				 (int) sizeof(data.partnumber), data.partnumber);
+			snprintf(dev->asset_id, sizeof(dev->asset_id), "%.*s",
+				 (int) sizeof(data.asset_id), data.asset_id);
+		}
+		eeprom_bus_usage(e, &usage);
+		sa->usage.busy_ns += usage.busy_ns;
+		sa->usage.elapsed_ns += usage.elapsed_ns;
+		sa->usage.transfers += usage.transfers;
+		eeprom_close(e);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sa->ms = elapsed_ms(&start, &end);
+
+} /* scan_one */
+
+/*
+ * scan_worker
+ *
+ * Takes one root bus group at a time and works
+ * through its adapters sequentially.
+ */
+static void *
+scan_worker (void *arg)
+{
+	struct scan_state *state = arg;
+	unsigned int g, i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		g = state->next_group;
+		if (g < state->ngroups)
+			state->next_group += 1;
+		pthread_mutex_unlock(&state->lock);
+		if (g >= state->ngroups)
+			break;
+		end = (g + 1 < state->ngroups ? state->groups[g+1] : state->count);
+		for (i = state->groups[g]; i < end; i++)
+			scan_one(state, &state->adapters[i]);
+	}
+	return NULL;
+
+} /* scan_worker */
+
+/*
+ * scan_selected
+ *
+ * Checks whether an adapter is one of the requested
+ * buses, or behind one of them.
+ */
+static int
+scan_selected (const eeprom_i2c_adapter_t *adapter, const unsigned int *buses, unsigned int nbuses)
+{
+	unsigned int i, hop, hops = adapter->depth;
+
+	if (nbuses == 0)
+		return 1;
+	for (hop = 0; adapter != NULL && hop <= hops; hop++) {
+		for (i = 0; i < nbuses; i++)
+			if (buses[i] == adapter->bus)
+				return 1;
+		if (adapter->mux_addr < 0)
+			break;
+		adapter = eeprom_i2c_adapter(adapter->parent);
+	}
+	return 0;
+
+} /* scan_selected */
+
+/*
+ * do_scan
+ *
+ * Find the EEPROMs on the I2C buses, including those
+ * behind muxes, and show what each one holds.
+ */
+static int
+do_scan (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct scan_state state;
+	const eeprom_i2c_adapter_t *adapters;
+	struct scan_adapter *sa;
+	struct scan_device *dev;
+	unsigned int *buses = NULL;
+	pthread_t *threads = NULL;
+	struct timespec start, end;
+	unsigned int i, j, nbuses = 0, nthreads, found = 0, failed = 0;
+	unsigned long val;
+	char *ep;
+	int count, arg, ret = 1;
+
+	memset(&state, 0, sizeof(state));
+	state.mtype = mtype;
+	state.first = SCAN_FIRST_DEFAULT;
+	state.last = SCAN_LAST_DEFAULT;
+	buses = calloc(argc + 1, sizeof(*buses));
+	if (buses == NULL) {
+		perror("allocating buses");
+		return 1;
+	}
+	for (arg = 0; arg < argc; arg++) {
+		if (arg + 1 >= argc) {
+			fprintf(stderr, "missing value for %s\n", argv[arg]);
+			goto depart;
+		}
+		if (strcmp(argv[arg], "--bus") == 0) {
+			val = strtoul(argv[++arg], &ep, 0);
+			if (ep == argv[arg] || *ep != '\0') {
+				fprintf(stderr, "invalid bus number: %s\n", argv[arg]);
+				goto depart;
+			}
+			buses[nbuses++] = (unsigned int) val;
+		} else if (strcmp(argv[arg], "--addresses") == 0) {
+			val = strtoul(argv[++arg], &ep, 0);
+			state.first = state.last = (unsigned int) val;
+			if (ep != argv[arg] && *ep == '-')
+				state.last = (unsigned int) strtoul(ep + 1, &ep, 0);
+			if (ep == argv[arg] || *ep != '\0' || state.first > state.last || state.last > 0x7f) {
+				fprintf(stderr, "invalid address range: %s\n", argv[arg]);
+				goto depart;
+			}
+		} else {
+			fprintf(stderr, "unrecognized argument: %s\n", argv[arg]);
+			goto depart;
+		}
+	}
+
+	count = eeprom_i2c_topology(&adapters);
+	if (count < 0) {
+		perror("reading I2C topology");
+		goto depart;
+	}
+	state.adapters = calloc(count + 1, sizeof(*state.adapters));
+	state.groups = calloc(count + 1, sizeof(*state.groups));
+	if (state.adapters == NULL || state.groups == NULL) {
+		perror("allocating scan state");
+		goto depart;
+	}
+	/*
+	 * The adapters come in topology order, so those
+	 * sharing a root bus are already together.
+	 */
+	for (i = 0; i < (unsigned int) count; i++) {
+		if (!scan_selected(&adapters[i], buses, nbuses))
+			continue;
+		if (state.count == 0 || adapters[i].root != state.adapters[state.count-1].adapter->root)
+			state.groups[state.ngroups++] = state.count;
+		state.adapters[state.count++].adapter = &adapters[i];
+	}
+	if (state.count == 0) {
+		fprintf(stderr, "Error: no I2C adapters found\n");
+		goto depart;
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	nthreads = (batch_jobs < state.ngroups ? batch_jobs : state.ngroups);
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("allocating threads");
+		pthread_mutex_destroy(&state.lock);
+		goto depart;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, &state) != 0) {
+			fprintf(stderr, "Error: could not create worker thread\n");
+			break;
+		}
+	}
+	if (i == 0)
+		scan_worker(&state);
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_destroy(&state.lock);
+
+	for (i = 0; i < state.count; i++) {
+		sa = &state.adapters[i];
+		printf("%*si2c-%u", (int) sa->adapter->depth * 2, "", sa->adapter->bus);
+		if (sa->adapter->mux_addr >= 0) {
+			printf(" (mux %u-%04x", sa->adapter->parent, sa->adapter->mux_addr);
+			if (sa->adapter->channel >= 0)
+				printf(" channel %d", sa->adapter->channel);
+			printf(")");
+		}
+		if (sa->err != 0) {
+			printf(": FAILED: %s\n", strerror(sa->err));
+			failed += 1;
+			continue;
+		}
+		printf(": %u device%s (%.1f ms", sa->ndevices, (sa->ndevices == 1 ? "" : "s"), sa->ms);
+		if (open_opts.bus_duty_pct > 0 && open_opts.bus_duty_pct < 100 && sa->usage.elapsed_ns > 0)
+			printf(", bus duty cycle %.1f%%", 100.0 * sa->usage.busy_ns / sa->usage.elapsed_ns);
+		printf(")\n");
+		for (j = 0; j < sa->ndevices; j++) {
+			dev = &sa->devices[j];
+			printf("%*s  %u-%04x: ", (int) sa->adapter->depth * 2, "", sa->adapter->bus, dev->addr);
+			if (dev->valid)
+				printf("%s%s%s", dev->partnumber, (dev->asset_id[0] == '\0' ? "" : " asset-id "),
+				       dev->asset_id);
+			else
+				printf("no valid EEPROM contents");
+			printf("%s\n", (dev->claimed ? " (claimed by a driver)" : ""));
+		}
+		found += sa->ndevices;
+	}
+	printf("Scanned %u adapter%s on %u root bus%s in %.1f ms: %u device%s found\n",
+	       state.count, (state.count == 1 ? "" : "s"), state.ngroups, (state.ngroups == 1 ? "" : "es"),
+	       elapsed_ms(&start, &end), found, (found == 1 ? "" : "s"));
+	ret = (failed == 0 ? 0 : 1);
+
+  depart:
+	if (state.adapters != NULL) {
+		for (i = 0; i < state.count; i++)
+			free(state.adapters[i].devices);
+		free(state.adapters);
+	}
+	free(state.groups);
+	free(threads);
+	free(buses);
+	return ret;
+
+} /* do_scan */
+
+/*
+ * do_calibrate
+ *
+ * Time each read method on the EEPROMs given, saving
+ * the ranking for their buses in the transport cache.
+ * Devices are done one at a time, so that the timings
+ * are not skewed by other traffic from this process.
+ */
+static int
+do_calibrate (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	eeprom_transport_result_t results[eeprom_transport_count];
+	unsigned int bus, addr;
+	int arg, t, best, n, save_errno, ret = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "missing device\n");
+		return 1;
+	}
+	for (arg = 0; arg < argc; arg++) {
+		if (sscanf(argv[arg], "%u-%x%n", &bus, &addr, &n) != 2 || argv[arg][n] != '\0' || addr > 0x7f) {
+			fprintf(stderr, "invalid device (expected <bus>-<addr>): %s\n", argv[arg]);
+			ret = 1;
+			continue;
+		}
+		n = eeprom_calibrate(bus, addr, results);
+		save_errno = errno;
+		printf("%u-%04x:\n", bus, addr);
+		best = -1;
+		for (t = 0; t < eeprom_transport_count; t++) {
+			printf("  %-12s", eeprom_transport_name(t));
+			if (!results[t].supported) {
+				printf("not usable: %s\n", strerror(results[t].error));
+				continue;
+			}
+			printf("%10.1f KB/s\n", results[t].bytes_per_sec / 1024.0);
+			if (best < 0 || results[t].bytes_per_sec > results[best].bytes_per_sec)
+				best = t;
+		}
+		if (n < 0) {
+			printf("  FAILED: %s\n", strerror(save_errno));
+			ret = 1;
+		} else
+			printf("  using %s\n", eeprom_transport_name(best));
+	}
+	return ret;
+
+} /* do_calibrate */
+
+/*
+ * history_print
+ *
+ * Shows one journal entry: when, where, and by whom the
+ * image was written, and the fields it changed.
+ */
+static void
+history_print (uint64_t idx, const eeprom_journal_entry_t *e, int images)
+{
+	char when[64], oldval[DIFF_VALLEN], newval[DIFF_VALLEN];
+	const eeprom_layout_field_t *f;
+	time_t secs = (time_t) (e->time_ns / 1000000000ULL);
+	struct tm tm;
+	unsigned int i;
+
+	localtime_r(&secs, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("#%llu %s.%03u station %s device %s crc 0x%02x%s\n", (unsigned long long) idx, when,
+	       (unsigned int) (e->time_ns / 1000000ULL % 1000), e->station, e->device, e->crc,
+	       (e->have_before ? "" : " (previous contents unknown)"));
+	for (i = 0; i < eeprom_layout_field_count && e->have_before; i++) {
+		f = &eeprom_layout_fields[i];
+		if (f->kind == layout_field_bytes || strcmp(f->name, "crc8") == 0 ||
+		    memcmp(e->before + f->offset, e->after + f->offset, f->size) == 0)
+			continue;
+		diff_format_field(oldval, sizeof(oldval), f, e->before);
+		diff_format_field(newval, sizeof(newval), f, e->after);
+		printf("    %s: %s -> %s\n", f->name, oldval, newval);
+	}
+	if (!images)
+		return;
+	for (i = 0; i < sizeof(e->after); i++)
+		printf("%s%02x%s", (i % 16 == 0 ? "    " : ""), e->after[i], (i % 16 == 15 ? "\n" : " "));
+
+} /* history_print */
+
+/*
+ * do_history
+ *
+ * Look up the journaled writes of images holding a
+ * serial number, asset ID, or MAC address, using the
+ * journal's hash index.
+ */
+static int
+do_history (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	eeprom_journal_entry_t entry;
+	eeprom_journal_t j;
+	uint64_t *ids = NULL, mac = 0;
+	uint8_t macbytes[6];
+	size_t maxids;
+	const char *key, *value;
+	int64_t found, i;
+	int arg = 0, images = 0, w, ret = 1;
+
+	if (arg < argc && strcmp(argv[arg], "--images") == 0) {
+		images = 1;
+		arg += 1;
+	}
+	if (argc - arg != 2 || strchr(argv[arg+1], '=') == NULL) {
+		fprintf(stderr, "usage: history [--images] <journal> (serial|asset-id|mac)=<value>\n");
+		return 1;
+	}
+	key = argv[arg+1];
+	value = strchr(key, '=') + 1;
+	j = eeprom_journal_open(argv[arg]);
+	if (j == NULL) {
+		perror(argv[arg]);
+		return 1;
+	}
+	if (strncmp(key, "mac=", 4) == 0) {
+		if (parse_macaddr(macbytes, value) < 0) {
+			fprintf(stderr, "history: invalid MAC address: %s\n", value);
+			goto depart;
+		}
+		for (mac = 0, w = 0; w < 6; w++)
+			mac = (mac << 8) | macbytes[w];
+		found = eeprom_journal_mac(j, mac, NULL, 0);
+	} else if (strncmp(key, "serial=", 7) == 0 || strncmp(key, "system-serialnumber=", 20) == 0) {
+		key = "system-serialnumber";
+		found = eeprom_journal_lookup(j, key, value, NULL, 0);
+	} else if (strncmp(key, "asset-id=", 9) == 0) {
+		key = "asset-id";
+		found = eeprom_journal_lookup(j, key, value, NULL, 0);
+	} else {
+		fprintf(stderr, "history: unrecognized key: %s\n", key);
+		goto depart;
+	}
+	if (found < 0) {
+		perror("history");
+		goto depart;
+	}
+	maxids = found + 1;
+	ids = calloc(maxids, sizeof(*ids));
+	if (ids == NULL) {
+		perror("allocating entries");
+		goto depart;
+	}
+	if (strcmp(key, "system-serialnumber") == 0 || strcmp(key, "asset-id") == 0)
+		found = eeprom_journal_lookup(j, key, value, ids, maxids);
+	else
+		found = eeprom_journal_mac(j, mac, ids, maxids);
+	if (found < 0) {
+		perror("history");
+		goto depart;
+	}
+	// entries may have been added since the count was taken
+	if ((size_t) found > maxids)
+		found = maxids;
+	for (i = found - 1; i >= 0; i--) {
+		if (eeprom_journal_entry(j, ids[i], &entry) < 0) {
+			perror("reading journal entry");
+			goto depart;
+		}
+		history_print(ids[i], &entry, images);
+	}
+	printf("%lld write%s found in %llu journal entries\n", (long long) found, (found == 1 ? "" : "s"),
+	       (unsigned long long) eeprom_journal_count(j));
+	ret = 0;
+
+  depart:
+	free(ids);
+	eeprom_journal_close(j);
+	return ret;
+
+} /* do_history */
+
+/*
+ * Validation support.  Each image is opened in memory as
+ * an offline context, so its layout and module type come
+ * from its own header rather than from this host, and
+ * images for different SoC families can be checked in one
+ * pass on any machine.  Workers claim slices of the set,
+ * and print each slice's results together.
+ */
+#define VALIDATE_SLICE	256
+
+enum {
+	validate_v1,
+	validate_v1_cvm,
+	validate_v2,
+	validate_v2_cvm,
+	validate_invalid,
+	validate_unreadable,
+	validate_count,
+};
+
+struct validate_state {
+	struct image_set *set;
+	int list_all;
+	pthread_mutex_t lock;
+	uint64_t next;
+	uint64_t counts[validate_count];
+};
+
+/*
+ * validate_image
+ *
+ * Validates and decodes one image, formatting a line
+ * for it (if it is to be shown) into the buffer.
+ *
+ * Returns the image's validate_* category.
+ */
+static int
+validate_image (struct validate_state *state, const char *name, const uint8_t *image,
+		char *buf, size_t bufsize)
+{
+	const struct module_eeprom_v1_raw *raw = (const struct module_eeprom_v1_raw *) image;
+	eeprom_module_type_t mtype;
+	eeprom_context_t e;
+	module_eeprom_t data;
+	unsigned int version;
+	int which;
+
+	buf[0] = '\0';
+	if (eeprom_infer_layout(image, EEPROM_IMAGE_SIZE, &version, &mtype) < 0) {
+		snprintf(buf, bufsize, "%s: INVALID: unrecognized layout (version %u, length %u)\n",
+			 name, raw->major_version, (unsigned int) (image[offsetof(struct module_eeprom_v1_raw, length)] |
+								   (image[offsetof(struct module_eeprom_v1_raw, length)+1] << 8)));
+		return validate_invalid;
+	}
+	if (eeprom_image_crc(image) != raw->crc8) {
+		snprintf(buf, bufsize, "%s: INVALID: CRC mismatch\n", name);
+		return validate_invalid;
+	}
+	e = eeprom_open_image(image, EEPROM_IMAGE_SIZE);
+	if (e == NULL) {
+		snprintf(buf, bufsize, "%s: %s\n", name, strerror(errno));
+		return validate_unreadable;
+	}
+	if (eeprom_read(e, &data) < 0) {
+		eeprom_close(e);
+		snprintf(buf, bufsize, "%s: INVALID: bad CVM configuration block\n", name);
+		return validate_invalid;
+	}
+	eeprom_close(e);
+	which = (version == LAYOUT_VERSION_V1 ? validate_v1 : validate_v2) + (mtype == module_type_cvm ? 1 : 0);
+	if (state->list_all)
+		snprintf(buf, bufsize, "%s: V%u %s %s%s%s%s%s\n", name, version,
+			 (mtype == module_type_cvm ? "cvm" : "board"), data.partnumber,
+			 (data.system_serialnumber[0] == '\0' ? "" : " serial "), data.system_serialnumber,
+			 (data.asset_id[0] == '\0' ? "" : " asset-id "), data.asset_id);
+	return which;
+
+} /* validate_image */
+
+/*
+ * validate_worker
+ */
+static void *
+validate_worker (void *arg)
+{
+	struct validate_state *state = arg;
+	uint64_t counts[validate_count];
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	char namebuf[PATH_MAX+32], line[PATH_MAX+256];
+	char *out = NULL, *newp;
+	size_t outlen, outalloc = 0, len;
+	const char *name;
+	uint64_t first, last, idx;
+	int which;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		first = state->next;
+		state->next += VALIDATE_SLICE;
+		pthread_mutex_unlock(&state->lock);
+		if (first >= state->set->total)
+			break;
+		last = (first + VALIDATE_SLICE < state->set->total ? first + VALIDATE_SLICE : state->set->total);
+		memset(counts, 0, sizeof(counts));
+		outlen = 0;
+		for (idx = first; idx < last; idx++) {
+			name = image_set_name(state->set, idx, namebuf, sizeof(namebuf));
+			if (image_set_read(state->set, idx, image) < 0) {
+				snprintf(line, sizeof(line), "%s: %s\n", name,
+					 (errno == ENODATA ? "too short for an EEPROM image" : strerror(errno)));
+				which = validate_unreadable;
+			} else
+				which = validate_image(state, name, image, line, sizeof(line));
+			counts[which] += 1;
+			len = strlen(line);
+			if (outlen + len + 1 > outalloc) {
+				newp = realloc(out, outalloc + len + 65536);
+				if (newp == NULL) {
+					fputs(line, stderr);
+					continue;
+				}
+				out = newp;
+				outalloc += len + 65536;
+			}
+			memcpy(out + outlen, line, len + 1);
+			outlen += len;
+		}
+		pthread_mutex_lock(&state->lock);
+		if (outlen > 0)
+			fputs(out, stdout);
+		for (which = 0; which < validate_count; which++)
+			state->counts[which] += counts[which];
+		pthread_mutex_unlock(&state->lock);
+	}
+	free(out);
+	return NULL;
+
+} /* validate_worker */
+
+/*
+ * do_validate
+ *
+ * Validate and decode a set of images, which may be a
+ * mix of layouts, without reference to this host's SoC.
+ */
+static int
+do_validate (eeprom_module_type_t mtype, int argc, char * const argv[])
+{
+	struct image_set set;
+	struct validate_state state;
+	pthread_t *threads = NULL;
+	struct timespec start, end;
+	unsigned int i, nthreads;
+	int arg, ret = 1;
+
+	memset(&set, 0, sizeof(set));
+	memset(&state, 0, sizeof(state));
+	for (arg = 0; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--list") == 0)
+			state.list_all = 1;
+		else if (image_set_add(&set, argv[arg]) < 0)
+			goto depart;
+	}
+	if (set.count == 0) {
+		fprintf(stderr, "missing required argument: images\n");
+		goto depart;
+	}
+	state.set = &set;
+	pthread_mutex_init(&state.lock, NULL);
+	nthreads = (set.total < batch_jobs ? (unsigned int) set.total : batch_jobs);
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("allocating threads");
+		pthread_mutex_destroy(&state.lock);
+		goto depart;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, validate_worker, &state) != 0)
+			break;
+	if (i == 0)
+		validate_worker(&state);
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_destroy(&state.lock);
+	printf("Validated %llu image%s in %.1f ms: %llu V1 (%llu CVM), %llu V2 (%llu CVM), %llu invalid",
+	       (unsigned long long) set.total, (set.total == 1 ? "" : "s"), elapsed_ms(&start, &end),
+	       (unsigned long long) (state.counts[validate_v1] + state.counts[validate_v1_cvm]),
+	       (unsigned long long) state.counts[validate_v1_cvm],
+	       (unsigned long long) (state.counts[validate_v2] + state.counts[validate_v2_cvm]),
+	       (unsigned long long) state.counts[validate_v2_cvm],
+	       (unsigned long long) state.counts[validate_invalid]);
+	if (state.counts[validate_unreadable] > 0)
+		printf(", %llu unreadable", (unsigned long long) state.counts[validate_unreadable]);
+	printf("\n");
+	ret = (state.counts[validate_invalid] == 0 && state.counts[validate_unreadable] == 0 ? 0 : 1);
+
+  depart:
+	free(threads);
+	image_set_free(&set);
+	return ret;
+
+} /* do_validate */
+
+static char *prompt (EditLine *e)
+{
+	return promptstr + (continuation ? 0 : 1);
+}
+/*
+ * command_loop
+ *
+ */
+static int
+command_loop (context_t ctx)
+{
+	option_routine_t dispatch;
+	EditLine *el;
+	History *hist;
+	HistEvent ev;
+	const LineInfo *li;
+	Tokenizer *tok;
+	char *editor;
+	const char *line, **argv;
+	size_t promptlen;
+	int argc, alldone, llen, which, ret = 0, n;
+
+	setlocale(LC_CTYPE, "");
+	promptlen = snprintf(promptstr, sizeof(promptstr)-2, "_%s> ", progname);
+	promptstr[promptlen] = '\0';
+	el = el_init(progname, stdin, stdout, stderr);
+
+	el_set(el, EL_PROMPT, &prompt);
+	editor = getenv("EDITOR");
+	if (editor != NULL && strchr(editor, ' ') != NULL) {
+		char *edtemp = strdup(editor);
+		char *sp = strchr(edtemp, ' ');
+		*sp = '\0';
+		el_set(el, EL_EDITOR, edtemp);
+		free(edtemp);
+	} else if (editor != NULL)
+		el_set(el, EL_EDITOR, editor);
+	hist = history_init();
+	if (hist != NULL) {
+		history(hist, &ev, H_SETSIZE, 100);
+		el_set(el, EL_HIST, history, hist);
+	}
+	el_set(el, EL_SIGNAL, 1);
+	tok = tok_init(NULL);
+	continuation = alldone = 0;
+	while (!alldone && (line = el_gets(el, &llen)) != NULL && llen != 0) {
+		li = el_line(el);
+		if (!continuation && llen == 1)
+			continue;
+		argc = 0;
+		n = tok_line(tok, li, &argc, &argv, NULL, NULL);
+		if (n < 0) {
+			fprintf(stderr, "internal error\n");
+			continuation = 0;
+			continue;
+		}
+		history(hist, &ev, (continuation ? H_APPEND : H_ENTER), line);
+		continuation = n;
+		if (continuation)
+			continue;
+		dispatch = NULL;
+		for (which = 0; which < sizeof(commands)/sizeof(commands[0]); which++) {
+			if (strcmp(argv[0], commands[which].cmd) == 0) {
+				dispatch = commands[which].rtn;
+				if (dispatch == NULL)
+					alldone = 1;
+				break;
+			}
+		}
+		if (which >= sizeof(commands)/sizeof(commands[0]))
+			fprintf(stderr, "unrecognized command: %s\n", argv[0]);
+		else if (alldone || dispatch == NULL)
+			break;
+		else
+			ret = dispatch(ctx, argc-1, (char * const *)&argv[1]);
+
+		tok_reset(tok);
+	}
+	if (line == NULL && isatty(fileno(stdin)))
+		printf("\n");
+	el_end(el);
+	tok_end(tok);
+	history_end(hist);
+	return ret;
+
+} /* command_loop */
+
+/*
+ * report_bus_usage
+ *
+ * With a duty-cycle budget, shows the duty cycle
+ * actually realized.
+ */
+static void
+report_bus_usage (eeprom_context_t e)
+{
+	eeprom_bus_usage_t usage;
+
+	eeprom_bus_usage(e, &usage);
+	if (usage.elapsed_ns == 0)
+		return;
+	fprintf(stderr, "Bus duty cycle: %.1f%% (budget %u%%), %lu transfers, %.1f ms busy over %.1f ms\n",
+		100.0 * usage.busy_ns / usage.elapsed_ns, open_opts.bus_duty_pct, usage.transfers,
+		usage.busy_ns / 1e6, usage.elapsed_ns / 1e6);
+
+} /* report_bus_usage */
+
+/*
+ * stop_trace
+ *
+ * Run at exit, so the trace is complete however
+ * the program exits.
+ */
+static void
+stop_trace (void)
+{
+	if (eeprom_trace_stop() < 0)
+		perror("writing trace");
+
+} /* stop_trace */
+
+/*
+ * tool_option
+ *
+ * Returns 1 if an argument is a tool option, 0 if not.
+ * With loose set, the
+ * argument is matched the way getopt_long_only() would,
+ * allowing abbreviated names and clusters of short options;
+ * otherwise only -x, -name, and --name (with "=value" on a
+ * long name) count.  Sets *argnext if the option's value
+ * is the next argument.
+ */
+static int
+tool_option (const char *arg, int loose, int *argnext)
+{
+	const char *name, *eq, *p, *opt;
+	size_t len;
+	int i;
+
+	*argnext = 0;
+	if (arg[0] != '-' || arg[1] == '\0' || strcmp(arg, "--") == 0)
+		return 0;
+	name = arg + (arg[1] == '-' ? 2 : 1);
+	eq = strchr(name, '=');
+	len = (eq == NULL ? strlen(name) : (size_t) (eq - name));
+	for (i = 0; len > 0 && options[i].name != 0; i++)
+		if (strncmp(name, options[i].name, len) == 0 && (loose || options[i].name[len] == '\0'))
+			break;
+	if (len > 0 && options[i].name != 0) {
+		if (options[i].has_arg == no_argument && eq != NULL)
+			return 0;
+		*argnext = (options[i].has_arg == required_argument && eq == NULL);
+		return 1;
+	}
+	if (name != arg + 1 || (!loose && name[1] != '\0'))
+		return 0;
+	for (p = name; *p != '\0'; p++) {
+		opt = (*p == ':' || *p == '+' ? NULL : strchr(shortopts, *p));
+		if (opt == NULL)
+			return 0;
+		if (opt[1] == ':') {
+			*argnext = (p[1] == '\0');
+			break;
+		}
+	}
+	return 1;
+
+} /* tool_option */
+
+/*
+ * hoist_trailing_options
+ *
+ * Options are parsed only up to the command or mode, so
+ * that the arguments after it are left for the command.
+ * Earlier releases also took tool options that came after
+ * the command, so for now those (spelled out in full) are
+ * moved in front of it, with a warning.  An argument of
+ * "--" ends the search.
+ */
+static void
+hoist_trailing_options (int argc, char *argv[])
+{
+	char *moved[2];
+	int cmd, i, n, argnext;
+
+	for (cmd = 1; cmd < argc; cmd++) {
+		if (strcmp(argv[cmd], "--") == 0)
+			return;
+		if (argv[cmd][0] != '-' || argv[cmd][1] == '\0')
+			break;
+		if (tool_option(argv[cmd], 1, &argnext) && argnext)
+			cmd += 1;
+	}
+	for (i = cmd + 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+		if (!tool_option(argv[i], 0, &argnext) || (argnext && i + 1 >= argc))
+			continue;
+		fprintf(stderr, "Warning: options after the command are deprecated; "
+			"put %s before it\n", argv[i]);
+		n = (argnext ? 2 : 1);
+		memcpy(moved, &argv[i], n * sizeof(moved[0]));
+		memmove(&argv[cmd + n], &argv[cmd], (i - cmd) * sizeof(argv[0]));
+		memcpy(&argv[cmd], moved, n * sizeof(moved[0]));
+		cmd += n;
+		i += n - 1;
+	}
+
+} /* hoist_trailing_options */
+
+/*
+ * main program
+ */
+int
+main (int argc, char *argv[])
+{
+	int c, which, ret;
+	context_t ctx = NULL;
+	option_routine_t dispatch = NULL;
+	char *argv0_copy = strdup(argv[0]);
+        char *eeprom_device = NULL;
+	const cvm_i2c_address_t *i2caddr;
+	char cvmdevice[32];
+	const char *firmware_path = NULL;
+	unsigned long ulval;
+	char *ep;
+	eeprom_module_type_t mtype = module_type_normal;
+	uint8_t image[EEPROM_IMAGE_SIZE];
+	unsigned int layout_version;
+
+	progname = basename(argv0_copy);
+	eeprom_open_options_init(&open_opts);
+	hoist_trailing_options(argc, argv);
+
+	for (;;) {
+		c = getopt_long_only(argc, argv, shortopts, options, &which);
+		if (c == -1)
+			break;
+
+
+		switch (c) {
+
+		case 'h':
+			print_usage(1);
+			ret = 0;
+			goto depart;
+		case 'd':
+			eeprom_device = optarg;
+			break;
+		case 'c':
+			mtype = module_type_cvm;
+			break;
+		case 'f':
+			firmware_path = optarg;
+			break;
+		case 'j':
+			ulval = strtoul(optarg, NULL, 10);
+			if (ulval < 1 || ulval > MAX_JOBS) {
+				fprintf(stderr, "Error: jobs must be between 1 and %u\n", MAX_JOBS);
+				ret = 1;
+				goto depart;
+			}
+			batch_jobs = (unsigned int) ulval;
+			break;
+		case 't':
+			open_opts.timeout_ms = strtoul(optarg, &ep, 10);
+			if (ep == optarg || *ep != '\0') {
+				fprintf(stderr, "Error: invalid timeout '%s'\n", optarg);
+				ret = 1;
+				goto depart;
+			}
+			break;
+		case 'r':
+		case 'R':
+			if ((c == 'r' ? eeprom_trace_record(optarg) : eeprom_trace_replay(optarg)) < 0) {
+				perror(optarg);
+				ret = 1;
+				goto depart;
+			}
+			atexit(stop_trace);
+			break;
+		case 'J':
+			if (eeprom_journal_log(optarg) < 0) {
+				perror(optarg);
+				ret = 1;
+				goto depart;
+			}
+			break;
+		case 'D':
+			ulval = strtoul(optarg, &ep, 10);
+			if (ep == optarg || *ep != '\0' || ulval < 1 || ulval > 100) {
+				fprintf(stderr, "Error: duty cycle must be between 1 and 100 percent\n");
+				ret = 1;
+				goto depart;
+			}
+			open_opts.bus_duty_pct = (unsigned int) ulval;
+			break;
+		case 'O':
+			open_opts.flags |= EEPROM_OPEN_OFFLINE;
+			break;
+		default:
+			fprintf(stderr, "Error: unrecognized option\n");
+			print_usage(1);
+			ret = 1;
+			goto depart;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 * Batch modes work on their own set of devices
+	 */
+	if (argc > 0) {
+		for (which = 0; which < (int) (sizeof(modes)/sizeof(modes[0])); which++) {
+			if (strcmp(argv[0], modes[which].cmd) == 0) {
+				ret = modes[which].rtn(mtype, argc-1, &argv[1]);
+				goto depart;
+			}
+		}
+	}
+
+	if (argc > 0) {
+		for (which = 0; which < (int) (sizeof(commands)/sizeof(commands[0])) - non_oneshot_commands; which++) {
+			if (strcmp(argv[0], commands[which].cmd) == 0) {
+				dispatch = commands[which].rtn;
+				break;
+			}
+		}
+		if (dispatch == NULL) {
+			fprintf(stderr, "Unrecognized command\n");
+			ret = 1;
+			goto depart;
+		}
+	}
+
+	/*
+	 * If no device specified, assume CVM is desired.
+	 * For one-shot commands that only look at the contents,
+	 * the copy published by the firmware can be used in
+	 * place of the device itself.
+	 */
+	if (eeprom_device == NULL) {
+		if (open_opts.flags & EEPROM_OPEN_OFFLINE) {
+			fprintf(stderr, "Error: --offline requires a device\n");
+			ret = 1;
+			goto depart;
+		}
+		i2caddr = cvm_i2c_address();
+		if (i2caddr == NULL) {
+			fprintf(stderr, "Error: no EEPROM device specified and cannot identify CVM location\n");
+			print_usage(1);
+			ret = 1;
+			goto depart;
+		}
+		snprintf(cvmdevice, sizeof(cvmdevice), "%d-%04x", i2caddr->busnum, i2caddr->addr);
+		eeprom_device = cvmdevice;
+		mtype = module_type_cvm;
+	}
+
+	ctx = calloc(1, sizeof(struct context_s));
+	if (ctx == NULL) {
+		perror("allocating context structure");
+		return errno;
+	}
+	if (eeprom_device == cvmdevice &&
+	    (dispatch == do_show || dispatch == do_get || dispatch == do_verify || dispatch == do_dump))
+		ctx->e = eeprom_open_cvm_ex(firmware_path, &open_opts);
+	else
+		ctx->e = open_device(eeprom_device, mtype);
+	if (ctx->e == NULL) {
+		perror(eeprom_device);
+		free(ctx);
+		return errno;
+	}
+	ctx->mtype = mtype;
+	if ((open_opts.flags & EEPROM_OPEN_OFFLINE) && eeprom_get_raw(ctx->e, image, sizeof(image)) == sizeof(image))
+		eeprom_infer_layout(image, sizeof(image), &layout_version, &ctx->mtype);
+	ctx->havedata = eeprom_read(ctx->e, &ctx->data) == 0;
+	ctx->basecrc = eeprom_crc(ctx->e);
+	ctx->readonly = eeprom_readonly(ctx->e);
+
+	if (argc < 1) {
+		ret = command_loop(ctx);
 		goto depart;
 	}
 
@@ -705,6 +5679,8 @@ depart:
 					ret = saveret;
 			}
 		}
+		if (open_opts.bus_duty_pct > 0 && open_opts.bus_duty_pct < 100)
+			report_bus_usage(ctx->e);
 		eeprom_close(ctx->e);
 		free(ctx);
 	}
@@ -0,0 +1,502 @@
+#ifndef tegra_eeprom_hpp__
+#define tegra_eeprom_hpp__
+
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+/*
+ * Header-only C++17 binding for libtegra-eeprom.
+ *
+ * Contexts and archives are move-only RAII handles.  Images
+ * are held in their raw form, and the field accessors return
+ * views into the raw bytes (std::string_view for strings, a
+ * span of bytes for everything else) rather than decoding into
+ * a module_eeprom_t.  The field offsets are compile-time
+ * constants, checked against struct module_eeprom_v1_raw.
+ * Errors are thrown as std::system_error.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "eeprom.h"
+#include "eeprom-layout.h"
+#include "eeprom-archive.h"
+
+namespace tegra_eeprom {
+
+inline constexpr std::size_t image_size = EEPROM_IMAGE_SIZE;
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+using byte_span = std::span<const std::uint8_t>;
+#else
+// Minimal stand-in for std::span<const std::uint8_t>
+class byte_span {
+public:
+	constexpr byte_span() noexcept = default;
+	constexpr byte_span(const std::uint8_t *data, std::size_t size) noexcept : data_(data), size_(size) { }
+	constexpr const std::uint8_t *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr bool empty() const noexcept { return size_ == 0; }
+	constexpr const std::uint8_t *begin() const noexcept { return data_; }
+	constexpr const std::uint8_t *end() const noexcept { return data_ + size_; }
+	constexpr std::uint8_t operator[](std::size_t i) const noexcept { return data_[i]; }
+private:
+	const std::uint8_t *data_ = nullptr;
+	std::size_t size_ = 0;
+};
+#endif
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/*
+ * Raw layout.  Each field is a compile-time offset
+ * and size within the image.
+ */
+namespace layout {
+
+enum class kind { uint, string, macaddr, bytes };
+
+struct field {
+	std::size_t offset;
+	std::size_t size;
+	layout::kind kind;
+};
+
+inline constexpr field major_version { 0, 1, kind::uint };
+inline constexpr field minor_version { 1, 1, kind::uint };
+inline constexpr field length { 2, 2, kind::uint };
+inline constexpr field factory_default_ether_mac_count { 19, 1, kind::uint };
+inline constexpr field partnumber { 20, 22, kind::string };
+inline constexpr field factory_default_wifi_mac { 50, 6, kind::macaddr };
+inline constexpr field factory_default_bt_mac { 56, 6, kind::macaddr };
+inline constexpr field factory_default_wifi_alt_mac { 62, 6, kind::macaddr };
+inline constexpr field factory_default_ether_mac { 68, 6, kind::macaddr };
+inline constexpr field asset_id { 74, 15, kind::string };
+inline constexpr field cfgblk_sig { 150, 4, kind::string };
+inline constexpr field cfgblk_len { 154, 2, kind::uint };
+inline constexpr field macfmt_tag { 156, 2, kind::string };
+inline constexpr field macfmt_version { 158, 2, kind::uint };
+inline constexpr field vendor_wifi_mac { 160, 6, kind::macaddr };
+inline constexpr field vendor_bt_mac { 166, 6, kind::macaddr };
+inline constexpr field vendor_ether_mac { 172, 6, kind::macaddr };
+inline constexpr field vendor_ether_mac_count { 178, 1, kind::uint };
+inline constexpr field system_partnumber { 200, 21, kind::string };
+inline constexpr field system_serialnumber { 221, 15, kind::string };
+inline constexpr field crc8 { 255, 1, kind::uint };
+
+#define TEGRA_EEPROM_CHECK_FIELD(field_, member_) \
+	static_assert(field_.offset == offsetof(module_eeprom_v1_raw, member_) && \
+		      field_.size == sizeof(module_eeprom_v1_raw::member_), \
+		      "layout mismatch for " #member_)
+static_assert(sizeof(module_eeprom_v1_raw) == image_size, "raw layout size mismatch");
+TEGRA_EEPROM_CHECK_FIELD(major_version, major_version);
+TEGRA_EEPROM_CHECK_FIELD(minor_version, minor_version);
+TEGRA_EEPROM_CHECK_FIELD(length, length);
+TEGRA_EEPROM_CHECK_FIELD(factory_default_ether_mac_count, ether_mac_count_v2);
+TEGRA_EEPROM_CHECK_FIELD(partnumber, partnumber);
+TEGRA_EEPROM_CHECK_FIELD(factory_default_wifi_mac, factory_default_wifi_mac);
+TEGRA_EEPROM_CHECK_FIELD(factory_default_bt_mac, factory_default_bt_mac);
+TEGRA_EEPROM_CHECK_FIELD(factory_default_wifi_alt_mac, factory_default_wifi_alt_mac);
+TEGRA_EEPROM_CHECK_FIELD(factory_default_ether_mac, factory_default_ether_mac);
+TEGRA_EEPROM_CHECK_FIELD(asset_id, asset_id);
+TEGRA_EEPROM_CHECK_FIELD(cfgblk_sig, cfgblk_sig);
+TEGRA_EEPROM_CHECK_FIELD(cfgblk_len, cfgblk_len);
+TEGRA_EEPROM_CHECK_FIELD(macfmt_tag, macfmt_tag);
+TEGRA_EEPROM_CHECK_FIELD(macfmt_version, macfmt_version);
+TEGRA_EEPROM_CHECK_FIELD(vendor_wifi_mac, vendor_wifi_mac);
+TEGRA_EEPROM_CHECK_FIELD(vendor_bt_mac, vendor_bt_mac);
+TEGRA_EEPROM_CHECK_FIELD(vendor_ether_mac, vendor_ether_mac);
+TEGRA_EEPROM_CHECK_FIELD(vendor_ether_mac_count, vendor_ether_mac_count_v2);
+TEGRA_EEPROM_CHECK_FIELD(system_partnumber, system_partnumber_v2);
+TEGRA_EEPROM_CHECK_FIELD(system_serialnumber, system_serialnumber_v2);
+TEGRA_EEPROM_CHECK_FIELD(crc8, crc8);
+#undef TEGRA_EEPROM_CHECK_FIELD
+
+} // namespace layout
+
+using mac_address = std::array<std::uint8_t, 6>;
+
+namespace detail {
+
+// Strings are padded with either nulls or 0xff
+inline std::string_view string(byte_span b) noexcept
+{
+	std::size_t len = b.size();
+	const std::uint8_t pad = b[len - 1];
+
+	if (pad == 0 || pad == 0xff)
+		while (len > 0 && b[len - 1] == pad)
+			len -= 1;
+	return std::string_view(reinterpret_cast<const char *>(b.data()), len);
+}
+inline std::uint32_t uint(byte_span b) noexcept
+{
+	std::uint32_t val = 0;
+
+	for (std::size_t i = b.size(); i > 0; i--)
+		val = (val << 8) | b[i - 1];
+	return val;
+}
+// MAC addresses are stored little-endian; this returns the usual order
+inline mac_address mac(byte_span b) noexcept
+{
+	mac_address addr;
+
+	for (std::size_t i = 0; i < addr.size(); i++)
+		addr[i] = b[addr.size() - 1 - i];
+	return addr;
+}
+
+} // namespace detail
+
+/*
+ * Non-owning view of a raw image.
+ */
+class image_view {
+public:
+	constexpr explicit image_view(const std::uint8_t *data) noexcept : data_(data) { }
+
+	byte_span bytes(const layout::field &f) const noexcept
+	{
+		return byte_span(data_ + f.offset, f.size);
+	}
+	std::string_view string(const layout::field &f) const noexcept { return detail::string(bytes(f)); }
+	std::uint32_t uint(const layout::field &f) const noexcept { return detail::uint(bytes(f)); }
+	mac_address mac(const layout::field &f) const noexcept { return detail::mac(bytes(f)); }
+
+	unsigned int major_version() const noexcept { return uint(layout::major_version); }
+	unsigned int minor_version() const noexcept { return uint(layout::minor_version); }
+	bool customer_partnumber() const noexcept { return data_[layout::partnumber.offset] == 0xcc; }
+	std::string_view partnumber() const noexcept
+	{
+		std::string_view pn = string(layout::partnumber);
+		return customer_partnumber() ? pn.substr(1) : pn;
+	}
+	std::string_view asset_id() const noexcept { return string(layout::asset_id); }
+	std::string_view system_partnumber() const noexcept
+	{
+		return major_version() >= LAYOUT_VERSION_V2 ? string(layout::system_partnumber) : std::string_view();
+	}
+	std::string_view system_serialnumber() const noexcept
+	{
+		return major_version() >= LAYOUT_VERSION_V2 ? string(layout::system_serialnumber) : std::string_view();
+	}
+	const module_eeprom_v1_raw &raw() const noexcept
+	{
+		return *reinterpret_cast<const module_eeprom_v1_raw *>(data_);
+	}
+	byte_span data() const noexcept { return byte_span(data_, image_size); }
+
+private:
+	const std::uint8_t *data_;
+};
+
+/*
+ * An image, held by value.
+ */
+class image {
+public:
+	image() noexcept : data_{} { }
+	explicit image(const void *raw) noexcept
+	{
+		const auto *p = static_cast<const std::uint8_t *>(raw);
+		std::copy(p, p + image_size, data_.begin());
+	}
+	image_view view() const noexcept { return image_view(data_.data()); }
+	std::uint8_t *data() noexcept { return data_.data(); }
+	const std::uint8_t *data() const noexcept { return data_.data(); }
+	static constexpr std::size_t size() noexcept { return image_size; }
+
+private:
+	std::array<std::uint8_t, image_size> data_;
+};
+
+/*
+ * A device (or file) context.
+ */
+class context {
+public:
+	explicit context(eeprom_context_t ctx) noexcept : ctx_(ctx) { }
+	context(context &&other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) { }
+	context &operator=(context &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			ctx_ = std::exchange(other.ctx_, nullptr);
+		}
+		return *this;
+	}
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+	~context() { reset(); }
+
+	static context open(const std::string &pathname, eeprom_module_type_t mtype,
+			    const eeprom_open_options_t *opts = nullptr)
+	{
+		return context(check(eeprom_open_ex(pathname.c_str(), mtype, opts), "eeprom_open"));
+	}
+	static context open_i2c(unsigned int bus, unsigned int addr, eeprom_module_type_t mtype,
+				const eeprom_open_options_t *opts = nullptr)
+	{
+		return context(check(eeprom_open_i2c_ex(bus, addr, mtype, opts), "eeprom_open_i2c"));
+	}
+	static context open_cvm(const eeprom_open_options_t *opts = nullptr)
+	{
+		return context(check(eeprom_open_cvm_ex(nullptr, opts), "eeprom_open_cvm"));
+	}
+	static context open_image(const image &img)
+	{
+		return context(check(eeprom_open_image(img.data(), img.size()), "eeprom_open_image"));
+	}
+
+	void reset() noexcept
+	{
+		if (ctx_ != nullptr)
+			eeprom_close(ctx_);
+		ctx_ = nullptr;
+	}
+	eeprom_context_t native_handle() const noexcept { return ctx_; }
+	explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+	bool valid() const noexcept { return eeprom_data_valid(ctx_) != 0; }
+	bool readonly() const noexcept { return eeprom_readonly(ctx_) != 0; }
+	// A copy, not a view: a write through another handle can replace
+	// the context's cached image at any time.  Refilling an existing
+	// image saves constructing one on each call.
+	void contents(image &img) const
+	{
+		if (eeprom_get_raw(ctx_, img.data(), img.size()) != static_cast<ssize_t>(img.size()))
+			throw_errno("eeprom_get_raw");
+	}
+	image contents() const
+	{
+		image img;
+		contents(img);
+		return img;
+	}
+	module_eeprom_t read() const
+	{
+		module_eeprom_t data;
+		if (eeprom_read(ctx_, &data) < 0)
+			throw_errno("eeprom_read");
+		return data;
+	}
+	void write(module_eeprom_t data)
+	{
+		if (eeprom_write(ctx_, &data) < 0)
+			throw_errno("eeprom_write");
+	}
+	// Returns false (without writing) if the device's CRC no longer matches
+	bool write_if(module_eeprom_t data, std::uint8_t expected_crc)
+	{
+		if (eeprom_write_if(ctx_, &data, expected_crc) == 0)
+			return true;
+		if (errno == ESTALE)
+			return false;
+		throw_errno("eeprom_write_if");
+	}
+	void write(const image &img)
+	{
+		if (eeprom_set_raw(ctx_, img.data(), img.size()) < 0)
+			throw_errno("eeprom_set_raw");
+	}
+	bool changed()
+	{
+		int ret = eeprom_changed(ctx_);
+		if (ret < 0)
+			throw_errno("eeprom_changed");
+		return ret != 0;
+	}
+
+private:
+	template <typename T> static T check(T handle, const char *what)
+	{
+		if (handle == nullptr)
+			throw_errno(what);
+		return handle;
+	}
+	eeprom_context_t ctx_;
+};
+
+class archive;
+
+/*
+ * View of one archive record.  The archive is stored by
+ * column, so each field is looked up on its own, as a view
+ * into the mapped archive where the column is stored plain
+ * or as a dictionary (and into the archive's decoded copy of
+ * the column otherwise).  The whole image is put together
+ * only when image() is called.  Valid for the archive's lifetime.
+ */
+class record_view {
+public:
+	record_view(const archive *a, std::uint64_t record) noexcept : a_(a), record_(record) { }
+
+	inline byte_span bytes(const layout::field &f) const;
+	std::string_view string(const layout::field &f) const { return detail::string(bytes(f)); }
+	std::uint32_t uint(const layout::field &f) const { return detail::uint(bytes(f)); }
+	mac_address mac(const layout::field &f) const { return detail::mac(bytes(f)); }
+
+	unsigned int major_version() const { return uint(layout::major_version); }
+	unsigned int minor_version() const { return uint(layout::minor_version); }
+	bool customer_partnumber() const { return bytes(layout::partnumber)[0] == 0xcc; }
+	std::string_view partnumber() const
+	{
+		byte_span b = bytes(layout::partnumber);
+		std::string_view pn = detail::string(b);
+		return b[0] == 0xcc ? pn.substr(1) : pn;
+	}
+	std::string_view asset_id() const { return string(layout::asset_id); }
+	std::string_view system_partnumber() const
+	{
+		return major_version() >= LAYOUT_VERSION_V2 ? string(layout::system_partnumber) : std::string_view();
+	}
+	std::string_view system_serialnumber() const
+	{
+		return major_version() >= LAYOUT_VERSION_V2 ? string(layout::system_serialnumber) : std::string_view();
+	}
+	inline tegra_eeprom::image image() const;
+	std::uint64_t record() const noexcept { return record_; }
+
+private:
+	const archive *a_;
+	std::uint64_t record_;
+};
+
+/*
+ * An archive of images (see eeprom-archive.h), iterable
+ * with a range-based for loop over record views.
+ */
+class archive {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = record_view;
+		using difference_type = std::ptrdiff_t;
+		using reference = record_view;
+		struct pointer {
+			record_view v;
+			const record_view *operator->() const noexcept { return &v; }
+		};
+
+		iterator(const archive *a, std::uint64_t record) noexcept : a_(a), record_(record) { }
+		reference operator*() const noexcept { return record_view(a_, record_); }
+		pointer operator->() const noexcept { return pointer { **this }; }
+		iterator &operator++() noexcept { record_ += 1; return *this; }
+		iterator operator++(int) noexcept { iterator prev = *this; record_ += 1; return prev; }
+		bool operator==(const iterator &other) const noexcept { return record_ == other.record_; }
+		bool operator!=(const iterator &other) const noexcept { return record_ != other.record_; }
+		std::uint64_t record() const noexcept { return record_; }
+
+	private:
+		const archive *a_;
+		std::uint64_t record_;
+	};
+
+	explicit archive(const std::string &pathname)
+		: a_(eeprom_archive_open(pathname.c_str()))
+	{
+		if (a_ == nullptr)
+			throw_errno("eeprom_archive_open");
+		columns_.fill(-1);
+		for (unsigned int i = 0; i < eeprom_layout_field_count; i++)
+			columns_[eeprom_layout_fields[i].offset] = eeprom_archive_column(a_, eeprom_layout_fields[i].name);
+	}
+	archive(archive &&other) noexcept : a_(std::exchange(other.a_, nullptr)), columns_(other.columns_) { }
+	archive &operator=(archive &&other) noexcept
+	{
+		if (this != &other) {
+			if (a_ != nullptr)
+				eeprom_archive_close(a_);
+			a_ = std::exchange(other.a_, nullptr);
+			columns_ = other.columns_;
+		}
+		return *this;
+	}
+	archive(const archive &) = delete;
+	archive &operator=(const archive &) = delete;
+	~archive()
+	{
+		if (a_ != nullptr)
+			eeprom_archive_close(a_);
+	}
+
+	std::uint64_t size() const noexcept { return eeprom_archive_count(a_); }
+	record_view operator[](std::uint64_t record) const noexcept { return record_view(this, record); }
+	// Decodes the whole record into an image
+	tegra_eeprom::image image(std::uint64_t record) const
+	{
+		tegra_eeprom::image img;
+		if (eeprom_archive_image(a_, record, img.data(), img.size()) < 0)
+			throw_errno("eeprom_archive_image");
+		return img;
+	}
+	// Column number for a field name, for use with field()
+	int column(const char *name) const
+	{
+		int col = eeprom_archive_column(a_, name);
+		if (col < 0) {
+			errno = ENOENT;
+			throw_errno("eeprom_archive_column");
+		}
+		return col;
+	}
+	// Column number for a layout field
+	int column(const layout::field &f) const
+	{
+		int col = columns_[f.offset];
+		if (col < 0) {
+			errno = ENOENT;
+			throw_errno("eeprom_archive_column");
+		}
+		return col;
+	}
+	// Reads only the one column; the view is into the mapped archive where possible
+	byte_span field(std::uint64_t record, int column) const
+	{
+		std::size_t len;
+		const std::uint8_t *p = eeprom_archive_field(a_, record, column, &len);
+		if (p == nullptr)
+			throw_errno("eeprom_archive_field");
+		return byte_span(p, len);
+	}
+	iterator begin() const noexcept { return iterator(this, 0); }
+	iterator end() const noexcept { return iterator(this, size()); }
+	eeprom_archive_t native_handle() const noexcept { return a_; }
+
+private:
+	eeprom_archive_t a_;
+	// Column holding each layout field, indexed by field offset
+	std::array<int, image_size> columns_;
+};
+
+inline byte_span record_view::bytes(const layout::field &f) const
+{
+	return a_->field(record_, a_->column(f));
+}
+
+inline tegra_eeprom::image record_view::image() const
+{
+	return a_->image(record_);
+}
+
+} // namespace tegra_eeprom
+
+#endif /* tegra_eeprom_hpp__ */
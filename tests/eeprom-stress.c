@@ -0,0 +1,254 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "eeprom.h"
+
+/*
+ * Concurrency stress test: several threads share one
+ * context over an image file, some reading, one checking
+ * for changes, and one writing.  The writer alternates
+ * between two sets of contents, each with an asset ID and
+ * MAC address that go together, so a reader that sees one
+ * without the other has seen a torn update.  Every fourth
+ * write goes through a second context on the same file, so
+ * that the change checks have changes to pick up.  The
+ * writer and checker pause between calls; the context's
+ * operation lock is not fair, so either one, looping, would
+ * starve the other.  The read and write rates over the
+ * run are reported, in operations and bytes per second.
+ *
+ * Usage: eeprom-stress <image-file> [<writes>]
+ */
+
+#define READERS		4
+#define DEFAULT_WRITES	2000
+#define IMAGE_SIZE	256	// bytes read or written per operation
+
+static const struct {
+	const char *asset_id;
+	uint8_t mac_byte;
+} variants[2] = {
+	{ "STRESS-AAAAAAA", 0xaa },
+	{ "STRESS-BBBBBBB", 0xbb },
+};
+
+static eeprom_context_t ctx;
+static atomic_int done;
+static atomic_ulong failures;
+static atomic_ulong reads, checks, changes;
+static const struct timespec pause = { 0, 50000 };
+
+/*
+ * fail
+ */
+static void
+fail (const char *what, int err)
+{
+	if (atomic_fetch_add(&failures, 1) < 10)
+		fprintf(stderr, "eeprom-stress: %s%s%s\n", what, (err ? ": " : ""), (err ? strerror(err) : ""));
+
+} /* fail */
+
+/*
+ * fill
+ *
+ * Sets up the contents for one of the variants.
+ */
+static void
+fill (module_eeprom_t *data, unsigned int which)
+{
+	memset(data, 0, sizeof(*data));
+	data->major_version = 1;
+	data->partnumber_type = partnum_type_nvidia;
+	strcpy(data->partnumber, "699-13448-0000-300 K.0");
+	strcpy(data->asset_id, variants[which].asset_id);
+	memset(data->vendor_ether_mac, variants[which].mac_byte, sizeof(data->vendor_ether_mac));
+
+} /* fill */
+
+/*
+ * consistent
+ *
+ * Checks that read contents are exactly one of the variants.
+ */
+static int
+consistent (const module_eeprom_t *data)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 2; i++) {
+		if (strcmp(data->asset_id, variants[i].asset_id) != 0)
+			continue;
+		for (j = 0; j < sizeof(data->vendor_ether_mac); j++)
+			if (data->vendor_ether_mac[j] != variants[i].mac_byte)
+				return 0;
+		return 1;
+	}
+	return 0;
+
+} /* consistent */
+
+/*
+ * reader
+ */
+static void *
+reader (void *arg)
+{
+	module_eeprom_t data;
+
+	(void) arg;
+	while (!atomic_load(&done)) {
+		if (eeprom_read(ctx, &data) < 0)
+			fail("eeprom_read", errno);
+		else if (!consistent(&data))
+			fail("eeprom_read returned a torn update", 0);
+		atomic_fetch_add(&reads, 1);
+	}
+	return NULL;
+
+} /* reader */
+
+/*
+ * checker
+ */
+static void *
+checker (void *arg)
+{
+	int ret;
+
+	(void) arg;
+	while (!atomic_load(&done)) {
+		ret = eeprom_changed(ctx);
+		if (ret < 0)
+			fail("eeprom_changed", errno);
+		else if (ret > 0)
+			atomic_fetch_add(&changes, 1);
+		atomic_fetch_add(&checks, 1);
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+
+} /* checker */
+
+/*
+ * create_image
+ */
+static int
+create_image (const char *pathname)
+{
+	module_eeprom_t data;
+	uint8_t image[IMAGE_SIZE];
+	FILE *fp;
+
+	fill(&data, 0);
+	if (eeprom_encode_new(module_type_cvm, &data, image, sizeof(image)) < 0) {
+		perror("eeprom_encode_new");
+		return -1;
+	}
+	fp = fopen(pathname, "w");
+	if (fp == NULL) {
+		perror(pathname);
+		return -1;
+	}
+	if (fwrite(image, sizeof(image), 1, fp) != 1) {
+		perror(pathname);
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp);
+
+} /* create_image */
+
+static double
+elapsed_secs (const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+
+} /* elapsed_secs */
+
+/*
+ * report_rate
+ */
+static void
+report_rate (const char *what, unsigned long ops, double secs)
+{
+	printf("%s: %lu in %.3f s, %.0f ops/s, %.0f bytes/s\n", what, ops, secs,
+	       ops / secs, ops * (double) IMAGE_SIZE / secs);
+
+} /* report_rate */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+	pthread_t readers[READERS], check;
+	eeprom_open_options_t opts;
+	eeprom_context_t other;
+	module_eeprom_t data;
+	struct timespec start, writes_end, end;
+	unsigned long i, writes = DEFAULT_WRITES;
+	int ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: eeprom-stress <image-file> [<writes>]\n");
+		return 2;
+	}
+	if (argc > 2)
+		writes = strtoul(argv[2], NULL, 0);
+	if (create_image(argv[1]) < 0)
+		return 1;
+	eeprom_open_options_init(&opts);
+	opts.flags |= EEPROM_OPEN_OFFLINE;
+	ctx = eeprom_open_ex(argv[1], module_type_cvm, &opts);
+	other = eeprom_open_ex(argv[1], module_type_cvm, &opts);
+	if (ctx == NULL || other == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < READERS; i++)
+		if (pthread_create(&readers[i], NULL, reader, NULL) != 0) {
+			fprintf(stderr, "eeprom-stress: could not start reader\n");
+			return 1;
+		}
+	if (pthread_create(&check, NULL, checker, NULL) != 0) {
+		fprintf(stderr, "eeprom-stress: could not start checker\n");
+		return 1;
+	}
+	for (i = 0; i < writes; i++) {
+		fill(&data, (i + 1) & 1);
+		if (eeprom_write((i % 4 == 2 ? other : ctx), &data) < 0)
+			fail("eeprom_write", errno);
+		nanosleep(&pause, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &writes_end);
+	atomic_store(&done, 1);
+	for (i = 0; i < READERS; i++)
+		pthread_join(readers[i], NULL);
+	pthread_join(check, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (eeprom_read(ctx, &data) < 0 || strcmp(data.asset_id, variants[writes & 1].asset_id) != 0)
+		fail("final contents are not the last ones written", 0);
+	eeprom_close(ctx);
+	eeprom_close(other);
+
+	ret = (atomic_load(&failures) == 0 ? 0 : 1);
+	report_rate("reads", atomic_load(&reads), elapsed_secs(&start, &end));
+	report_rate("writes", writes, elapsed_secs(&start, &writes_end));
+	printf("%lu writes, %lu reads, %lu change checks (%lu changed): %s\n", writes,
+	       atomic_load(&reads), atomic_load(&checks), atomic_load(&changes),
+	       (ret == 0 ? "ok" : "FAILED"));
+	return ret;
+
+} /* main */
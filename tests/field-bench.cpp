@@ -0,0 +1,96 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+/*
+ * Benchmark for the C++ binding's field views: reads the
+ * part number, asset ID, and vendor Ethernet MAC address
+ * from a context, each way the API allows:
+ *
+ *   eeprom_read    decode the whole image with eeprom_read()
+ *   contents+view  copy the raw image out of the context
+ *                  with context::contents(), then use views
+ *   view           views into an image already copied out
+ *
+ * Usage: eeprom-field-bench [<iterations>]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "tegra_eeprom.hpp"
+
+namespace {
+
+volatile unsigned int sink;
+
+/*
+ * consume
+ *
+ * Folds the fields into the sink, so that the work
+ * is not optimized away.
+ */
+void consume(std::string_view pn, std::string_view asset, const std::uint8_t *mac)
+{
+	sink += pn.size() + asset.size() + (asset.empty() ? 0 : static_cast<unsigned char>(asset.front())) + mac[5];
+}
+
+template <typename Fn> void run(const char *name, unsigned long iterations, Fn fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < iterations; i++)
+		fn();
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	std::printf("%-14s %8.1f ns/iteration\n", name, elapsed.count() / iterations);
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long iterations = (argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 1000000);
+	module_eeprom_t data;
+	tegra_eeprom::image img;
+
+	if (iterations == 0) {
+		std::fprintf(stderr, "usage: eeprom-field-bench [<iterations>]\n");
+		return 2;
+	}
+	std::memset(&data, 0, sizeof(data));
+	data.major_version = 1;
+	data.partnumber_type = partnum_type_nvidia;
+	std::strcpy(data.partnumber, "699-13448-0000-300 K.0");
+	std::strcpy(data.asset_id, "1421419000123");
+	std::memcpy(data.vendor_ether_mac, "\x00\x04\x4b\x01\x02\x03", sizeof(data.vendor_ether_mac));
+	if (eeprom_encode_new(module_type_cvm, &data, img.data(), img.size()) < 0) {
+		std::perror("eeprom_encode_new");
+		return 1;
+	}
+
+	try {
+		auto ctx = tegra_eeprom::context::open_image(img);
+		auto copy = ctx.contents();
+		auto view = copy.view();
+
+		run("eeprom_read", iterations, [&] {
+			module_eeprom_t d;
+			if (eeprom_read(ctx.native_handle(), &d) < 0)
+				std::abort();
+			consume(d.partnumber, d.asset_id, d.vendor_ether_mac);
+		});
+		run("contents+view", iterations, [&] {
+			auto v = ctx.contents();
+			auto iv = v.view();
+			consume(iv.partnumber(), iv.asset_id(), iv.mac(tegra_eeprom::layout::vendor_ether_mac).data());
+		});
+		run("view", iterations, [&] {
+			consume(view.partnumber(), view.asset_id(), view.mac(tegra_eeprom::layout::vendor_ether_mac).data());
+		});
+	} catch (const std::system_error &e) {
+		std::fprintf(stderr, "eeprom-field-bench: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,218 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "eeprom-internal.h"
+
+/*
+ * Bus duty-cycle pacing.  With a bus_duty_pct budget of d
+ * percent, a chunk that kept the bus busy for t is followed
+ * by t * (100 - d) / d of idle time, during which no paced
+ * transfer on the same bus may start.  The bus is the root
+ * of the I2C topology, since devices behind a mux share its
+ * wires, and the time when it is next free is shared by all
+ * of the paced contexts in the process, so that concurrent
+ * readers together stay within the budget.  A context whose
+ * bus is not known (a plain file, say) is paced on its own.
+ * Bus probes (eeprom_i2c_probe_ex()) count against the same
+ * budget as transfers.
+ *
+ * The wait is expressed as the transfer's not_before time,
+ * so blocking calls sleep through it and asynchronous ones
+ * return to the event loop.
+ */
+struct bus_budget {
+	int bus;
+	struct timespec next_free;
+};
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bus_budget *budgets;
+static unsigned int budget_count;
+
+/*
+ * ts_before
+ */
+static int
+ts_before (const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+
+} /* ts_before */
+
+/*
+ * ts_diff_ns
+ */
+static uint64_t
+ts_diff_ns (const struct timespec *end, const struct timespec *start)
+{
+	int64_t ns = (int64_t) (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+
+	return (ns < 0 ? 0 : (uint64_t) ns);
+
+} /* ts_diff_ns */
+
+/*
+ * paced
+ */
+static int
+paced (eeprom_context_t ctx)
+{
+	return (ctx->opts.bus_duty_pct > 0 && ctx->opts.bus_duty_pct < 100);
+
+} /* paced */
+
+/*
+ * bus_next_free
+ *
+ * Finds (adding, if necessary) the time a bus is next
+ * free; 'own' is used if the bus is not known (bus < 0)
+ * or cannot be added.  Called with the throttle lock held.
+ */
+static struct timespec *
+bus_next_free (int bus, struct timespec *own)
+{
+	const eeprom_i2c_adapter_t *adapter;
+	struct bus_budget *newp;
+	unsigned int i;
+
+	if (bus < 0)
+		return own;
+	adapter = eeprom_i2c_adapter((unsigned int) bus);
+	if (adapter != NULL)
+		bus = (int) adapter->root;
+	for (i = 0; i < budget_count; i++)
+		if (budgets[i].bus == bus)
+			return &budgets[i].next_free;
+	newp = realloc(budgets, (budget_count + 1) * sizeof(*budgets));
+	if (newp == NULL)
+		return own;
+	budgets = newp;
+	memset(&budgets[budget_count], 0, sizeof(budgets[budget_count]));
+	budgets[budget_count].bus = bus;
+	return &budgets[budget_count++].next_free;
+
+} /* bus_next_free */
+
+/*
+ * throttle_bus_until
+ *
+ * Checks whether a paced transaction on a bus must wait.
+ *
+ * Returns 1 (setting *until) if so, 0 if it can go now.
+ */
+int
+throttle_bus_until (int bus, struct timespec *own, struct timespec *until)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&throttle_lock);
+	*until = *bus_next_free(bus, own);
+	pthread_mutex_unlock(&throttle_lock);
+	return ts_before(&now, until);
+
+} /* throttle_bus_until */
+
+/*
+ * throttle_bus_account
+ *
+ * Pushes back the time a bus is next free after a paced
+ * transaction that kept it busy from start to end.
+ */
+void
+throttle_bus_account (int bus, struct timespec *own, unsigned int duty_pct,
+		      const struct timespec *start, const struct timespec *end)
+{
+	uint64_t idle = ts_diff_ns(end, start) * (100 - duty_pct) / duty_pct;
+	struct timespec *next;
+
+	pthread_mutex_lock(&throttle_lock);
+	next = bus_next_free(bus, own);
+	if (ts_before(next, end))
+		*next = *end;
+	next->tv_sec += idle / 1000000000ULL;
+	next->tv_nsec += idle % 1000000000ULL;
+	if (next->tv_nsec >= 1000000000L) {
+		next->tv_sec += 1;
+		next->tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_unlock(&throttle_lock);
+
+} /* throttle_bus_account */
+
+/*
+ * throttle_until
+ *
+ * Checks whether the next chunk of a paced transfer
+ * must wait for the bus.
+ *
+ * Returns 1 (setting *until) if so, 0 if it can go now.
+ */
+int
+throttle_until (eeprom_context_t ctx, struct timespec *until)
+{
+	if (!paced(ctx))
+		return 0;
+	return throttle_bus_until(ctx->bus, &ctx->throttle_next, until);
+
+} /* throttle_until */
+
+/*
+ * throttle_account
+ *
+ * Records a chunk's time on the bus, and for a paced
+ * transfer, pushes back the time the bus is next free.
+ */
+void
+throttle_account (eeprom_context_t ctx, struct xfer_s *x, const struct timespec *start,
+		  const struct timespec *end)
+{
+	uint64_t busy = ts_diff_ns(end, start);
+
+	if (!x->timed) {
+		x->first_start = *start;
+		x->timed = 1;
+	}
+	x->last_end = *end;
+	ctx->usage.busy_ns += busy;
+	ctx->usage.transfers += 1;
+	if (paced(ctx))
+		throttle_bus_account(ctx->bus, &ctx->throttle_next, ctx->opts.bus_duty_pct, start, end);
+
+} /* throttle_account */
+
+/*
+ * throttle_finish
+ *
+ * Adds a finished transfer's span to the elapsed time.
+ */
+void
+throttle_finish (eeprom_context_t ctx, struct xfer_s *x)
+{
+	if (!x->timed)
+		return;
+	ctx->usage.elapsed_ns += ts_diff_ns(&x->last_end, &x->first_start);
+	x->timed = 0;
+
+} /* throttle_finish */
+
+/*
+ * eeprom_bus_usage
+ *
+ * Returns the bus usage of the context's transfers
+ * so far.
+ */
+void
+eeprom_bus_usage (eeprom_context_t ctx, eeprom_bus_usage_t *usage)
+{
+	pthread_mutex_lock(&ctx->oplock);
+	*usage = ctx->usage;
+	pthread_mutex_unlock(&ctx->oplock);
+
+} /* eeprom_bus_usage */
@@ -0,0 +1,407 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "eeprom-internal.h"
+
+/*
+ * I2C topology discovery.  The I2C mux core gives each
+ * adapter it creates a 'mux_device' link to the mux's
+ * client directory (named <parent-bus>-<address>), and
+ * the mux's directory a 'channel-<n>' link to each of
+ * its adapters.  From these, every adapter is mapped to
+ * the mux channel it sits behind and to the root adapter
+ * that carries its traffic.  The index is built once per
+ * process, on first use.
+ */
+#define TOPOLOGY_DIR_ENV	"TEGRA_EEPROM_I2C_DEVICES"
+#define TOPOLOGY_DIR_DEFAULT	"/sys/bus/i2c/devices"
+#define TOPOLOGY_MAX_DEPTH	8
+
+struct topo_entry {
+	eeprom_i2c_adapter_t adapter;
+	unsigned int key[1 + (TOPOLOGY_MAX_DEPTH + 1) * 2];	// root, then mux and channel per level
+	unsigned int keylen;
+};
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static eeprom_i2c_adapter_t *topology;
+static unsigned int topology_count;
+static int topology_errno;
+
+/*
+ * topology_dir
+ */
+static const char *
+topology_dir (void)
+{
+	const char *dir = getenv(TOPOLOGY_DIR_ENV);
+
+	return (dir == NULL || *dir == '\0' ? TOPOLOGY_DIR_DEFAULT : dir);
+
+} /* topology_dir */
+
+/*
+ * find_channel
+ *
+ * Looks through the mux's channel links for the one
+ * leading to the adapter; if there are none (older
+ * kernels), falls back to the channel number in the
+ * adapter's name.
+ */
+static int
+find_channel (const char *muxpath, const char *adapterpath, const char *namefile)
+{
+	char path[PATH_MAX], resolved[PATH_MAX], name[128];
+	struct dirent *de;
+	unsigned int chan;
+	DIR *dir;
+	FILE *fp;
+	int n, channel = -1;
+
+	dir = opendir(muxpath);
+	if (dir != NULL) {
+		while (channel < 0 && (de = readdir(dir)) != NULL) {
+			if (sscanf(de->d_name, "channel-%u%n", &chan, &n) != 1 || de->d_name[n] != '\0')
+				continue;
+			n = snprintf(path, sizeof(path), "%s/%s", muxpath, de->d_name);
+			if (n < 0 || (size_t) n >= sizeof(path) || realpath(path, resolved) == NULL)
+				continue;
+			if (strcmp(resolved, adapterpath) == 0)
+				channel = (int) chan;
+		}
+		closedir(dir);
+	}
+	if (channel >= 0)
+		return channel;
+	fp = fopen(namefile, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(name, sizeof(name), fp) != NULL && sscanf(name, "i2c-%*u-mux (chan_id %u)", &chan) == 1)
+		channel = (int) chan;
+	fclose(fp);
+	return channel;
+
+} /* find_channel */
+
+/*
+ * read_adapter
+ *
+ * Fills in the adapter's parent, mux address, and channel.
+ * Returns 0 on success, -1 if the adapter should be skipped.
+ */
+static int
+read_adapter (const char *dirname, unsigned int bus, eeprom_i2c_adapter_t *a)
+{
+	char path[PATH_MAX], adapterpath[PATH_MAX], muxpath[PATH_MAX], namefile[PATH_MAX];
+	const char *base;
+	unsigned int parent, addr;
+	int n;
+
+	memset(a, 0, sizeof(*a));
+	a->bus = a->parent = a->root = bus;
+	a->mux_addr = a->channel = -1;
+	n = snprintf(path, sizeof(path), "%s/i2c-%u", dirname, bus);
+	if (n < 0 || (size_t) n >= sizeof(path) || realpath(path, adapterpath) == NULL)
+		return -1;
+	n = snprintf(path, sizeof(path), "%s/i2c-%u/mux_device", dirname, bus);
+	if (n < 0 || (size_t) n >= sizeof(path) || realpath(path, muxpath) == NULL)
+		return 0;
+	base = strrchr(muxpath, '/');
+	base = (base == NULL ? muxpath : base + 1);
+	if (sscanf(base, "%u-%x%n", &parent, &addr, &n) != 2 || base[n] != '\0' || parent == bus)
+		return 0;
+	a->parent = parent;
+	a->mux_addr = (int) addr;
+	n = snprintf(namefile, sizeof(namefile), "%s/name", adapterpath);
+	if (n < 0 || (size_t) n >= sizeof(namefile))
+		namefile[0] = '\0';
+	a->channel = find_channel(muxpath, adapterpath, namefile);
+	return 0;
+
+} /* read_adapter */
+
+/*
+ * entry_compare
+ *
+ * Orders the adapters by their path from the root:
+ * root bus, then mux address and channel at each level.
+ */
+static int
+entry_compare (const void *va, const void *vb)
+{
+	const struct topo_entry *a = va, *b = vb;
+	unsigned int i;
+
+	for (i = 0; i < a->keylen && i < b->keylen; i++)
+		if (a->key[i] != b->key[i])
+			return (a->key[i] < b->key[i] ? -1 : 1);
+	if (a->keylen != b->keylen)
+		return (a->keylen < b->keylen ? -1 : 1);
+	return (a->adapter.bus < b->adapter.bus ? -1 : a->adapter.bus > b->adapter.bus);
+
+} /* entry_compare */
+
+/*
+ * find_entry
+ */
+static struct topo_entry *
+find_entry (struct topo_entry *entries, unsigned int count, unsigned int bus)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (entries[i].adapter.bus == bus)
+			return &entries[i];
+	return NULL;
+
+} /* find_entry */
+
+/*
+ * topology_build
+ */
+static void
+topology_build (void)
+{
+	const char *dirname = topology_dir();
+	struct topo_entry *entries = NULL, *e, *p, *chain[TOPOLOGY_MAX_DEPTH + 1];
+	unsigned int count = 0, alloc = 0, bus, i, j, depth;
+	struct dirent *de;
+	DIR *dir;
+	void *newp;
+	int n;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		topology_errno = errno;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "i2c-%u%n", &bus, &n) != 1 || de->d_name[n] != '\0')
+			continue;
+		if (count >= alloc) {
+			newp = realloc(entries, (alloc + 32) * sizeof(*entries));
+			if (newp == NULL) {
+				topology_errno = errno;
+				closedir(dir);
+				free(entries);
+				return;
+			}
+			entries = newp;
+			alloc += 32;
+		}
+		if (read_adapter(dirname, bus, &entries[count].adapter) == 0)
+			count += 1;
+	}
+	closedir(dir);
+
+	/*
+	 * Walk each adapter's parents up to the root, then
+	 * build its sort key from the top down.  A parent we
+	 * did not find, or one already in the chain (a loop),
+	 * ends the walk.
+	 */
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		chain[0] = e;
+		for (depth = 0, p = e; depth < TOPOLOGY_MAX_DEPTH && p->adapter.mux_addr >= 0; depth++) {
+			p = find_entry(entries, count, p->adapter.parent);
+			for (j = 0; p != NULL && j <= depth; j++)
+				if (chain[j] == p)
+					p = NULL;
+			if (p == NULL)
+				break;
+			chain[depth + 1] = p;
+		}
+		if (p == NULL)
+			p = chain[depth];
+		e->adapter.root = (p->adapter.mux_addr >= 0 ? p->adapter.parent : p->adapter.bus);
+		e->adapter.depth = depth + (p->adapter.mux_addr >= 0 ? 1 : 0);
+		e->keylen = 0;
+		e->key[e->keylen++] = e->adapter.root;
+		for (n = (int) depth; n >= 0; n--) {
+			if (chain[n]->adapter.mux_addr < 0)
+				continue;
+			e->key[e->keylen++] = (unsigned int) chain[n]->adapter.mux_addr;
+			e->key[e->keylen++] = (unsigned int) chain[n]->adapter.channel;
+		}
+	}
+	qsort(entries, count, sizeof(*entries), entry_compare);
+
+	topology = calloc(count + 1, sizeof(*topology));
+	if (topology == NULL) {
+		topology_errno = errno;
+		free(entries);
+		return;
+	}
+	for (i = 0; i < count; i++)
+		topology[i] = entries[i].adapter;
+	topology_count = count;
+	free(entries);
+
+} /* topology_build */
+
+/*
+ * eeprom_i2c_topology
+ *
+ * Returns the number of I2C adapters, and points
+ * *adapters at the list (in topology order).
+ */
+int
+eeprom_i2c_topology (const eeprom_i2c_adapter_t **adapters)
+{
+	pthread_once(&topology_once, topology_build);
+	if (topology == NULL) {
+		errno = topology_errno;
+		return -1;
+	}
+	if (adapters != NULL)
+		*adapters = topology;
+	return (int) topology_count;
+
+} /* eeprom_i2c_topology */
+
+/*
+ * eeprom_i2c_adapter
+ *
+ * Looks up a single adapter by bus number.
+ */
+const eeprom_i2c_adapter_t *
+eeprom_i2c_adapter (unsigned int bus)
+{
+	unsigned int i;
+
+	if (eeprom_i2c_topology(NULL) < 0)
+		return NULL;
+	for (i = 0; i < topology_count; i++)
+		if (topology[i].bus == bus)
+			return &topology[i];
+	errno = ENOENT;
+	return NULL;
+
+} /* eeprom_i2c_adapter */
+
+/*
+ * i2c_adapter_name
+ *
+ * Reads an adapter's name from sysfs, without the
+ * trailing newline.
+ */
+int
+i2c_adapter_name (unsigned int bus, char *buf, size_t bufsiz)
+{
+	char path[PATH_MAX];
+	size_t len;
+	FILE *fp;
+	int n;
+
+	n = snprintf(path, sizeof(path), "%s/i2c-%u/name", topology_dir(), bus);
+	if (n < 0 || (size_t) n >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(buf, bufsiz, fp) == NULL) {
+		fclose(fp);
+		errno = EIO;
+		return -1;
+	}
+	fclose(fp);
+	len = strcspn(buf, "\n");
+	buf[len] = '\0';
+	return 0;
+
+} /* i2c_adapter_name */
+
+/*
+ * eeprom_i2c_probe_ex
+ *
+ * Checks for devices at each address from first through
+ * last on a bus, with a single open of the adapter.  Uses
+ * a receive-byte transfer, as i2cdetect does for EEPROM
+ * addresses, so that no device is written to.  Sets
+ * present[addr - first] to EEPROM_I2C_PRESENT for each
+ * address that answers, and to EEPROM_I2C_CLAIMED for each
+ * one that a kernel driver has bound (which is not probed,
+ * as i2cdetect shows "UU" for it).
+ * With a bus_duty_pct in opts, each probe waits for (and
+ * is charged to) the bus's duty-cycle budget, as paced
+ * reads are.
+ *
+ * Returns the number of devices found, claimed ones
+ * included, or -1 on error.
+ */
+int
+eeprom_i2c_probe_ex (unsigned int bus, unsigned int first, unsigned int last, uint8_t *present,
+		     const eeprom_open_options_t *opts)
+{
+	union i2c_smbus_data data;
+	struct i2c_smbus_ioctl_data args = {
+		.read_write = I2C_SMBUS_READ,
+		.command = 0,
+		.size = I2C_SMBUS_BYTE,
+		.data = &data,
+	};
+	struct timespec own = { 0, 0 }, until, start, end;
+	unsigned int duty = (opts == NULL ? 0 : opts->bus_duty_pct);
+	char devname[32];
+	unsigned int addr;
+	int fd, rc, found = 0;
+
+	if (first > last || last > 0x7f) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(devname, sizeof(devname), "/dev/i2c-%u", bus);
+	fd = trace_open(devname, O_RDWR);
+	if (fd < 0)
+		return -1;
+	for (addr = first; addr <= last; addr++) {
+		present[addr - first] = 0;
+		if (trace_ioctl(fd, I2C_SLAVE, (void *) (uintptr_t) addr) < 0) {
+			if (errno == EBUSY) {
+				present[addr - first] = EEPROM_I2C_CLAIMED;
+				found += 1;
+			}
+			continue;
+		}
+		if (duty > 0 && duty < 100) {
+			while (throttle_bus_until((int) bus, &own, &until))
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			rc = trace_ioctl(fd, I2C_SMBUS, &args);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			throttle_bus_account((int) bus, &own, duty, &start, &end);
+		} else
+			rc = trace_ioctl(fd, I2C_SMBUS, &args);
+		if (rc < 0)
+			continue;
+		present[addr - first] = EEPROM_I2C_PRESENT;
+		found += 1;
+	}
+	trace_close(fd);
+	return found;
+
+} /* eeprom_i2c_probe_ex */
+
+int
+eeprom_i2c_probe (unsigned int bus, unsigned int first, unsigned int last, uint8_t *present)
+{
+	return eeprom_i2c_probe_ex(bus, first, last, present, NULL);
+
+} /* eeprom_i2c_probe */
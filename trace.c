@@ -0,0 +1,1075 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "eeprom-internal.h"
+
+/*
+ * Transaction tracing.  Every open, ioctl, pread, pwrite, and
+ * close the library does on a device goes through the trace_*
+ * wrappers below.  Normally they just make the system call;
+ * while recording, each call is also logged with its arguments,
+ * result, errno, start time, and duration; while replaying, no
+ * devices are touched at all, and the calls are answered from a
+ * recorded trace, taking as long as they took when recorded.
+ *
+ * The trace file is a header followed by a sequence of events,
+ * each a fixed-size record followed by its data: the pathname
+ * for an open, the bytes read or written for a transfer, and
+ * for an SMBus ioctl, the read/write flag followed by the
+ * payload, for an I2C_RDWR register read, the bytes read, and
+ * for I2C_FUNCS, the adapter's functionality word, padded to
+ * a multiple of 8 bytes.  Each successful
+ * open starts a new stream, and the events on that descriptor
+ * carry the (32-bit) stream number.  Integers are in host byte
+ * order.
+ *
+ * On replay, opens are matched in order by pathname and flags,
+ * and each operation on the resulting descriptor is matched to
+ * the next unused event in its stream with the same type and
+ * arguments.  So that different read strategies can be tried
+ * against a trace, an operation with no matching event is
+ * answered from the last contents seen in the stream, taking
+ * the average time per byte that the stream's transfers took.
+ *
+ * Recording and replaying are process-wide, and should be
+ * started before any device is opened and stopped after all
+ * are closed.
+ */
+#define TRACE_MAGIC		"TEGEETRC"
+#define TRACE_VERSION		2
+#define TRACE_BUFSIZE		65536
+#define TRACE_MAX_DATA		(I2C_SMBUS_BLOCK_MAX + 3)
+#define TRACE_PAD(n)		(((size_t) (n) + 7) & ~(size_t) 7)
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t soctype;
+};
+
+enum {
+	trace_open_event = 1,
+	trace_close_event,
+	trace_ioctl_event,
+	trace_pread_event,
+	trace_pwrite_event,
+};
+
+struct trace_event {
+	uint64_t start_ns;	// since the start of the trace
+	uint32_t duration_ns;
+	int32_t result;
+	uint32_t arg;		// open flags or ioctl request
+	uint32_t offset;	// file offset, SMBus command, or I2C address
+	uint32_t stream;
+	uint16_t len;		// transfer length or SMBus size
+	uint16_t datalen;
+	uint8_t type;
+	uint8_t err;
+	uint8_t reserved[6];
+};
+_Static_assert(sizeof(struct trace_event) == 40, "trace event size");
+
+/*
+ * For replay, the events on one stream, with the contents
+ * and timing they imply
+ */
+struct replay_stream {
+	const struct trace_event **events;
+	uint8_t *consumed;
+	size_t count;
+	size_t cursor;
+	uint8_t *contents;
+	uint8_t *known;
+	size_t size;
+	uint64_t xfer_ns;
+	uint64_t xfer_bytes;
+};
+
+enum {
+	trace_off,
+	trace_recording,
+	trace_replaying,
+};
+
+static atomic_int trace_mode;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_epoch;
+static tegra_soctype_t trace_soc;
+static int *fdstreams;		// stream+1 for each descriptor, 0 if none
+static int fdstreams_size;
+
+static int record_fd = -1;
+static uint8_t *record_buf;
+static size_t record_used;
+static int record_error;
+static uint32_t record_streams;
+
+static uint8_t *replay_data;
+static const struct trace_event **replay_opens;
+static uint8_t *replay_opens_used;
+static size_t replay_open_count;
+static struct replay_stream *replay_streams;
+static size_t replay_stream_count;
+
+/*
+ * elapsed_ns
+ */
+static uint64_t
+elapsed_ns (const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+
+} /* elapsed_ns */
+
+/*
+ * sleep_ns
+ */
+static void
+sleep_ns (uint64_t ns)
+{
+	struct timespec until;
+
+	if (ns == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += ns / 1000000000ULL;
+	until.tv_nsec += ns % 1000000000ULL;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec += 1;
+		until.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+
+} /* sleep_ns */
+
+/*
+ * fd_stream
+ *
+ * Returns the stream for a descriptor, or -1.  Called
+ * with the trace lock held.
+ */
+static int
+fd_stream (int fd)
+{
+	if (fd < 0 || fd >= fdstreams_size)
+		return -1;
+	return fdstreams[fd] - 1;
+
+} /* fd_stream */
+
+/*
+ * fd_bind
+ *
+ * Called with the trace lock held.
+ */
+static int
+fd_bind (int fd, int stream)
+{
+	int *newtab;
+	int newsize;
+
+	if (fd >= fdstreams_size) {
+		newsize = (fd < 64 ? 64 : fd * 2);
+		newtab = realloc(fdstreams, newsize * sizeof(*newtab));
+		if (newtab == NULL)
+			return -1;
+		memset(newtab + fdstreams_size, 0, (newsize - fdstreams_size) * sizeof(*newtab));
+		fdstreams = newtab;
+		fdstreams_size = newsize;
+	}
+	fdstreams[fd] = stream + 1;
+	return 0;
+
+} /* fd_bind */
+
+/*
+ * smbus_payload_len
+ *
+ * Number of data bytes an SMBus transaction transfers.
+ */
+static size_t
+smbus_payload_len (const struct i2c_smbus_ioctl_data *args)
+{
+	switch (args->size) {
+	case I2C_SMBUS_BYTE:
+	case I2C_SMBUS_BYTE_DATA:
+		return 1;
+	case I2C_SMBUS_WORD_DATA:
+	case I2C_SMBUS_PROC_CALL:
+		return 2;
+	case I2C_SMBUS_BLOCK_DATA:
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+	case I2C_SMBUS_BLOCK_PROC_CALL:
+		if (args->data == NULL || args->data->block[0] > I2C_SMBUS_BLOCK_MAX)
+			return I2C_SMBUS_BLOCK_MAX + 1;
+		return args->data->block[0] + 1;
+	default:
+		return 0;
+	}
+
+} /* smbus_payload_len */
+
+/*
+ * rdwr_register_read
+ *
+ * Checks whether an I2C_RDWR transaction is a register read
+ * (a one-byte offset write, then a read), as rdwr_read() does.
+ * Returns the read message, setting *reg to the offset, or
+ * NULL for any other kind of transaction.
+ */
+static struct i2c_msg *
+rdwr_register_read (const struct i2c_rdwr_ioctl_data *args, uint32_t *reg)
+{
+	if (args == NULL || args->msgs == NULL || args->nmsgs != 2 ||
+	    (args->msgs[0].flags & I2C_M_RD) != 0 || args->msgs[0].len != 1 ||
+	    (args->msgs[1].flags & I2C_M_RD) == 0)
+		return NULL;
+	*reg = args->msgs[0].buf[0];
+	return &args->msgs[1];
+
+} /* rdwr_register_read */
+
+/*
+ * record_flush
+ *
+ * Called with the trace lock held.
+ */
+static int
+record_flush (void)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < record_used; off += n) {
+		n = write(record_fd, record_buf + off, record_used - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			record_error = errno;
+			break;
+		}
+	}
+	record_used = 0;
+	return record_error == 0 ? 0 : -1;
+
+} /* record_flush */
+
+/*
+ * record_event
+ *
+ * Appends an event to the trace.  A new_stream of 1 assigns
+ * a new stream to the (successfully opened) descriptor; -1
+ * means the caller has already set the event's stream.
+ */
+static void
+record_event (struct trace_event *ev, const struct timespec *start, int fd,
+	      const void *data, size_t datalen, int new_stream)
+{
+	int save_errno = errno;
+	uint64_t ns = elapsed_ns(start);
+
+	if (datalen > UINT16_MAX)
+		datalen = UINT16_MAX;
+	ev->start_ns = (uint64_t) (start->tv_sec - trace_epoch.tv_sec) * 1000000000ULL +
+		start->tv_nsec - trace_epoch.tv_nsec;
+	ev->duration_ns = (ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns);
+	ev->err = (ev->result < 0 ? save_errno : 0);
+	ev->datalen = datalen;
+	pthread_mutex_lock(&trace_lock);
+	if (new_stream > 0) {
+		// descriptors are bound to stream+1 in an int
+		if (record_streams >= INT_MAX)
+			record_error = EOVERFLOW;
+		ev->stream = record_streams++;
+		if (record_error == 0 && fd_bind(fd, ev->stream) < 0)
+			record_error = ENOMEM;
+	} else if (new_stream == 0)
+		ev->stream = fd_stream(fd);
+	if (record_used + sizeof(*ev) + TRACE_PAD(datalen) > TRACE_BUFSIZE)
+		record_flush();
+	if (sizeof(*ev) + TRACE_PAD(datalen) > TRACE_BUFSIZE)
+		record_error = EFBIG;
+	else {
+		memcpy(record_buf + record_used, ev, sizeof(*ev));
+		record_used += sizeof(*ev);
+		if (datalen > 0)
+			memcpy(record_buf + record_used, data, datalen);
+		memset(record_buf + record_used + datalen, 0, TRACE_PAD(datalen) - datalen);
+		record_used += TRACE_PAD(datalen);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	errno = save_errno;
+
+} /* record_event */
+
+/*
+ * replay_match
+ *
+ * Finds the next unused event on a stream that matches,
+ * starting at the cursor and wrapping around.  Called with
+ * the trace lock held.
+ */
+static const struct trace_event *
+replay_match (struct replay_stream *s, uint8_t type, uint32_t arg, uint32_t offset,
+	      uint16_t len, const uint8_t *prefix, size_t prefixlen)
+{
+	const struct trace_event *ev;
+	size_t i, n;
+
+	for (n = 0; n < s->count; n++) {
+		i = (s->cursor + n) % s->count;
+		ev = s->events[i];
+		if (s->consumed[i] || ev->type != type || ev->arg != arg ||
+		    ev->offset != offset || ev->len != len)
+			continue;
+		if (prefixlen > 0 &&
+		    (ev->datalen < prefixlen || memcmp(ev + 1, prefix, prefixlen) != 0))
+			continue;
+		s->consumed[i] = 1;
+		s->cursor = i + 1;
+		return ev;
+	}
+	return NULL;
+
+} /* replay_match */
+
+/*
+ * replay_fill
+ *
+ * Copies remembered contents for a synthesized read,
+ * returning the time to take, or -1 if any of the bytes
+ * were never seen.  Called with the trace lock held.
+ */
+static int64_t
+replay_fill (struct replay_stream *s, void *buf, size_t offset, size_t len)
+{
+	size_t i;
+
+	if (offset + len > s->size)
+		return -1;
+	for (i = 0; i < len; i++)
+		if (!s->known[offset + i])
+			return -1;
+	memcpy(buf, s->contents + offset, len);
+	return s->xfer_bytes == 0 ? 0 : (int64_t) (s->xfer_ns * len / s->xfer_bytes);
+
+} /* replay_fill */
+
+/*
+ * replay_remember
+ *
+ * Notes contents seen (or written) on a stream.
+ */
+static int
+replay_remember (struct replay_stream *s, const void *buf, size_t offset, size_t len)
+{
+	uint8_t *newcontents, *newknown;
+	size_t newsize;
+
+	if (offset + len > s->size) {
+		newsize = offset + len;
+		newcontents = realloc(s->contents, newsize);
+		if (newcontents == NULL)
+			return -1;
+		s->contents = newcontents;
+		newknown = realloc(s->known, newsize);
+		if (newknown == NULL)
+			return -1;
+		s->known = newknown;
+		memset(s->known + s->size, 0, newsize - s->size);
+		s->size = newsize;
+	}
+	memcpy(s->contents + offset, buf, len);
+	memset(s->known + offset, 1, len);
+	return 0;
+
+} /* replay_remember */
+
+/*
+ * replay_finish
+ *
+ * Sleeps out the recorded duration of an event (less the
+ * time already spent) and sets errno from it.
+ */
+static int
+replay_finish (const struct trace_event *ev, const struct timespec *start)
+{
+	uint64_t spent = elapsed_ns(start);
+
+	if (ev->duration_ns > spent)
+		sleep_ns(ev->duration_ns - spent);
+	if (ev->result < 0)
+		errno = ev->err;
+	return ev->result;
+
+} /* replay_finish */
+
+/*
+ * replay_synthesize
+ *
+ * Finishes an operation that had no recorded event.
+ */
+static int
+replay_synthesize (int64_t ns, const struct timespec *start, int result)
+{
+	uint64_t spent = elapsed_ns(start);
+
+	if (ns < 0) {
+		errno = EIO;
+		return -1;
+	}
+	if ((uint64_t) ns > spent)
+		sleep_ns(ns - spent);
+	return result;
+
+} /* replay_synthesize */
+
+/*
+ * replay_stream_for
+ *
+ * Called with the trace lock held.
+ */
+static struct replay_stream *
+replay_stream_for (int fd)
+{
+	int stream = fd_stream(fd);
+
+	if (stream < 0 || (size_t) stream >= replay_stream_count)
+		return NULL;
+	return &replay_streams[stream];
+
+} /* replay_stream_for */
+
+/*
+ * trace_open
+ */
+int
+trace_open (const char *pathname, int flags)
+{
+	struct trace_event ev;
+	struct timespec start;
+	size_t i, len = strlen(pathname);
+	int fd;
+
+	switch (atomic_load_explicit(&trace_mode, memory_order_acquire)) {
+	case trace_recording:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		fd = open(pathname, flags);
+		memset(&ev, 0, sizeof(ev));
+		ev.type = trace_open_event;
+		ev.arg = flags;
+		ev.result = (fd < 0 ? -1 : 0);
+		record_event(&ev, &start, fd, pathname, len, fd >= 0);
+		return fd;
+	case trace_replaying:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&trace_lock);
+		for (i = 0; i < replay_open_count; i++) {
+			const struct trace_event *op = replay_opens[i];
+			if (!replay_opens_used[i] && op->arg == (uint32_t) flags && op->datalen == len &&
+			    memcmp(op + 1, pathname, len) == 0)
+				break;
+		}
+		if (i >= replay_open_count) {
+			pthread_mutex_unlock(&trace_lock);
+			errno = ENOENT;
+			return -1;
+		}
+		replay_opens_used[i] = 1;
+		fd = -1;
+		if (replay_opens[i]->result >= 0) {
+			// stands in for the device, so the descriptor can be closed normally
+			fd = open("/dev/null", O_RDWR|O_CLOEXEC);
+			if (fd >= 0 && fd_bind(fd, replay_opens[i]->stream) < 0) {
+				close(fd);
+				fd = -1;
+			}
+			if (fd < 0) {
+				pthread_mutex_unlock(&trace_lock);
+				return -1;
+			}
+		}
+		pthread_mutex_unlock(&trace_lock);
+		return replay_finish(replay_opens[i], &start) < 0 ? -1 : fd;
+	default:
+		return open(pathname, flags);
+	}
+
+} /* trace_open */
+
+/*
+ * trace_close
+ *
+ * The descriptor is unbound from its stream before it is
+ * closed, since another thread's open may reuse the number
+ * as soon as it is.
+ */
+int
+trace_close (int fd)
+{
+	struct trace_event ev;
+	struct timespec start;
+	int ret, mode, stream;
+
+	mode = atomic_load_explicit(&trace_mode, memory_order_acquire);
+	if (mode == trace_off)
+		return close(fd);
+	pthread_mutex_lock(&trace_lock);
+	stream = fd_stream(fd);
+	if (fd >= 0 && fd < fdstreams_size)
+		fdstreams[fd] = 0;
+	pthread_mutex_unlock(&trace_lock);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = close(fd);
+	if (mode == trace_recording) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = trace_close_event;
+		ev.result = ret;
+		ev.stream = (uint32_t) stream;
+		record_event(&ev, &start, fd, NULL, 0, -1);
+	}
+	return ret;
+
+} /* trace_close */
+
+/*
+ * trace_ioctl
+ *
+ * Only I2C_SMBUS, I2C_RDWR, I2C_FUNCS, and the I2C_SLAVE
+ * requests are recorded and replayed; the argument of
+ * I2C_SLAVE_FORCE is the address itself, not a pointer.
+ */
+int
+trace_ioctl (int fd, unsigned long request, void *arg)
+{
+	struct i2c_smbus_ioctl_data *args = arg;
+	struct replay_stream *s;
+	const struct trace_event *ev;
+	struct trace_event newev;
+	struct timespec start;
+	struct i2c_msg *msg;
+	uint8_t data[TRACE_MAX_DATA];
+	size_t paylen = 0, prefixlen;
+	uint32_t reg = 0;
+	int ret;
+	int64_t ns;
+
+	switch (atomic_load_explicit(&trace_mode, memory_order_acquire)) {
+	case trace_recording:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = ioctl(fd, request, arg);
+		memset(&newev, 0, sizeof(newev));
+		newev.type = trace_ioctl_event;
+		newev.arg = request;
+		newev.result = ret;
+		if (request == I2C_SMBUS) {
+			newev.offset = args->command;
+			newev.len = args->size;
+			data[0] = args->read_write;
+			paylen = smbus_payload_len(args);
+			if (paylen > 0 && args->data != NULL)
+				memcpy(data + 1, args->data, paylen);
+			else
+				paylen = 0;
+			record_event(&newev, &start, fd, data, paylen + 1, 0);
+		} else if (request == I2C_RDWR) {
+			msg = rdwr_register_read(arg, &newev.offset);
+			if (msg != NULL) {
+				newev.len = msg->len;
+				record_event(&newev, &start, fd, msg->buf, (ret < 0 ? 0 : msg->len), 0);
+			} else
+				record_event(&newev, &start, fd, NULL, 0, 0);
+		} else if (request == I2C_FUNCS) {
+			record_event(&newev, &start, fd, arg, (ret < 0 ? 0 : sizeof(unsigned long)), 0);
+		} else {
+			newev.offset = (uint32_t) (uintptr_t) arg;
+			record_event(&newev, &start, fd, NULL, 0, 0);
+		}
+		return ret;
+	case trace_replaying:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&trace_lock);
+		s = replay_stream_for(fd);
+		if (s == NULL) {
+			pthread_mutex_unlock(&trace_lock);
+			errno = EBADF;
+			return -1;
+		}
+		if (request == I2C_FUNCS) {
+			ev = replay_match(s, trace_ioctl_event, request, 0, 0, NULL, 0);
+			pthread_mutex_unlock(&trace_lock);
+			if (ev != NULL) {
+				if (ev->result >= 0 && ev->datalen == sizeof(unsigned long))
+					memcpy(arg, ev + 1, sizeof(unsigned long));
+				return replay_finish(ev, &start);
+			}
+			// Not recorded: claim what the library's read methods need
+			*(unsigned long *) arg = I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE_DATA |
+				I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK;
+			return 0;
+		}
+		if (request == I2C_RDWR) {
+			msg = rdwr_register_read(arg, &reg);
+			ev = replay_match(s, trace_ioctl_event, request, reg, (msg == NULL ? 0 : msg->len), NULL, 0);
+			if (ev != NULL) {
+				if (ev->result >= 0 && msg != NULL && ev->datalen == msg->len)
+					memcpy(msg->buf, ev + 1, ev->datalen);
+				pthread_mutex_unlock(&trace_lock);
+				return replay_finish(ev, &start);
+			}
+			ns = (msg == NULL ? -1 : replay_fill(s, msg->buf, reg, msg->len));
+			pthread_mutex_unlock(&trace_lock);
+			return replay_synthesize(ns, &start, 2);
+		}
+		if (request != I2C_SMBUS) {
+			ev = replay_match(s, trace_ioctl_event, request, (uint32_t) (uintptr_t) arg, 0, NULL, 0);
+			pthread_mutex_unlock(&trace_lock);
+			return ev == NULL ? 0 : replay_finish(ev, &start);
+		}
+		// I2C block reads must also match in length
+		data[0] = args->read_write;
+		prefixlen = 1;
+		if (args->size == I2C_SMBUS_I2C_BLOCK_DATA && args->data != NULL) {
+			data[1] = args->data->block[0];
+			prefixlen = 2;
+		}
+		ev = replay_match(s, trace_ioctl_event, request, args->command, args->size, data, prefixlen);
+		if (ev != NULL) {
+			// the trace is not trusted to fit the caller's buffer
+			if (ev->result >= 0 && args->read_write == I2C_SMBUS_READ && args->data != NULL &&
+			    ev->datalen > 1)
+				memcpy(args->data, (const uint8_t *) (ev + 1) + 1,
+				       ((size_t) ev->datalen - 1 < sizeof(*args->data) ? (size_t) ev->datalen - 1 :
+					sizeof(*args->data)));
+			pthread_mutex_unlock(&trace_lock);
+			return replay_finish(ev, &start);
+		}
+		/*
+		 * Not recorded; only byte and word transfers (as
+		 * smbus_read() does) and I2C block reads (as
+		 * i2c_block_read() does) can be made up.
+		 */
+		ns = -1;
+		if (args->size == I2C_SMBUS_BYTE_DATA || args->size == I2C_SMBUS_WORD_DATA) {
+			paylen = (args->size == I2C_SMBUS_BYTE_DATA ? 1 : 2);
+			if (args->read_write == I2C_SMBUS_READ)
+				ns = replay_fill(s, args->data, args->command, paylen);
+			else if (replay_remember(s, args->data, args->command, paylen) == 0)
+				ns = s->xfer_bytes == 0 ? 0 : (int64_t) (s->xfer_ns * paylen / s->xfer_bytes);
+		} else if (args->size == I2C_SMBUS_I2C_BLOCK_DATA && args->read_write == I2C_SMBUS_READ &&
+			   args->data != NULL && args->data->block[0] <= I2C_SMBUS_BLOCK_MAX)
+			ns = replay_fill(s, &args->data->block[1], args->command, args->data->block[0]);
+		pthread_mutex_unlock(&trace_lock);
+		return replay_synthesize(ns, &start, 0);
+	default:
+		return ioctl(fd, request, arg);
+	}
+
+} /* trace_ioctl */
+
+/*
+ * trace_pread
+ */
+ssize_t
+trace_pread (int fd, void *buf, size_t len, off_t offset)
+{
+	struct replay_stream *s;
+	const struct trace_event *ev;
+	struct trace_event newev;
+	struct timespec start;
+	ssize_t n;
+	int64_t ns;
+
+	switch (atomic_load_explicit(&trace_mode, memory_order_acquire)) {
+	case trace_recording:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = pread(fd, buf, len, offset);
+		memset(&newev, 0, sizeof(newev));
+		newev.type = trace_pread_event;
+		newev.offset = offset;
+		newev.len = len;
+		newev.result = n;
+		record_event(&newev, &start, fd, buf, (n < 0 ? 0 : n), 0);
+		return n;
+	case trace_replaying:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&trace_lock);
+		s = replay_stream_for(fd);
+		if (s == NULL) {
+			pthread_mutex_unlock(&trace_lock);
+			errno = EBADF;
+			return -1;
+		}
+		ev = replay_match(s, trace_pread_event, 0, offset, len, NULL, 0);
+		if (ev != NULL) {
+			// the trace is not trusted to fit the caller's buffer
+			n = 0;
+			if (ev->result > 0) {
+				n = (ev->datalen < len ? ev->datalen : len);
+				memcpy(buf, ev + 1, n);
+			}
+			pthread_mutex_unlock(&trace_lock);
+			return (replay_finish(ev, &start) > n ? n : ev->result);
+		}
+		ns = replay_fill(s, buf, offset, len);
+		pthread_mutex_unlock(&trace_lock);
+		return replay_synthesize(ns, &start, len);
+	default:
+		return pread(fd, buf, len, offset);
+	}
+
+} /* trace_pread */
+
+/*
+ * trace_pwrite
+ */
+ssize_t
+trace_pwrite (int fd, const void *buf, size_t len, off_t offset)
+{
+	struct replay_stream *s;
+	const struct trace_event *ev;
+	struct trace_event newev;
+	struct timespec start;
+	ssize_t n;
+	int64_t ns;
+
+	switch (atomic_load_explicit(&trace_mode, memory_order_acquire)) {
+	case trace_recording:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = pwrite(fd, buf, len, offset);
+		memset(&newev, 0, sizeof(newev));
+		newev.type = trace_pwrite_event;
+		newev.offset = offset;
+		newev.len = len;
+		newev.result = n;
+		record_event(&newev, &start, fd, buf, (n < 0 ? 0 : n), 0);
+		return n;
+	case trace_replaying:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&trace_lock);
+		s = replay_stream_for(fd);
+		if (s == NULL) {
+			pthread_mutex_unlock(&trace_lock);
+			errno = EBADF;
+			return -1;
+		}
+		ev = replay_match(s, trace_pwrite_event, 0, offset, len, NULL, 0);
+		if (ev != NULL) {
+			pthread_mutex_unlock(&trace_lock);
+			return replay_finish(ev, &start);
+		}
+		ns = -1;
+		if (replay_remember(s, buf, offset, len) == 0)
+			ns = s->xfer_bytes == 0 ? 0 : (int64_t) (s->xfer_ns * len / s->xfer_bytes);
+		pthread_mutex_unlock(&trace_lock);
+		return replay_synthesize(ns, &start, len);
+	default:
+		return pwrite(fd, buf, len, offset);
+	}
+
+} /* trace_pwrite */
+
+/*
+ * trace_soctype
+ *
+ * When replaying, the SoC type is the one recorded, so a
+ * trace can be replayed on any machine.
+ */
+tegra_soctype_t
+trace_soctype (void)
+{
+	if (atomic_load_explicit(&trace_mode, memory_order_acquire) == trace_replaying)
+		return trace_soc;
+	return cvm_soctype();
+
+} /* trace_soctype */
+
+/*
+ * eeprom_trace_record
+ *
+ * Starts recording all device transactions to a file.
+ *
+ * Returns 0 on success, -1 on error (EBUSY if a trace
+ * is already being recorded or replayed).
+ */
+int
+eeprom_trace_record (const char *pathname)
+{
+	struct trace_header hdr;
+	int save_errno;
+
+	if (atomic_load(&trace_mode) != trace_off) {
+		errno = EBUSY;
+		return -1;
+	}
+	record_buf = malloc(TRACE_BUFSIZE);
+	if (record_buf == NULL)
+		return -1;
+	record_fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (record_fd < 0) {
+		save_errno = errno;
+		free(record_buf);
+		record_buf = NULL;
+		errno = save_errno;
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.soctype = cvm_soctype();
+	memcpy(record_buf, &hdr, sizeof(hdr));
+	record_used = sizeof(hdr);
+	record_error = 0;
+	record_streams = 0;
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+	atomic_store(&trace_mode, trace_recording);
+	return 0;
+
+} /* eeprom_trace_record */
+
+/*
+ * replay_load
+ *
+ * Splits the trace into its streams, noting the contents
+ * each one saw and how long its transfers took per byte.
+ */
+static int
+replay_load (size_t size)
+{
+	const struct trace_event *ev;
+	struct replay_stream *s;
+	const uint8_t *payload;
+	size_t off, i, paylen;
+
+	for (off = sizeof(struct trace_header); off < size; off += sizeof(*ev) + TRACE_PAD(ev->datalen)) {
+		ev = (const struct trace_event *) (replay_data + off);
+		if (size - off < sizeof(*ev) || size - off - sizeof(*ev) < TRACE_PAD(ev->datalen)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (ev->type == trace_open_event) {
+			if (ev->result >= 0 && ev->stream >= replay_stream_count)
+				replay_stream_count = ev->stream + 1;
+			replay_open_count += 1;
+		}
+	}
+	replay_opens = calloc(replay_open_count, sizeof(*replay_opens));
+	replay_opens_used = calloc(replay_open_count, 1);
+	replay_streams = calloc(replay_stream_count, sizeof(*replay_streams));
+	if ((replay_open_count > 0 && (replay_opens == NULL || replay_opens_used == NULL)) ||
+	    (replay_stream_count > 0 && replay_streams == NULL))
+		return -1;
+	for (off = sizeof(struct trace_header); off < size; off += sizeof(*ev) + TRACE_PAD(ev->datalen)) {
+		ev = (const struct trace_event *) (replay_data + off);
+		if (ev->type != trace_open_event && ev->type != trace_close_event &&
+		    ev->stream < replay_stream_count)
+			replay_streams[ev->stream].count += 1;
+	}
+	for (i = 0; i < replay_stream_count; i++) {
+		replay_streams[i].events = calloc(replay_streams[i].count + 1, sizeof(*replay_streams[i].events));
+		if (replay_streams[i].events == NULL)
+			return -1;
+		replay_streams[i].count = 0;
+	}
+
+	replay_open_count = 0;
+	for (off = sizeof(struct trace_header); off < size; off += sizeof(*ev) + TRACE_PAD(ev->datalen)) {
+		ev = (const struct trace_event *) (replay_data + off);
+		if (ev->type == trace_open_event) {
+			replay_opens[replay_open_count++] = ev;
+			continue;
+		}
+		if (ev->stream >= replay_stream_count || ev->type == trace_close_event)
+			continue;
+		s = &replay_streams[ev->stream];
+		s->events[s->count++] = ev;
+		if (ev->result < 0)
+			continue;
+		if (ev->type == trace_pread_event || ev->type == trace_pwrite_event) {
+			if (replay_remember(s, ev + 1, ev->offset, ev->datalen) < 0)
+				return -1;
+			s->xfer_ns += ev->duration_ns;
+			s->xfer_bytes += ev->datalen;
+		} else if (ev->type == trace_ioctl_event) {
+			payload = (const uint8_t *) (ev + 1);
+			paylen = 0;
+			if (ev->arg == I2C_SMBUS && (ev->len == I2C_SMBUS_BYTE_DATA || ev->len == I2C_SMBUS_WORD_DATA) &&
+			    ev->datalen > 1) {
+				payload += 1;
+				paylen = ev->datalen - 1;
+			} else if (ev->arg == I2C_SMBUS && ev->len == I2C_SMBUS_I2C_BLOCK_DATA && ev->datalen > 2 &&
+				   payload[0] == I2C_SMBUS_READ) {
+				paylen = payload[1];
+				payload += 2;
+				if (paylen > (size_t) ev->datalen - 2)
+					paylen = (size_t) ev->datalen - 2;
+			} else if (ev->arg == I2C_RDWR)
+				paylen = ev->datalen;
+			if (paylen == 0)
+				continue;
+			if (replay_remember(s, payload, ev->offset, paylen) < 0)
+				return -1;
+			s->xfer_ns += ev->duration_ns;
+			s->xfer_bytes += paylen;
+		}
+	}
+	for (i = 0; i < replay_stream_count; i++) {
+		replay_streams[i].consumed = calloc(replay_streams[i].count + 1, 1);
+		if (replay_streams[i].consumed == NULL)
+			return -1;
+	}
+	return 0;
+
+} /* replay_load */
+
+/*
+ * replay_free
+ */
+static void
+replay_free (void)
+{
+	size_t i;
+
+	for (i = 0; i < replay_stream_count; i++) {
+		free(replay_streams[i].events);
+		free(replay_streams[i].consumed);
+		free(replay_streams[i].contents);
+		free(replay_streams[i].known);
+	}
+	free(replay_streams);
+	free(replay_opens);
+	free(replay_opens_used);
+	free(replay_data);
+	replay_streams = NULL;
+	replay_stream_count = 0;
+	replay_opens = NULL;
+	replay_opens_used = NULL;
+	replay_open_count = 0;
+	replay_data = NULL;
+
+} /* replay_free */
+
+/*
+ * eeprom_trace_replay
+ *
+ * Starts answering all device transactions from a trace
+ * recorded with eeprom_trace_record().
+ *
+ * Returns 0 on success, -1 on error (EINVAL if the file
+ * is not a valid trace, EBUSY if a trace is already being
+ * recorded or replayed).
+ */
+int
+eeprom_trace_replay (const char *pathname)
+{
+	struct trace_header hdr;
+	struct stat st;
+	size_t off;
+	ssize_t n;
+	int fd, save_errno;
+
+	if (atomic_load(&trace_mode) != trace_off) {
+		errno = EBUSY;
+		return -1;
+	}
+	fd = open(pathname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+	if (st.st_size < (off_t) sizeof(hdr)) {
+		errno = EINVAL;
+		goto failure;
+	}
+	// allocated rather than mapped, so the events are suitably aligned
+	replay_data = malloc(st.st_size + sizeof(struct trace_event));
+	if (replay_data == NULL)
+		goto failure;
+	for (off = 0; off < (size_t) st.st_size; off += n) {
+		n = read(fd, replay_data + off, st.st_size - off);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EINVAL;
+			goto failure;
+		}
+	}
+	close(fd);
+	fd = -1;
+	memcpy(&hdr, replay_data, sizeof(hdr));
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != TRACE_VERSION) {
+		errno = EINVAL;
+		goto failure;
+	}
+	if (replay_load(st.st_size) < 0)
+		goto failure;
+	trace_soc = hdr.soctype;
+	atomic_store(&trace_mode, trace_replaying);
+	return 0;
+
+  failure:
+	save_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	replay_free();
+	errno = save_errno;
+	return -1;
+
+} /* eeprom_trace_replay */
+
+/*
+ * eeprom_trace_stop
+ *
+ * Stops recording (writing out the rest of the trace)
+ * or replaying.
+ *
+ * Returns 0 on success, -1 if the trace could not be
+ * completely written.
+ */
+int
+eeprom_trace_stop (void)
+{
+	int mode = atomic_exchange(&trace_mode, trace_off);
+	int ret = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if (mode == trace_recording) {
+		if (record_flush() < 0 || close(record_fd) < 0) {
+			if (record_error == 0)
+				record_error = errno;
+		}
+		if (record_error != 0) {
+			errno = record_error;
+			ret = -1;
+		}
+		free(record_buf);
+		record_buf = NULL;
+		record_fd = -1;
+	} else if (mode == trace_replaying)
+		replay_free();
+	free(fdstreams);
+	fdstreams = NULL;
+	fdstreams_size = 0;
+	pthread_mutex_unlock(&trace_lock);
+	return ret;
+
+} /* eeprom_trace_stop */
@@ -0,0 +1,603 @@
+// Copyright (c) 2022, Matthew Madison
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "eeprom-internal.h"
+
+/*
+ * Read transports.  Besides the EEPROM driver and SMBus byte
+ * reads, the NVIDIA layout can be read with SMBus I2C block
+ * reads (up to 32 bytes per transaction) or with a single
+ * I2C_RDWR transaction (writing the offset, then reading
+ * after a repeated start).  Adapters differ in which of these
+ * they support and how fast each one is, so eeprom_calibrate()
+ * measures them, and the results are kept in a cache file,
+ * one line per bus:
+ *
+ *    <bus> <transport>=<bytes/sec>[,<transport>=<bytes/sec>]... <adapter name>
+ *
+ * with the transports that work listed fastest first.  An
+ * entry whose adapter name no longer matches (the buses having
+ * been renumbered, say) is ignored.  The cache is loaded once
+ * per process, on first use.  Calibration reloads it under an
+ * flock() on the file and merges its results in, so that
+ * concurrent calibrations of different buses all survive.
+ */
+#define TRANSPORT_CACHE_ENV	"TEGRA_EEPROM_TRANSPORT_CACHE"
+#define TRANSPORT_CACHE_DEFAULT	"/var/cache/tegra-eeprom/transports"
+#define CALIBRATE_PASSES	4
+
+struct cache_entry {
+	unsigned int bus;
+	unsigned int count;
+	eeprom_transport_t ranking[eeprom_transport_count];
+	unsigned long rates[eeprom_transport_count];
+	char name[128];
+};
+
+static const char *transport_names[eeprom_transport_count] = {
+	[eeprom_transport_sysfs] = "sysfs",
+	[eeprom_transport_rdwr] = "rdwr",
+	[eeprom_transport_i2c_block] = "i2c-block",
+	[eeprom_transport_smbus_byte] = "smbus-byte",
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+static unsigned int cache_count;
+
+/*
+ * i2c_block_read
+ *
+ * Reads with SMBus I2C block transactions.
+ */
+ssize_t
+i2c_block_read (eeprom_context_t ctx, void *buf, size_t offset, size_t len)
+{
+	union i2c_smbus_data data;
+	struct i2c_smbus_ioctl_data args = {
+		.read_write = I2C_SMBUS_READ,
+		.size = I2C_SMBUS_I2C_BLOCK_DATA,
+		.data = &data,
+	};
+	uint8_t *bp = buf;
+	size_t count, n;
+
+	for (count = 0; count < len; count += n) {
+		n = len - count;
+		if (n > I2C_SMBUS_BLOCK_MAX)
+			n = I2C_SMBUS_BLOCK_MAX;
+		args.command = offset + count;
+		data.block[0] = n;
+		if (trace_ioctl(ctx->i2cfd, I2C_SMBUS, &args) < 0)
+			return -1;
+		memcpy(bp + count, &data.block[1], n);
+	}
+	return (ssize_t) len;
+
+} /* i2c_block_read */
+
+/*
+ * rdwr_read
+ *
+ * Reads with a single combined I2C transaction.
+ */
+ssize_t
+rdwr_read (eeprom_context_t ctx, void *buf, size_t offset, size_t len)
+{
+	uint8_t reg = offset;
+	struct i2c_msg msgs[2] = {
+		{ .addr = ctx->i2c_addr, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = ctx->i2c_addr, .flags = I2C_M_RD, .len = len, .buf = buf },
+	};
+	struct i2c_rdwr_ioctl_data args = {
+		.msgs = msgs,
+		.nmsgs = 2,
+	};
+
+	if (trace_ioctl(ctx->i2cfd, I2C_RDWR, &args) < 0)
+		return -1;
+	return (ssize_t) len;
+
+} /* rdwr_read */
+
+/*
+ * transport_readfunc
+ */
+eeprom_readfunc_t
+transport_readfunc (eeprom_transport_t transport)
+{
+	switch (transport) {
+	case eeprom_transport_sysfs:
+		return normal_read;
+	case eeprom_transport_rdwr:
+		return rdwr_read;
+	case eeprom_transport_i2c_block:
+		return i2c_block_read;
+	default:
+		break;
+	}
+	return smbus_read;
+
+} /* transport_readfunc */
+
+/*
+ * cache_path
+ */
+static const char *
+cache_path (void)
+{
+	const char *path = getenv(TRANSPORT_CACHE_ENV);
+
+	return (path == NULL || *path == '\0' ? TRANSPORT_CACHE_DEFAULT : path);
+
+} /* cache_path */
+
+/*
+ * parse_entry
+ *
+ * Parses a cache file line.  Returns 0 on success,
+ * -1 for a line that should be skipped.
+ */
+static int
+parse_entry (char *line, struct cache_entry *e)
+{
+	char *ranking, *item, *eq, *save, *ep;
+	unsigned int t;
+	size_t len;
+
+	memset(e, 0, sizeof(*e));
+	line[strcspn(line, "\n")] = '\0';
+	if (line[0] == '#')
+		return -1;
+	e->bus = strtoul(line, &ep, 10);
+	if (ep == line || *ep != ' ')
+		return -1;
+	ranking = ep + 1;
+	ep = strchr(ranking, ' ');
+	if (ep == NULL)
+		return -1;
+	*ep++ = '\0';
+	len = strlen(ep);
+	if (len == 0 || len >= sizeof(e->name))
+		return -1;
+	memcpy(e->name, ep, len + 1);
+	for (item = strtok_r(ranking, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		eq = strchr(item, '=');
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+		for (t = 0; t < eeprom_transport_count; t++)
+			if (strcmp(item, transport_names[t]) == 0)
+				break;
+		if (t >= eeprom_transport_count || e->count >= eeprom_transport_count)
+			return -1;
+		e->ranking[e->count] = t;
+		e->rates[e->count] = strtoul(eq + 1, NULL, 10);
+		e->count += 1;
+	}
+	return (e->count > 0 ? 0 : -1);
+
+} /* parse_entry */
+
+/*
+ * cache_load
+ *
+ * Replaces the cached entries with those in the file.
+ */
+static void
+cache_load (void)
+{
+	struct cache_entry e, *newp;
+	char line[512];
+	unsigned int alloc = 0;
+	FILE *fp;
+
+	free(cache);
+	cache = NULL;
+	cache_count = 0;
+	fp = fopen(cache_path(), "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (parse_entry(line, &e) < 0)
+			continue;
+		if (cache_count >= alloc) {
+			newp = realloc(cache, (alloc + 16) * sizeof(*cache));
+			if (newp == NULL)
+				break;
+			cache = newp;
+			alloc += 16;
+		}
+		cache[cache_count++] = e;
+	}
+	fclose(fp);
+
+} /* cache_load */
+
+/*
+ * cache_lock_file
+ *
+ * Opens the cache file (creating it, and its directory, if
+ * need be) and takes an exclusive flock() on it.  The file
+ * is replaced by rename, so once the lock is held, it is
+ * checked to still be the one at the path.
+ *
+ * Returns the locked descriptor, or -1 on error.
+ */
+static int
+cache_lock_file (void)
+{
+	const char *path = cache_path();
+	char dir[PATH_MAX];
+	struct stat st, pst;
+	int fd, save_errno;
+
+	if (strlen(path) >= sizeof(dir)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(dir, path);
+	if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST)
+		return -1;
+	for (;;) {
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+			save_errno = errno;
+			close(fd);
+			errno = save_errno;
+			return -1;
+		}
+		if (stat(path, &pst) == 0 && pst.st_dev == st.st_dev && pst.st_ino == st.st_ino)
+			return fd;
+		close(fd);
+	}
+
+} /* cache_lock_file */
+
+/*
+ * cache_save
+ *
+ * Writes out the cache, replacing the file atomically.
+ * Called with the cache lock held, and the file locked
+ * with cache_lock_file().
+ */
+static int
+cache_save (void)
+{
+	const char *path = cache_path();
+	char tmppath[PATH_MAX];
+	unsigned int i, j;
+	FILE *fp;
+	int n, save_errno;
+
+	n = snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if (n < 0 || (size_t) n >= sizeof(tmppath)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fp = fopen(tmppath, "w");
+	if (fp == NULL)
+		return -1;
+	fprintf(fp, "# tegra-eeprom transport calibration: bus, transports fastest first, adapter name\n");
+	for (i = 0; i < cache_count; i++) {
+		fprintf(fp, "%u ", cache[i].bus);
+		for (j = 0; j < cache[i].count; j++)
+			fprintf(fp, "%s%s=%lu", (j == 0 ? "" : ","), transport_names[cache[i].ranking[j]],
+				cache[i].rates[j]);
+		fprintf(fp, " %s\n", cache[i].name);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		save_errno = errno;
+		fclose(fp);
+		unlink(tmppath);
+		errno = save_errno;
+		return -1;
+	}
+	if (fclose(fp) != 0 || rename(tmppath, path) < 0) {
+		save_errno = errno;
+		unlink(tmppath);
+		errno = save_errno;
+		return -1;
+	}
+	return 0;
+
+} /* cache_save */
+
+/*
+ * transport_ranking
+ *
+ * Fills in the transports that work on a bus, fastest
+ * first, as calibrated.  Returns the number of them, or
+ * 0 if the bus has not been calibrated (or its adapter
+ * has changed since).
+ */
+int
+transport_ranking (unsigned int bus, eeprom_transport_t *ranking)
+{
+	char name[sizeof(cache->name)];
+	unsigned int i;
+	int count = 0;
+
+	pthread_once(&cache_once, cache_load);
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_count; i++)
+		if (cache[i].bus == bus)
+			break;
+	if (i < cache_count && i2c_adapter_name(bus, name, sizeof(name)) == 0 &&
+	    strcmp(name, cache[i].name) == 0) {
+		memcpy(ranking, cache[i].ranking, cache[i].count * sizeof(*ranking));
+		count = (int) cache[i].count;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return count;
+
+} /* transport_ranking */
+
+/*
+ * transport_best_i2c
+ *
+ * The fastest userland I2C transport for a bus, defaulting
+ * to SMBus byte reads, which every adapter supports.
+ */
+eeprom_transport_t
+transport_best_i2c (unsigned int bus)
+{
+	eeprom_transport_t ranking[eeprom_transport_count];
+	int count = transport_ranking(bus, ranking), i;
+
+	for (i = 0; i < count; i++)
+		if (ranking[i] != eeprom_transport_sysfs)
+			return ranking[i];
+	return eeprom_transport_smbus_byte;
+
+} /* transport_best_i2c */
+
+/*
+ * calibrate_open
+ *
+ * Sets up a context for timing one transport.
+ */
+static eeprom_context_t
+calibrate_open (unsigned int bus, unsigned int addr, eeprom_transport_t transport)
+{
+	eeprom_context_t ctx;
+	char path[PATH_MAX];
+	int fd, readonly, len;
+
+	if (transport == eeprom_transport_sysfs) {
+		if (eeprom_nvmem_path(bus, addr, path, sizeof(path)) < 0) {
+			len = snprintf(path, sizeof(path), "/sys/bus/i2c/devices/%u-%04x/eeprom", bus, addr);
+			if (len < 0 || (size_t) len >= sizeof(path)) {
+				errno = ENAMETOOLONG;
+				return NULL;
+			}
+		}
+		fd = open_path_fd(path, &readonly);
+		if (fd < 0)
+			return NULL;
+		ctx = open_context(fd, module_type_other, 1, normal_read, NULL);
+	} else {
+		fd = open_i2c_fd(bus, addr);
+		if (fd < 0)
+			return NULL;
+		ctx = open_context(fd, module_type_other, 1, transport_readfunc(transport), NULL);
+	}
+	if (ctx == NULL)
+		return NULL;
+	ctx->i2c_addr = addr;
+	lock_init_i2c(ctx, bus, addr);
+	return ctx;
+
+} /* calibrate_open */
+
+/*
+ * calibrate_one
+ *
+ * Times reads of the NVIDIA layout through one transport,
+ * checking that they return the reference contents (or
+ * setting the reference, if there is none yet).
+ *
+ * Returns the throughput in bytes per second, or -1
+ * with errno set if the transport does not work.
+ */
+static double
+calibrate_one (unsigned int bus, unsigned int addr, eeprom_transport_t transport,
+	       uint8_t *reference, int *have_reference)
+{
+	uint8_t buf[EEPROM_SIZE];
+	struct timespec start, end;
+	eeprom_context_t ctx;
+	double ns = 0;
+	unsigned int pass;
+	ssize_t n;
+	int save_errno;
+
+	ctx = calibrate_open(bus, addr, transport);
+	if (ctx == NULL)
+		return -1;
+	for (pass = 0; pass < CALIBRATE_PASSES; pass++) {
+		op_start(ctx);
+		if (lock_wait(ctx, 0) < 0)
+			goto failed;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = ctx->readfunc(ctx, buf, 0, sizeof(buf));
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		lock_release(ctx);
+		if (n < 0)
+			goto failed;
+		if (!*have_reference) {
+			memcpy(reference, buf, sizeof(buf));
+			*have_reference = 1;
+		} else if (memcmp(reference, buf, sizeof(buf)) != 0) {
+			errno = EIO;
+			goto failed;
+		}
+		ns += (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	}
+	eeprom_close(ctx);
+	return (ns <= 0 ? 1e12 : CALIBRATE_PASSES * EEPROM_SIZE * 1e9 / ns);
+
+  failed:
+	save_errno = errno;
+	eeprom_close(ctx);
+	errno = save_errno;
+	return -1;
+
+} /* calibrate_one */
+
+/*
+ * eeprom_calibrate
+ *
+ * Tries each transport on the EEPROM at an I2C address,
+ * filling in results[] (indexed by transport), and saves
+ * the ranking of the ones that work in the cache file.
+ * Transports the adapter does not claim to support
+ * (per I2C_FUNCS) are not tried.  The EEPROM driver,
+ * then SMBus byte reads, are tried first, so that the
+ * contents they return are the reference that the
+ * others must match.
+ *
+ * Returns the number of transports that work, or -1 on
+ * error (including when the cache could not be written).
+ */
+int
+eeprom_calibrate (unsigned int bus, unsigned int addr, eeprom_transport_result_t results[eeprom_transport_count])
+{
+	static const eeprom_transport_t order[eeprom_transport_count] = {
+		eeprom_transport_sysfs,
+		eeprom_transport_smbus_byte,
+		eeprom_transport_i2c_block,
+		eeprom_transport_rdwr,
+	};
+	static const unsigned long needs[eeprom_transport_count] = {
+		[eeprom_transport_sysfs] = 0,
+		[eeprom_transport_rdwr] = I2C_FUNC_I2C,
+		[eeprom_transport_i2c_block] = I2C_FUNC_SMBUS_READ_I2C_BLOCK,
+		[eeprom_transport_smbus_byte] = I2C_FUNC_SMBUS_READ_BYTE_DATA,
+	};
+	uint8_t reference[EEPROM_SIZE];
+	struct cache_entry e, *newp;
+	unsigned long funcs = ~0UL;
+	unsigned int i, j;
+	int fd, have_reference = 0, ret, save_errno;
+	double rate;
+
+	memset(&e, 0, sizeof(e));
+	if (i2c_adapter_name(bus, e.name, sizeof(e.name)) < 0)
+		return -1;
+	e.bus = bus;
+	fd = open_i2c_fd(bus, addr);
+	if (fd >= 0) {
+		if (trace_ioctl(fd, I2C_FUNCS, &funcs) < 0)
+			funcs = ~0UL;
+		trace_close(fd);
+	}
+	for (i = 0; i < eeprom_transport_count; i++) {
+		results[i].transport = i;
+		results[i].supported = 0;
+		results[i].error = 0;
+		results[i].bytes_per_sec = 0;
+	}
+	for (i = 0; i < eeprom_transport_count; i++) {
+		if ((funcs & needs[order[i]]) != needs[order[i]]) {
+			results[order[i]].error = EOPNOTSUPP;
+			continue;
+		}
+		rate = calibrate_one(bus, addr, order[i], reference, &have_reference);
+		if (rate < 0) {
+			results[order[i]].error = errno;
+			continue;
+		}
+		results[order[i]].supported = 1;
+		results[order[i]].bytes_per_sec = rate;
+		// insertion sort, fastest first
+		for (j = e.count; j > 0 && e.rates[j-1] < (unsigned long) rate; j--) {
+			e.ranking[j] = e.ranking[j-1];
+			e.rates[j] = e.rates[j-1];
+		}
+		e.ranking[j] = order[i];
+		e.rates[j] = (unsigned long) rate;
+		e.count += 1;
+	}
+	if (e.count == 0) {
+		errno = (results[eeprom_transport_smbus_byte].error != 0 ?
+			 results[eeprom_transport_smbus_byte].error : EIO);
+		return -1;
+	}
+
+	pthread_once(&cache_once, cache_load);
+	pthread_mutex_lock(&cache_lock);
+	fd = cache_lock_file();
+	if (fd < 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return -1;
+	}
+	// Pick up what other processes have calibrated since we loaded
+	cache_load();
+	for (i = 0; i < cache_count; i++)
+		if (cache[i].bus == bus)
+			break;
+	if (i >= cache_count) {
+		newp = realloc(cache, (cache_count + 1) * sizeof(*cache));
+		if (newp == NULL) {
+			close(fd);
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+		cache = newp;
+		cache_count += 1;
+	}
+	cache[i] = e;
+	ret = cache_save();
+	save_errno = errno;
+	close(fd);
+	pthread_mutex_unlock(&cache_lock);
+	errno = save_errno;
+	return (ret < 0 ? -1 : (int) e.count);
+
+} /* eeprom_calibrate */
+
+/*
+ * eeprom_transport_name
+ */
+const char *
+eeprom_transport_name (eeprom_transport_t transport)
+{
+	if (transport == eeprom_transport_none)
+		return "firmware";
+	if (transport < 0 || transport >= eeprom_transport_count)
+		return NULL;
+	return transport_names[transport];
+
+} /* eeprom_transport_name */
+
+/*
+ * eeprom_transport
+ *
+ * Returns the transport a context reads through.
+ */
+eeprom_transport_t
+eeprom_transport (eeprom_context_t ctx)
+{
+	return ctx->transport;
+
+} /* eeprom_transport */